@@ -0,0 +1,575 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+	#include <windows.h>
+	#include <process.h>
+	#include <sys/utime.h>
+#endif
+
+#if !defined(_WIN32)
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <utime.h>
+	#include <sys/file.h>
+#endif
+
+#if defined(__linux__)
+	#include <sys/ioctl.h>
+	#include <linux/fs.h>
+#endif
+
+#include "archive_cache.h"
+#include "errors.h"
+#include "fs/cp.h"
+#include "fs/exists.h"
+#include "fs/mkdir.h"
+#include "fs/mmap.h"
+#include "fs/mv.h"
+#include "fs/rm.h"
+#include "fs/sep.h"
+#include "fs/walkdir.h"
+#include "hex.h"
+#include "logging.h"
+#include "sha256.h"
+
+static const char LOCK_FILE[] = "lock";
+
+struct ArchiveCacheEntry {
+	char* name;
+	biguint_t size;
+	time_t mtime;
+};
+
+typedef struct ArchiveCacheEntry archive_cache_entry_t;
+
+static char* archive_cache_path(
+	const archive_cache_t* const cache,
+	const char* const name
+) {
+	
+	char* path = NULL;
+	
+	path = malloc(strlen(cache->directory) + strlen(PATHSEP_S) + strlen(name) + 1);
+	
+	if (path == NULL) {
+		return path;
+	}
+	
+	strcpy(path, cache->directory);
+	strcat(path, PATHSEP_S);
+	strcat(path, name);
+	
+	return path;
+	
+}
+
+static char* archive_cache_key(
+	const archive_cache_t* const cache,
+	const pkg_t* const pkg
+) {
+	/*
+	Get the location of the archive of the given package within the cache.
+	
+	Archives are named after their SHA-256 digest, so that the same archive is
+	only stored once no matter which repository it came from. Packages without
+	a digest cannot be told apart from an archive with the same name, version
+	and size published elsewhere, so they are never cached.
+	*/
+	
+	size_t index = 0;
+	
+	char* key = NULL;
+	char* path = NULL;
+	
+	if (pkg->sha256 == NULL) {
+		return path;
+	}
+	
+	key = malloc(SHA256_DIGEST_SIZE * 2 + 1);
+	
+	if (key == NULL) {
+		return key;
+	}
+	
+	for (index = 0; index < SHA256_DIGEST_SIZE; index++) {
+		key[index * 2] = (char) to_hex(pkg->sha256[index] >> 4);
+		key[index * 2 + 1] = (char) to_hex(pkg->sha256[index] & 15);
+	}
+	
+	key[SHA256_DIGEST_SIZE * 2] = '\0';
+	
+	path = archive_cache_path(cache, key);
+	
+	free(key);
+	
+	return path;
+	
+}
+
+static int archive_cache_verify(
+	const char* const path,
+	const pkg_t* const pkg
+) {
+	/*
+	Check whether the cached archive at path still matches the SHA-256 digest
+	of the given package.
+	
+	Returns (1) if it does, (0) if it does not or could not be read.
+	*/
+	
+	int match = 0;
+	
+	sha256_t context = {0};
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	
+	mapped_file_t file = {0};
+	
+	if (map_file(path, &file) != 0) {
+		return match;
+	}
+	
+	sha256_init(&context);
+	
+	if (file.data != NULL) {
+		sha256_update(&context, file.data, file.size);
+	}
+	
+	sha256_final(&context, digest);
+	
+	unmap_file(&file);
+	
+	match = (memcmp(digest, pkg->sha256, sizeof(digest)) == 0);
+	
+	return match;
+	
+}
+
+static int archive_cache_link(
+	const char* const source,
+	const char* const destination
+) {
+	/*
+	Make the file available at a second location without copying its contents
+	when possible: hard links are tried first, then reflinks, and only then a
+	regular copy.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	#if defined(__linux__) && defined(FICLONE)
+		int input = -1;
+		int output = -1;
+		int status = 0;
+	#endif
+	
+	remove_file(destination);
+	
+	#if defined(_WIN32)
+		if (CreateHardLinkA(destination, source, NULL)) {
+			return 0;
+		}
+	#else
+		if (link(source, destination) == 0) {
+			return 0;
+		}
+		
+		/* The file went away in the meantime; there is nothing to copy either */
+		if (errno == ENOENT) {
+			return -1;
+		}
+	#endif
+	
+	#if defined(__linux__) && defined(FICLONE)
+		input = open(source, O_RDONLY);
+		
+		if (input != -1) {
+			output = open(destination, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		}
+		
+		if (output != -1) {
+			status = ioctl(output, FICLONE, input);
+		}
+		
+		if (input != -1) {
+			close(input);
+		}
+		
+		if (output != -1) {
+			close(output);
+			
+			if (status == 0) {
+				return 0;
+			}
+			
+			remove_file(destination);
+		}
+	#endif
+	
+	return copy_file(source, destination);
+	
+}
+
+static void archive_cache_touch(const char* const path) {
+	/*
+	Mark the archive as recently used. Archives are evicted in the order they
+	were last used in.
+	*/
+	
+	#if defined(_WIN32)
+		_utime(path, NULL);
+	#else
+		utime(path, NULL);
+	#endif
+	
+}
+
+int archive_cache_open(
+	archive_cache_t* const cache,
+	const char* const directory,
+	const biguint_t limit
+) {
+	
+	cache->directory = malloc(strlen(directory) + 1);
+	
+	if (cache->directory == NULL) {
+		return APTERR_MEM_ALLOC_FAILURE;
+	}
+	
+	strcpy(cache->directory, directory);
+	
+	cache->limit = limit;
+	
+	if (create_directory(cache->directory) != 0) {
+		archive_cache_close(cache);
+		return APTERR_FS_MKDIR_FAILURE;
+	}
+	
+	return APTERR_SUCCESS;
+	
+}
+
+int archive_cache_fetch(
+	const archive_cache_t* const cache,
+	const pkg_t* const pkg,
+	const char* const destination
+) {
+	/*
+	Place the cached archive of the given package at destination.
+	
+	The cached archive is checked against the digest of the package before it
+	is used; archives that do not match are evicted, so that the package is
+	downloaded again.
+	
+	Returns (1) if the archive was in the cache, (0) if it was not or could not
+	be used.
+	*/
+	
+	int hit = 0;
+	
+	char* path = NULL;
+	struct stat st = {0};
+	
+	if (pkg->sha256 == NULL) {
+		goto end;
+	}
+	
+	path = archive_cache_key(cache, pkg);
+	
+	if (path == NULL) {
+		goto end;
+	}
+	
+	if (stat(path, &st) != 0) {
+		goto end;
+	}
+	
+	if (pkg->size > 0 && (biguint_t) st.st_size != pkg->size) {
+		loggln(LOG_VERBOSE, "Ignoring cached archive of '%s' as its size does not match", pkg->name);
+		goto end;
+	}
+	
+	if (!archive_cache_verify(path, pkg)) {
+		loggln(LOG_VERBOSE, "Evicting cached archive of '%s' as its SHA-256 does not match", pkg->name);
+		remove_file(path);
+		goto end;
+	}
+	
+	/* Another process may have evicted it in the meantime */
+	if (archive_cache_link(path, destination) != 0) {
+		goto end;
+	}
+	
+	archive_cache_touch(path);
+	
+	loggln(LOG_VERBOSE, "Using cached archive of '%s' at '%s'", pkg->name, path);
+	
+	hit = 1;
+	
+	end:;
+	
+	free(path);
+	
+	return hit;
+	
+}
+
+int archive_cache_store(
+	const archive_cache_t* const cache,
+	const pkg_t* const pkg,
+	const char* const source
+) {
+	/*
+	Keep a copy of the archive of the given package in the cache.
+	
+	The archive is first linked under a name unique to this process, and then
+	renamed into place, so that other processes never see a partial file.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	char* path = NULL;
+	char* temporary = NULL;
+	char* pid = NULL;
+	
+	if (pkg->sha256 == NULL) {
+		goto end;
+	}
+	
+	path = archive_cache_key(cache, pkg);
+	
+	if (path == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	if (file_exists(path) == 1) {
+		archive_cache_touch(path);
+		goto end;
+	}
+	
+	#if defined(_WIN32)
+		pid = uint_stringify((biguint_t) _getpid());
+	#else
+		pid = uint_stringify((biguint_t) getpid());
+	#endif
+	
+	if (pid == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	temporary = malloc(strlen(path) + strlen(ARCHIVE_CACHE_TEMPORARY_SUFFIX) + 1 + strlen(pid) + 1);
+	
+	if (temporary == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	strcpy(temporary, path);
+	strcat(temporary, ARCHIVE_CACHE_TEMPORARY_SUFFIX);
+	strcat(temporary, ".");
+	strcat(temporary, pid);
+	
+	if (archive_cache_link(source, temporary) != 0) {
+		err = APTERR_ARCHIVE_CACHE_STORE_FAILURE;
+		goto end;
+	}
+	
+	if (move_file(temporary, path) != 0) {
+		remove_file(temporary);
+		
+		err = APTERR_ARCHIVE_CACHE_STORE_FAILURE;
+		goto end;
+	}
+	
+	loggln(LOG_VERBOSE, "Stored archive of '%s' at '%s'", pkg->name, path);
+	
+	end:;
+	
+	free(path);
+	free(temporary);
+	free(pid);
+	
+	return err;
+	
+}
+
+static int archive_cache_compare(const void* a, const void* b) {
+	
+	const archive_cache_entry_t* const first = a;
+	const archive_cache_entry_t* const second = b;
+	
+	if (first->mtime != second->mtime) {
+		return (first->mtime < second->mtime) ? -1 : 1;
+	}
+	
+	return strcmp(first->name, second->name);
+	
+}
+
+int archive_cache_trim(const archive_cache_t* const cache) {
+	/*
+	Evict the least recently used archives until the cache fits within its size
+	limit.
+	
+	Only one process trims the cache at a time. Processes that are fetching an
+	archive while it is evicted either got their own link to it already, or
+	download it again.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	size_t size = 0;
+	
+	biguint_t total = 0;
+	
+	time_t now = 0;
+	
+	char* path = NULL;
+	const char* match = NULL;
+	
+	struct stat st = {0};
+	
+	walkdir_t walkdir = {0};
+	const walkdir_item_t* item = NULL;
+	
+	archive_cache_entry_t* entry = NULL;
+	archive_cache_entry_t* entries = NULL;
+	size_t offset = 0;
+	
+	#if !defined(_WIN32)
+		int lock = -1;
+	#endif
+	
+	#if !defined(_WIN32)
+		path = archive_cache_path(cache, LOCK_FILE);
+		
+		if (path == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		lock = open(path, O_RDWR | O_CREAT, 0644);
+		
+		if (lock == -1 || flock(lock, LOCK_EX) != 0) {
+			err = APTERR_FSTREAM_OPEN_FAILURE;
+			goto end;
+		}
+		
+		free(path);
+		path = NULL;
+	#endif
+	
+	if (walkdir_init(&walkdir, cache->directory) == -1) {
+		err = APTERR_FS_WALKDIR_FAILURE;
+		goto end;
+	}
+	
+	now = time(NULL);
+	
+	while ((item = walkdir_next(&walkdir)) != NULL) {
+		if (item->type != WALKDIR_ITEM_FILE || strcmp(item->name, LOCK_FILE) == 0) {
+			continue;
+		}
+		
+		free(path);
+		path = archive_cache_path(cache, item->name);
+		
+		if (path == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		if (stat(path, &st) != 0) {
+			continue;
+		}
+		
+		match = strstr(item->name, ARCHIVE_CACHE_TEMPORARY_SUFFIX);
+		
+		/* Archives still being stored do not count, unless they were left behind */
+		if (match != NULL) {
+			if (now - st.st_mtime > ARCHIVE_CACHE_STALE_AGE) {
+				remove_file(path);
+			}
+			
+			continue;
+		}
+		
+		if (sizeof(*entries) * (offset + 1) > size) {
+			size = size + sizeof(*entries) * (offset + 1);
+			entry = realloc(entries, size);
+			
+			if (entry == NULL) {
+				err = APTERR_MEM_ALLOC_FAILURE;
+				goto end;
+			}
+			
+			entries = entry;
+		}
+		
+		entry = &entries[offset];
+		entry->name = path;
+		entry->size = (biguint_t) st.st_size;
+		entry->mtime = st.st_mtime;
+		
+		path = NULL;
+		offset++;
+		
+		total += (biguint_t) st.st_size;
+	}
+	
+	if (total <= cache->limit) {
+		goto end;
+	}
+	
+	qsort(entries, offset, sizeof(*entries), archive_cache_compare);
+	
+	for (index = 0; index < offset && total > cache->limit; index++) {
+		entry = &entries[index];
+		
+		if (remove_file(entry->name) != 0) {
+			continue;
+		}
+		
+		loggln(LOG_VERBOSE, "Evicted '%s' from the archive cache", entry->name);
+		
+		total -= entry->size;
+	}
+	
+	end:;
+	
+	for (index = 0; index < offset; index++) {
+		free(entries[index].name);
+	}
+	
+	free(entries);
+	free(path);
+	
+	walkdir_free(&walkdir);
+	
+	#if !defined(_WIN32)
+		if (lock != -1) {
+			close(lock);
+		}
+	#endif
+	
+	return err;
+	
+}
+
+void archive_cache_close(archive_cache_t* const cache) {
+	
+	free(cache->directory);
+	cache->directory = NULL;
+	
+	cache->limit = 0;
+	
+}
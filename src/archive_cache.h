@@ -0,0 +1,42 @@
+#if !defined(ARCHIVE_CACHE_H)
+#define ARCHIVE_CACHE_H
+
+#include "biggestint.h"
+#include "package.h"
+
+/* Archives that are being stored have this suffix until they are complete */
+#define ARCHIVE_CACHE_TEMPORARY_SUFFIX ".part"
+
+/* Leftovers from processes that died while storing an archive are removed after this many seconds */
+#define ARCHIVE_CACHE_STALE_AGE (60 * 60)
+
+struct ArchiveCache {
+	char* directory;
+	biguint_t limit;
+};
+
+typedef struct ArchiveCache archive_cache_t;
+
+int archive_cache_open(
+	archive_cache_t* const cache,
+	const char* const directory,
+	const biguint_t limit
+);
+
+int archive_cache_fetch(
+	const archive_cache_t* const cache,
+	const pkg_t* const pkg,
+	const char* const destination
+);
+
+int archive_cache_store(
+	const archive_cache_t* const cache,
+	const pkg_t* const pkg,
+	const char* const source
+);
+
+int archive_cache_trim(const archive_cache_t* const cache);
+
+void archive_cache_close(archive_cache_t* const cache);
+
+#endif
@@ -0,0 +1,391 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bktree.h"
+#include "errors.h"
+
+unsigned int bktree_distance(
+	const char* const a,
+	const char* const b
+) {
+	/*
+	Get the Levenshtein distance between two strings.
+	
+	Strings longer than BKTREE_MAX_NAME_LEN are compared up to that length.
+	*/
+	
+	size_t index = 0;
+	size_t subindex = 0;
+	
+	size_t a_length = strlen(a);
+	size_t b_length = strlen(b);
+	
+	unsigned int row[BKTREE_MAX_NAME_LEN + 1];
+	unsigned int diagonal = 0;
+	unsigned int above = 0;
+	unsigned int cost = 0;
+	
+	if (a_length > BKTREE_MAX_NAME_LEN) {
+		a_length = BKTREE_MAX_NAME_LEN;
+	}
+	
+	if (b_length > BKTREE_MAX_NAME_LEN) {
+		b_length = BKTREE_MAX_NAME_LEN;
+	}
+	
+	for (subindex = 0; subindex <= b_length; subindex++) {
+		row[subindex] = (unsigned int) subindex;
+	}
+	
+	for (index = 1; index <= a_length; index++) {
+		diagonal = row[0];
+		row[0] = (unsigned int) index;
+		
+		for (subindex = 1; subindex <= b_length; subindex++) {
+			above = row[subindex];
+			cost = diagonal + (a[index - 1] != b[subindex - 1]);
+			
+			if (above + 1 < cost) {
+				cost = above + 1;
+			}
+			
+			if (row[subindex - 1] + 1 < cost) {
+				cost = row[subindex - 1] + 1;
+			}
+			
+			row[subindex] = cost;
+			diagonal = above;
+		}
+	}
+	
+	return row[b_length];
+	
+}
+
+static void bktree_pattern_init(
+	bktree_pattern_t* const pattern,
+	const char* const name
+) {
+	/*
+	Precompute the character masks used by bktree_pattern_distance().
+	*/
+	
+	size_t index = 0;
+	
+	pattern->name = name;
+	pattern->length = strlen(name);
+	
+	if (pattern->length > BKTREE_MAX_PATTERN_LEN) {
+		return;
+	}
+	
+	memset(pattern->masks, 0, sizeof(pattern->masks));
+	
+	for (index = 0; index < pattern->length; index++) {
+		pattern->masks[(unsigned char) name[index]] |= (1ULL << index);
+	}
+	
+}
+
+static unsigned int bktree_pattern_distance(
+	const bktree_pattern_t* const pattern,
+	const char* const name
+) {
+	/*
+	Get the Levenshtein distance between the pattern and the name.
+	
+	Names of up to 64 characters use the bit-parallel algorithm by Myers
+	(as formulated by Hyyrö), which processes a whole column of the
+	distance matrix per character; longer names use bktree_distance().
+	*/
+	
+	const unsigned char* position = (const unsigned char*) name;
+	
+	unsigned long long positive = 0;
+	unsigned long long negative = 0;
+	unsigned long long equal = 0;
+	unsigned long long vertical = 0;
+	unsigned long long horizontal = 0;
+	unsigned long long horizontal_positive = 0;
+	unsigned long long horizontal_negative = 0;
+	unsigned long long last = 0;
+	
+	unsigned int score = 0;
+	
+	if (pattern->length > BKTREE_MAX_PATTERN_LEN) {
+		return bktree_distance(pattern->name, name);
+	}
+	
+	if (pattern->length == 0) {
+		return (unsigned int) strlen(name);
+	}
+	
+	positive = ~0ULL;
+	last = 1ULL << (pattern->length - 1);
+	score = (unsigned int) pattern->length;
+	
+	while (*position != '\0') {
+		equal = pattern->masks[*position++];
+		
+		vertical = equal | negative;
+		horizontal = (((equal & positive) + positive) ^ positive) | equal;
+		
+		horizontal_positive = negative | ~(horizontal | positive);
+		horizontal_negative = positive & horizontal;
+		
+		if (horizontal_positive & last) {
+			score++;
+		} else if (horizontal_negative & last) {
+			score--;
+		}
+		
+		horizontal_positive = (horizontal_positive << 1) | 1;
+		horizontal_negative = horizontal_negative << 1;
+		
+		positive = horizontal_negative | ~(vertical | horizontal_positive);
+		negative = horizontal_positive & vertical;
+	}
+	
+	return score;
+	
+}
+
+static int bktree_append(
+	bktree_t* const tree,
+	pkg_t* const pkg,
+	const unsigned int distance
+) {
+	
+	size_t size = 0;
+	
+	bktree_node_t* items = NULL;
+	bktree_node_t* node = NULL;
+	
+	if (sizeof(*tree->items) * (tree->offset + 1) > tree->size) {
+		size = (tree->size == 0) ? sizeof(*tree->items) * 1024 : tree->size * 2;
+		items = realloc(tree->items, size);
+		
+		if (items == NULL) {
+			return APTERR_MEM_ALLOC_FAILURE;
+		}
+		
+		tree->size = size;
+		tree->items = items;
+	}
+	
+	node = &tree->items[tree->offset++];
+	
+	node->pkg = pkg;
+	node->child = 0;
+	node->sibling = 0;
+	node->distance = distance;
+	
+	return APTERR_SUCCESS;
+	
+}
+
+int bktree_add(
+	bktree_t* const tree,
+	pkg_t* const pkg
+) {
+	/*
+	Add the package name to the tree.
+	
+	Each node keeps its children in a linked list, keyed by their distance
+	to the node. Names already present in the tree are ignored.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t current = 0;
+	size_t child = 0;
+	
+	unsigned int distance = 0;
+	
+	bktree_pattern_t pattern = {0};
+	
+	if (tree->offset == 0) {
+		return bktree_append(tree, pkg, 0);
+	}
+	
+	bktree_pattern_init(&pattern, pkg->name);
+	
+	while (1) {
+		distance = bktree_pattern_distance(&pattern, tree->items[current].pkg->name);
+		
+		if (distance == 0) {
+			break;
+		}
+		
+		for (child = tree->items[current].child; child != 0; child = tree->items[child].sibling) {
+			if (tree->items[child].distance == distance) {
+				break;
+			}
+		}
+		
+		if (child != 0) {
+			current = child;
+			continue;
+		}
+		
+		err = bktree_append(tree, pkg, distance);
+		
+		if (err != APTERR_SUCCESS) {
+			break;
+		}
+		
+		child = tree->offset - 1;
+		
+		tree->items[child].sibling = tree->items[current].child;
+		tree->items[current].child = child;
+		
+		break;
+	}
+	
+	return err;
+	
+}
+
+static int bktree_match_compare(const void* a, const void* b) {
+	
+	const bktree_match_t* const first = a;
+	const bktree_match_t* const second = b;
+	
+	if (first->distance != second->distance) {
+		return (first->distance < second->distance) ? -1 : 1;
+	}
+	
+	return strcmp(first->pkg->name, second->pkg->name);
+	
+}
+
+int bktree_query(
+	const bktree_t* const tree,
+	const char* const name,
+	const unsigned int maximum,
+	bktree_matches_t* const matches
+) {
+	/*
+	Get all names within the given edit distance of the name.
+	
+	By the triangle inequality, only children whose distance to their
+	parent differs by at most the maximum from the parent's distance to
+	the name can lead to a match; every other subtree is skipped.
+	
+	Matches are sorted by distance, then by name.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t size = 0;
+	size_t current = 0;
+	size_t child = 0;
+	
+	size_t* stack = NULL;
+	size_t* items = NULL;
+	size_t stack_size = 0;
+	size_t stack_offset = 0;
+	
+	unsigned int distance = 0;
+	
+	bktree_match_t* match = NULL;
+	const bktree_node_t* node = NULL;
+	
+	bktree_pattern_t pattern = {0};
+	
+	if (tree->offset == 0) {
+		goto end;
+	}
+	
+	bktree_pattern_init(&pattern, name);
+	
+	stack_size = 64;
+	stack = malloc(sizeof(*stack) * stack_size);
+	
+	if (stack == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	stack[stack_offset++] = 0;
+	
+	while (stack_offset > 0) {
+		current = stack[--stack_offset];
+		node = &tree->items[current];
+		
+		distance = bktree_pattern_distance(&pattern, node->pkg->name);
+		
+		if (distance <= maximum) {
+			if (sizeof(*matches->items) * (matches->offset + 1) > matches->size) {
+				size = sizeof(*matches->items) * (matches->offset + 8);
+				match = realloc(matches->items, size);
+				
+				if (match == NULL) {
+					err = APTERR_MEM_ALLOC_FAILURE;
+					goto end;
+				}
+				
+				matches->size = size;
+				matches->items = match;
+			}
+			
+			match = &matches->items[matches->offset++];
+			
+			match->pkg = node->pkg;
+			match->distance = distance;
+		}
+		
+		for (child = node->child; child != 0; child = tree->items[child].sibling) {
+			if (tree->items[child].distance + maximum < distance || tree->items[child].distance > distance + maximum) {
+				continue;
+			}
+			
+			if (stack_offset == stack_size) {
+				stack_size *= 2;
+				items = realloc(stack, sizeof(*stack) * stack_size);
+				
+				if (items == NULL) {
+					err = APTERR_MEM_ALLOC_FAILURE;
+					goto end;
+				}
+				
+				stack = items;
+			}
+			
+			stack[stack_offset++] = child;
+		}
+	}
+	
+	if (matches->offset > 1) {
+		qsort(matches->items, matches->offset, sizeof(*matches->items), bktree_match_compare);
+	}
+	
+	end:;
+	
+	free(stack);
+	
+	return err;
+	
+}
+
+void bktree_free(bktree_t* const tree) {
+	
+	free(tree->items);
+	tree->items = NULL;
+	
+	tree->size = 0;
+	tree->offset = 0;
+	tree->ready = 0;
+	
+}
+
+void bktree_matches_free(bktree_matches_t* const matches) {
+	
+	free(matches->items);
+	matches->items = NULL;
+	
+	matches->size = 0;
+	matches->offset = 0;
+	
+}
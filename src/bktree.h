@@ -0,0 +1,72 @@
+#if !defined(BKTREE_H)
+#define BKTREE_H
+
+#include <stddef.h>
+
+#include "package.h"
+
+#define BKTREE_MAX_NAME_LEN (255)
+#define BKTREE_MAX_PATTERN_LEN (64)
+
+struct BkTreePattern {
+	const char* name;
+	size_t length;
+	unsigned long long masks[256];
+};
+
+typedef struct BkTreePattern bktree_pattern_t;
+
+struct BkTreeNode {
+	pkg_t* pkg;
+	size_t child;
+	size_t sibling;
+	unsigned int distance;
+};
+
+typedef struct BkTreeNode bktree_node_t;
+
+struct BkTree {
+	size_t size;
+	size_t offset;
+	bktree_node_t* items;
+	int ready;
+};
+
+typedef struct BkTree bktree_t;
+
+struct BkTreeMatch {
+	pkg_t* pkg;
+	unsigned int distance;
+};
+
+typedef struct BkTreeMatch bktree_match_t;
+
+struct BkTreeMatches {
+	size_t size;
+	size_t offset;
+	bktree_match_t* items;
+};
+
+typedef struct BkTreeMatches bktree_matches_t;
+
+unsigned int bktree_distance(
+	const char* const a,
+	const char* const b
+);
+
+int bktree_add(
+	bktree_t* const tree,
+	pkg_t* const pkg
+);
+
+int bktree_query(
+	const bktree_t* const tree,
+	const char* const name,
+	const unsigned int maximum,
+	bktree_matches_t* const matches
+);
+
+void bktree_free(bktree_t* const tree);
+void bktree_matches_free(bktree_matches_t* const matches);
+
+#endif
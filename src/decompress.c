@@ -0,0 +1,507 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <lzma.h>
+#include <zstd.h>
+
+#include "decompress.h"
+
+static const unsigned char XZ_MAGIC[] = {0xFD, 0x37, 0x7A, 0x58, 0x5A, 0x00};
+static const unsigned char ZSTD_MAGIC[] = {0x28, 0xB5, 0x2F, 0xFD};
+
+static const char XZ_EXTENSION[] = ".xz";
+static const char ZSTD_EXTENSION[] = ".zst";
+
+int decompress_guess(
+	const char* const data,
+	const size_t size
+) {
+	/*
+	Guess the compression format of the given data from its magic bytes.
+	
+	Only the formats with a decoder here are recognized; everything else is
+	left for libarchive.
+	*/
+	
+	if (size >= sizeof(XZ_MAGIC) && memcmp(data, XZ_MAGIC, sizeof(XZ_MAGIC)) == 0) {
+		return DECOMPRESS_FORMAT_XZ;
+	}
+	
+	if (size >= sizeof(ZSTD_MAGIC) && memcmp(data, ZSTD_MAGIC, sizeof(ZSTD_MAGIC)) == 0) {
+		return DECOMPRESS_FORMAT_ZSTD;
+	}
+	
+	return DECOMPRESS_FORMAT_UNKNOWN;
+	
+}
+
+int decompress_guess_name(const char* const name) {
+	/*
+	Guess the compression format of a file from its extension.
+	*/
+	
+	const char* extension = strrchr(name, '.');
+	
+	if (extension == NULL) {
+		return DECOMPRESS_FORMAT_UNKNOWN;
+	}
+	
+	if (strcmp(extension, XZ_EXTENSION) == 0) {
+		return DECOMPRESS_FORMAT_XZ;
+	}
+	
+	if (strcmp(extension, ZSTD_EXTENSION) == 0) {
+		return DECOMPRESS_FORMAT_ZSTD;
+	}
+	
+	return DECOMPRESS_FORMAT_UNKNOWN;
+	
+}
+
+static char* block_acquire(decompress_t* const decompress) {
+	/*
+	Wait for the next block to be released by the reader.
+	
+	Returns NULL if the reader has gone away.
+	*/
+	
+	char* data = NULL;
+	
+	decompress_block_t* block = NULL;
+	
+	mutex_lock(&decompress->mutex);
+	
+	block = &decompress->blocks[decompress->produced];
+	
+	while (block->ready && !decompress->aborted) {
+		condition_wait(&decompress->condition, &decompress->mutex);
+	}
+	
+	if (!decompress->aborted) {
+		data = block->data;
+	}
+	
+	mutex_unlock(&decompress->mutex);
+	
+	return data;
+	
+}
+
+static void block_publish(
+	decompress_t* const decompress,
+	const size_t length
+) {
+	
+	decompress_block_t* block = NULL;
+	
+	if (length == 0) {
+		return;
+	}
+	
+	mutex_lock(&decompress->mutex);
+	
+	block = &decompress->blocks[decompress->produced];
+	block->length = length;
+	block->ready = 1;
+	
+	decompress->produced = (decompress->produced + 1) % DECOMPRESS_QUEUE_SIZE;
+	
+	condition_broadcast(&decompress->condition);
+	
+	mutex_unlock(&decompress->mutex);
+	
+}
+
+static int decompress_xz(decompress_t* const decompress) {
+	/*
+	Decode an xz stream with liblzma's multi-threaded decoder.
+	
+	Streams made of several blocks with their sizes stored in the headers
+	(like the ones "xz -T" creates) are decoded by up to the given number
+	of threads; anything else is decoded by a single one.
+	*/
+	
+	int err = 0;
+	
+	long rsize = 0;
+	
+	const void* input = NULL;
+	char* output = NULL;
+	
+	lzma_ret ret = LZMA_OK;
+	lzma_action action = LZMA_RUN;
+	lzma_stream stream = LZMA_STREAM_INIT;
+	
+	#if LZMA_VERSION >= 50040002
+		lzma_mt mt;
+		
+		memset(&mt, 0, sizeof(mt));
+		
+		mt.flags = LZMA_CONCATENATED;
+		mt.threads = (uint32_t) decompress->threads;
+		mt.memlimit_threading = lzma_physmem() / DECOMPRESS_MEMORY_FRACTION;
+		mt.memlimit_stop = UINT64_MAX;
+		
+		/* Past the limit the decoder simply falls back to a single thread */
+		if (mt.memlimit_threading == 0) {
+			mt.memlimit_threading = UINT64_MAX;
+		}
+		
+		ret = lzma_stream_decoder_mt(&stream, &mt);
+	#else
+		ret = lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED);
+	#endif
+	
+	if (ret != LZMA_OK) {
+		fprintf(stderr, "decompress(): could not initialize the xz decoder\n");
+		return -1;
+	}
+	
+	output = block_acquire(decompress);
+	
+	if (output == NULL) {
+		err = -1;
+		goto end;
+	}
+	
+	stream.next_out = (uint8_t*) output;
+	stream.avail_out = decompress->block_size;
+	
+	while (1) {
+		if (stream.avail_in == 0 && action == LZMA_RUN) {
+			rsize = (*decompress->read)(decompress->read_data, &input);
+			
+			if (rsize < 0) {
+				err = -1;
+				goto end;
+			}
+			
+			if (rsize == 0) {
+				action = LZMA_FINISH;
+			}
+			
+			stream.next_in = input;
+			stream.avail_in = (size_t) rsize;
+		}
+		
+		ret = lzma_code(&stream, action);
+		
+		if (!(ret == LZMA_OK || ret == LZMA_STREAM_END)) {
+			fprintf(stderr, "decompress(): the xz stream is corrupt or truncated (error %i)\n", (int) ret);
+			
+			err = -1;
+			goto end;
+		}
+		
+		if (stream.avail_out == 0 || ret == LZMA_STREAM_END) {
+			block_publish(decompress, decompress->block_size - stream.avail_out);
+			
+			if (ret == LZMA_STREAM_END) {
+				break;
+			}
+			
+			output = block_acquire(decompress);
+			
+			if (output == NULL) {
+				err = -1;
+				goto end;
+			}
+			
+			stream.next_out = (uint8_t*) output;
+			stream.avail_out = decompress->block_size;
+		}
+	}
+	
+	end:;
+	
+	lzma_end(&stream);
+	
+	return err;
+	
+}
+
+static int decompress_zstd(decompress_t* const decompress) {
+	/*
+	Decode a zstd stream made of one or more frames.
+	
+	libzstd has no multi-threaded decoder, so the frames are decoded in order;
+	this still runs in parallel with whatever is consuming the output.
+	*/
+	
+	int err = 0;
+	int eof = 0;
+	
+	long rsize = 0;
+	
+	size_t ret = 0;
+	size_t last = 0;
+	size_t position = 0;
+	
+	const void* input = NULL;
+	char* output = NULL;
+	
+	ZSTD_inBuffer in = {0};
+	ZSTD_outBuffer out = {0};
+	
+	ZSTD_DStream* stream = ZSTD_createDStream();
+	
+	if (stream == NULL) {
+		fprintf(stderr, "decompress(): could not initialize the zstd decoder\n");
+		return -1;
+	}
+	
+	ret = ZSTD_initDStream(stream);
+	
+	if (ZSTD_isError(ret)) {
+		fprintf(stderr, "decompress(): %s\n", ZSTD_getErrorName(ret));
+		
+		err = -1;
+		goto end;
+	}
+	
+	output = block_acquire(decompress);
+	
+	if (output == NULL) {
+		err = -1;
+		goto end;
+	}
+	
+	out.dst = output;
+	out.size = decompress->block_size;
+	
+	while (1) {
+		if (in.pos == in.size && !eof) {
+			rsize = (*decompress->read)(decompress->read_data, &input);
+			
+			if (rsize < 0) {
+				err = -1;
+				goto end;
+			}
+			
+			eof = (rsize == 0);
+			
+			in.src = input;
+			in.size = (size_t) rsize;
+			in.pos = 0;
+		}
+		
+		position = out.pos;
+		last = ret;
+		
+		ret = ZSTD_decompressStream(stream, &out, &in);
+		
+		if (ZSTD_isError(ret)) {
+			fprintf(stderr, "decompress(): %s\n", ZSTD_getErrorName(ret));
+			
+			err = -1;
+			goto end;
+		}
+		
+		if (out.pos == out.size) {
+			block_publish(decompress, out.pos);
+			
+			output = block_acquire(decompress);
+			
+			if (output == NULL) {
+				err = -1;
+				goto end;
+			}
+			
+			out.dst = output;
+			out.pos = 0;
+			
+			continue;
+		}
+		
+		if (eof && in.pos == in.size && out.pos == position) {
+			/*
+			Once there is nothing left to do, the decoder asks for the header of
+			the next frame; only a non-zero hint before that means the last
+			frame was cut short.
+			*/
+			if (last != 0) {
+				fprintf(stderr, "decompress(): the zstd stream is truncated\n");
+				
+				err = -1;
+				goto end;
+			}
+			
+			break;
+		}
+	}
+	
+	block_publish(decompress, out.pos);
+	
+	end:;
+	
+	ZSTD_freeDStream(stream);
+	
+	return err;
+	
+}
+
+static void* decompress_run(void* const argument) {
+	
+	int err = 0;
+	
+	decompress_t* const decompress = argument;
+	
+	switch (decompress->format) {
+		case DECOMPRESS_FORMAT_XZ: {
+			err = decompress_xz(decompress);
+			break;
+		}
+		case DECOMPRESS_FORMAT_ZSTD: {
+			err = decompress_zstd(decompress);
+			break;
+		}
+		default: {
+			err = -1;
+			break;
+		}
+	}
+	
+	mutex_lock(&decompress->mutex);
+	
+	decompress->err = err;
+	decompress->done = 1;
+	
+	condition_broadcast(&decompress->condition);
+	
+	mutex_unlock(&decompress->mutex);
+	
+	return NULL;
+	
+}
+
+int decompress_open(
+	decompress_t* const decompress,
+	const int format,
+	const size_t threads,
+	const size_t block_size,
+	decompress_read_callback_t read,
+	void* const read_data
+) {
+	/*
+	Start decoding the data returned by the given callback.
+	
+	Decoding runs on its own thread, a few blocks ahead of the reader, and
+	the callback is only ever called from that thread.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	size_t index = 0;
+	
+	memset(decompress, 0, sizeof(*decompress));
+	
+	decompress->format = format;
+	decompress->threads = (threads < 1) ? 1 : threads;
+	decompress->block_size = (block_size < 1) ? DECOMPRESS_BLOCK_SIZE : block_size;
+	decompress->read = read;
+	decompress->read_data = read_data;
+	
+	if (mutex_init(&decompress->mutex) != 0) {
+		return -1;
+	}
+	
+	if (condition_init(&decompress->condition) != 0) {
+		mutex_free(&decompress->mutex);
+		return -1;
+	}
+	
+	for (index = 0; index < DECOMPRESS_QUEUE_SIZE; index++) {
+		decompress->blocks[index].data = malloc(decompress->block_size);
+		
+		if (decompress->blocks[index].data == NULL) {
+			decompress_free(decompress);
+			return -1;
+		}
+	}
+	
+	if (thread_create(&decompress->thread, decompress_run, decompress) != 0) {
+		decompress_free(decompress);
+		return -1;
+	}
+	
+	decompress->started = 1;
+	
+	return 0;
+	
+}
+
+long decompress_read(
+	decompress_t* const decompress,
+	const void** const buffer
+) {
+	/*
+	Hand the reader the next decoded block.
+	
+	The block handed out last time is only given back to the decoder when
+	this is called again, as the reader may still be looking at it.
+	
+	Returns the size of the block, (0) at the end of the stream, or (-1) on error.
+	*/
+	
+	long rsize = 0;
+	
+	decompress_block_t* block = NULL;
+	
+	mutex_lock(&decompress->mutex);
+	
+	if (decompress->holding) {
+		decompress->blocks[decompress->consumed].ready = 0;
+		decompress->consumed = (decompress->consumed + 1) % DECOMPRESS_QUEUE_SIZE;
+		decompress->holding = 0;
+		
+		condition_broadcast(&decompress->condition);
+	}
+	
+	block = &decompress->blocks[decompress->consumed];
+	
+	while (!block->ready && !decompress->done) {
+		condition_wait(&decompress->condition, &decompress->mutex);
+	}
+	
+	if (block->ready) {
+		*buffer = block->data;
+		
+		decompress->holding = 1;
+		rsize = (long) block->length;
+	} else if (decompress->err != 0) {
+		rsize = -1;
+	}
+	
+	mutex_unlock(&decompress->mutex);
+	
+	return rsize;
+	
+}
+
+void decompress_free(decompress_t* const decompress) {
+	
+	size_t index = 0;
+	
+	if (decompress->started) {
+		mutex_lock(&decompress->mutex);
+		
+		decompress->aborted = 1;
+		condition_broadcast(&decompress->condition);
+		
+		mutex_unlock(&decompress->mutex);
+		
+		thread_join(&decompress->thread, NULL);
+		decompress->started = 0;
+	}
+	
+	for (index = 0; index < DECOMPRESS_QUEUE_SIZE; index++) {
+		free(decompress->blocks[index].data);
+		decompress->blocks[index].data = NULL;
+	}
+	
+	mutex_free(&decompress->mutex);
+	condition_free(&decompress->condition);
+	
+}
@@ -0,0 +1,75 @@
+#if !defined(DECOMPRESS_H)
+#define DECOMPRESS_H
+
+#include <stddef.h>
+
+#include "os/thread.h"
+
+#define DECOMPRESS_FORMAT_UNKNOWN (0)
+#define DECOMPRESS_FORMAT_XZ (1)
+#define DECOMPRESS_FORMAT_ZSTD (2)
+
+/* Decoded data is handed to the reader in blocks of this size, unless told otherwise */
+#define DECOMPRESS_BLOCK_SIZE (1024 * 1024)
+
+/* How many decoded blocks may be waiting for the reader, including the one it holds */
+#define DECOMPRESS_QUEUE_SIZE (3)
+
+/* The xz decoder threads may use up to this fraction of the physical memory */
+#define DECOMPRESS_MEMORY_FRACTION (4)
+
+typedef long (*decompress_read_callback_t)(void* const, const void** const);
+
+struct DecompressBlock {
+	char* data;
+	size_t length;
+	int ready;
+};
+
+typedef struct DecompressBlock decompress_block_t;
+
+struct Decompress {
+	mutex_t mutex;
+	condition_t condition;
+	thread_t thread;
+	int started;
+	int format;
+	size_t threads;
+	size_t block_size;
+	decompress_read_callback_t read;
+	void* read_data;
+	decompress_block_t blocks[DECOMPRESS_QUEUE_SIZE];
+	size_t produced;
+	size_t consumed;
+	int holding;
+	int aborted;
+	int done;
+	int err;
+};
+
+typedef struct Decompress decompress_t;
+
+int decompress_guess(
+	const char* const data,
+	const size_t size
+);
+
+int decompress_guess_name(const char* const name);
+
+int decompress_open(
+	decompress_t* const decompress,
+	const int format,
+	const size_t threads,
+	const size_t block_size,
+	decompress_read_callback_t read,
+	void* const read_data
+);
+
+long decompress_read(
+	decompress_t* const decompress,
+	const void** const buffer
+);
+
+void decompress_free(decompress_t* const decompress);
+
+#endif
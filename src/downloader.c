@@ -1,17 +1,849 @@
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <curl/curl.h>
 
+#include "biggestint.h"
 #include "downloader.h"
 #include "term/screen.h"
 #include "fs/fstream.h"
 #include "wcurl.h"
 #include "errors.h"
 #include "fs/sep.h"
+#include "logging.h"
+#include "os/clock.h"
 #include "write_callback.h"
 
 static const char DEB_FILE_EXT[] = ".deb";
+static const char IF_RANGE_HEADER[] = "If-Range: ";
+
+static char* downloader_partial_name(
+	const dlopts_t* const options,
+	const pkg_t* const pkg
+) {
+	/*
+	Build the name of the file the package is downloaded into before it is complete.
+	
+	It includes the version, so that data left behind by an interrupted transfer
+	is never mistaken for a part of a newer archive.
+	*/
+	
+	size_t index = 0;
+	char* name = NULL;
+	char* position = NULL;
+	
+	const char* const directory = (options->partial_directory == NULL) ? options->temporary_directory : options->partial_directory;
+	
+	name = malloc(
+		strlen(directory) +
+		strlen(PATHSEP_S) +
+		strlen(pkg->name) +
+		1 +
+		strlen(pkg->version) * 3 +
+		strlen(DEB_FILE_EXT) +
+		1
+	);
+	
+	if (name == NULL) {
+		return name;
+	}
+	
+	strcpy(name, directory);
+	strcat(name, PATHSEP_S);
+	strcat(name, pkg->name);
+	strcat(name, "_");
+	
+	position = strchr(name, '\0');
+	
+	/* Epochs are not valid in Windows filenames */
+	for (index = 0; pkg->version[index] != '\0'; index++) {
+		if (pkg->version[index] == ':') {
+			memcpy(position, "%3a", 3);
+			position += 3;
+			continue;
+		}
+		
+		*position++ = pkg->version[index];
+	}
+	
+	*position = '\0';
+	
+	strcat(name, DEB_FILE_EXT);
+	
+	return name;
+	
+}
+
+static int downloader_host(
+	downloader_t* const downloader,
+	const char* const url,
+	size_t* const index
+) {
+	/*
+	Find the host the given URL points to, registering it if this is the first
+	transfer from it.
+	
+	Hosts are told apart by the scheme, name and port of the URL.
+	*/
+	
+	size_t length = 0;
+	size_t size = 0;
+	
+	const char* start = NULL;
+	const char* end = NULL;
+	
+	dlhost_t* host = NULL;
+	dlhost_t* items = NULL;
+	
+	dlhosts_t* const hosts = &downloader->hosts;
+	
+	start = strstr(url, "://");
+	start = (start == NULL) ? url : start + 3;
+	
+	end = strchr(start, '/');
+	length = (end == NULL) ? strlen(url) : (size_t) (end - url);
+	
+	for (*index = 0; *index < hosts->offset; (*index)++) {
+		host = &hosts->items[*index];
+		
+		if (strlen(host->name) == length && memcmp(host->name, url, length) == 0) {
+			return APTERR_SUCCESS;
+		}
+	}
+	
+	if (sizeof(*hosts->items) * (hosts->offset + 1) > hosts->size) {
+		size = hosts->size + sizeof(*hosts->items) * (hosts->offset + 1);
+		items = realloc(hosts->items, size);
+		
+		if (items == NULL) {
+			return APTERR_MEM_ALLOC_FAILURE;
+		}
+		
+		hosts->size = size;
+		hosts->items = items;
+	}
+	
+	host = &hosts->items[hosts->offset];
+	memset(host, 0, sizeof(*host));
+	
+	host->name = malloc(length + 1);
+	
+	if (host->name == NULL) {
+		return APTERR_MEM_ALLOC_FAILURE;
+	}
+	
+	memcpy(host->name, url, length);
+	host->name[length] = '\0';
+	
+	*index = hosts->offset++;
+	
+	return APTERR_SUCCESS;
+	
+}
+
+static int downloader_seturl(
+	downloader_t* const downloader,
+	pkgdl_transfer_t* const transfer,
+	CURL* const curl,
+	const char* const url
+) {
+	/*
+	Point the transfer to a new URL, keeping track of the host it now talks to.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	err = downloader_host(downloader, url, &transfer->host);
+	
+	if (err != APTERR_SUCCESS) {
+		return err;
+	}
+	
+	if (curl_easy_setopt(curl, CURLOPT_URL, url) != CURLE_OK) {
+		return APTERR_WCURL_SETOPT_FAILURE;
+	}
+	
+	return err;
+	
+}
+
+static void downloader_enqueue(
+	pkgdl_transfer_t* const transfer,
+	const biguint_t delay
+) {
+	/*
+	Schedule the transfer to be started once the given number of milliseconds
+	have passed and its host has room for it.
+	*/
+	
+	transfer->state = DOWNLOADER_TRANSFER_QUEUED;
+	transfer->ready = clock_monotonic() + delay;
+	
+}
+
+static biguint_t downloader_jitter(const biguint_t delay) {
+	/*
+	Pick a random delay between half of the given one and all of it, so that
+	transfers that failed together are not retried together.
+	*/
+	
+	static unsigned long seed = 0;
+	
+	if (seed == 0) {
+		seed = (unsigned long) clock_monotonic() | 1;
+	}
+	
+	seed = seed * 1103515245UL + 12345UL;
+	
+	return delay / 2 + (biguint_t) ((seed >> 16) % (unsigned long) (delay / 2 + 1));
+	
+}
+
+static biguint_t downloader_backoff(
+	CURL* const curl,
+	const size_t attempt
+) {
+	/*
+	Compute how long to wait before retrying a transfer that failed the given
+	number of times in a row.
+	*/
+	
+	size_t index = 0;
+	biguint_t delay = DOWNLOADER_BACKOFF_BASE;
+	
+	#if LIBCURL_VERSION_NUM >= 0x074200
+		curl_off_t retry_after = 0;
+	#endif
+	
+	for (index = 1; index < attempt && delay < DOWNLOADER_BACKOFF_MAX; index++) {
+		delay *= 2;
+	}
+	
+	if (delay > DOWNLOADER_BACKOFF_MAX) {
+		delay = DOWNLOADER_BACKOFF_MAX;
+	}
+	
+	delay = downloader_jitter(delay);
+	
+	#if LIBCURL_VERSION_NUM >= 0x074200
+		/* Servers that are rate limiting us may tell how long to wait */
+		if (curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after) == CURLE_OK && retry_after > 0) {
+			if ((biguint_t) retry_after * 1000 > delay) {
+				delay = (biguint_t) retry_after * 1000;
+			}
+			
+			if (delay > DOWNLOADER_BACKOFF_MAX) {
+				delay = DOWNLOADER_BACKOFF_MAX;
+			}
+		}
+	#else
+		(void) curl;
+	#endif
+	
+	return delay;
+	
+}
+
+static size_t downloader_ceiling(const dlopts_t* const options) {
+	
+	return (options->concurrency > 0) ? options->concurrency : 1;
+	
+}
+
+static void downloader_feedback(
+	downloader_t* const downloader,
+	const dlopts_t* const options,
+	pkgdl_transfer_t* const transfer,
+	CURL* const curl,
+	const CURLcode result
+) {
+	/*
+	Adjust how many transfers may run at once against the host of a finished
+	transfer.
+	
+	This works like TCP congestion control: errors that indicate an overloaded
+	server (timeouts, 429, 503, ...) and sudden latency spikes shrink the window,
+	while a full round of successful transfers grows it back by one, as long as
+	the extra connections keep the overall throughput from that host up.
+	*/
+	
+	size_t window = 0;
+	
+	curl_off_t pretransfer = 0;
+	curl_off_t starttransfer = 0;
+	curl_off_t speed = 0;
+	
+	biguint_t latency = 0;
+	biguint_t throughput = 0;
+	
+	dlhost_t* const host = &downloader->hosts.items[transfer->host];
+	
+	const size_t ceiling = downloader_ceiling(options);
+	
+	transfer->state = DOWNLOADER_TRANSFER_IDLE;
+	
+	if (host->active > 0) {
+		host->active--;
+	}
+	
+	window = host->window;
+	
+	if (result != CURLE_OK) {
+		/* Errors such as missing files are not a sign of congestion */
+		if (!wcurl_retryable(curl, result)) {
+			return;
+		}
+		
+		host->window = (host->window > 1) ? host->window / 2 : 1;
+		host->successes = 0;
+		
+		if (host->window != window) {
+			loggln(LOG_VERBOSE, "Lowering the number of concurrent transfers from %s to %zu", host->name, host->window);
+		}
+		
+		return;
+	}
+	
+	curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+	curl_easy_getinfo(curl, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+	
+	/* How long the server took to answer, and how fast all transfers from it were going */
+	latency = (biguint_t) ((starttransfer > pretransfer) ? (starttransfer - pretransfer) : 0);
+	throughput = (biguint_t) speed * (host->active + 1);
+	
+	if (host->latency > 0 && latency > host->latency * DOWNLOADER_LATENCY_FACTOR) {
+		host->window = (host->window > 1) ? host->window - 1 : 1;
+		host->successes = 0;
+		
+		if (host->window != window) {
+			loggln(LOG_VERBOSE, "Lowering the number of concurrent transfers from %s to %zu", host->name, host->window);
+		}
+	} else if (host->throughput == 0 || throughput >= host->throughput - host->throughput / 8) {
+		if (++host->successes >= host->window && host->window < ceiling) {
+			host->window++;
+			host->successes = 0;
+			
+			loggln(LOG_VERBOSE, "Raising the number of concurrent transfers from %s to %zu", host->name, host->window);
+		}
+	} else {
+		host->successes = 0;
+	}
+	
+	/* Both are tracked as moving averages */
+	host->latency = (host->latency == 0) ? latency : (host->latency * 3 + latency) / 4;
+	host->throughput = (host->throughput == 0) ? throughput : (host->throughput * 3 + throughput) / 4;
+	
+}
+
+static int downloader_activate(
+	downloader_t* const downloader,
+	const dlopts_t* const options,
+	pkgdl_transfer_t* const transfer,
+	CURL* const curl,
+	CURLM* const curl_multi,
+	const biguint_t now,
+	size_t* const queued,
+	long* const timeout
+) {
+	/*
+	Start a queued transfer if it is due and its host has room for it.
+	*/
+	
+	biguint_t wait = 0;
+	dlhost_t* host = NULL;
+	
+	if (transfer->state != DOWNLOADER_TRANSFER_QUEUED) {
+		return APTERR_SUCCESS;
+	}
+	
+	host = &downloader->hosts.items[transfer->host];
+	
+	/* Hosts start with as many transfers as we are allowed to run */
+	if (host->window == 0) {
+		host->window = downloader_ceiling(options);
+	}
+	
+	if (transfer->ready > now) {
+		wait = transfer->ready - now;
+		
+		if (wait < (biguint_t) *timeout) {
+			*timeout = (long) wait;
+		}
+		
+		(*queued)++;
+		return APTERR_SUCCESS;
+	}
+	
+	if (host->active >= host->window) {
+		(*queued)++;
+		return APTERR_SUCCESS;
+	}
+	
+	if (curl_multi_add_handle(curl_multi, curl) != CURLM_OK) {
+		return APTERR_WCURLMLT_ADD_FAILURE;
+	}
+	
+	transfer->state = DOWNLOADER_TRANSFER_ACTIVE;
+	host->active++;
+	
+	return APTERR_SUCCESS;
+	
+}
+
+static int downloader_dispatch(
+	downloader_t* const downloader,
+	const dlopts_t* const options,
+	CURLM* const curl_multi,
+	size_t* const queued,
+	long* const timeout
+) {
+	/*
+	Start every queued transfer that can be started right now. On return, "queued"
+	holds how many are still waiting, and "timeout" how long until the next one
+	of them is due.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	size_t subindex = 0;
+	
+	pkgdl_t* download = NULL;
+	pkgdl_segment_t* segment = NULL;
+	
+	const biguint_t now = clock_monotonic();
+	
+	*queued = 0;
+	*timeout = DOWNLOADER_POLL_TIMEOUT;
+	
+	for (index = 0; index < downloader->offset; index++) {
+		download = &downloader->items[index];
+		
+		if (download->segments.offset == 0) {
+			err = downloader_activate(downloader, options, &download->transfer, wcurl_getcurl(&download->wcurl), curl_multi, now, queued, timeout);
+			
+			if (err != APTERR_SUCCESS) {
+				return err;
+			}
+			
+			continue;
+		}
+		
+		for (subindex = 0; subindex < download->segments.offset; subindex++) {
+			segment = &download->segments.items[subindex];
+			
+			err = downloader_activate(downloader, options, &segment->transfer, wcurl_getcurl(&segment->wcurl), curl_multi, now, queued, timeout);
+			
+			if (err != APTERR_SUCCESS) {
+				return err;
+			}
+		}
+	}
+	
+	return err;
+	
+}
+
+static int downloader_range(pkgdl_t* const download) {
+	/*
+	Ask the server to continue from where the data on disk ends.
+	
+	The If-Range header makes the server send the whole file instead if it changed
+	since the data on disk was received.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	CURLcode code = CURLE_OK;
+	
+	char* header = NULL;
+	struct curl_slist* headers = NULL;
+	
+	file_sink_t* const sink = download->sink;
+	CURL* const curl = wcurl_getcurl(&download->wcurl);
+	
+	code = curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) sink->offset);
+	
+	if (code != CURLE_OK) {
+		err = APTERR_WCURL_SETOPT_FAILURE;
+		goto end;
+	}
+	
+	if (sink->offset > 0 && sink->validator[0] != '\0') {
+		header = malloc(strlen(IF_RANGE_HEADER) + strlen(sink->validator) + 1);
+		
+		if (header == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		strcpy(header, IF_RANGE_HEADER);
+		strcat(header, sink->validator);
+		
+		headers = curl_slist_append(NULL, header);
+		
+		if (headers == NULL) {
+			err = APTERR_WCURL_SLIST_FAILURE;
+			goto end;
+		}
+	}
+	
+	code = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	
+	if (code != CURLE_OK) {
+		err = APTERR_WCURL_SETOPT_FAILURE;
+		goto end;
+	}
+	
+	curl_slist_free_all(download->headers);
+	download->headers = headers;
+	headers = NULL;
+	
+	end:;
+	
+	free(header);
+	curl_slist_free_all(headers);
+	
+	return err;
+	
+}
+
+static int downloader_segment_range(pkgdl_segment_t* const segment) {
+	/*
+	Ask for the part of the segment that was not received yet.
+	*/
+	
+	char range[64];
+	
+	CURLcode code = CURLE_OK;
+	CURL* const curl = wcurl_getcurl(&segment->wcurl);
+	
+	const file_segment_t* const file = &segment->file;
+	
+	sprintf(
+		range,
+		"%"FORMAT_BIGGEST_UINT_T"-%"FORMAT_BIGGEST_UINT_T,
+		file->start + file->received,
+		file->start + file->size - 1
+	);
+	
+	code = curl_easy_setopt(curl, CURLOPT_RANGE, range);
+	
+	if (code != CURLE_OK) {
+		return APTERR_WCURL_SETOPT_FAILURE;
+	}
+	
+	return APTERR_SUCCESS;
+	
+}
+
+static void downloader_segments_free(
+	pkgdl_t* const download,
+	CURLM* const curl_multi
+) {
+	/*
+	Release the connections used to fetch the archive in pieces. Those that are
+	still running are removed from the multi handle first.
+	*/
+	
+	size_t index = 0;
+	pkgdl_segment_t* segment = NULL;
+	
+	pkgdl_segments_t* const segments = &download->segments;
+	
+	for (index = 0; index < segments->offset; index++) {
+		segment = &segments->items[index];
+		
+		if (curl_multi != NULL && wcurl_getcurl(&segment->wcurl) != NULL) {
+			curl_multi_remove_handle(curl_multi, wcurl_getcurl(&segment->wcurl));
+		}
+		
+		wcurl_free(&segment->wcurl);
+		wcurlerr_free(&segment->error);
+	}
+	
+	free(segments->items);
+	segments->items = NULL;
+	segments->offset = 0;
+	segments->size = 0;
+	
+	download->pending = 0;
+	
+}
+
+static int downloader_split(
+	downloader_t* const downloader,
+	pkgdl_t* const download,
+	const dlopts_t* const options,
+	const char* const url
+) {
+	/*
+	Split a large archive into byte ranges that are fetched concurrently over
+	separate connections. Each range is written at its own offset in the partial
+	file, and the digest is computed once all of them are done.
+	
+	Archives that are being resumed from an earlier run are not split.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	CURLcode code = CURLE_OK;
+	
+	size_t index = 0;
+	size_t count = 0;
+	
+	biguint_t size = 0;
+	
+	char* resolved = NULL;
+	
+	wcurl_t* wcurl_global = NULL;
+	pkgdl_segment_t* segment = NULL;
+	
+	pkgdl_segments_t* const segments = &download->segments;
+	const pkg_t* const pkg = download->pkg;
+	
+	CURL* curl = NULL;
+	
+	if (options->segment_threshold == 0 || pkg->size < options->segment_threshold || download->sink->offset > 0) {
+		goto end;
+	}
+	
+	count = (size_t) (pkg->size / DOWNLOADER_SEGMENT_MIN_SIZE);
+	
+	if (count > DOWNLOADER_MAX_SEGMENTS) {
+		count = DOWNLOADER_MAX_SEGMENTS;
+	}
+	
+	if (options->concurrency > 0 && count > options->concurrency) {
+		count = options->concurrency;
+	}
+	
+	if (count < 2) {
+		goto end;
+	}
+	
+	wcurl_global = wcurl_getglobal();
+	
+	if (wcurl_global == NULL) {
+		err = APTERR_WCURL_INIT_FAILURE;
+		goto end;
+	}
+	
+	segments->size = sizeof(*segments->items) * count;
+	segments->items = malloc(segments->size);
+	
+	if (segments->items == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	memset(segments->items, 0, segments->size);
+	
+	size = pkg->size / count;
+	
+	for (index = 0; index < count; index++) {
+		segment = &segments->items[segments->offset++];
+		
+		segment->file.stream = download->sink->stream;
+		segment->file.start = size * index;
+		segment->file.size = (index == count - 1) ? (pkg->size - segment->file.start) : size;
+		segment->file.status = FILE_SINK_PENDING;
+		
+		if (wcurl_duplicate(wcurl_global, &segment->wcurl) != WCURL_ERR_SUCCESS) {
+			err = APTERR_WCURL_INIT_FAILURE;
+			goto end;
+		}
+		
+		curl = wcurl_getcurl(&segment->wcurl);
+		
+		segment->error.msg = malloc(CURL_ERROR_SIZE);
+		
+		if (segment->error.msg == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		segment->error.msg[0] = '\0';
+		
+		/* Spread the ranges across the best mirrors */
+		if (download->mirrors != NULL) {
+			segment->mirror = mirrors_next(download->mirrors);
+			
+			free(resolved);
+			resolved = mirror_resolve(segment->mirror, download->path);
+			
+			if (resolved == NULL) {
+				err = APTERR_MEM_ALLOC_FAILURE;
+				goto end;
+			}
+		}
+		
+		err = downloader_seturl(downloader, &segment->transfer, curl, (resolved == NULL) ? url : resolved);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+		
+		code = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_segment_cb);
+		
+		if (code == CURLE_OK) {
+			code = curl_easy_setopt(curl, CURLOPT_WRITEDATA, &segment->file);
+		}
+		
+		if (code == CURLE_OK) {
+			code = curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_segment_cb);
+		}
+		
+		if (code == CURLE_OK) {
+			code = curl_easy_setopt(curl, CURLOPT_HEADERDATA, &segment->file);
+		}
+		
+		if (code == CURLE_OK) {
+			code = curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, segment->error.msg);
+		}
+		
+		if (code != CURLE_OK) {
+			err = APTERR_WCURL_SETOPT_FAILURE;
+			goto end;
+		}
+		
+		err = downloader_segment_range(segment);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	download->pending = segments->offset;
+	
+	end:;
+	
+	free(resolved);
+	
+	if (err != APTERR_SUCCESS) {
+		downloader_segments_free(download, NULL);
+	}
+	
+	return err;
+	
+}
+
+static int downloader_unsplit(
+	downloader_t* const downloader,
+	pkgdl_t* const download,
+	CURLM* const curl_multi
+) {
+	/*
+	Give up on fetching the archive in pieces and start over with a single transfer.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	pkgdl_segment_t* segment = NULL;
+	
+	for (index = 0; index < download->segments.offset; index++) {
+		segment = &download->segments.items[index];
+		
+		if (segment->transfer.state == DOWNLOADER_TRANSFER_ACTIVE) {
+			downloader->hosts.items[segment->transfer.host].active--;
+		}
+	}
+	
+	downloader_segments_free(download, curl_multi);
+	
+	err = file_sink_restart(download->sink);
+	
+	if (err != APTERR_SUCCESS) {
+		return err;
+	}
+	
+	err = downloader_range(download);
+	
+	if (err != APTERR_SUCCESS) {
+		return err;
+	}
+	
+	downloader_enqueue(&download->transfer, 0);
+	
+	return err;
+	
+}
+
+static int downloader_failover(
+	downloader_t* const downloader,
+	pkgdl_t* const download,
+	pkgdl_transfer_t* const transfer,
+	mirror_t** const mirror,
+	CURL* const curl,
+	int* const switched
+) {
+	/*
+	Move a failed transfer over to another mirror, if there is one.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	char* url = NULL;
+	mirror_t* next = NULL;
+	
+	*switched = 0;
+	
+	if (download->mirrors == NULL || *mirror == NULL) {
+		return APTERR_SUCCESS;
+	}
+	
+	(*mirror)->errors++;
+	
+	next = mirrors_failover(download->mirrors, *mirror);
+	
+	if (next == NULL) {
+		return APTERR_SUCCESS;
+	}
+	
+	url = mirror_resolve(next, download->path);
+	
+	if (url == NULL) {
+		return APTERR_MEM_ALLOC_FAILURE;
+	}
+	
+	err = downloader_seturl(downloader, transfer, curl, url);
+	
+	free(url);
+	
+	if (err != APTERR_SUCCESS) {
+		return err;
+	}
+	
+	loggln(LOG_VERBOSE, "Retrying '%s' from mirror %s", download->pkg->name, next->url);
+	
+	*mirror = next;
+	*switched = 1;
+	
+	return APTERR_SUCCESS;
+	
+}
+
+static void downloader_propagate(
+	wcurl_error_t* const destination,
+	const wcurl_error_t* const source,
+	const CURLcode result
+) {
+	/*
+	Propagate the error to the global HTTP client so that we can retrieve it later.
+	*/
+	
+	strcpy(destination->msg, source->msg);
+	destination->code = result;
+	
+	if (destination->msg[0] == '\0') {
+		strcpy(destination->msg, curl_easy_strerror(destination->code));
+	}
+	
+}
 
 int downloader_append(
 	downloader_t* const downloader,
@@ -41,13 +873,60 @@ int downloader_append(
 	
 }
 
+static void downloader_stream(
+	file_sink_t* const sink,
+	const dlopts_t* const options,
+	const pkg_t* const pkg
+) {
+	/*
+	Unpack the archive while it is being received instead of writing it to disk.
+	
+	This is only an optimization, so the archive is simply written to disk as
+	usual if the extractor cannot be set up.
+	*/
+	
+	stream_unpack_t* unpack = malloc(sizeof(*unpack));
+	
+	if (unpack == NULL) {
+		return;
+	}
+	
+	if (stream_unpack_open(unpack, options->unpack_prefix, pkg->name) != APTERR_SUCCESS) {
+		loggln(LOG_VERBOSE, "Could not set up streaming unpack for '%s'; downloading it to a file", pkg->name);
+		
+		free(unpack);
+		return;
+	}
+	
+	sink->unpack = unpack;
+	
+}
+
+static void downloader_unstream(file_sink_t* const sink) {
+	
+	if (sink->unpack == NULL) {
+		return;
+	}
+	
+	stream_unpack_free(sink->unpack);
+	
+	free(sink->unpack);
+	sink->unpack = NULL;
+	
+}
+
 int downloader_add(
 	downloader_t* const downloader,
 	const dlopts_t* const options,
-	pkg_t* const pkg
+	pkg_t* const pkg,
+	mirrors_t* const mirrors
 ) {
 	
 	char* value = NULL; 
+	char* partial = NULL;
+	char* resolved = NULL;
+	
+	const char* path = NULL;
 	
 	int err = APTERR_SUCCESS;
 	
@@ -55,7 +934,7 @@ int downloader_add(
 	
 	pkgdl_t download = {0};
 	
-	fstream_t* stream = NULL;
+	file_sink_t* sink = NULL;
 	
 	wcurl_t* wcurl_global = NULL;
 	wcurl_t* wcurl = &download.wcurl;
@@ -67,103 +946,413 @@ int downloader_add(
 		goto end;
 	}
 	
-	wcurl_global = wcurl_getglobal();
+	value = pkg->filename;
+	
+	pkg->filename = malloc(
+		strlen(options->temporary_directory) +
+		strlen(PATHSEP_S) +
+		strlen(pkg->name) +
+		strlen(DEB_FILE_EXT) +
+		1
+	);
+	
+	if (pkg->filename == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	strcpy(pkg->filename, options->temporary_directory);
+	strcat(pkg->filename, PATHSEP_S);
+	strcat(pkg->filename, pkg->name);
+	strcat(pkg->filename, DEB_FILE_EXT);
+	
+	/* Archives fetched before, possibly for another prefix, do not need to be downloaded again */
+	if (options->archive_cache.directory != NULL && archive_cache_fetch(&options->archive_cache, pkg, pkg->filename)) {
+		download.pkg = pkg;
+		download.cached = 1;
+		
+		err = downloader_append(downloader, &download);
+		goto end;
+	}
+	
+	wcurl_global = wcurl_getglobal();
+	
+	if (wcurl_global == NULL) {
+		err = APTERR_WCURL_INIT_FAILURE;
+		goto end;
+	}
+	
+	err = wcurl_duplicate(wcurl_global, wcurl);
+	
+	if (err != WCURL_ERR_SUCCESS) {
+		err = APTERR_WCURL_INIT_FAILURE;
+		goto end;
+	}
+	
+	curl = wcurl_getcurl(wcurl);
+	
+	/* Spread the downloads across the best mirrors of the repository */
+	if (mirrors != NULL && mirrors->offset > 1 && mirrors_find(mirrors, value, &path) != NULL) {
+		download.mirrors = mirrors;
+		download.mirror = mirrors_next(mirrors);
+		download.path = malloc(strlen(path) + 1);
+		
+		if (download.path == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		strcpy(download.path, path);
+		
+		resolved = mirror_resolve(download.mirror, download.path);
+		
+		if (resolved == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+	}
+	
+	err = downloader_seturl(downloader, &download.transfer, curl, (resolved == NULL) ? value : resolved);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	partial = downloader_partial_name(options, pkg);
+	
+	if (partial == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	sink = malloc(sizeof(*sink));
+	
+	if (sink == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	err = file_sink_open(sink, partial, pkg->sha256, pkg->size);
+	
+	if (err != APTERR_SUCCESS) {
+		free(sink);
+		sink = NULL;
+		goto end;
+	}
+	
+	download.sink = sink;
+	download.pkg = pkg;
+	
+	/* Unless told otherwise, the largest archives are started first */
+	download.priority = pkg->size;
+	
+	if (sink->offset > 0) {
+		loggln(LOG_VERBOSE, "Resuming download of '%s' from a previous run", pkg->name);
+	}
+	
+	err = downloader_range(&download);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	code = curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_file_cb);
+	
+	if (code != CURLE_OK) {
+		err = APTERR_WCURL_SETOPT_FAILURE;
+		goto end;
+	}
+	
+	code = curl_easy_setopt(curl, CURLOPT_HEADERDATA, sink);
+	
+	if (code != CURLE_OK) {
+		err = APTERR_WCURL_SETOPT_FAILURE;
+		goto end;
+	}
+	
+	code = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_file_cb);
+	
+	if (code != CURLE_OK) {
+		err = APTERR_WCURL_SETOPT_FAILURE;
+		goto end;
+	}
+	
+	code = curl_easy_setopt(curl, CURLOPT_WRITEDATA, sink);
+	
+	if (code != CURLE_OK) {
+		err = APTERR_WCURL_SETOPT_FAILURE;
+		goto end;
+	}
+	
+	error->msg = malloc(CURL_ERROR_SIZE);
+	
+	if (error->msg == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	code = curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error->msg);
+	
+	if (code != CURLE_OK) {
+		err = APTERR_WCURL_SETOPT_FAILURE;
+		goto end;
+	}
+	
+	wcurl->retry = options->retry;
+	
+	err = downloader_split(downloader, &download, options, value);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	/* Archives fetched in pieces, or continued from a previous run, do not arrive in order */
+	if (options->unpack_prefix != NULL && download.segments.offset == 0 && sink->offset == 0) {
+		downloader_stream(sink, options, pkg);
+	}
+	
+	err = downloader_append(downloader, &download);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	end:;
+	
+	free(value);
+	free(partial);
+	free(resolved);
+	
+	if (err != APTERR_SUCCESS) {
+		free(download.path);
+		
+		if (sink != NULL) {
+			downloader_unstream(sink);
+			file_sink_close(sink);
+		}
+		
+		free(sink);
+		curl_slist_free_all(download.headers);
+		downloader_segments_free(&download, NULL);
+	}
+	
+	return err;
+	
+}
+
+static pkgdl_t* downloader_lookup(
+	downloader_t* const downloader,
+	CURL* const curl,
+	pkgdl_segment_t** const segment
+) {
+	/*
+	Find the download that owns the given handle, and the range it is fetching if
+	the archive is being fetched in pieces.
+	*/
+	
+	size_t index = 0;
+	size_t subindex = 0;
+	
+	pkgdl_t* download = NULL;
+	
+	*segment = NULL;
+	
+	for (index = 0; index < downloader->offset; index++) {
+		download = &downloader->items[index];
+		
+		if (wcurl_getcurl(&download->wcurl) == curl) {
+			return download;
+		}
+		
+		for (subindex = 0; subindex < download->segments.offset; subindex++) {
+			if (wcurl_getcurl(&download->segments.items[subindex].wcurl) == curl) {
+				*segment = &download->segments.items[subindex];
+				return download;
+			}
+		}
+	}
+	
+	return NULL;
+	
+}
+
+void downloader_prioritize(
+	downloader_t* const downloader,
+	const pkg_t* const pkg,
+	const biguint_t priority
+) {
+	/*
+	Override the priority of the download of the given package. Downloads with
+	higher priorities are started first.
+	*/
+	
+	size_t index = 0;
+	
+	for (index = 0; index < downloader->offset; index++) {
+		if (downloader->items[index].pkg == pkg) {
+			downloader->items[index].priority = priority;
+			break;
+		}
+	}
+	
+}
+
+static int downloader_compare(const void* a, const void* b) {
 	
-	if (wcurl_global == NULL) {
-		err = APTERR_WCURL_INIT_FAILURE;
-		goto end;
-	}
+	const pkgdl_t* const first = a;
+	const pkgdl_t* const second = b;
 	
-	err = wcurl_duplicate(wcurl_global, wcurl);
+	if (first->priority != second->priority) {
+		return (first->priority > second->priority) ? -1 : 1;
+	}
 	
-	if (err != WCURL_ERR_SUCCESS) {
-		err = APTERR_WCURL_INIT_FAILURE;
-		goto end;
+	if (first->pkg->size != second->pkg->size) {
+		return (first->pkg->size > second->pkg->size) ? -1 : 1;
 	}
 	
-	curl = wcurl_getcurl(wcurl);
+	return strcmp(first->pkg->name, second->pkg->name);
 	
-	code = curl_easy_setopt(curl, CURLOPT_URL, pkg->filename);
+}
+
+static int downloader_schedule(
+	downloader_t* const downloader,
+	const dlopts_t* const options
+) {
+	/*
+	Order the downloads by priority, and estimate the order they will complete in.
 	
-	if (code != CURLE_OK) {
-		err = APTERR_WCURL_SETOPT_FAILURE;
-		goto end;
-	}
+	The estimate assumes every connection gets the same share of the bandwidth,
+	and that each download is started on whichever connection frees up first.
+	It is only used to report how well the schedule held up.
+	*/
 	
-	free(pkg->filename);
+	size_t index = 0;
+	size_t subindex = 0;
+	size_t slot = 0;
 	
-	pkg->filename = malloc(
-		strlen(options->temporary_directory) +
-		strlen(PATHSEP_S) +
-		strlen(pkg->name) +
-		strlen(DEB_FILE_EXT) +
-		1
-	);
+	biguint_t* slots = NULL;
+	biguint_t* finish = NULL;
 	
-	if (pkg->filename == NULL) {
-		err = APTERR_MEM_ALLOC_FAILURE;
-		goto end;
-	}
+	const size_t count = downloader_ceiling(options);
 	
-	strcpy(pkg->filename, options->temporary_directory);
-	strcat(pkg->filename, PATHSEP_S);
-	strcat(pkg->filename, pkg->name);
-	strcat(pkg->filename, DEB_FILE_EXT);
+	qsort(downloader->items, downloader->offset, sizeof(*downloader->items), downloader_compare);
 	
-	stream = fstream_open(pkg->filename, FSTREAM_WRITE);
+	slots = calloc(count, sizeof(*slots));
+	finish = calloc(downloader->offset + 1, sizeof(*finish));
 	
-	if (stream == NULL) {
-		err = APTERR_FSTREAM_OPEN_FAILURE;
-		goto end;
+	if (slots == NULL || finish == NULL) {
+		free(slots);
+		free(finish);
+		
+		return APTERR_MEM_ALLOC_FAILURE;
 	}
 	
-	download.stream = stream;
-	
-	code = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_file_cb);
+	for (index = 0; index < downloader->offset; index++) {
+		slot = 0;
+		
+		for (subindex = 1; subindex < count; subindex++) {
+			if (slots[subindex] < slots[slot]) {
+				slot = subindex;
+			}
+		}
+		
+		/* Cached archives are available right away */
+		if (!downloader->items[index].cached) {
+			slots[slot] += downloader->items[index].pkg->size;
+		}
+		
+		finish[index] = downloader->items[index].cached ? 0 : slots[slot];
+	}
 	
-	if (code != CURLE_OK) {
-		err = APTERR_WCURL_SETOPT_FAILURE;
-		goto end;
+	for (index = 0; index < downloader->offset; index++) {
+		downloader->items[index].expected = 1;
+		
+		for (subindex = 0; subindex < downloader->offset; subindex++) {
+			if (finish[subindex] < finish[index] || (finish[subindex] == finish[index] && subindex < index)) {
+				downloader->items[index].expected++;
+			}
+		}
 	}
 	
-	code = curl_easy_setopt(curl, CURLOPT_WRITEDATA, stream);
+	free(slots);
+	free(finish);
 	
-	if (code != CURLE_OK) {
-		err = APTERR_WCURL_SETOPT_FAILURE;
-		goto end;
-	}
+	return APTERR_SUCCESS;
 	
-	error->msg = malloc(CURL_ERROR_SIZE);
+}
+
+static void downloader_wakeup(void* const argument) {
+	/*
+	Called by the extractor of a paused transfer once it made room for more
+	data, so that the transfer is resumed without waiting for the poll to
+	time out.
+	*/
+	
+	#if LIBCURL_VERSION_NUM >= 0x074400
+		curl_multi_wakeup((CURLM*) argument);
+	#else
+		(void) argument;
+	#endif
 	
-	if (error->msg == NULL) {
-		err = APTERR_MEM_ALLOC_FAILURE;
-		goto end;
-	}
+}
+
+static size_t downloader_resume(downloader_t* const downloader) {
+	/*
+	Resume the transfers that were paused because their extractor could not
+	keep up with them.
 	
-	code = curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error->msg);
+	Returns how many transfers are still paused.
+	*/
 	
-	if (code != CURLE_OK) {
-		err = APTERR_WCURL_SETOPT_FAILURE;
-		goto end;
+	size_t index = 0;
+	size_t paused = 0;
+	
+	pkgdl_t* download = NULL;
+	
+	for (index = 0; index < downloader->offset; index++) {
+		download = &downloader->items[index];
+		
+		if (download->cached || download->sink->unpack == NULL) {
+			continue;
+		}
+		
+		if (stream_unpack_resume(download->sink->unpack)) {
+			curl_easy_pause(wcurl_getcurl(&download->wcurl), CURLPAUSE_CONT);
+		}
+		
+		/* Resuming hands the transfer the data it held back, which may pause it again */
+		if (download->sink->unpack->paused) {
+			paused++;
+		}
 	}
 	
-	wcurl->retry = options->retry;
+	return paused;
 	
-	err = downloader_append(downloader, &download);
+}
+
+static void downloader_start(
+	pkgdl_t* const download,
+	CURLM* const curl_multi
+) {
 	
-	if (err != APTERR_SUCCESS) {
-		goto end;
-	}
+	size_t index = 0;
 	
-	end:;
+	if (download->cached) {
+		return;
+	}
 	
-	free(value);
+	if (download->sink->unpack != NULL) {
+		download->sink->unpack->wakeup = downloader_wakeup;
+		download->sink->unpack->argument = curl_multi;
+	}
 	
-	if (err != APTERR_SUCCESS) {
-		fstream_close(stream);
+	if (download->segments.offset == 0) {
+		downloader_enqueue(&download->transfer, 0);
 	}
 	
-	return err;
+	for (index = 0; index < download->segments.offset; index++) {
+		downloader_enqueue(&download->segments.items[index].transfer, 0);
+	}
 	
 }
 
@@ -185,8 +1374,24 @@ int downloader_wait(
 	int left = 0;
 	
 	int status = 0;
+	int mismatch = 0;
+	int stale = 0;
+	int switched = 0;
+	int unstreamed = 0;
+	
+	size_t queued = 0;
+	size_t displacement = 0;
+	long timeout = 0;
+	
+	biguint_t delay = 0;
+	
+	long response = 0;
+	
+	CURLcode result = CURLE_OK;
 	
 	pkgdl_t* download = NULL;
+	pkgdl_segment_t* segment = NULL;
+	pkgdl_transfer_t* transfer = NULL;
 	
 	wcurl_multi_t* wcurl_multi = NULL;
 	wcurl_error_t* wcurl_error = NULL;
@@ -216,16 +1421,15 @@ int downloader_wait(
 	
 	wcurl_error = wcurl_geterr(curl);
 	
+	err = downloader_schedule(downloader, options);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
 	for (index = 0; index < downloader->offset; index++) {
 		download = &downloader->items[index];
-		curl = wcurl_getcurl(&download->wcurl);
-		
-		code = curl_multi_add_handle(curl_multi, curl);
-		
-		if (code != CURLM_OK) {
-			err = APTERR_WCURLMLT_ADD_FAILURE;
-			goto end;
-		}
+		downloader_start(download, curl_multi);
 		
 		total += 1;
 	}
@@ -234,7 +1438,47 @@ int downloader_wait(
 		(*options->progress_callback)(total, current);
 	}
 	
+	for (index = 0; index < downloader->offset; index++) {
+		download = &downloader->items[index];
+		
+		if (!download->cached) {
+			continue;
+		}
+		
+		current++;
+		
+		if (options->progress_callback != NULL) {
+			(*options->progress_callback)(total, current);
+		}
+		
+		if (options->complete_callback != NULL) {
+			err = (*options->complete_callback)(download->pkg, options->complete_argument);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+		}
+	}
+	
+	running = (current < total);
+	
 	while (running) {
+		/* Transfers are started as their hosts make room for them, rather than all at once */
+		err = downloader_dispatch(downloader, options, curl_multi, &queued, &timeout);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+		
+		#if LIBCURL_VERSION_NUM >= 0x074400
+			downloader_resume(downloader);
+		#else
+			/* There is no way for the extractors to wake us up, so check on them more often */
+			if (downloader_resume(downloader) > 0 && timeout > DOWNLOADER_PAUSE_TIMEOUT) {
+				timeout = DOWNLOADER_PAUSE_TIMEOUT;
+			}
+		#endif
+		
 		code = curl_multi_perform(curl_multi, &running);
 		
 		if (code != CURLM_OK) {
@@ -242,8 +1486,8 @@ int downloader_wait(
 			goto end;
 		}
 		
-		if (running) {
-			code = curl_multi_poll(curl_multi, NULL, 0, 0, NULL);
+		if (running || queued > 0) {
+			code = curl_multi_poll(curl_multi, NULL, 0, (int) timeout, NULL);
 		}
 		
 		if (code != CURLM_OK) {
@@ -256,74 +1500,261 @@ int downloader_wait(
 				continue;
 			}
 			
-			download = NULL;
+			download = downloader_lookup(downloader, msg->easy_handle, &segment);
+			transfer = (segment == NULL) ? &download->transfer : &segment->transfer;
+			
+			code = curl_multi_remove_handle(curl_multi, msg->easy_handle);
+			
+			if (code != CURLM_OK) {
+				err = APTERR_WCURLMLT_REMOVE_FAILURE;
+				goto end;
+			}
+			
+			result = msg->data.result;
+			
+			downloader_feedback(downloader, options, transfer, msg->easy_handle, result);
 			
-			for (index = 0; index < downloader->offset; index++) {
-				download = &downloader->items[index];
-				curl = wcurl_getcurl(&download->wcurl);
+			switched = 0;
+			
+			if (segment != NULL) {
+				if (result == CURLE_OK && segment->file.received != segment->file.size) {
+					result = CURLE_PARTIAL_FILE;
+				}
+				
+				if (result != CURLE_OK && segment->file.status == FILE_SINK_STALE) {
+					loggln(LOG_VERBOSE, "Could not fetch '%s' in pieces; falling back to a single transfer", download->pkg->name);
+					
+					err = downloader_unsplit(downloader, download, curl_multi);
+					
+					if (err != APTERR_SUCCESS) {
+						goto end;
+					}
+					
+					running = 1;
+					continue;
+				}
+				
+				if (result != CURLE_OK) {
+					status = wcurl_retryable(msg->easy_handle, result);
+					
+					if (segment->mirror != NULL && (status || segment->failovers++ < download->mirrors->offset - 1)) {
+						err = downloader_failover(downloader, download, &segment->transfer, &segment->mirror, msg->easy_handle, &switched);
+						
+						if (err != APTERR_SUCCESS) {
+							goto end;
+						}
+						
+						status = status || switched;
+					}
+					
+					if (segment->retries++ > options->retry || !status) {
+						downloader_propagate(wcurl_error, &segment->error, result);
+						err = APTERR_WCURL_REQUEST_FAILURE;
+						goto end;
+					}
+					
+					/* Only this range failed; ask for the rest of it */
+					err = downloader_segment_range(segment);
+					
+					if (err != APTERR_SUCCESS) {
+						goto end;
+					}
+					
+					/* Another mirror can be tried right away */
+					delay = switched ? 0 : downloader_backoff(msg->easy_handle, segment->retries);
+					
+					loggln(LOG_VERBOSE, "Retrying a piece of '%s' in %"FORMAT_BIGGEST_UINT_T" ms", download->pkg->name, delay);
+					
+					downloader_enqueue(&segment->transfer, delay);
+					
+					running = 1;
+					continue;
+				}
 				
-				if (curl == msg->easy_handle) {
-					break;
+				if (--download->pending > 0) {
+					continue;
 				}
 				
-				download = NULL;
+				downloader_segments_free(download, NULL);
+				
+				/* The ranges arrived out of order, so the digest can only be computed now */
+				if (file_sink_verify(download->sink) == FILE_SINK_MISMATCH) {
+					loggln(LOG_WARN, "Checksum mismatch for '%s'", download->pkg->name);
+					
+					if (download->retries++ > options->retry) {
+						err = APTERR_DOWNLOAD_CHECKSUM_MISMATCH;
+						goto end;
+					}
+					
+					err = downloader_unsplit(downloader, download, curl_multi);
+					
+					if (err != APTERR_SUCCESS) {
+						goto end;
+					}
+					
+					running = 1;
+					continue;
+				}
 			}
 			
-			code = curl_multi_remove_handle(curl_multi, msg->easy_handle);
+			if (segment == NULL && result == CURLE_OK && file_sink_finish(download->sink) == FILE_SINK_MISMATCH) {
+				result = CURLE_WRITE_ERROR;
+			}
 			
-			if (code != CURLM_OK) {
-				err = APTERR_WCURLMLT_REMOVE_FAILURE;
-				goto end;
+			if (segment == NULL && result == CURLE_OK && download->sink->unpack != NULL && stream_unpack_finish(download->sink->unpack) != 0) {
+				result = CURLE_WRITE_ERROR;
 			}
 			
-			if (msg->data.result != CURLE_OK) {
-				status = wcurl_retryable(msg->easy_handle, msg->data.result);
+			if (result != CURLE_OK) {
+				unstreamed = (download->sink->unpack != NULL);
 				
-				if (download->retries++ > options->retry || !status) {
-					/* Propagate the error to the global HTTP client so that we can retrieve it later */
-					strcpy(wcurl_error->msg, download->error.msg);
-					wcurl_error->code = msg->data.result;
+				/*
+				Nothing of what was received so far is on disk, so the archive is
+				downloaded again from the start; this time into a file, as usual.
+				*/
+				if (unstreamed) {
+					loggln(LOG_VERBOSE, "Could not unpack '%s' while downloading it; falling back to a file", download->pkg->name);
+					
+					downloader_unstream(download->sink);
+					
+					err = file_sink_restart(download->sink);
+					
+					if (err != APTERR_SUCCESS) {
+						goto end;
+					}
+				}
+				
+				response = 0;
+				curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &response);
+				
+				/* The data on disk cannot be continued; the file probably changed on the server */
+				if (result == CURLE_RANGE_ERROR || (response == 416 && download->sink->offset > 0)) {
+					download->sink->status = FILE_SINK_STALE;
+				}
+				
+				mismatch = (download->sink->status == FILE_SINK_MISMATCH);
+				stale = (download->sink->status == FILE_SINK_STALE);
+				status = mismatch || stale || unstreamed || wcurl_retryable(msg->easy_handle, result);
+				
+				/* Another mirror may be able to serve what this one could not */
+				if (download->mirror != NULL && (status || download->failovers++ < download->mirrors->offset - 1)) {
+					err = downloader_failover(downloader, download, &download->transfer, &download->mirror, msg->easy_handle, &switched);
 					
-					if (wcurl_error->msg[0] == '\0') {
-						strcpy(wcurl_error->msg, curl_easy_strerror(wcurl_error->code));
+					if (err != APTERR_SUCCESS) {
+						goto end;
 					}
 					
-					err = APTERR_WCURL_REQUEST_FAILURE;
-					goto end;
+					status = status || switched;
+				}
+				
+				if (mismatch) {
+					loggln(LOG_WARN, "Checksum mismatch for '%s'", download->pkg->name);
 				}
 				
-				if (download->stream != NULL) {
-					/*
-					The download failed, but it is still retryable. Let's try again after
-					discarding any partially downloaded data.
-					*/
-					status = fstream_seek(download->stream, 0, FSTREAM_SEEK_BEGIN);
+				if (mismatch || stale) {
+					err = file_sink_restart(download->sink);
 					
-					if (status != FSTREAM_SUCCESS) {
-						err = APTERR_FSTREAM_SEEK_FAILURE;
+					if (err != APTERR_SUCCESS) {
+						goto end;
+					}
+				}
+				
+				if (download->retries++ > options->retry || !status) {
+					if (mismatch) {
+						err = APTERR_DOWNLOAD_CHECKSUM_MISMATCH;
 						goto end;
 					}
+					
+					downloader_propagate(wcurl_error, &download->error, result);
+					err = APTERR_WCURL_REQUEST_FAILURE;
+					goto end;
 				}
 				
-				code = curl_multi_add_handle(curl_multi, msg->easy_handle);
+				/*
+				The download failed, but it is still retryable. Whatever was received so far
+				is kept on disk, and we only ask for the rest of it.
+				*/
+				file_sink_resume(download->sink);
 				
-				if (code != CURLM_OK) {
-					err = APTERR_WCURLMLT_ADD_FAILURE;
+				err = downloader_range(download);
+				
+				if (err != APTERR_SUCCESS) {
 					goto end;
 				}
+				
+				/* Back off before asking the same mirror again, in case it is overloaded */
+				delay = (switched || mismatch || stale || unstreamed) ? 0 : downloader_backoff(msg->easy_handle, download->retries);
+				
+				loggln(LOG_VERBOSE, "Retrying '%s' in %"FORMAT_BIGGEST_UINT_T" ms", download->pkg->name, delay);
+				
+				downloader_enqueue(&download->transfer, delay);
+				
+				/* This may have been the last transfer; keep the loop going */
+				running = 1;
+				continue;
+			}
+			
+			current++;
+			
+			loggln(LOG_VERBOSE, "Fetched '%s' in position %zu (expected %zu)", download->pkg->name, current, download->expected);
+			
+			if (current > download->expected) {
+				displacement += current - download->expected;
 			} else {
-				current++;
+				displacement += download->expected - current;
+			}
+			
+			if (options->progress_callback != NULL) {
+				(*options->progress_callback)(total, current);
+			}
+			
+			wcurl_free(&download->wcurl);
+			
+			curl_slist_free_all(download->headers);
+			download->headers = NULL;
+			
+			/* The package is already staged; there is no archive to keep */
+			if (download->sink->unpack != NULL) {
+				download->pkg->unpack = download->sink->unpack;
+				download->sink->unpack = NULL;
 				
-				if (options->progress_callback != NULL) {
-					(*options->progress_callback)(total, current);
+				err = file_sink_discard(download->sink);
+			} else {
+				err = file_sink_commit(download->sink, download->pkg->filename);
+			}
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+			
+			if (options->archive_cache.directory != NULL && download->pkg->unpack == NULL) {
+				if (archive_cache_store(&options->archive_cache, download->pkg, download->pkg->filename) != APTERR_SUCCESS) {
+					loggln(LOG_WARN, "Could not store the archive of '%s' in the archive cache", download->pkg->name);
 				}
+			}
+			
+			/* Let the caller start working on this package while the others are still downloading */
+			if (options->complete_callback != NULL) {
+				err = (*options->complete_callback)(download->pkg, options->complete_argument);
 				
-				wcurl_free(&download->wcurl);
-				
-				fstream_close(download->stream);
-				download->stream = NULL;
+				if (err != APTERR_SUCCESS) {
+					goto end;
+				}
 			}
 		}
+		
+		if (queued > 0) {
+			running = 1;
+		}
+	}
+	
+	/* Make room for what was just stored; this is not worth failing the transaction over */
+	if (options->archive_cache.directory != NULL && archive_cache_trim(&options->archive_cache) != APTERR_SUCCESS) {
+		loggln(LOG_WARN, "Could not evict old archives from the archive cache");
+	}
+	
+	if (current > 0) {
+		loggln(LOG_VERBOSE, "Downloads completed an average of %.1f positions away from the expected order", (double) displacement / (double) current);
 	}
 	
 	end:;
@@ -344,8 +1775,22 @@ void downloader_free(downloader_t* const downloader) {
 		
 		wcurl_free(&download->wcurl);
 		wcurlerr_free(&download->error);
-		fstream_close(download->stream);
-		download->stream = NULL;
+		
+		curl_slist_free_all(download->headers);
+		download->headers = NULL;
+		
+		downloader_segments_free(download, NULL);
+		
+		free(download->path);
+		download->path = NULL;
+		
+		if (download->sink != NULL) {
+			downloader_unstream(download->sink);
+			file_sink_close(download->sink);
+		}
+		
+		free(download->sink);
+		download->sink = NULL;
 		download->retries = 0;
 	}
 	
@@ -354,15 +1799,33 @@ void downloader_free(downloader_t* const downloader) {
 	downloader->offset = 0;
 	downloader->size = 0;
 	
+	for (index = 0; index < downloader->hosts.offset; index++) {
+		free(downloader->hosts.items[index].name);
+	}
+	
+	free(downloader->hosts.items);
+	downloader->hosts.items = NULL;
+	downloader->hosts.offset = 0;
+	downloader->hosts.size = 0;
+	
 }
 
 void dlopts_free(dlopts_t* const options) {
 	
 	free(options->temporary_directory);
+	free(options->partial_directory);
 	
 	options->temporary_directory = NULL;
+	options->partial_directory = NULL;
+	options->unpack_prefix = NULL;
+	
+	archive_cache_close(&options->archive_cache);
+	
 	options->concurrency = 0;
 	options->retry = 0;
+	options->segment_threshold = 0;
 	options->progress_callback = NULL;
+	options->complete_callback = NULL;
+	options->complete_argument = NULL;
 	
 }
\ No newline at end of file
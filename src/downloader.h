@@ -1,12 +1,101 @@
+#include "archive_cache.h"
 #include "fs/fstream.h"
+#include "mirrors.h"
 #include "package.h"
 #include "wcurl.h"
+#include "write_callback.h"
+
+/* Archives at least this large are fetched in pieces over several connections */
+#if !defined(DOWNLOADER_SEGMENT_THRESHOLD)
+	#define DOWNLOADER_SEGMENT_THRESHOLD (16 * 1024 * 1024)
+#endif
+
+#if !defined(DOWNLOADER_SEGMENT_MIN_SIZE)
+	#define DOWNLOADER_SEGMENT_MIN_SIZE (4 * 1024 * 1024)
+#endif
+
+#define DOWNLOADER_MAX_SEGMENTS (8)
+
+/* Failed transfers wait between these many milliseconds before being retried */
+#define DOWNLOADER_BACKOFF_BASE (500)
+#define DOWNLOADER_BACKOFF_MAX (30 * 1000)
+
+/* A transfer that takes this many times longer than usual to start is a sign of congestion */
+#define DOWNLOADER_LATENCY_FACTOR (4)
+
+#define DOWNLOADER_POLL_TIMEOUT (1000)
+
+/* How often transfers paused waiting for their extractor are checked on, when libcurl cannot be woken up */
+#define DOWNLOADER_PAUSE_TIMEOUT (50)
+
+#define DOWNLOADER_TRANSFER_IDLE (0)
+#define DOWNLOADER_TRANSFER_QUEUED (1)
+#define DOWNLOADER_TRANSFER_ACTIVE (2)
+
+struct PkgDownloadTransfer {
+	size_t host;
+	int state;
+	biguint_t ready;
+};
+
+typedef struct PkgDownloadTransfer pkgdl_transfer_t;
+
+struct DownloadHost {
+	char* name;
+	size_t window;
+	size_t active;
+	size_t successes;
+	biguint_t latency;
+	biguint_t throughput;
+};
+
+typedef struct DownloadHost dlhost_t;
+
+struct DownloadHosts {
+	size_t offset;
+	size_t size;
+	dlhost_t* items;
+};
+
+typedef struct DownloadHosts dlhosts_t;
+
+struct PkgDownloadSegment {
+	wcurl_t wcurl;
+	wcurl_error_t error;
+	file_segment_t file;
+	pkgdl_transfer_t transfer;
+	mirror_t* mirror;
+	size_t retries;
+	size_t failovers;
+};
+
+typedef struct PkgDownloadSegment pkgdl_segment_t;
+
+struct PkgDownloadSegments {
+	size_t offset;
+	size_t size;
+	pkgdl_segment_t* items;
+};
+
+typedef struct PkgDownloadSegments pkgdl_segments_t;
 
 struct PkgDownload {
 	wcurl_t wcurl;
 	wcurl_error_t error;
-	fstream_t* stream;
+	struct curl_slist* headers;
+	file_sink_t* sink;
+	pkgdl_transfer_t transfer;
+	pkgdl_segments_t segments;
+	size_t pending;
 	size_t retries;
+	mirrors_t* mirrors;
+	mirror_t* mirror;
+	char* path;
+	size_t failovers;
+	biguint_t priority;
+	size_t expected;
+	int cached;
+	pkg_t* pkg;
 };
 
 typedef struct PkgDownload pkgdl_t;
@@ -15,17 +104,25 @@ struct PkgDownloader {
 	size_t offset;
 	size_t size;
 	pkgdl_t* items;
+	dlhosts_t hosts;
 };
 
 typedef struct PkgDownloader downloader_t;
 
 typedef void (*progress_callback_t)(size_t, size_t);
+typedef int (*complete_callback_t)(pkg_t* const, void* const);
 
 struct DownloadOptions {
 	size_t concurrency;
 	size_t retry;
+	biguint_t segment_threshold;
 	char* temporary_directory;
+	char* partial_directory;
+	const char* unpack_prefix;
+	archive_cache_t archive_cache;
 	progress_callback_t progress_callback;
+	complete_callback_t complete_callback;
+	void* complete_argument;
 };
 
 typedef struct DownloadOptions dlopts_t;
@@ -33,7 +130,14 @@ typedef struct DownloadOptions dlopts_t;
 int downloader_add(
 	downloader_t* const downloader,
 	const dlopts_t* const options,
-	pkg_t* const pkg
+	pkg_t* const pkg,
+	mirrors_t* const mirrors
+);
+
+void downloader_prioritize(
+	downloader_t* const downloader,
+	const pkg_t* const pkg,
+	const biguint_t priority
 );
 
 int downloader_wait(
@@ -135,6 +135,26 @@ const char* apterr_getmessage(const int code) {
 			return "Failed to increase the maximum open files limit";
 		case APTERR_REPO_EMPTY:
 			return "Repository package index is empty";
+		case APTERR_FS_MOVE_FAILURE:
+			return "Could not move file to the specified location";
+		case APTERR_TEXTINDEX_CORRUPTED:
+			return "The package description index is corrupted or was built by an incompatible version";
+		case APTERR_PATTERN_INVALID:
+			return "Invalid glob or regular expression";
+		case APTERR_PATTERN_TOO_COMPLEX:
+			return "Pattern is too complex to compile";
+		case APTERR_THREAD_INIT_FAILURE:
+			return "Could not initialize thread synchronization primitives";
+		case APTERR_DOWNLOAD_CHECKSUM_MISMATCH:
+			return "Downloaded package does not match its expected checksum";
+		case APTERR_ARCHIVE_CACHE_STORE_FAILURE:
+			return "Could not store the package archive in the local archive cache";
+		case APTERR_FS_SYNC_FAILURE:
+			return "Could not flush the unpacked files to disk";
+		case APTERR_PKGDB_CORRUPTED:
+			return "The installed package database is corrupted or was written by an incompatible version";
+		case APTERR_PACKAGE_FILE_CONFLICT:
+			return "Trying to overwrite a file that belongs to another installed package";
 	}
 	
 	return "Unknown error";
@@ -84,6 +84,24 @@
 
 #define APTERR_RLIMIT_NOFILE_FAILURE -61 /* Failed to increase the maximum open files limit */
 
+#define APTERR_FS_MOVE_FAILURE -62 /* Could not move file to the specified location */
+#define APTERR_TEXTINDEX_CORRUPTED -63 /* The package description index is corrupted or was built by an incompatible version */
+
+#define APTERR_PATTERN_INVALID -64 /* Invalid glob or regular expression */
+#define APTERR_PATTERN_TOO_COMPLEX -65 /* Pattern is too complex to compile */
+
+#define APTERR_THREAD_INIT_FAILURE -66 /* Could not initialize thread synchronization primitives */
+
+#define APTERR_DOWNLOAD_CHECKSUM_MISMATCH -67 /* Downloaded package does not match its expected checksum */
+
+#define APTERR_ARCHIVE_CACHE_STORE_FAILURE -68 /* Could not store the package archive in the local archive cache */
+
+#define APTERR_FS_SYNC_FAILURE -69 /* Could not flush the unpacked files to disk */
+
+#define APTERR_PKGDB_CORRUPTED -70 /* The installed package database is corrupted or was written by an incompatible version */
+
+#define APTERR_PACKAGE_FILE_CONFLICT -71 /* Trying to overwrite a file that belongs to another installed package */
+
 const char* apterr_getmessage(const int code);
 
 #endif
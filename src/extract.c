@@ -0,0 +1,1870 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/stat.h>
+#endif
+
+#include "extract.h"
+
+/* Handles for writing to disk that were made up front by extractor_reserve() */
+struct ExtractReserve {
+	int active;
+	size_t offset;
+	struct archive** items;
+	mutex_t mutex;
+};
+
+static struct ExtractReserve extract_reserve = {0};
+
+static void digest_begin(
+	extractor_t* const extractor,
+	struct archive_entry* const entry
+) {
+	/*
+	Start hashing the contents of a regular file. The digest is only kept if
+	the contents come in order, with no holes in between.
+	*/
+	
+	extractor->digest.valid = archive_entry_sparse_count(entry) == 0;
+	extractor->digest.size = (size_t) archive_entry_size(entry);
+	extractor->digest.mode = (int) (archive_entry_perm(entry) & 07777);
+	
+	extractor->hashed = 0;
+	
+	sha256_init(&extractor->sha256);
+	
+}
+
+static void digest_update(
+	extractor_t* const extractor,
+	const void* const chunk,
+	const size_t size,
+	const size_t offset
+) {
+	
+	if (!extractor->digest.valid) {
+		return;
+	}
+	
+	if (offset != extractor->hashed) {
+		extractor->digest.valid = 0;
+		return;
+	}
+	
+	sha256_update(&extractor->sha256, chunk, size);
+	extractor->hashed += size;
+	
+}
+
+static int digest_end(extractor_t* const extractor) {
+	/*
+	Returns (1) if the digest is valid, (0) otherwise.
+	*/
+	
+	if (extractor->hashed == (size_t) -1) {
+		return extractor->digest.valid;
+	}
+	
+	if (extractor->digest.valid && extractor->hashed != extractor->digest.size) {
+		extractor->digest.valid = 0;
+	}
+	
+	if (extractor->digest.valid) {
+		sha256_final(&extractor->sha256, extractor->digest.hash);
+	}
+	
+	/* Nothing else is hashed for this entry */
+	extractor->hashed = (size_t) -1;
+	
+	return extractor->digest.valid;
+	
+}
+
+#if !defined(_WIN32)
+/* Operations queued on the ring for an entry; their tags are the entry's index times QUEUED_STEPS, plus the step */
+#define QUEUED_UNLINK (0)
+#define QUEUED_CREATE (1)
+#define QUEUED_WRITE (2)
+#define QUEUED_CLOSE (3)
+#define QUEUED_STEPS (4)
+
+static unsigned long hash_string(const char* const string) {
+	
+	const unsigned char* position = (const unsigned char*) string;
+	unsigned long hash = 2166136261UL;
+	
+	while (*position != '\0') {
+		hash ^= *position++;
+		hash *= 16777619UL;
+	}
+	
+	return hash;
+	
+}
+
+static char** directories_lookup(
+	const extract_directories_t* const directories,
+	const char* const path
+) {
+	
+	size_t bucket = 0;
+	
+	char** item = NULL;
+	
+	bucket = (size_t) (hash_string(path) & (directories->buckets - 1));
+	
+	while (1) {
+		item = &directories->items[bucket];
+		
+		if (*item == NULL || strcmp(*item, path) == 0) {
+			break;
+		}
+		
+		bucket = (bucket + 1) & (directories->buckets - 1);
+	}
+	
+	return item;
+	
+}
+
+static int directories_contains(
+	const extract_directories_t* const directories,
+	const char* const path
+) {
+	
+	if (directories->buckets == 0) {
+		return 0;
+	}
+	
+	return *directories_lookup(directories, path) != NULL;
+	
+}
+
+static int directories_grow(extract_directories_t* const directories) {
+	
+	size_t bucket = 0;
+	
+	const size_t buckets = directories->buckets;
+	char** const items = directories->items;
+	
+	directories->buckets = (buckets == 0) ? EXTRACT_INITIAL_DIRECTORIES : buckets * 2;
+	directories->items = calloc(directories->buckets, sizeof(*directories->items));
+	
+	if (directories->items == NULL) {
+		directories->buckets = buckets;
+		directories->items = items;
+		
+		return -1;
+	}
+	
+	for (bucket = 0; bucket < buckets; bucket++) {
+		if (items[bucket] == NULL) {
+			continue;
+		}
+		
+		*directories_lookup(directories, items[bucket]) = items[bucket];
+	}
+	
+	free(items);
+	
+	return 0;
+	
+}
+
+static int directories_add(
+	extract_directories_t* const directories,
+	const char* const path
+) {
+	
+	char** item = NULL;
+	
+	if ((directories->count + 1) * 2 > directories->buckets && directories_grow(directories) != 0) {
+		return -1;
+	}
+	
+	item = directories_lookup(directories, path);
+	
+	if (*item != NULL) {
+		return 0;
+	}
+	
+	*item = malloc(strlen(path) + 1);
+	
+	if (*item == NULL) {
+		return -1;
+	}
+	
+	strcpy(*item, path);
+	directories->count++;
+	
+	return 0;
+	
+}
+
+static int fixups_append(
+	extract_fixups_t* const fixups,
+	const char* const path,
+	const int mode
+) {
+	
+	size_t size = 0;
+	
+	extract_fixup_t* items = NULL;
+	extract_fixup_t* fixup = NULL;
+	
+	if (sizeof(*fixups->items) * (fixups->offset + 1) > fixups->size) {
+		size = fixups->size + sizeof(*fixups->items) * (fixups->offset + 1);
+		items = realloc(fixups->items, size);
+		
+		if (items == NULL) {
+			return -1;
+		}
+		
+		fixups->size = size;
+		fixups->items = items;
+	}
+	
+	fixup = &fixups->items[fixups->offset];
+	fixup->path = malloc(strlen(path) + 1);
+	
+	if (fixup->path == NULL) {
+		return -1;
+	}
+	
+	strcpy(fixup->path, path);
+	fixup->mode = mode;
+	
+	fixups->offset++;
+	
+	return 0;
+	
+}
+
+static int open_exclusive(
+	extractor_t* const extractor,
+	const char* const path,
+	const int mode
+) {
+	/*
+	Create a new file at the given path, replacing whatever was there.
+	
+	Like libarchive, existing files are unlinked rather than truncated, so
+	programs that are running from them (and other links to them) are left
+	alone.
+	*/
+	
+	int fd = -1;
+	
+	extractor->stats.syscalls++;
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+	
+	if (fd == -1 && errno == EEXIST) {
+		extractor->stats.syscalls++;
+		
+		if (unlink(path) == -1) {
+			return -1;
+		}
+		
+		extractor->stats.syscalls++;
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+	}
+	
+	return fd;
+	
+}
+
+static int write_all(
+	extractor_t* const extractor,
+	const int fd,
+	const char* data,
+	size_t size,
+	off_t offset
+) {
+	
+	ssize_t wsize = 0;
+	
+	while (size > 0) {
+		extractor->stats.syscalls++;
+		wsize = pwrite(fd, data, size, offset);
+		
+		if (wsize == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			
+			return -1;
+		}
+		
+		data += wsize;
+		size -= (size_t) wsize;
+		offset += (off_t) wsize;
+	}
+	
+	return 0;
+	
+}
+
+static char* temporary_path(const char* const path) {
+	
+	char* temporary = malloc(strlen(path) + strlen(EXTRACT_TEMPORARY_SUFFIX) + 1);
+	
+	if (temporary == NULL) {
+		return NULL;
+	}
+	
+	strcpy(temporary, path);
+	strcat(temporary, EXTRACT_TEMPORARY_SUFFIX);
+	
+	return temporary;
+	
+}
+
+static int replace_link(
+	extractor_t* const extractor,
+	const char* const hardlink,
+	const char* const target,
+	const char* const path
+) {
+	/*
+	Like create_link(), but the link is created next to whatever is at the
+	path, and renamed over it. Symbolic links that point to the right place
+	already are left alone.
+	
+	Returns (0) on success, (1) if the link could not be created.
+	*/
+	
+	int err = 0;
+	
+	ssize_t length = 0;
+	
+	char* temporary = NULL;
+	char* current = NULL;
+	
+	if (hardlink == NULL) {
+		current = malloc(strlen(target) + 2);
+		
+		if (current == NULL) {
+			return 1;
+		}
+		
+		extractor->stats.syscalls++;
+		length = readlink(path, current, strlen(target) + 1);
+		
+		if (length >= 0 && (size_t) length == strlen(target) && memcmp(current, target, (size_t) length) == 0) {
+			free(current);
+			extractor->stats.unchanged++;
+			return 0;
+		}
+		
+		free(current);
+	}
+	
+	temporary = temporary_path(path);
+	
+	if (temporary == NULL) {
+		return 1;
+	}
+	
+	extractor->stats.syscalls++;
+	unlink(temporary);
+	
+	extractor->stats.syscalls++;
+	
+	if (hardlink != NULL) {
+		err = link(hardlink, temporary);
+	} else {
+		err = symlink(target, temporary);
+	}
+	
+	if (err == 0) {
+		extractor->stats.syscalls++;
+		err = rename(temporary, path);
+	}
+	
+	/* Renaming a link over another link to the same file leaves both of them */
+	if (err != 0 || hardlink != NULL) {
+		extractor->stats.syscalls++;
+		unlink(temporary);
+	}
+	
+	free(temporary);
+	
+	if (err != 0) {
+		return 1;
+	}
+	
+	extractor->stats.links++;
+	
+	return 0;
+	
+}
+
+static int create_link(
+	extractor_t* const extractor,
+	const char* const hardlink,
+	const char* const target,
+	const char* const path
+) {
+	/*
+	Create a hard link to the given file or, if that is NULL, a symbolic link
+	pointing to the given target, replacing whatever was there.
+	
+	Returns (0) on success, (1) if the link could not be created.
+	*/
+	
+	int err = 0;
+	int attempt = 0;
+	
+	if (extractor->replace) {
+		return replace_link(extractor, hardlink, target, path);
+	}
+	
+	for (attempt = 0; attempt < 2; attempt++) {
+		extractor->stats.syscalls++;
+		
+		if (hardlink != NULL) {
+			err = link(hardlink, path);
+		} else {
+			err = symlink(target, path);
+		}
+		
+		if (err == 0 || errno != EEXIST) {
+			break;
+		}
+		
+		extractor->stats.syscalls++;
+		
+		if (unlink(path) == -1) {
+			break;
+		}
+	}
+	
+	if (err != 0) {
+		return 1;
+	}
+	
+	extractor->stats.links++;
+	
+	return 0;
+	
+}
+
+static extract_queued_t* queue_append(
+	extractor_t* const extractor,
+	const int type,
+	const char* const path,
+	const char* const target,
+	const int mode
+) {
+	
+	size_t size = 0;
+	
+	extract_queue_t* const queue = &extractor->queue;
+	
+	extract_queued_t* items = NULL;
+	extract_queued_t* item = NULL;
+	
+	if (sizeof(*queue->items) * (queue->offset + 1) > queue->size) {
+		size = queue->size + sizeof(*queue->items) * (queue->offset + 1);
+		items = realloc(queue->items, size);
+		
+		if (items == NULL) {
+			return NULL;
+		}
+		
+		queue->size = size;
+		queue->items = items;
+	}
+	
+	item = &queue->items[queue->offset];
+	memset(item, 0, sizeof(*item));
+	
+	item->type = type;
+	item->mode = mode;
+	item->path = malloc(strlen(path) + 1);
+	
+	if (item->path == NULL) {
+		return NULL;
+	}
+	
+	strcpy(item->path, path);
+	
+	if (target != NULL) {
+		item->target = malloc(strlen(target) + 1);
+		
+		if (item->target == NULL) {
+			free(item->path);
+			return NULL;
+		}
+		
+		strcpy(item->target, target);
+	}
+	
+	queue->offset++;
+	
+	return item;
+	
+}
+
+static void queue_complete(
+	void* const data,
+	const unsigned long tag,
+	const int result
+) {
+	/*
+	Record how one of the operations queued for an entry went.
+	*/
+	
+	extractor_t* const extractor = data;
+	extract_queued_t* const item = &extractor->queue.items[tag / QUEUED_STEPS];
+	
+	switch (tag % QUEUED_STEPS) {
+		case QUEUED_UNLINK:
+			/* There was usually nothing to replace */
+			break;
+		case QUEUED_WRITE:
+			if (result >= 0 && (size_t) result != item->size) {
+				item->err = -EIO;
+				break;
+			}
+			/* fall through */
+		default:
+			if (result < 0 && item->err == 0) {
+				item->err = result;
+			}
+			
+			break;
+	}
+	
+}
+
+static int queue_flush(extractor_t* const extractor) {
+	/*
+	Submit everything that was queued on the ring and wait for it.
+	
+	Files and links that could not be created through the ring are created
+	again the usual way, from the copy of their contents that was kept.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	int err = 0;
+	int fd = -1;
+	int calls = 0;
+	
+	size_t index = 0;
+	
+	extract_queued_t* item = NULL;
+	
+	if (extractor->queue.offset == 0) {
+		return 0;
+	}
+	
+	calls = uring_submit(&extractor->ring, queue_complete, extractor);
+	
+	if (calls == -1) {
+		err = -1;
+		goto end;
+	}
+	
+	extractor->stats.syscalls += (size_t) calls;
+	
+	for (index = 0; index < extractor->queue.offset; index++) {
+		item = &extractor->queue.items[index];
+		
+		switch (item->type) {
+			case AE_IFDIR:
+				/* Directories that were there already still get their permissions applied */
+				if (item->clean && item->err == -EEXIST && fixups_append(&extractor->fixups, item->path, item->mode) != 0) {
+					err = -1;
+					goto end;
+				}
+				
+				break;
+			case AE_IFREG:
+				if (item->err == 0) {
+					extractor->stats.files++;
+					break;
+				}
+				
+				fd = open_exclusive(extractor, item->path, item->mode & 0777);
+				
+				/* Like any other file that cannot be created, it is skipped */
+				if (fd == -1) {
+					break;
+				}
+				
+				err = write_all(extractor, fd, extractor->buffer + item->offset, item->size, 0);
+				
+				extractor->stats.syscalls++;
+				
+				if (close(fd) == -1 || err != 0) {
+					err = -1;
+					goto end;
+				}
+				
+				extractor->stats.files++;
+				
+				break;
+			case AE_IFLNK:
+				if (item->err == 0) {
+					extractor->stats.links++;
+					break;
+				}
+				
+				create_link(extractor, NULL, item->target, item->path);
+				
+				break;
+		}
+	}
+	
+	end:;
+	
+	for (index = 0; index < extractor->queue.offset; index++) {
+		item = &extractor->queue.items[index];
+		
+		free(item->path);
+		free(item->target);
+	}
+	
+	extractor->queue.offset = 0;
+	extractor->buffer_offset = 0;
+	extractor->slots = 0;
+	extractor->directories_queued = 0;
+	
+	return err;
+	
+}
+
+static int queue_directory(
+	extractor_t* const extractor,
+	const char* const path,
+	const int mode,
+	const int clean
+) {
+	/*
+	Queue the creation of a directory on the ring.
+	
+	Directories are chained to each other, so parents are always created
+	before what is inside of them; anything else has to wait for them to be
+	submitted.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	unsigned long tag = 0;
+	
+	extract_queued_t* item = NULL;
+	
+	if (uring_space(&extractor->ring) < 1 && queue_flush(extractor) != 0) {
+		return -1;
+	}
+	
+	item = queue_append(extractor, AE_IFDIR, path, NULL, mode);
+	
+	if (item == NULL) {
+		return -1;
+	}
+	
+	item->clean = clean;
+	
+	tag = (unsigned long) (extractor->queue.offset - 1) * QUEUED_STEPS;
+	
+	uring_mkdirat(&extractor->ring, AT_FDCWD, item->path, mode, URING_HARDLINK, tag + QUEUED_CREATE);
+	
+	extractor->directories_queued = 1;
+	
+	return 0;
+	
+}
+
+static int queue_entry(
+	extractor_t* const extractor,
+	struct archive* const input,
+	struct archive_entry* const entry,
+	const char* const path
+) {
+	/*
+	Queue the creation of a small regular file or a symbolic link on the
+	ring. The contents of the file are read in right away, and kept until
+	the ring is submitted.
+	
+	Whatever was at the path is unlinked first, like it would have been
+	otherwise.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	int code = 0;
+	
+	unsigned long tag = 0;
+	
+	extract_queued_t* item = NULL;
+	
+	const int type = (int) archive_entry_filetype(entry);
+	const int mode = (int) archive_entry_perm(entry);
+	const size_t size = (type == AE_IFREG) ? (size_t) archive_entry_size(entry) : 0;
+	
+	const void* chunk = NULL;
+	size_t rsize = 0;
+	
+	#if ARCHIVE_VERSION_NUMBER >= 3000000
+		int64_t offset = 0;
+	#else
+		off_t offset = 0;
+	#endif
+	
+	if (extractor->directories_queued || uring_space(&extractor->ring) < QUEUED_STEPS || extractor->slots == URING_FILE_SLOTS || extractor->buffer_offset + size > EXTRACT_RING_BUFFER_SIZE) {
+		if (queue_flush(extractor) != 0) {
+			return -1;
+		}
+	}
+	
+	if (type == AE_IFREG && extractor->buffer == NULL) {
+		extractor->buffer = malloc(EXTRACT_RING_BUFFER_SIZE);
+		
+		if (extractor->buffer == NULL) {
+			return -1;
+		}
+	}
+	
+	item = queue_append(extractor, type, path, archive_entry_symlink(entry), mode);
+	
+	if (item == NULL) {
+		return -1;
+	}
+	
+	tag = (unsigned long) (extractor->queue.offset - 1) * QUEUED_STEPS;
+	
+	uring_unlinkat(&extractor->ring, AT_FDCWD, item->path, 0, URING_HARDLINK, tag + QUEUED_UNLINK);
+	
+	if (type == AE_IFLNK) {
+		uring_symlinkat(&extractor->ring, item->target, AT_FDCWD, item->path, 0, tag + QUEUED_CREATE);
+		return 0;
+	}
+	
+	item->slot = extractor->slots++;
+	item->offset = extractor->buffer_offset;
+	item->size = size;
+	
+	while (1) {
+		code = archive_read_data_block(input, &chunk, &rsize, &offset);
+		
+		if (code == ARCHIVE_EOF) {
+			break;
+		}
+		
+		if (code != ARCHIVE_OK || offset < 0 || (size_t) offset + rsize > size) {
+			return -1;
+		}
+		
+		memcpy(extractor->buffer + item->offset + (size_t) offset, chunk, rsize);
+		digest_update(extractor, chunk, rsize, (size_t) offset);
+	}
+	
+	extractor->buffer_offset += size;
+	
+	/* Files opened into the ring's own table never become descriptors, and may not ask for O_CLOEXEC */
+	uring_openat(&extractor->ring, AT_FDCWD, item->path, O_WRONLY | O_CREAT | O_EXCL, mode & 0777, item->slot, URING_LINK, tag + QUEUED_CREATE);
+	
+	/* The file is closed even if it could not be written */
+	if (size > 0) {
+		uring_write(&extractor->ring, item->slot, extractor->buffer + item->offset, size, 0, URING_HARDLINK, tag + QUEUED_WRITE);
+	}
+	
+	uring_close(&extractor->ring, item->slot, 0, tag + QUEUED_CLOSE);
+	
+	return 0;
+	
+}
+
+static int queueable(
+	const extractor_t* const extractor,
+	struct archive_entry* const entry
+) {
+	/*
+	Tell whether the entry can be created through the ring: symbolic links,
+	and regular files that are known to be small, not sparse, and end up
+	with the right permissions when created. Nothing is, while replacing
+	the files of an earlier version.
+	*/
+	
+	const int type = (int) archive_entry_filetype(entry);
+	const int mode = (int) archive_entry_perm(entry);
+	
+	/* Replacing files takes more than the ring does for them */
+	if (!extractor->has_ring || extractor->replace || archive_entry_hardlink(entry) != NULL) {
+		return 0;
+	}
+	
+	if (type == AE_IFLNK) {
+		return archive_entry_symlink(entry) != NULL;
+	}
+	
+	/* Raw streams (such as package indexes) come without a size */
+	return type == AE_IFREG && archive_entry_size_is_set(entry) && archive_entry_size(entry) <= EXTRACT_RING_FILE_SIZE && archive_entry_sparse_count(entry) == 0 && (mode & 07777) == ((mode & 0777) & ~extractor->umask);
+	
+}
+
+static int make_directories(
+	extractor_t* const extractor,
+	char* const path
+) {
+	/*
+	Create the given directory and any of its parents that are not known to
+	exist yet.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	int known = 0;
+	
+	char ch = '\0';
+	char* position = NULL;
+	char* start = NULL;
+	
+	if (*path == '\0' || directories_contains(&extractor->directories, path)) {
+		return 0;
+	}
+	
+	/* Only what is below the deepest directory known to exist needs to be created */
+	for (start = path + strlen(path) - 1; start > path; start--) {
+		if (*start != '/') {
+			continue;
+		}
+		
+		*start = '\0';
+		known = directories_contains(&extractor->directories, path);
+		*start = '/';
+		
+		if (known) {
+			break;
+		}
+	}
+	
+	for (position = start + 1; ; position++) {
+		if (!(*position == '/' || *position == '\0')) {
+			continue;
+		}
+		
+		ch = *position;
+		*position = '\0';
+		
+		if (!directories_contains(&extractor->directories, path)) {
+			if (extractor->has_ring) {
+				if (queue_directory(extractor, path, 0777, 0) != 0) {
+					*position = ch;
+					return -1;
+				}
+			} else {
+				extractor->stats.syscalls++;
+				
+				if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+					*position = ch;
+					return -1;
+				}
+			}
+			
+			if (directories_add(&extractor->directories, path) != 0) {
+				*position = ch;
+				return -1;
+			}
+		}
+		
+		*position = ch;
+		
+		if (ch == '\0') {
+			break;
+		}
+	}
+	
+	return 0;
+	
+}
+
+static int make_parent_directories(
+	extractor_t* const extractor,
+	char* const path
+) {
+	
+	int err = 0;
+	
+	char* separator = strrchr(path, '/');
+	
+	if (separator == NULL || separator == path) {
+		return 0;
+	}
+	
+	*separator = '\0';
+	err = make_directories(extractor, path);
+	*separator = '/';
+	
+	return err;
+	
+}
+
+static int write_contents(
+	extractor_t* const extractor,
+	struct archive* const input,
+	struct archive_entry* const entry,
+	const int fd,
+	off_t written
+) {
+	/*
+	Write what is left of the contents of the entry to the given file, and
+	give the file its size and permissions. The first written bytes of it
+	are taken to be there already.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	int code = 0;
+	
+	const int mode = (int) archive_entry_perm(entry);
+	
+	const void* chunk = NULL;
+	size_t rsize = 0;
+	
+	#if ARCHIVE_VERSION_NUMBER >= 3000000
+		int64_t offset = 0;
+		const int64_t size = archive_entry_size(entry);
+	#else
+		off_t offset = 0;
+		const off_t size = archive_entry_size(entry);
+	#endif
+	
+	/* Reserving the space of a sparse file would fill in its holes */
+	if (size >= EXTRACT_FALLOCATE_THRESHOLD && archive_entry_sparse_count(entry) == 0) {
+		extractor->stats.syscalls++;
+		
+		/* Filesystems that cannot do this are fine; running out of space is not */
+		if (posix_fallocate(fd, 0, (off_t) size) == ENOSPC) {
+			return -1;
+		}
+	}
+	
+	while (1) {
+		code = archive_read_data_block(input, &chunk, &rsize, &offset);
+		
+		if (code == ARCHIVE_EOF) {
+			break;
+		}
+		
+		if (code != ARCHIVE_OK) {
+			return -1;
+		}
+		
+		digest_update(extractor, chunk, rsize, (size_t) offset);
+		
+		if (write_all(extractor, fd, chunk, rsize, (off_t) offset) != 0) {
+			return -1;
+		}
+		
+		written = (off_t) offset + (off_t) rsize;
+	}
+	
+	/* Sparse files may end in a hole */
+	if (written < (off_t) size) {
+		extractor->stats.syscalls++;
+		
+		if (ftruncate(fd, (off_t) size) == -1) {
+			return -1;
+		}
+	}
+	
+	/* Only needed if the umask took something away, or for the set-id and sticky bits */
+	if ((mode & 07777) != ((mode & 0777) & ~extractor->umask)) {
+		extractor->stats.syscalls++;
+		
+		if (fchmod(fd, (mode_t) (mode & 07777)) == -1) {
+			return -1;
+		}
+	}
+	
+	return 0;
+	
+}
+
+static int write_regular(
+	extractor_t* const extractor,
+	struct archive* const input,
+	struct archive_entry* const entry,
+	const char* const path
+) {
+	/*
+	Returns (0) on success, (1) if the file could not be created (and its
+	contents were left unread), or (-1) on error.
+	*/
+	
+	int err = 0;
+	int fd = -1;
+	
+	const int mode = (int) archive_entry_perm(entry);
+	
+	fd = open_exclusive(extractor, path, mode & 0777);
+	
+	if (fd == -1) {
+		return 1;
+	}
+	
+	err = write_contents(extractor, input, entry, fd, 0);
+	
+	if (err == 0) {
+		extractor->stats.files++;
+	}
+	
+	extractor->stats.syscalls++;
+	
+	if (close(fd) == -1 && err == 0) {
+		err = -1;
+	}
+	
+	return err;
+	
+}
+
+static int read_all(
+	extractor_t* const extractor,
+	const int fd,
+	char* data,
+	size_t size,
+	off_t offset
+) {
+	/*
+	Returns (0) on success, (-1) on error or if the file ends too soon.
+	*/
+	
+	ssize_t rsize = 0;
+	
+	while (size > 0) {
+		extractor->stats.syscalls++;
+		rsize = pread(fd, data, size, offset);
+		
+		if (rsize == -1 && errno == EINTR) {
+			continue;
+		}
+		
+		if (rsize <= 0) {
+			return -1;
+		}
+		
+		data += rsize;
+		size -= (size_t) rsize;
+		offset += (off_t) rsize;
+	}
+	
+	return 0;
+	
+}
+
+static int compare_chunk(
+	extractor_t* const extractor,
+	const int fd,
+	const char* data,
+	size_t size,
+	off_t offset
+) {
+	/*
+	Returns (1) if the file holds the given data at the given offset, (0)
+	otherwise.
+	*/
+	
+	size_t length = 0;
+	
+	while (size > 0) {
+		length = (size > EXTRACT_RING_BUFFER_SIZE) ? EXTRACT_RING_BUFFER_SIZE : size;
+		
+		if (read_all(extractor, fd, extractor->buffer, length, offset) != 0 || memcmp(extractor->buffer, data, length) != 0) {
+			return 0;
+		}
+		
+		data += length;
+		size -= length;
+		offset += (off_t) length;
+	}
+	
+	return 1;
+	
+}
+
+static int copy_range(
+	extractor_t* const extractor,
+	const int source,
+	const int destination,
+	off_t size
+) {
+	/*
+	Copy the first bytes of one file into the other.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	size_t length = 0;
+	off_t offset = 0;
+	
+	while (offset < size) {
+		length = ((size - offset) > EXTRACT_RING_BUFFER_SIZE) ? EXTRACT_RING_BUFFER_SIZE : (size_t) (size - offset);
+		
+		if (read_all(extractor, source, extractor->buffer, length, offset) != 0) {
+			return -1;
+		}
+		
+		if (write_all(extractor, destination, extractor->buffer, length, offset) != 0) {
+			return -1;
+		}
+		
+		offset += (off_t) length;
+	}
+	
+	return 0;
+	
+}
+
+static int write_replacement(
+	extractor_t* const extractor,
+	struct archive* const input,
+	struct archive_entry* const entry,
+	const char* const path
+) {
+	/*
+	Replace the file at the given path with the contents of the entry,
+	unless it holds them already.
+	
+	Files are only compared if the earlier version listed them with the
+	same size and permissions, and the file on disk still has them. Small
+	ones are read into memory, and compared by their digest. Larger ones
+	are compared with the file on disk while they are read, and only
+	written out from where they start to differ.
+	
+	The new contents are written next to the file, and renamed over it,
+	so that the file is never missing.
+	
+	Returns (0) on success, (1) if the file could not be created (and its
+	contents were left unread), or (-1) on error.
+	*/
+	
+	int err = 0;
+	int code = 0;
+	int fd = -1;
+	int existing = -1;
+	int same = 0;
+	int consumed = 0;
+	
+	char* temporary = NULL;
+	
+	struct stat st = {0};
+	
+	const int mode = (int) archive_entry_perm(entry);
+	
+	const extract_digest_t* const expected = extractor->expected;
+	
+	const void* chunk = NULL;
+	size_t rsize = 0;
+	
+	#if ARCHIVE_VERSION_NUMBER >= 3000000
+		int64_t offset = 0;
+		const int64_t size = archive_entry_size(entry);
+	#else
+		off_t offset = 0;
+		const off_t size = archive_entry_size(entry);
+	#endif
+	
+	const int candidate = (
+		expected != NULL &&
+		expected->valid &&
+		expected->size == (size_t) size &&
+		expected->mode == (mode & 07777) &&
+		archive_entry_sparse_count(entry) == 0
+	);
+	
+	if (candidate && extractor->buffer == NULL) {
+		extractor->buffer = malloc(EXTRACT_RING_BUFFER_SIZE);
+		
+		if (extractor->buffer == NULL) {
+			return -1;
+		}
+	}
+	
+	if (candidate && size <= EXTRACT_RING_BUFFER_SIZE) {
+		consumed = 1;
+		
+		while (1) {
+			code = archive_read_data_block(input, &chunk, &rsize, &offset);
+			
+			if (code == ARCHIVE_EOF) {
+				break;
+			}
+			
+			if (code != ARCHIVE_OK || offset < 0 || (size_t) offset + rsize > (size_t) size) {
+				return -1;
+			}
+			
+			memcpy(extractor->buffer + (size_t) offset, chunk, rsize);
+			digest_update(extractor, chunk, rsize, (size_t) offset);
+		}
+		
+		/* The digest is what the earlier version had; the file itself may have been changed or removed since */
+		if (digest_end(extractor) && memcmp(extractor->digest.hash, expected->hash, sizeof(expected->hash)) == 0) {
+			extractor->stats.syscalls++;
+			same = (lstat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == (off_t) size && (int) (st.st_mode & 07777) == expected->mode);
+		}
+		
+		if (same) {
+			extractor->stats.unchanged++;
+			return 0;
+		}
+	} else if (candidate) {
+		extractor->stats.syscalls++;
+		existing = open(path, O_RDONLY | O_CLOEXEC);
+		
+		if (existing != -1) {
+			extractor->stats.syscalls++;
+			same = (fstat(existing, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == (off_t) size && (int) (st.st_mode & 07777) == expected->mode);
+		}
+		
+		while (same) {
+			code = archive_read_data_block(input, &chunk, &rsize, &offset);
+			consumed = 1;
+			
+			if (code == ARCHIVE_EOF) {
+				break;
+			}
+			
+			if (code != ARCHIVE_OK) {
+				err = -1;
+				goto end;
+			}
+			
+			digest_update(extractor, chunk, rsize, (size_t) offset);
+			
+			/* The chunk is written out below, along with whatever came before it */
+			same = compare_chunk(extractor, existing, chunk, rsize, (off_t) offset);
+		}
+		
+		if (same) {
+			extractor->stats.unchanged++;
+			goto end;
+		}
+	}
+	
+	temporary = temporary_path(path);
+	
+	if (temporary == NULL) {
+		err = -1;
+		goto end;
+	}
+	
+	fd = open_exclusive(extractor, temporary, mode & 0777);
+	
+	if (fd == -1) {
+		err = consumed ? -1 : 1;
+		goto end;
+	}
+	
+	if (candidate && size <= EXTRACT_RING_BUFFER_SIZE) {
+		err = write_all(extractor, fd, extractor->buffer, (size_t) size, 0);
+		
+		/* Everything was read already; this only sets the permissions */
+		if (err == 0) {
+			err = write_contents(extractor, input, entry, fd, (off_t) size);
+		}
+	} else if (consumed) {
+		err = copy_range(extractor, existing, fd, (off_t) offset);
+		
+		if (err == 0) {
+			err = write_all(extractor, fd, chunk, rsize, (off_t) offset);
+		}
+		
+		if (err == 0) {
+			err = write_contents(extractor, input, entry, fd, (off_t) offset + (off_t) rsize);
+		}
+	} else {
+		err = write_contents(extractor, input, entry, fd, 0);
+	}
+	
+	extractor->stats.syscalls++;
+	
+	if (close(fd) == -1 && err == 0) {
+		err = -1;
+	}
+	
+	if (err == 0) {
+		extractor->stats.syscalls++;
+		err = rename(temporary, path);
+	}
+	
+	if (err != 0) {
+		extractor->stats.syscalls++;
+		unlink(temporary);
+		
+		err = -1;
+		goto end;
+	}
+	
+	extractor->stats.files++;
+	
+	end:;
+	
+	if (existing != -1) {
+		extractor->stats.syscalls++;
+		close(existing);
+	}
+	
+	free(temporary);
+	
+	return err;
+	
+}
+
+static int write_link(
+	extractor_t* const extractor,
+	struct archive_entry* const entry,
+	const char* const path
+) {
+	/*
+	Returns (0) on success, (1) if the link could not be created.
+	*/
+	
+	return create_link(extractor, archive_entry_hardlink(entry), archive_entry_symlink(entry), path);
+	
+}
+
+static int write_directory(
+	extractor_t* const extractor,
+	struct archive_entry* const entry,
+	char* const path
+) {
+	/*
+	Returns (0) on success, (1) if the directory could not be created.
+	
+	Permissions are only applied once everything else was extracted, so
+	that read-only directories can still be filled in; directories created
+	here with the right permissions already are left alone.
+	*/
+	
+	const int mode = (int) archive_entry_perm(entry);
+	
+	/* Without these, nothing could be created inside it */
+	const int writable = (mode & 0700) == 0700;
+	
+	/* Created with the right permissions already */
+	const int clean = writable && (mode & 07777) == ((mode & 0777) & ~extractor->umask);
+	
+	if (make_parent_directories(extractor, path) != 0) {
+		return 1;
+	}
+	
+	extractor->stats.directories++;
+	
+	if (!directories_contains(&extractor->directories, path) && extractor->has_ring) {
+		/* Whether it was there already is only known once the ring was submitted */
+		if (queue_directory(extractor, path, writable ? (mode & 0777) : 0777, clean) != 0) {
+			return -1;
+		}
+		
+		if (directories_add(&extractor->directories, path) != 0) {
+			return -1;
+		}
+		
+		if (clean) {
+			return 0;
+		}
+	} else if (!directories_contains(&extractor->directories, path)) {
+		extractor->stats.syscalls++;
+		
+		if (mkdir(path, (mode_t) (writable ? (mode & 0777) : 0777)) == 0) {
+			if (directories_add(&extractor->directories, path) != 0) {
+				return -1;
+			}
+			
+			if (clean) {
+				return 0;
+			}
+		} else if (errno != EEXIST) {
+			return 1;
+		} else if (directories_add(&extractor->directories, path) != 0) {
+			return -1;
+		}
+	}
+	
+	if (fixups_append(&extractor->fixups, path, mode & 07777) != 0) {
+		return -1;
+	}
+	
+	return 0;
+	
+}
+
+static int needs_libarchive(struct archive_entry* const entry) {
+	/*
+	Tell whether the entry has anything only libarchive knows how to restore.
+	*/
+	
+	unsigned long set = 0;
+	unsigned long clear = 0;
+	
+	const int type = (int) archive_entry_filetype(entry);
+	
+	/* Hard links carry no type of their own */
+	if (archive_entry_hardlink(entry) != NULL) {
+		if (archive_entry_size(entry) > 0) {
+			return 1;
+		}
+	} else if (!(type == AE_IFREG || type == AE_IFDIR || type == AE_IFLNK)) {
+		return 1;
+	}
+	
+	if (archive_entry_acl_count(entry, ARCHIVE_ENTRY_ACL_TYPE_ACCESS | ARCHIVE_ENTRY_ACL_TYPE_DEFAULT | ARCHIVE_ENTRY_ACL_TYPE_NFS4) > 0) {
+		return 1;
+	}
+	
+	archive_entry_fflags(entry, &set, &clear);
+	
+	return (set != 0 || clear != 0);
+	
+}
+#endif
+
+static int write_delegated(
+	extractor_t* const extractor,
+	struct archive* const input,
+	struct archive_entry* const entry
+) {
+	/*
+	Have libarchive extract the entry. ACLs and file flags are only asked
+	for when the entry actually has them, which saves it from looking for
+	them on every file.
+	
+	Returns (0) on success, (1) if the entry was skipped, or (-1) on error.
+	*/
+	
+	int code = 0;
+	int flags = ARCHIVE_EXTRACT_PERM;
+	
+	unsigned long set = 0;
+	unsigned long clear = 0;
+	
+	const void* chunk = NULL;
+	size_t rsize = 0;
+	
+	#if ARCHIVE_VERSION_NUMBER >= 3000000
+		int64_t offset = 0;
+	#else
+		off_t offset = 0;
+	#endif
+	
+	if (archive_entry_acl_count(entry, ARCHIVE_ENTRY_ACL_TYPE_ACCESS | ARCHIVE_ENTRY_ACL_TYPE_DEFAULT | ARCHIVE_ENTRY_ACL_TYPE_NFS4) > 0) {
+		flags |= ARCHIVE_EXTRACT_ACL;
+	}
+	
+	archive_entry_fflags(entry, &set, &clear);
+	
+	if (set != 0 || clear != 0) {
+		flags |= ARCHIVE_EXTRACT_FFLAGS;
+	}
+	
+	code = archive_write_disk_set_options(extractor->disk, flags);
+	
+	if (code != ARCHIVE_OK) {
+		return -1;
+	}
+	
+	code = archive_write_header(extractor->disk, entry);
+	
+	if (code != ARCHIVE_OK) {
+		return 1;
+	}
+	
+	while (1) {
+		code = archive_read_data_block(input, &chunk, &rsize, &offset);
+		
+		if (code == ARCHIVE_EOF) {
+			break;
+		}
+		
+		if (code != ARCHIVE_OK) {
+			return -1;
+		}
+		
+		digest_update(extractor, chunk, rsize, (size_t) offset);
+		
+		code = archive_write_data_block(extractor->disk, chunk, rsize, offset);
+		
+		if (code != ARCHIVE_OK) {
+			return -1;
+		}
+	}
+	
+	extractor->stats.delegated++;
+	
+	return 0;
+	
+}
+
+void extract_stats_add(
+	extract_stats_t* const destination,
+	const extract_stats_t* const source
+) {
+	
+	destination->files += source->files;
+	destination->directories += source->directories;
+	destination->links += source->links;
+	destination->delegated += source->delegated;
+	destination->unchanged += source->unchanged;
+	destination->syscalls += source->syscalls;
+	
+}
+
+int extractor_reserve(const size_t count) {
+	/*
+	Make the handles for writing to disk for the given number of extractors
+	in advance.
+	
+	archive_write_disk_new() reads the umask of the process by clearing it
+	and setting it back, and anything another thread creates in between gets
+	the wrong permissions. This is meant to be called before any other thread
+	is started; extractor_init() then takes its handle from here. Extractors
+	set up once these are used up still make their own, serialised with each
+	other, so the window is narrower but not gone.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	size_t index = 0;
+	
+	if (extract_reserve.active) {
+		return -1;
+	}
+	
+	extract_reserve.items = malloc(sizeof(*extract_reserve.items) * (count + 1));
+	
+	if (extract_reserve.items == NULL) {
+		return -1;
+	}
+	
+	if (mutex_init(&extract_reserve.mutex) != 0) {
+		free(extract_reserve.items);
+		extract_reserve.items = NULL;
+		
+		return -1;
+	}
+	
+	extract_reserve.active = 1;
+	
+	for (index = 0; index < count; index++) {
+		extract_reserve.items[index] = archive_write_disk_new();
+		
+		if (extract_reserve.items[index] == NULL) {
+			extractor_unreserve();
+			return -1;
+		}
+		
+		extract_reserve.offset++;
+	}
+	
+	return 0;
+	
+}
+
+void extractor_unreserve(void) {
+	/*
+	Free the handles that were reserved but never taken. No extractor may be
+	set up while this runs.
+	*/
+	
+	size_t index = 0;
+	
+	if (!extract_reserve.active) {
+		return;
+	}
+	
+	for (index = 0; index < extract_reserve.offset; index++) {
+		archive_write_free(extract_reserve.items[index]);
+	}
+	
+	free(extract_reserve.items);
+	mutex_free(&extract_reserve.mutex);
+	
+	memset(&extract_reserve, 0, sizeof(extract_reserve));
+	
+}
+
+static struct archive* disk_new(const int mask) {
+	
+	struct archive* disk = NULL;
+	
+	if (extract_reserve.active) {
+		mutex_lock(&extract_reserve.mutex);
+	}
+	
+	if (extract_reserve.offset > 0) {
+		disk = extract_reserve.items[--extract_reserve.offset];
+	} else {
+		disk = archive_write_disk_new();
+		
+		#if !defined(_WIN32)
+			/* Put back the umask read at startup, in case another thread cleared it too */
+			umask((mode_t) mask);
+		#endif
+	}
+	
+	if (extract_reserve.active) {
+		mutex_unlock(&extract_reserve.mutex);
+	}
+	
+	return disk;
+	
+}
+
+int extractor_init(
+	extractor_t* const extractor,
+	const char* const directory,
+	const int mask
+) {
+	/*
+	Prepare to extract archive entries to disk.
+	
+	The given directory (if not NULL) is taken to exist already, so nothing
+	above it is ever created. The mask is the umask of the process; it is
+	read once by the caller, as extractors may be set up from several threads.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	memset(extractor, 0, sizeof(*extractor));
+	
+	extractor->disk = disk_new(mask);
+	
+	if (extractor->disk == NULL) {
+		return -1;
+	}
+	
+	#if !defined(_WIN32)
+		if (directory != NULL && directories_add(&extractor->directories, directory) != 0) {
+			extractor_free(extractor);
+			return -1;
+		}
+	#else
+		(void) directory;
+	#endif
+	
+	extractor->umask = mask;
+	
+	/* Without a ring, everything is done one system call at a time */
+	extractor->has_ring = (uring_init(&extractor->ring) == 0);
+	
+	return 0;
+	
+}
+
+static int extract_entry(
+	extractor_t* const extractor,
+	struct archive* const input,
+	struct archive_entry* const entry
+) {
+	/*
+	Returns (0) on success, (1) if the entry was skipped, or (-1) on error.
+	*/
+	
+	#if !defined(_WIN32)
+		int err = 0;
+		int type = 0;
+		
+		size_t length = 0;
+		char* path = NULL;
+		
+		const char* const pathname = archive_entry_pathname(entry);
+		
+		if (pathname == NULL || needs_libarchive(entry)) {
+			if (queue_flush(extractor) != 0) {
+				return -1;
+			}
+			
+			return write_delegated(extractor, input, entry);
+		}
+		
+		path = malloc(strlen(pathname) + 1);
+		
+		if (path == NULL) {
+			return -1;
+		}
+		
+		strcpy(path, pathname);
+		
+		length = strlen(path);
+		
+		while (length > 1 && path[length - 1] == '/') {
+			path[--length] = '\0';
+		}
+		
+		type = (int) archive_entry_filetype(entry);
+		
+		if (type == AE_IFDIR && archive_entry_hardlink(entry) == NULL) {
+			err = write_directory(extractor, entry, path);
+		} else if (make_parent_directories(extractor, path) != 0) {
+			err = 1;
+		} else if (queueable(extractor, entry)) {
+			err = queue_entry(extractor, input, entry, path);
+		} else if (queue_flush(extractor) != 0) {
+			err = -1;
+		} else if (type == AE_IFREG && archive_entry_hardlink(entry) == NULL && extractor->replace) {
+			err = write_replacement(extractor, input, entry, path);
+		} else if (type == AE_IFREG && archive_entry_hardlink(entry) == NULL) {
+			err = write_regular(extractor, input, entry, path);
+		} else {
+			err = write_link(extractor, entry, path);
+		}
+		
+		free(path);
+		
+		if (err == 1) {
+			err = (queue_flush(extractor) == 0) ? write_delegated(extractor, input, entry) : -1;
+		}
+		
+		return err;
+	#else
+		return write_delegated(extractor, input, entry);
+	#endif
+	
+}
+
+int extractor_write(
+	extractor_t* const extractor,
+	struct archive* const input,
+	struct archive_entry* const entry
+) {
+	/*
+	Extract the given entry, reading its contents from the input archive.
+	
+	Regular files, directories and links are created directly, skipping the
+	per-file checks libarchive would do; the parents of each file are only
+	created once, and the space for large files is reserved up front. Nothing
+	is flushed to disk here.
+	
+	Where io_uring is available, directories, symbolic links and small files
+	are queued and created in batches instead; extractor_finish() submits
+	whatever is still queued.
+	
+	When replacing the files of an earlier version, files and links are
+	never removed first. Those that did not change are left alone, and the
+	others are renamed over the old ones.
+	
+	Anything else (and anything these cannot cope with) is handed to
+	libarchive.
+	
+	The digest of each regular file is left in the extractor.
+	
+	Returns (0) on success, (1) if the entry was skipped, or (-1) on error.
+	*/
+	
+	int err = 0;
+	
+	const int regular = (archive_entry_filetype(entry) == AE_IFREG && archive_entry_hardlink(entry) == NULL);
+	
+	extractor->digest.valid = 0;
+	
+	if (regular) {
+		digest_begin(extractor, entry);
+	}
+	
+	err = extract_entry(extractor, input, entry);
+	
+	if (regular && err == 0) {
+		digest_end(extractor);
+	} else {
+		extractor->digest.valid = 0;
+	}
+	
+	return err;
+	
+}
+
+int extractor_finish(extractor_t* const extractor) {
+	/*
+	Create whatever is still queued, then apply the permissions of the
+	extracted directories, deepest ones first.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	int err = 0;
+	
+	#if !defined(_WIN32)
+		size_t index = 0;
+		
+		const extract_fixup_t* fixup = NULL;
+		
+		if (queue_flush(extractor) != 0) {
+			err = -1;
+		}
+		
+		for (index = extractor->fixups.offset; index > 0; index--) {
+			fixup = &extractor->fixups.items[index - 1];
+			
+			extractor->stats.syscalls++;
+			
+			/* libarchive only warns about these as well */
+			chmod(fixup->path, (mode_t) fixup->mode);
+		}
+	#endif
+	
+	if (archive_write_close(extractor->disk) != ARCHIVE_OK) {
+		err = -1;
+	}
+	
+	return err;
+	
+}
+
+void extractor_free(extractor_t* const extractor) {
+	
+	size_t index = 0;
+	
+	if (extractor->disk != NULL) {
+		archive_write_free(extractor->disk);
+		extractor->disk = NULL;
+	}
+	
+	for (index = 0; index < extractor->directories.buckets; index++) {
+		free(extractor->directories.items[index]);
+	}
+	
+	free(extractor->directories.items);
+	extractor->directories.items = NULL;
+	extractor->directories.buckets = 0;
+	extractor->directories.count = 0;
+	
+	for (index = 0; index < extractor->fixups.offset; index++) {
+		free(extractor->fixups.items[index].path);
+	}
+	
+	free(extractor->fixups.items);
+	extractor->fixups.items = NULL;
+	extractor->fixups.size = 0;
+	extractor->fixups.offset = 0;
+	
+	/* Anything still queued was never submitted */
+	for (index = 0; index < extractor->queue.offset; index++) {
+		free(extractor->queue.items[index].path);
+		free(extractor->queue.items[index].target);
+	}
+	
+	free(extractor->queue.items);
+	extractor->queue.items = NULL;
+	extractor->queue.size = 0;
+	extractor->queue.offset = 0;
+	
+	free(extractor->buffer);
+	extractor->buffer = NULL;
+	extractor->buffer_offset = 0;
+	
+	if (extractor->has_ring) {
+		uring_free(&extractor->ring);
+		extractor->has_ring = 0;
+	}
+	
+}
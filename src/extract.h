@@ -0,0 +1,143 @@
+#if !defined(EXTRACT_H)
+#define EXTRACT_H
+
+#include <stddef.h>
+
+#if !defined(_WIN32)
+	#include <sys/types.h>
+#endif
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include "fs/uring.h"
+#include "os/thread.h"
+#include "sha256.h"
+
+/* Regular files at least this large have their space reserved before being written */
+#define EXTRACT_FALLOCATE_THRESHOLD (1024 * 1024)
+
+/* Initial number of slots in the table of directories known to exist */
+#define EXTRACT_INITIAL_DIRECTORIES (64)
+
+/* Regular files up to this size are written through the ring, when there is one */
+#define EXTRACT_RING_FILE_SIZE (256 * 1024)
+
+/* Contents of the files queued on the ring are held here until it is submitted */
+#define EXTRACT_RING_BUFFER_SIZE (4 * 1024 * 1024)
+
+/* When replacing files, the new contents are written here first, next to the old file, and renamed over it */
+#define EXTRACT_TEMPORARY_SUFFIX ".nouzen-new"
+
+struct ExtractStats {
+	size_t files;
+	size_t directories;
+	size_t links;
+	size_t delegated;
+	size_t unchanged;
+	size_t syscalls;
+};
+
+typedef struct ExtractStats extract_stats_t;
+
+struct ExtractDigest {
+	int valid;
+	size_t size;
+	int mode;
+	unsigned char hash[SHA256_DIGEST_SIZE];
+};
+
+typedef struct ExtractDigest extract_digest_t;
+
+struct ExtractDirectories {
+	size_t buckets;
+	size_t count;
+	char** items;
+};
+
+typedef struct ExtractDirectories extract_directories_t;
+
+struct ExtractFixup {
+	char* path;
+	int mode;
+};
+
+typedef struct ExtractFixup extract_fixup_t;
+
+struct ExtractFixups {
+	size_t size;
+	size_t offset;
+	extract_fixup_t* items;
+};
+
+typedef struct ExtractFixups extract_fixups_t;
+
+struct ExtractQueued {
+	int type;
+	char* path;
+	char* target;
+	int mode;
+	int clean;
+	unsigned int slot;
+	size_t offset;
+	size_t size;
+	int err;
+};
+
+typedef struct ExtractQueued extract_queued_t;
+
+struct ExtractQueue {
+	size_t size;
+	size_t offset;
+	extract_queued_t* items;
+};
+
+typedef struct ExtractQueue extract_queue_t;
+
+struct Extractor {
+	struct archive* disk;
+	extract_directories_t directories;
+	extract_fixups_t fixups;
+	extract_stats_t stats;
+	int umask;
+	uring_t ring;
+	int has_ring;
+	extract_queue_t queue;
+	char* buffer;
+	size_t buffer_offset;
+	unsigned int slots;
+	int directories_queued;
+	int replace;
+	const extract_digest_t* expected;
+	extract_digest_t digest;
+	sha256_t sha256;
+	size_t hashed;
+};
+
+typedef struct Extractor extractor_t;
+
+void extract_stats_add(
+	extract_stats_t* const destination,
+	const extract_stats_t* const source
+);
+
+int extractor_reserve(const size_t count);
+void extractor_unreserve(void);
+
+int extractor_init(
+	extractor_t* const extractor,
+	const char* const directory,
+	const int mask
+);
+
+int extractor_write(
+	extractor_t* const extractor,
+	struct archive* const input,
+	struct archive_entry* const entry
+);
+
+int extractor_finish(extractor_t* const extractor);
+
+void extractor_free(extractor_t* const extractor);
+
+#endif
@@ -8,6 +8,7 @@
 #endif
 
 #if !defined(_WIN32)
+	#include <errno.h>
 	#include <stdio.h>
 	#include <unistd.h>
 	#include <sys/file.h>
@@ -256,6 +257,43 @@ int fstream_lock(fstream_t* const stream) {
 	
 }
 
+int fstream_sync(fstream_t* const stream) {
+	/*
+	Flush the data written so far all the way to the disk.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	int status = 0;
+	
+	#if !defined(_WIN32)
+		int fd = 0;
+	#endif
+	
+	#if defined(_WIN32)
+		status = FlushFileBuffers(stream->stream) == TRUE;
+	#else
+		if (fflush(stream->stream) != 0) {
+			return FSTREAM_ERROR;
+		}
+		
+		fd = fileno(stream->stream);
+		
+		if (fd == -1) {
+			return FSTREAM_ERROR;
+		}
+		
+		status = fsync(fd) == 0;
+	#endif
+	
+	if (!status) {
+		return FSTREAM_ERROR;
+	}
+	
+	return FSTREAM_SUCCESS;
+	
+}
+
 ssize_t fstream_read(fstream_t* const stream, char* const buffer, const size_t size) {
 	/*
 	Reads a block of data.
@@ -342,6 +380,63 @@ int fstream_write(fstream_t* const stream, const char* const buffer, const size_
 	
 }
 
+int fstream_pwrite(fstream_t* const stream, const char* const buffer, const size_t size, const biguint_t offset) {
+	/*
+	Writes a block of data at the given offset, without using or moving the current
+	file position. The file must not have been opened in append mode.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	#if defined(_WIN32)
+		DWORD wsize = 0;
+		BOOL status = FALSE;
+		OVERLAPPED overlapped = {0};
+	#else
+		int fd = 0;
+		size_t written = 0;
+		ssize_t wsize = 0;
+	#endif
+	
+	if (stream->mode == FSTREAM_READ || stream->mode == FSTREAM_APPEND) {
+		return FSTREAM_ERROR;
+	}
+	
+	#if defined(_WIN32)
+		overlapped.Offset = (DWORD) (offset & 0xFFFFFFFF);
+		overlapped.OffsetHigh = (DWORD) ((offset >> 16) >> 16);
+		
+		status = WriteFile(stream->stream, buffer, (DWORD) size, &wsize, &overlapped);
+		
+		if (status == 0 || wsize != (DWORD) size) {
+			return FSTREAM_ERROR;
+		}
+	#else
+		fd = fileno(stream->stream);
+		
+		if (fd == -1) {
+			return FSTREAM_ERROR;
+		}
+		
+		while (written < size) {
+			wsize = pwrite(fd, buffer + written, size - written, (off_t) (offset + written));
+			
+			if (wsize == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				
+				return FSTREAM_ERROR;
+			}
+			
+			written += (size_t) wsize;
+		}
+	#endif
+	
+	return FSTREAM_SUCCESS;
+	
+}
+
 int fstream_seek(fstream_t* const stream, const long int offset, const fstream_seek_t method) {
 	/*
 	Sets the current file position.
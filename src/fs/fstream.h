@@ -13,6 +13,8 @@
 	#include <sys/types.h>
 #endif
 
+#include "biggestint.h"
+
 #define FSTREAM_SUCCESS (0)
 #define FSTREAM_ERROR (-1)
 #define FSTREAM_EOF (0)
@@ -48,8 +50,10 @@ typedef struct FStream fstream_t;
 fstream_t* fstream_open(const char* const filename, const fstream_mode_t mode);
 fstream_t* fstream_fdopen(const int fd, const fstream_mode_t mode);
 int fstream_lock(fstream_t* const stream);
+int fstream_sync(fstream_t* const stream);
 ssize_t fstream_read(fstream_t* const stream, char* const buffer, const size_t size);
 int fstream_write(fstream_t* const stream, const char* const buffer, const size_t size);
+int fstream_pwrite(fstream_t* const stream, const char* const buffer, const size_t size, const biguint_t offset);
 int fstream_seek(fstream_t* const stream, const long int offset, const fstream_seek_t method);
 int fsream_truncate(fstream_t* const stream, const long int offset);
 long int fstream_tell(fstream_t* const stream);
@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+	#include <windows.h>
+	#include <fileapi.h>
+#endif
+
+#if !defined(_WIN32)
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+#include "fs/mmap.h"
+
+#if defined(_WIN32) && defined(_UNICODE)
+	#include "fs/absrel.h"
+	#include "fs/sep.h"
+#endif
+
+int map_file(const char* const filename, mapped_file_t* const mapped) {
+	/*
+	Map the whole contents of a file into memory for reading.
+	
+	Empty files are reported as mapped, but with a null data pointer.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	#if defined(_WIN32)
+		#if defined(_UNICODE)
+			size_t prefixs = 0;
+			wchar_t* wfilename = NULL;
+			int wfilenames = 0;
+		#endif
+		
+		LARGE_INTEGER size = {0};
+	#else
+		int fd = -1;
+		struct stat st = {0};
+	#endif
+	
+	memset(mapped, 0, sizeof(*mapped));
+	
+	#if defined(_WIN32)
+		#if defined(_UNICODE)
+			prefixs = isabsolute(filename) ? wcslen(WIN10_LONG_PATH_PREFIX) : 0;
+			
+			wfilenames = MultiByteToWideChar(CP_UTF8, 0, filename, -1, NULL, 0);
+			
+			if (wfilenames == 0) {
+				return -1;
+			}
+			
+			wfilename = malloc((prefixs + (size_t) wfilenames) * sizeof(*wfilename));
+			
+			if (wfilename == NULL) {
+				return -1;
+			}
+			
+			if (prefixs > 0) {
+				wcscpy(wfilename, WIN10_LONG_PATH_PREFIX);
+			}
+			
+			if (MultiByteToWideChar(CP_UTF8, 0, filename, -1, wfilename + prefixs, wfilenames) == 0) {
+				free(wfilename);
+				return -1;
+			}
+			
+			mapped->file = CreateFileW(wfilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			
+			free(wfilename);
+		#else
+			mapped->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		#endif
+		
+		if (mapped->file == INVALID_HANDLE_VALUE) {
+			mapped->file = NULL;
+			return -1;
+		}
+		
+		if (GetFileSizeEx(mapped->file, &size) == 0) {
+			unmap_file(mapped);
+			return -1;
+		}
+		
+		mapped->size = (size_t) size.QuadPart;
+		
+		if (mapped->size == 0) {
+			return 0;
+		}
+		
+		mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+		
+		if (mapped->mapping == NULL) {
+			unmap_file(mapped);
+			return -1;
+		}
+		
+		mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+		
+		if (mapped->data == NULL) {
+			unmap_file(mapped);
+			return -1;
+		}
+	#else
+		fd = open(filename, O_RDONLY);
+		
+		if (fd == -1) {
+			return -1;
+		}
+		
+		if (fstat(fd, &st) == -1) {
+			close(fd);
+			return -1;
+		}
+		
+		mapped->size = (size_t) st.st_size;
+		
+		if (mapped->size == 0) {
+			close(fd);
+			return 0;
+		}
+		
+		mapped->data = mmap(NULL, mapped->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		
+		close(fd);
+		
+		if (mapped->data == MAP_FAILED) {
+			mapped->data = NULL;
+			mapped->size = 0;
+			
+			return -1;
+		}
+	#endif
+	
+	return 0;
+	
+}
+
+void unmap_file(mapped_file_t* const mapped) {
+	
+	#if defined(_WIN32)
+		if (mapped->data != NULL) {
+			UnmapViewOfFile(mapped->data);
+		}
+		
+		if (mapped->mapping != NULL) {
+			CloseHandle(mapped->mapping);
+		}
+		
+		if (mapped->file != NULL) {
+			CloseHandle(mapped->file);
+		}
+		
+		mapped->mapping = NULL;
+		mapped->file = NULL;
+	#else
+		if (mapped->data != NULL) {
+			munmap(mapped->data, mapped->size);
+		}
+	#endif
+	
+	mapped->data = NULL;
+	mapped->size = 0;
+	
+}
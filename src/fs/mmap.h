@@ -0,0 +1,24 @@
+#if !defined(FS_MMAP_H)
+#define FS_MMAP_H
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+	#include <windows.h>
+#endif
+
+struct MappedFile {
+	void* data;
+	size_t size;
+#if defined(_WIN32)
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+typedef struct MappedFile mapped_file_t;
+
+int map_file(const char* const filename, mapped_file_t* const mapped);
+void unmap_file(mapped_file_t* const mapped);
+
+#endif
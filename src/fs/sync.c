@@ -0,0 +1,48 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+	#define _GNU_SOURCE
+#endif
+
+#if !defined(_WIN32)
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#include "fs/sync.h"
+
+int sync_filesystem(const char* const path) {
+	/*
+	Flush all pending writes to the filesystem the given path lives on.
+	
+	On systems without syncfs(), every filesystem is flushed instead. Files
+	on Windows are not cached in a way this could help with, so nothing is
+	done there.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	#if defined(__linux__)
+		int err = 0;
+		int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		
+		if (fd == -1) {
+			return -1;
+		}
+		
+		err = syncfs(fd);
+		
+		close(fd);
+		
+		return (err == -1) ? -1 : 0;
+	#elif !defined(_WIN32)
+		(void) path;
+		
+		sync();
+		
+		return 0;
+	#else
+		(void) path;
+		
+		return 0;
+	#endif
+	
+}
@@ -0,0 +1,6 @@
+#if !defined(FS_SYNC_H)
+#define FS_SYNC_H
+
+int sync_filesystem(const char* const path);
+
+#endif
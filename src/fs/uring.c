@@ -0,0 +1,591 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+	#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs/uring.h"
+
+#if defined(URING_SUPPORTED)
+	#include <errno.h>
+	#include <stdint.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+	#include <linux/io_uring.h>
+	
+	#if !(defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register))
+		#undef URING_SUPPORTED
+	#endif
+#endif
+
+#if defined(URING_SUPPORTED)
+/* Operations files are installed and removed with; the ring is not used unless all of them are there */
+static const int URING_OPERATIONS[] = {
+	IORING_OP_OPENAT,
+	IORING_OP_WRITE,
+	IORING_OP_CLOSE,
+	IORING_OP_UNLINKAT,
+	IORING_OP_MKDIRAT,
+	IORING_OP_SYMLINKAT
+};
+
+/* Enough room for every operation the kernel could know about */
+#define URING_PROBE_SIZE (256)
+#endif
+
+static int uring_enabled = 1;
+
+void uring_set_enabled(const int enabled) {
+	uring_enabled = enabled;
+}
+
+#if defined(URING_SUPPORTED)
+static int uring_probe(const int fd) {
+	/*
+	Check that the kernel knows about every operation we need.
+	
+	Returns (0) if it does, (-1) otherwise.
+	*/
+	
+	int err = 0;
+	
+	size_t index = 0;
+	
+	struct io_uring_probe* probe = NULL;
+	const size_t size = sizeof(*probe) + URING_PROBE_SIZE * sizeof(*probe->ops);
+	
+	probe = malloc(size);
+	
+	if (probe == NULL) {
+		return -1;
+	}
+	
+	memset(probe, 0, size);
+	
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, URING_PROBE_SIZE) == -1) {
+		err = -1;
+		goto end;
+	}
+	
+	for (index = 0; index < sizeof(URING_OPERATIONS) / sizeof(*URING_OPERATIONS); index++) {
+		if (URING_OPERATIONS[index] > probe->last_op || (probe->ops[URING_OPERATIONS[index]].flags & IO_URING_OP_SUPPORTED) == 0) {
+			err = -1;
+			goto end;
+		}
+	}
+	
+	end:;
+	
+	free(probe);
+	
+	return err;
+	
+}
+
+static struct io_uring_sqe* uring_next(
+	uring_t* const ring,
+	const int opcode,
+	const int chain,
+	const unsigned long tag
+) {
+	/*
+	Take the next free submission queue entry, or NULL if all of them were
+	already taken.
+	*/
+	
+	unsigned int tail = 0;
+	unsigned int index = 0;
+	
+	struct io_uring_sqe* sqe = NULL;
+	
+	if (ring->queued >= ring->entries) {
+		return NULL;
+	}
+	
+	/* Only we ever move the tail */
+	tail = *ring->sq_tail + ring->queued;
+	index = tail & ring->sq_mask;
+	
+	sqe = (struct io_uring_sqe*) ring->sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+	
+	sqe->opcode = (__u8) opcode;
+	sqe->user_data = (__u64) tag;
+	
+	if (chain == URING_LINK) {
+		sqe->flags |= IOSQE_IO_LINK;
+	} else if (chain == URING_HARDLINK) {
+		sqe->flags |= IOSQE_IO_HARDLINK;
+	}
+	
+	ring->sq_array[index] = index;
+	ring->queued++;
+	
+	return sqe;
+	
+}
+#endif
+
+int uring_init(uring_t* const ring) {
+	/*
+	Set up an io_uring instance for queueing file operations.
+	
+	Fails on systems other than Linux, on kernels that are too old (or have
+	io_uring turned off), and when it was disabled in the options; callers
+	are expected to fall back to doing the same operations one at a time.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	#if defined(URING_SUPPORTED)
+		int fds[URING_FILE_SLOTS];
+		size_t index = 0;
+		
+		struct io_uring_params params = {0};
+		
+		memset(ring, 0, sizeof(*ring));
+		ring->fd = -1;
+		
+		if (!uring_enabled) {
+			return -1;
+		}
+		
+		ring->fd = (int) syscall(__NR_io_uring_setup, URING_QUEUE_SIZE, &params);
+		
+		if (ring->fd == -1) {
+			return -1;
+		}
+		
+		if (uring_probe(ring->fd) != 0) {
+			goto error;
+		}
+		
+		ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+		ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		
+		if (params.features & IORING_FEAT_SINGLE_MMAP) {
+			if (ring->cq_map_size > ring->sq_map_size) {
+				ring->sq_map_size = ring->cq_map_size;
+			}
+			
+			ring->cq_map_size = 0;
+		}
+		
+		ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+		
+		if (ring->sq_map == MAP_FAILED) {
+			ring->sq_map = NULL;
+			goto error;
+		}
+		
+		ring->cq_map = ring->sq_map;
+		
+		if (ring->cq_map_size > 0) {
+			ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+			
+			if (ring->cq_map == MAP_FAILED) {
+				ring->cq_map = NULL;
+				goto error;
+			}
+		}
+		
+		ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+		ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+		
+		if (ring->sqes == MAP_FAILED) {
+			ring->sqes = NULL;
+			goto error;
+		}
+		
+		ring->sq_tail = (unsigned int*) ((char*) ring->sq_map + params.sq_off.tail);
+		ring->sq_array = (unsigned int*) ((char*) ring->sq_map + params.sq_off.array);
+		ring->sq_mask = *(unsigned int*) ((char*) ring->sq_map + params.sq_off.ring_mask);
+		
+		ring->cq_head = (unsigned int*) ((char*) ring->cq_map + params.cq_off.head);
+		ring->cq_tail = (unsigned int*) ((char*) ring->cq_map + params.cq_off.tail);
+		ring->cq_mask = *(unsigned int*) ((char*) ring->cq_map + params.cq_off.ring_mask);
+		ring->cqes = (char*) ring->cq_map + params.cq_off.cqes;
+		
+		ring->entries = params.sq_entries;
+		
+		/* Files are opened straight into these slots, so their descriptors never reach us */
+		for (index = 0; index < URING_FILE_SLOTS; index++) {
+			fds[index] = -1;
+		}
+		
+		if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, URING_FILE_SLOTS) == -1) {
+			goto error;
+		}
+		
+		return 0;
+		
+		error:;
+		
+		uring_free(ring);
+		
+		return -1;
+	#else
+		memset(ring, 0, sizeof(*ring));
+		ring->fd = -1;
+		
+		return -1;
+	#endif
+	
+}
+
+size_t uring_space(const uring_t* const ring) {
+	
+	return (size_t) (ring->entries - ring->queued);
+	
+}
+
+int uring_openat(
+	uring_t* const ring,
+	const int directory,
+	const char* const path,
+	const int flags,
+	const int mode,
+	const unsigned int slot,
+	const int chain,
+	const unsigned long tag
+) {
+	/*
+	Queue the opening of a file into the given slot of the ring's file
+	table. The file can then only be used through the ring.
+	
+	Returns (0) on success, (-1) if the queue is full.
+	*/
+	
+	#if defined(URING_SUPPORTED)
+		struct io_uring_sqe* const sqe = uring_next(ring, IORING_OP_OPENAT, chain, tag);
+		
+		if (sqe == NULL) {
+			return -1;
+		}
+		
+		sqe->fd = directory;
+		sqe->addr = (__u64) (uintptr_t) path;
+		sqe->len = (__u32) mode;
+		sqe->open_flags = (__u32) flags;
+		sqe->file_index = slot + 1;
+		
+		return 0;
+	#else
+		(void) ring;
+		(void) directory;
+		(void) path;
+		(void) flags;
+		(void) mode;
+		(void) slot;
+		(void) chain;
+		(void) tag;
+		
+		return -1;
+	#endif
+	
+}
+
+int uring_write(
+	uring_t* const ring,
+	const unsigned int slot,
+	const void* const data,
+	const size_t size,
+	const size_t offset,
+	const int chain,
+	const unsigned long tag
+) {
+	/*
+	Queue a write to the file in the given slot. The data must be left
+	alone until the ring was submitted.
+	
+	Returns (0) on success, (-1) if the queue is full.
+	*/
+	
+	#if defined(URING_SUPPORTED)
+		struct io_uring_sqe* const sqe = uring_next(ring, IORING_OP_WRITE, chain, tag);
+		
+		if (sqe == NULL) {
+			return -1;
+		}
+		
+		sqe->flags |= IOSQE_FIXED_FILE;
+		sqe->fd = (__s32) slot;
+		sqe->addr = (__u64) (uintptr_t) data;
+		sqe->len = (__u32) size;
+		sqe->off = (__u64) offset;
+		
+		return 0;
+	#else
+		(void) ring;
+		(void) slot;
+		(void) data;
+		(void) size;
+		(void) offset;
+		(void) chain;
+		(void) tag;
+		
+		return -1;
+	#endif
+	
+}
+
+int uring_close(
+	uring_t* const ring,
+	const unsigned int slot,
+	const int chain,
+	const unsigned long tag
+) {
+	/*
+	Queue the closing of the file in the given slot.
+	
+	Returns (0) on success, (-1) if the queue is full.
+	*/
+	
+	#if defined(URING_SUPPORTED)
+		struct io_uring_sqe* const sqe = uring_next(ring, IORING_OP_CLOSE, chain, tag);
+		
+		if (sqe == NULL) {
+			return -1;
+		}
+		
+		sqe->file_index = slot + 1;
+		
+		return 0;
+	#else
+		(void) ring;
+		(void) slot;
+		(void) chain;
+		(void) tag;
+		
+		return -1;
+	#endif
+	
+}
+
+int uring_unlinkat(
+	uring_t* const ring,
+	const int directory,
+	const char* const path,
+	const int flags,
+	const int chain,
+	const unsigned long tag
+) {
+	/*
+	Queue the removal of a file (or, with AT_REMOVEDIR, of an empty
+	directory).
+	
+	Returns (0) on success, (-1) if the queue is full.
+	*/
+	
+	#if defined(URING_SUPPORTED)
+		struct io_uring_sqe* const sqe = uring_next(ring, IORING_OP_UNLINKAT, chain, tag);
+		
+		if (sqe == NULL) {
+			return -1;
+		}
+		
+		sqe->fd = directory;
+		sqe->addr = (__u64) (uintptr_t) path;
+		sqe->unlink_flags = (__u32) flags;
+		
+		return 0;
+	#else
+		(void) ring;
+		(void) directory;
+		(void) path;
+		(void) flags;
+		(void) chain;
+		(void) tag;
+		
+		return -1;
+	#endif
+	
+}
+
+int uring_mkdirat(
+	uring_t* const ring,
+	const int directory,
+	const char* const path,
+	const int mode,
+	const int chain,
+	const unsigned long tag
+) {
+	/*
+	Queue the creation of a directory.
+	
+	Returns (0) on success, (-1) if the queue is full.
+	*/
+	
+	#if defined(URING_SUPPORTED)
+		struct io_uring_sqe* const sqe = uring_next(ring, IORING_OP_MKDIRAT, chain, tag);
+		
+		if (sqe == NULL) {
+			return -1;
+		}
+		
+		sqe->fd = directory;
+		sqe->addr = (__u64) (uintptr_t) path;
+		sqe->len = (__u32) mode;
+		
+		return 0;
+	#else
+		(void) ring;
+		(void) directory;
+		(void) path;
+		(void) mode;
+		(void) chain;
+		(void) tag;
+		
+		return -1;
+	#endif
+	
+}
+
+int uring_symlinkat(
+	uring_t* const ring,
+	const char* const target,
+	const int directory,
+	const char* const path,
+	const int chain,
+	const unsigned long tag
+) {
+	/*
+	Queue the creation of a symbolic link pointing to the given target.
+	
+	Returns (0) on success, (-1) if the queue is full.
+	*/
+	
+	#if defined(URING_SUPPORTED)
+		struct io_uring_sqe* const sqe = uring_next(ring, IORING_OP_SYMLINKAT, chain, tag);
+		
+		if (sqe == NULL) {
+			return -1;
+		}
+		
+		sqe->fd = directory;
+		sqe->addr = (__u64) (uintptr_t) target;
+		sqe->addr2 = (__u64) (uintptr_t) path;
+		
+		return 0;
+	#else
+		(void) ring;
+		(void) target;
+		(void) directory;
+		(void) path;
+		(void) chain;
+		(void) tag;
+		
+		return -1;
+	#endif
+	
+}
+
+int uring_submit(
+	uring_t* const ring,
+	uring_callback_t callback,
+	void* const data
+) {
+	/*
+	Submit everything that was queued and wait for all of it to finish.
+	
+	The callback is called once for every operation, with its tag and its
+	result (a negated errno value on failure). Operations that did not run
+	because an operation they were linked to failed report -ECANCELED.
+	
+	Returns the number of system calls that were needed, or (-1) on error.
+	*/
+	
+	#if defined(URING_SUPPORTED)
+		int calls = 0;
+		long status = 0;
+		
+		unsigned int head = 0;
+		unsigned int tail = 0;
+		
+		unsigned int submitted = 0;
+		unsigned int completed = 0;
+		
+		const unsigned int count = ring->queued;
+		
+		const struct io_uring_cqe* cqe = NULL;
+		
+		if (count == 0) {
+			return 0;
+		}
+		
+		__atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+		ring->queued = 0;
+		
+		while (completed < count) {
+			calls++;
+			
+			/* The kernel stops short of waiting when not everything could be submitted */
+			status = syscall(__NR_io_uring_enter, ring->fd, count - submitted, count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+			
+			if (status == -1) {
+				if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+					status = 0;
+				} else {
+					return -1;
+				}
+			}
+			
+			submitted += (unsigned int) status;
+			
+			head = *ring->cq_head;
+			tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+			
+			while (head != tail) {
+				cqe = (const struct io_uring_cqe*) ring->cqes + (head & ring->cq_mask);
+				
+				callback(data, (unsigned long) cqe->user_data, cqe->res);
+				
+				head++;
+				completed++;
+			}
+			
+			__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+			
+			/* Nothing is in flight, and the kernel would not take any more */
+			if (status == 0 && submitted == completed && submitted < count) {
+				return -1;
+			}
+		}
+		
+		return calls;
+	#else
+		(void) ring;
+		(void) callback;
+		(void) data;
+		
+		return -1;
+	#endif
+	
+}
+
+void uring_free(uring_t* const ring) {
+	
+	#if defined(URING_SUPPORTED)
+		if (ring->sqes != NULL) {
+			munmap(ring->sqes, ring->sqes_size);
+		}
+		
+		if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+			munmap(ring->cq_map, ring->cq_map_size);
+		}
+		
+		if (ring->sq_map != NULL) {
+			munmap(ring->sq_map, ring->sq_map_size);
+		}
+		
+		if (ring->fd != -1) {
+			close(ring->fd);
+		}
+	#endif
+	
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+	
+}
@@ -0,0 +1,119 @@
+#if !defined(FS_URING_H)
+#define FS_URING_H
+
+#include <stddef.h>
+
+#if defined(__linux__)
+	#include <linux/version.h>
+	
+	/* The ring needs mkdirat, symlinkat and files opened straight into its own table */
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+		#define URING_SUPPORTED 1
+	#endif
+#endif
+
+/* Number of operations that can be queued before they have to be submitted */
+#define URING_QUEUE_SIZE (256)
+
+/* Number of files that can be open through the ring at the same time */
+#define URING_FILE_SLOTS (64)
+
+/* The next operation only runs if this one succeeds */
+#define URING_LINK (1)
+
+/* The next operation runs once this one is done, whatever its result */
+#define URING_HARDLINK (2)
+
+typedef void (*uring_callback_t)(void* const, const unsigned long, const int);
+
+struct Uring {
+	int fd;
+	void* sq_map;
+	size_t sq_map_size;
+	void* cq_map;
+	size_t cq_map_size;
+	void* sqes;
+	size_t sqes_size;
+	unsigned int* sq_tail;
+	unsigned int* sq_array;
+	unsigned int sq_mask;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int cq_mask;
+	void* cqes;
+	unsigned int entries;
+	unsigned int queued;
+};
+
+typedef struct Uring uring_t;
+
+void uring_set_enabled(const int enabled);
+
+int uring_init(uring_t* const ring);
+
+size_t uring_space(const uring_t* const ring);
+
+int uring_openat(
+	uring_t* const ring,
+	const int directory,
+	const char* const path,
+	const int flags,
+	const int mode,
+	const unsigned int slot,
+	const int chain,
+	const unsigned long tag
+);
+
+int uring_write(
+	uring_t* const ring,
+	const unsigned int slot,
+	const void* const data,
+	const size_t size,
+	const size_t offset,
+	const int chain,
+	const unsigned long tag
+);
+
+int uring_close(
+	uring_t* const ring,
+	const unsigned int slot,
+	const int chain,
+	const unsigned long tag
+);
+
+int uring_unlinkat(
+	uring_t* const ring,
+	const int directory,
+	const char* const path,
+	const int flags,
+	const int chain,
+	const unsigned long tag
+);
+
+int uring_mkdirat(
+	uring_t* const ring,
+	const int directory,
+	const char* const path,
+	const int mode,
+	const int chain,
+	const unsigned long tag
+);
+
+int uring_symlinkat(
+	uring_t* const ring,
+	const char* const target,
+	const int directory,
+	const char* const path,
+	const int chain,
+	const unsigned long tag
+);
+
+int uring_submit(
+	uring_t* const ring,
+	uring_callback_t callback,
+	void* const data
+);
+
+void uring_free(uring_t* const ring);
+
+#endif
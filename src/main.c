@@ -1,8 +1,14 @@
 #include <errno.h>
+#include <locale.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 
+#if !defined(_WIN32)
+	#include <sys/types.h>
+	#include <sys/stat.h>
+#endif
+
 #if defined(_WIN32) && defined(_UNICODE)
 	#include "wio.h"
 	#define main wmain
@@ -13,6 +19,7 @@
 #include "options.h"
 #include "biggestint.h"
 #include "repository.h"
+#include "pattern.h"
 #include "logging.h"
 #include "sslcerts.h"
 #include "nouzen.h"
@@ -25,6 +32,7 @@
 #include "nouzen.h"
 #include "term/keyboard.h"
 #include "term/screen.h"
+#include "uncompress.h"
 
 #define PKGS_QUEUE_MAX (128)
 
@@ -71,6 +79,8 @@ static const char KOPT_SEARCH[] = "search";
 
 static const char KOPT_SHOW[] = "show";
 
+static const char KOPT_OWNS[] = "owns";
+
 #define ACTION_UNKNOWN (0x00)
 #define ACTION_INSTALL (0x01)
 #define ACTION_UNINSTALL (0x02)
@@ -85,6 +95,7 @@ static const char KOPT_SHOW[] = "show";
 #define ACTION_VERSION (0x11)
 #define ACTION_SEARCH (0x12)
 #define ACTION_SHOW (0x13)
+#define ACTION_OWNS (0x14)
 
 static int get_action(const arg_t* const arg) {
 	
@@ -200,6 +211,14 @@ static int get_action(const arg_t* const arg) {
 		return ACTION_SHOW;
 	}
 	
+	status = (
+		strcmp(arg->key, KOPT_OWNS) == 0
+	);
+	
+	if (status) {
+		return ACTION_OWNS;
+	}
+	
 	return ACTION_UNKNOWN;
 	
 }
@@ -208,6 +227,7 @@ static int repolist_perform_search(repolist_t* const repolist, const char* const
 	
 	int err = APTERR_SUCCESS;
 	int paginate = 1;
+	int ranked = 0;
 	
 	ssize_t status = 0;
 	size_t index = 0;
@@ -219,17 +239,41 @@ static int repolist_perform_search(repolist_t* const repolist, const char* const
 	
 	pkgs_t pkgs = {0};
 	pkgs_paging_t paging = {0};
+	pkgs_search_t search = {0};
 	
 	pkg_t* pkg = NULL;
 	
 	paging.maximum = 15;
 	
+	/* Multi-word queries can only match descriptions, unless they are patterns */
+	ranked = (strchr(query, ' ') != NULL && pattern_guess_type(query) == PATTERN_NONE);
+	
+	if (!ranked) {
+		err = repolist_search_init(repolist, &search, query);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
 	cir_init(&cir);
 	
 	hide_cursor();
 	
 	while (1) {
-		status = repolist_search_pkg(repolist, query, paging, &pkgs);
+		pkgs.offset = 0;
+		
+		if (ranked) {
+			status = repolist_search_description(repolist, &search, query, paging, &pkgs);
+		} else {
+			status = repolist_search_pkg(repolist, &search, paging, &pkgs);
+			
+			/* Nothing matched by name; fall back to searching descriptions */
+			if (status == 0 && paging.position == 0 && search.type == PATTERN_NONE) {
+				ranked = 1;
+				continue;
+			}
+		}
 		
 		if (paging.position == 0) {
 			if (status < 1) {
@@ -314,12 +358,13 @@ static int repolist_perform_search(repolist_t* const repolist, const char* const
 	show_cursor();
 	cir_free(&cir);
 	pkgs_free(&pkgs, 0);
+	repolist_search_free(&search);
 	
 	return err;
 	
 }
 
-static int repolist_perform_show(repolist_t* const repolist, const char* const query) {
+static int repolist_show_pkg(repolist_t* const repolist, pkg_t* const pkg) {
 	
 	int err = APTERR_SUCCESS;
 	
@@ -328,7 +373,6 @@ static int repolist_perform_show(repolist_t* const repolist, const char* const q
 	
 	repo_t* repo = NULL;
 	
-	pkg_t* pkg = NULL;
 	const pkg_t* subpkg = NULL;
 	
 	maintainer_t* maintainer = NULL;
@@ -340,13 +384,6 @@ static int repolist_perform_show(repolist_t* const repolist, const char* const q
 	
 	char package_size[BTOS_MAX_SIZE];
 	
-	pkg = repolist_get_pkg(repolist, query);
-	
-	if (pkg == NULL) {
-		err = APTERR_PACKAGE_SEARCH_NO_MATCHES;
-		goto end;
-	}
-	
 	err = repolist_resolve_deps(repolist, pkg);
 	
 	if (err != APTERR_SUCCESS) {
@@ -441,6 +478,140 @@ static int repolist_perform_show(repolist_t* const repolist, const char* const q
 	
 }
 
+static int repolist_perform_show(
+	repolist_t* const repolist,
+	const char* const query,
+	char** const suggestions
+) {
+	/*
+	Show the details of the given package, or of every package whose name
+	matches the given glob or regular expression.
+	
+	If no package matches a plain name, suggestions is set to the closest
+	existing package names, if any.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	int type = PATTERN_NONE;
+	
+	size_t index = 0;
+	
+	pkg_t* pkg = NULL;
+	pkgs_t pkgs = {0};
+	
+	type = pattern_guess_type(query);
+	
+	if (type == PATTERN_NONE) {
+		pkg = repolist_get_pkg(repolist, query);
+		
+		if (pkg != NULL) {
+			err = pkgs_append(&pkgs, pkg, 0);
+		}
+	} else {
+		err = repolist_match_pkgs(repolist, query, type, 0, &pkgs);
+	}
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	if (pkgs.offset == 0 && type == PATTERN_NONE) {
+		err = repolist_suggest_pkg(repolist, query, suggestions);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	if (pkgs.offset == 0) {
+		err = APTERR_PACKAGE_SEARCH_NO_MATCHES;
+		goto end;
+	}
+	
+	for (index = 0; index < pkgs.offset; index++) {
+		pkg = pkgs.items[index];
+		
+		err = repolist_show_pkg(repolist, pkg);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	end:;
+	
+	pkgs_free(&pkgs, 0);
+	
+	return err;
+	
+}
+
+static int repolist_perform_owns(
+	repolist_t* const repolist,
+	const char* const query
+) {
+	/*
+	Print the installed packages that own the given path.
+	
+	The path may be given relative to the prefix, or with the prefix in
+	front of it.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	size_t count = 0;
+	size_t length = 0;
+	
+	const char* path = query;
+	const char** owners = NULL;
+	
+	const options_t* const options = get_options();
+	
+	length = strlen(options->prefix);
+	
+	if (strncmp(path, options->prefix, length) == 0 && (path[length] == '/' || path[length] == '\\')) {
+		path += length;
+	}
+	
+	while (*path == '/' || *path == '\\') {
+		path++;
+	}
+	
+	while (strncmp(path, "./", 2) == 0) {
+		path += 2;
+	}
+	
+	count = pkgdb_owners(&repolist->database, path, strlen(path), NULL, 0);
+	
+	if (count == 0) {
+		err = APTERR_PACKAGE_SEARCH_NO_MATCHES;
+		goto end;
+	}
+	
+	owners = malloc(sizeof(*owners) * count);
+	
+	if (owners == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	count = pkgdb_owners(&repolist->database, path, strlen(path), owners, count);
+	
+	for (index = 0; index < count; index++) {
+		printf("%s%s", ((index == 0) ? "" : ", "), owners[index]);
+	}
+	
+	printf(": %s\n", path);
+	
+	end:;
+	
+	free(owners);
+	
+	return err;
+	
+}
+
 
 int main(int argc, argv_t* argv[]) {
 	
@@ -458,6 +629,7 @@ int main(int argc, argv_t* argv[]) {
 	char* config_dir = NULL;
 	
 	char* value = NULL;
+	char* suggestions = NULL;
 	char* packages[PKGS_QUEUE_MAX];
 	
 	repolist_t list = {0};
@@ -475,10 +647,31 @@ int main(int argc, argv_t* argv[]) {
 	wcurl_t* wcurl = NULL;
 	wcurl_error_t* wcurl_error = NULL;
 	
+	#if !defined(_WIN32)
+		mode_t mask = 0;
+	#endif
+	
 	#if defined(_WIN32) && defined(_UNICODE)
 		wio_enable_unicode();
 	#endif
 	
+	/*
+	Required for proper handling of Unicode characters in filenames. This
+	is done once, up front, as archives may be unpacked from several threads.
+	*/
+	setlocale(LC_CTYPE, "");
+	
+	#if !defined(_WIN32)
+		/*
+		Same for the umask, which cannot be read without changing it for a
+		moment; doing so from several threads could leave it cleared.
+		*/
+		mask = umask(0);
+		umask(mask);
+		
+		uncompress_set_umask((int) mask);
+	#endif
+	
 	config_dir = repo_get_config_dir();
 	
 	if (config_dir == NULL) {
@@ -540,7 +733,8 @@ int main(int argc, argv_t* argv[]) {
 			case ACTION_PREFIX:
 			case ACTION_LOGLEVEL:
 			case ACTION_SEARCH:
-			case ACTION_SHOW: {
+			case ACTION_SHOW:
+			case ACTION_OWNS: {
 				if (arg->value == NULL) {
 					err = APTERR_ARGPARSE_ARGUMENT_VALUE_MISSING;
 					goto end;
@@ -637,7 +831,8 @@ int main(int argc, argv_t* argv[]) {
 				goto end;
 			}
 			case ACTION_SEARCH:
-			case ACTION_SHOW: {
+			case ACTION_SHOW:
+			case ACTION_OWNS: {
 				search_query = arg->value;
 				operation = action;
 				break;
@@ -682,7 +877,11 @@ int main(int argc, argv_t* argv[]) {
 			break;
 		}
 		case ACTION_SHOW: {
-			err = repolist_perform_show(&list, search_query);
+			err = repolist_perform_show(&list, search_query, &suggestions);
+			break;
+		}
+		case ACTION_OWNS: {
+			err = repolist_perform_owns(&list, search_query);
 			break;
 		}
 		default: {
@@ -717,6 +916,13 @@ int main(int argc, argv_t* argv[]) {
 				fprintf(stderr, ": %s", arg->value);
 				break;
 			}
+			case APTERR_PACKAGE_SEARCH_NO_MATCHES: {
+				if (suggestions != NULL) {
+					fprintf(stderr, "; did you mean %s?", suggestions);
+				}
+				
+				break;
+			}
 		}
 		
 		fprintf(stderr, "\n");
@@ -732,6 +938,7 @@ int main(int argc, argv_t* argv[]) {
 	sslcerts_unload_certificates();
 	
 	free(config_dir);
+	free(suggestions);
 	
 	repolist_free(&list);
 	argparse_free(&argparse);
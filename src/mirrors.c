@@ -0,0 +1,623 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <curl/curl.h>
+
+#include "biggestint.h"
+#include "errors.h"
+#include "fs/exists.h"
+#include "logging.h"
+#include "mirrors.h"
+#include "query.h"
+#include "wcurl.h"
+
+struct MirrorProbe {
+	wcurl_t wcurl;
+	mirror_t* mirror;
+	biguint_t received;
+};
+
+typedef struct MirrorProbe mirror_probe_t;
+
+int mirrors_add(
+	mirrors_t* const mirrors,
+	const char* const url
+) {
+	
+	size_t size = 0;
+	size_t index = 0;
+	
+	mirror_t* items = NULL;
+	mirror_t* mirror = NULL;
+	
+	for (index = 0; index < mirrors->offset; index++) {
+		if (strcmp(mirrors->items[index].url, url) == 0) {
+			return APTERR_SUCCESS;
+		}
+	}
+	
+	if (sizeof(*mirrors->items) * (mirrors->offset + 1) > mirrors->size) {
+		size = mirrors->size + sizeof(*mirrors->items) * (mirrors->offset + 1);
+		items = realloc(mirrors->items, size);
+		
+		if (items == NULL) {
+			return APTERR_MEM_ALLOC_FAILURE;
+		}
+		
+		mirrors->size = size;
+		mirrors->items = items;
+	}
+	
+	mirror = &mirrors->items[mirrors->offset];
+	memset(mirror, 0, sizeof(*mirror));
+	
+	mirror->url = malloc(strlen(url) + 1);
+	
+	if (mirror->url == NULL) {
+		return APTERR_MEM_ALLOC_FAILURE;
+	}
+	
+	strcpy(mirror->url, url);
+	mirror->position = mirrors->offset++;
+	
+	return APTERR_SUCCESS;
+	
+}
+
+int mirrors_copy(
+	mirrors_t* const destination,
+	const mirrors_t* const source
+) {
+	
+	int err = APTERR_SUCCESS;
+	size_t index = 0;
+	
+	mirror_t* mirror = NULL;
+	const mirror_t* item = NULL;
+	
+	for (index = 0; index < source->offset; index++) {
+		item = &source->items[index];
+		
+		err = mirrors_add(destination, item->url);
+		
+		if (err != APTERR_SUCCESS) {
+			return err;
+		}
+		
+		mirror = &destination->items[destination->offset - 1];
+		
+		mirror->position = item->position;
+		mirror->latency = item->latency;
+		mirror->throughput = item->throughput;
+		mirror->failures = item->failures;
+		mirror->ranked = item->ranked;
+	}
+	
+	return err;
+	
+}
+
+int mirrors_load(
+	mirrors_t* const mirrors,
+	const char* const filename
+) {
+	/*
+	Restore the measurements taken during earlier runs.
+	
+	Each line of the file maps a mirror URL to its latency (in microseconds),
+	throughput (in bytes per second) and the number of probes that failed in a row.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	size_t index = 0;
+	
+	hquery_t query = {0};
+	
+	mirror_t* mirror = NULL;
+	const char* value = NULL;
+	char* end = NULL;
+	
+	if (file_exists(filename) != 1) {
+		goto end;
+	}
+	
+	query_init(&query, '\n', "=");
+	
+	if (query_load_file(&query, filename) != 0) {
+		err = APTERR_REPO_CONF_PARSE_FAILURE;
+		goto end;
+	}
+	
+	for (index = 0; index < mirrors->offset; index++) {
+		mirror = &mirrors->items[index];
+		value = query_get_string(&query, mirror->url);
+		
+		if (value == NULL) {
+			continue;
+		}
+		
+		mirror->latency = strtobui(value, &end, 10);
+		
+		if (*end != ',') {
+			continue;
+		}
+		
+		mirror->throughput = strtobui(end + 1, &end, 10);
+		
+		if (*end != ',') {
+			continue;
+		}
+		
+		mirror->failures = (size_t) strtobui(end + 1, &end, 10);
+		mirror->ranked = 1;
+	}
+	
+	end:;
+	
+	query_free(&query);
+	
+	return err;
+	
+}
+
+int mirrors_save(
+	const mirrors_t* const mirrors,
+	const char* const filename
+) {
+	/*
+	Persist the measurements of all ranked mirrors, keeping those of mirrors
+	that belong to other sources untouched.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	size_t index = 0;
+	
+	char value[(sizeof(biguint_t) * 3 + 1) * 3];
+	
+	hquery_t query = {0};
+	const mirror_t* mirror = NULL;
+	
+	query_init(&query, '\n', "=");
+	
+	if (file_exists(filename) == 1 && query_load_file(&query, filename) != 0) {
+		query_init(&query, '\n', "=");
+	}
+	
+	for (index = 0; index < mirrors->offset; index++) {
+		mirror = &mirrors->items[index];
+		
+		if (!mirror->ranked) {
+			continue;
+		}
+		
+		sprintf(
+			value,
+			"%"FORMAT_BIGGEST_UINT_T",%"FORMAT_BIGGEST_UINT_T",%"FORMAT_BIGGEST_UINT_T,
+			mirror->latency,
+			mirror->throughput,
+			(biguint_t) mirror->failures
+		);
+		
+		if (query_add_string(&query, mirror->url, value) != 0) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+	}
+	
+	if (query_dump_file(&query, filename) != 0) {
+		err = APTERR_FSTREAM_WRITE_FAILURE;
+		goto end;
+	}
+	
+	end:;
+	
+	query_free(&query);
+	
+	return err;
+	
+}
+
+static size_t mirror_probe_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
+	
+	mirror_probe_t* probe = userdata;
+	const size_t chunk_size = size * nmemb;
+	
+	(void) ptr;
+	
+	probe->received += chunk_size;
+	
+	return chunk_size;
+	
+}
+
+int mirrors_probe(
+	mirrors_t* const mirrors,
+	const char* const path
+) {
+	/*
+	Measure how fast each mirror is by fetching the first bytes of the given
+	file from all of them at once.
+	
+	Mirrors that fail to answer in time are penalized, but kept in the pool.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	int running = 1;
+	int left = 0;
+	
+	size_t index = 0;
+	
+	char range[64];
+	char* url = NULL;
+	
+	CURLcode code = CURLE_OK;
+	CURLMcode mcode = CURLM_OK;
+	
+	curl_off_t start = 0;
+	curl_off_t total = 0;
+	
+	mirror_t* mirror = NULL;
+	mirror_probe_t* probe = NULL;
+	mirror_probe_t* probes = NULL;
+	
+	wcurl_t* wcurl_global = NULL;
+	
+	CURL* curl = NULL;
+	CURLM* curl_multi = NULL;
+	CURLMsg* msg = NULL;
+	
+	if (mirrors->offset < 2) {
+		goto end;
+	}
+	
+	wcurl_global = wcurl_getglobal();
+	
+	if (wcurl_global == NULL) {
+		err = APTERR_WCURL_INIT_FAILURE;
+		goto end;
+	}
+	
+	curl_multi = curl_multi_init();
+	
+	if (curl_multi == NULL) {
+		err = APTERR_WCURLMLT_INIT_FAILURE;
+		goto end;
+	}
+	
+	probes = calloc(mirrors->offset, sizeof(*probes));
+	
+	if (probes == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	sprintf(range, "0-%i", MIRRORS_PROBE_SIZE - 1);
+	
+	for (index = 0; index < mirrors->offset; index++) {
+		probe = &probes[index];
+		probe->mirror = &mirrors->items[index];
+		
+		if (wcurl_duplicate(wcurl_global, &probe->wcurl) != WCURL_ERR_SUCCESS) {
+			err = APTERR_WCURL_INIT_FAILURE;
+			goto end;
+		}
+		
+		curl = wcurl_getcurl(&probe->wcurl);
+		
+		url = mirror_resolve(probe->mirror, path);
+		
+		if (url == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		code = curl_easy_setopt(curl, CURLOPT_URL, url);
+		
+		free(url);
+		url = NULL;
+		
+		if (code == CURLE_OK) {
+			code = curl_easy_setopt(curl, CURLOPT_RANGE, range);
+		}
+		
+		if (code == CURLE_OK) {
+			code = curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, MIRRORS_PROBE_TIMEOUT);
+		}
+		
+		if (code == CURLE_OK) {
+			code = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, mirror_probe_cb);
+		}
+		
+		if (code == CURLE_OK) {
+			code = curl_easy_setopt(curl, CURLOPT_WRITEDATA, probe);
+		}
+		
+		if (code != CURLE_OK) {
+			err = APTERR_WCURL_SETOPT_FAILURE;
+			goto end;
+		}
+		
+		mcode = curl_multi_add_handle(curl_multi, curl);
+		
+		if (mcode != CURLM_OK) {
+			err = APTERR_WCURLMLT_ADD_FAILURE;
+			goto end;
+		}
+	}
+	
+	loggln(LOG_VERBOSE, "Probing %zu mirrors", mirrors->offset);
+	
+	while (running) {
+		mcode = curl_multi_perform(curl_multi, &running);
+		
+		if (mcode == CURLM_OK && running) {
+			mcode = curl_multi_poll(curl_multi, NULL, 0, 1000, NULL);
+		}
+		
+		if (mcode != CURLM_OK) {
+			err = APTERR_WCURLMLT_PERFORM_FAILURE;
+			goto end;
+		}
+		
+		while ((msg = curl_multi_info_read(curl_multi, &left)) != NULL) {
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			
+			for (index = 0; index < mirrors->offset; index++) {
+				if (wcurl_getcurl(&probes[index].wcurl) == msg->easy_handle) {
+					break;
+				}
+			}
+			
+			probe = &probes[index];
+			mirror = probe->mirror;
+			
+			mirror->ranked = 1;
+			
+			if (msg->data.result != CURLE_OK || probe->received == 0) {
+				mirror->latency = 0;
+				mirror->throughput = 0;
+				mirror->failures++;
+				
+				loggln(LOG_VERBOSE, "Mirror %s failed to answer the probe: %s", mirror->url, curl_easy_strerror(msg->data.result));
+				continue;
+			}
+			
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_STARTTRANSFER_TIME_T, &start);
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME_T, &total);
+			
+			mirror->failures = 0;
+			mirror->latency = (biguint_t) start;
+			mirror->throughput = probe->received * 1000000 / (biguint_t) ((total > start) ? (total - start) : 1);
+			
+			loggln(
+				LOG_VERBOSE,
+				"Mirror %s answered in %"FORMAT_BIGGEST_UINT_T" us at %"FORMAT_BIGGEST_UINT_T" bytes/s",
+				mirror->url,
+				mirror->latency,
+				mirror->throughput
+			);
+		}
+	}
+	
+	mirrors_rank(mirrors);
+	
+	end:;
+	
+	if (probes != NULL) {
+		for (index = 0; index < mirrors->offset; index++) {
+			curl = wcurl_getcurl(&probes[index].wcurl);
+			
+			if (curl == NULL) {
+				continue;
+			}
+			
+			curl_multi_remove_handle(curl_multi, curl);
+			wcurl_free(&probes[index].wcurl);
+		}
+	}
+	
+	free(probes);
+	curl_multi_cleanup(curl_multi);
+	
+	return err;
+	
+}
+
+static double mirror_score(const mirror_t* const mirror) {
+	/*
+	Estimate how many seconds it takes to fetch MIRRORS_SCORE_SIZE bytes from this mirror.
+	*/
+	
+	double score = 0.0;
+	
+	if (mirror->throughput > 0) {
+		score = (double) mirror->latency / 1000000.0 + (double) MIRRORS_SCORE_SIZE / (double) mirror->throughput;
+	}
+	
+	score += (double) mirror->failures * MIRRORS_FAILURE_PENALTY;
+	
+	return score;
+	
+}
+
+static int mirror_compare(const void* a, const void* b) {
+	
+	const mirror_t* const first = a;
+	const mirror_t* const second = b;
+	
+	double x = 0.0;
+	double y = 0.0;
+	
+	/* Mirrors that were never measured keep the order they were configured in */
+	if (first->ranked != second->ranked) {
+		return first->ranked ? -1 : 1;
+	}
+	
+	if (first->ranked) {
+		x = mirror_score(first);
+		y = mirror_score(second);
+		
+		if (x != y) {
+			return (x < y) ? -1 : 1;
+		}
+	}
+	
+	return (first->position < second->position) ? -1 : (first->position > second->position);
+	
+}
+
+void mirrors_rank(mirrors_t* const mirrors) {
+	
+	qsort(mirrors->items, mirrors->offset, sizeof(*mirrors->items), mirror_compare);
+	mirrors->next = 0;
+	
+}
+
+mirror_t* mirrors_find(
+	mirrors_t* const mirrors,
+	const char* const url,
+	const char** const path
+) {
+	/*
+	Find the mirror the given URL points to, and the path relative to it.
+	*/
+	
+	size_t index = 0;
+	size_t size = 0;
+	
+	mirror_t* mirror = NULL;
+	
+	for (index = 0; index < mirrors->offset; index++) {
+		mirror = &mirrors->items[index];
+		size = strlen(mirror->url);
+		
+		if (size == 0 || strncmp(url, mirror->url, size) != 0) {
+			continue;
+		}
+		
+		if (mirror->url[size - 1] != '/' && url[size] != '/') {
+			continue;
+		}
+		
+		while (url[size] == '/') {
+			size++;
+		}
+		
+		*path = url + size;
+		
+		return mirror;
+	}
+	
+	return NULL;
+	
+}
+
+mirror_t* mirrors_next(mirrors_t* const mirrors) {
+	/*
+	Pick the next of the best ranked mirrors, so that transfers are spread across them.
+	
+	Mirrors that failed during this run, or that did not answer the last probe, are
+	only used when all of them did.
+	*/
+	
+	size_t index = 0;
+	size_t active = mirrors->offset;
+	
+	mirror_t* mirror = NULL;
+	
+	if (active > MIRRORS_MAX_ACTIVE) {
+		active = MIRRORS_MAX_ACTIVE;
+	}
+	
+	if (active == 0) {
+		return NULL;
+	}
+	
+	for (index = 0; index < active; index++) {
+		mirror = &mirrors->items[mirrors->next++ % active];
+		
+		if (mirror->errors == 0 && !(mirror->ranked && mirror->throughput == 0)) {
+			return mirror;
+		}
+	}
+	
+	return mirrors_failover(mirrors, NULL);
+	
+}
+
+mirror_t* mirrors_failover(
+	mirrors_t* const mirrors,
+	const mirror_t* const current
+) {
+	/*
+	Pick the mirror to retry a failed transfer on: the best ranked one, other than
+	the current one, that failed the least during this run.
+	*/
+	
+	size_t index = 0;
+	
+	mirror_t* mirror = NULL;
+	mirror_t* best = NULL;
+	
+	for (index = 0; index < mirrors->offset; index++) {
+		mirror = &mirrors->items[index];
+		
+		if (mirror == current) {
+			continue;
+		}
+		
+		if (best == NULL || mirror->errors < best->errors) {
+			best = mirror;
+		}
+	}
+	
+	return best;
+	
+}
+
+char* mirror_resolve(
+	const mirror_t* const mirror,
+	const char* const path
+) {
+	
+	char* url = NULL;
+	size_t size = strlen(mirror->url);
+	
+	url = malloc(size + 1 + strlen(path) + 1);
+	
+	if (url == NULL) {
+		return url;
+	}
+	
+	strcpy(url, mirror->url);
+	
+	if (size == 0 || url[size - 1] != '/') {
+		strcat(url, "/");
+	}
+	
+	strcat(url, path);
+	
+	return url;
+	
+}
+
+void mirrors_free(mirrors_t* const mirrors) {
+	
+	size_t index = 0;
+	
+	for (index = 0; index < mirrors->offset; index++) {
+		free(mirrors->items[index].url);
+	}
+	
+	free(mirrors->items);
+	mirrors->items = NULL;
+	
+	mirrors->size = 0;
+	mirrors->offset = 0;
+	mirrors->next = 0;
+	
+}
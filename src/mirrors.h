@@ -0,0 +1,89 @@
+#if !defined(MIRRORS_H)
+#define MIRRORS_H
+
+#include <stddef.h>
+
+#include "biggestint.h"
+
+/* How much of the index is fetched from each mirror when probing them */
+#define MIRRORS_PROBE_SIZE (64 * 1024)
+#define MIRRORS_PROBE_TIMEOUT (5000L)
+
+/* Package downloads are spread across this many of the best ranked mirrors */
+#define MIRRORS_MAX_ACTIVE (3)
+
+/* Mirrors are ranked by the estimated time it takes to fetch this much data */
+#define MIRRORS_SCORE_SIZE (1024 * 1024)
+
+/* Each failed probe counts as this many seconds when ranking a mirror */
+#define MIRRORS_FAILURE_PENALTY (30.0)
+
+struct Mirror {
+	char* url;
+	size_t position;
+	biguint_t latency;
+	biguint_t throughput;
+	size_t failures;
+	size_t errors;
+	int ranked;
+};
+
+typedef struct Mirror mirror_t;
+
+struct Mirrors {
+	size_t size;
+	size_t offset;
+	mirror_t* items;
+	size_t next;
+};
+
+typedef struct Mirrors mirrors_t;
+
+int mirrors_add(
+	mirrors_t* const mirrors,
+	const char* const url
+);
+
+int mirrors_copy(
+	mirrors_t* const destination,
+	const mirrors_t* const source
+);
+
+int mirrors_load(
+	mirrors_t* const mirrors,
+	const char* const filename
+);
+
+int mirrors_save(
+	const mirrors_t* const mirrors,
+	const char* const filename
+);
+
+int mirrors_probe(
+	mirrors_t* const mirrors,
+	const char* const path
+);
+
+void mirrors_rank(mirrors_t* const mirrors);
+
+mirror_t* mirrors_find(
+	mirrors_t* const mirrors,
+	const char* const url,
+	const char** const path
+);
+
+mirror_t* mirrors_next(mirrors_t* const mirrors);
+
+mirror_t* mirrors_failover(
+	mirrors_t* const mirrors,
+	const mirror_t* const current
+);
+
+char* mirror_resolve(
+	const mirror_t* const mirror,
+	const char* const path
+);
+
+void mirrors_free(mirrors_t* const mirrors);
+
+#endif
@@ -14,6 +14,8 @@
 #include "fs/sep.h"
 #include "fs/exists.h"
 #include "os/cpuinfo.h"
+#include "uncompress.h"
+#include "fs/uring.h"
 
 static const char KOPT_CACHE[] = "cache";
 static const char KOPT_PARALLELISM[] = "parallelism";
@@ -22,6 +24,11 @@ static const char KOPT_PREFIX[] = "prefix";
 static const char KOPT_LOGLEVEL[] = "loglevel";
 static const char KOPT_SKIP_MAINTAINER_SCRIPTS[] = "skip-maintainer-scripts";
 static const char KOPT_SYMLINK_PREFIX[] = "symlink-prefix";
+static const char KOPT_ARCHIVE_CACHE_SIZE[] = "archive-cache-size";
+static const char KOPT_STREAM_UNPACK[] = "stream-unpack";
+static const char KOPT_DECOMPRESS_THREADS[] = "decompress-threads";
+static const char KOPT_READ_BLOCK_SIZE[] = "read-block-size";
+static const char KOPT_IO_URING[] = "io-uring";
 
 static const char VPREFIX[] = "$ORIGIN" PATHSEP_M "sysroot";
 static const char VLOGLEVEL[] = "standard";
@@ -30,6 +37,11 @@ static const biguint_t VCACHE = 1;
 static const biguint_t VFORCE_REFRESH = 0;
 static const biguint_t VPARALLELISM = 0;
 static const biguint_t VSKIP_MAINTAINER_SCRIPTS = 1;
+static const biguint_t VARCHIVE_CACHE_SIZE = 1024;
+static const biguint_t VSTREAM_UNPACK = 0;
+static const biguint_t VDECOMPRESS_THREADS = 0;
+static const biguint_t VREAD_BLOCK_SIZE = 1024;
+static const biguint_t VIO_URING = 1;
 
 static const char OPTIONS_FILE[] = "options.conf";
 static const char DOLLAR_SIGN = '$';
@@ -59,6 +71,9 @@ int options_load(
 	
 	logging_t loglevel = LOG_QUIET;
 	biguint_t concurrency = 0;
+	biguint_t archive_cache_size = 0;
+	biguint_t decompress_threads = 0;
+	biguint_t read_block_size = 0;
 	ssize_t nproc = 0;
 	
 	const char* var = NULL;
@@ -139,6 +154,13 @@ int options_load(
 			goto end;
 		}
 		
+		err = query_add_uint(&query, KOPT_ARCHIVE_CACHE_SIZE, VARCHIVE_CACHE_SIZE);
+		
+		if (err != 0) {
+			err = APTERR_PKG_METADATA_WRITE_FAILURE;
+			goto end;
+		}
+		
 		err = query_dump_file(&query, filename);
 		
 		if (err != 0) {
@@ -274,6 +296,62 @@ int options_load(
 		options.concurrency = ((nproc == -1) ? 1 : nproc);
 	}
 	
+	options.archive_cache_size = VARCHIVE_CACHE_SIZE;
+	
+	/* Archive cache size (in megabytes; 0 disables the cache) */
+	archive_cache_size = query_get_uint(&query, KOPT_ARCHIVE_CACHE_SIZE);
+	
+	if (archive_cache_size != BIGUINT_MAX) {
+		options.archive_cache_size = archive_cache_size;
+	}
+	
+	options.stream_unpack = VSTREAM_UNPACK;
+	
+	/* Unpack packages while they are being downloaded */
+	status = query_get_bool(&query, KOPT_STREAM_UNPACK);
+	
+	if (status != -1) {
+		options.stream_unpack = status;
+	}
+	
+	options.decompress_threads = VDECOMPRESS_THREADS;
+	
+	/* Threads used to decode xz and zstd archives (0 means one per processor) */
+	decompress_threads = query_get_uint(&query, KOPT_DECOMPRESS_THREADS);
+	
+	if (decompress_threads != BIGUINT_MAX) {
+		options.decompress_threads = decompress_threads;
+	}
+	
+	if (options.decompress_threads == VDECOMPRESS_THREADS) {
+		nproc = get_nproc();
+		options.decompress_threads = ((nproc == -1) ? 1 : nproc);
+	}
+	
+	uncompress_set_threads((size_t) options.decompress_threads);
+	
+	options.read_block_size = VREAD_BLOCK_SIZE;
+	
+	/* Size of the blocks archives are read and decoded in (in kilobytes) */
+	read_block_size = query_get_uint(&query, KOPT_READ_BLOCK_SIZE);
+	
+	if (!(read_block_size == BIGUINT_MAX || read_block_size == 0)) {
+		options.read_block_size = read_block_size;
+	}
+	
+	uncompress_set_block_size((size_t) options.read_block_size * 1024);
+	
+	options.io_uring = VIO_URING;
+	
+	/* Batch file creation and removal through io_uring, where the kernel supports it */
+	status = query_get_bool(&query, KOPT_IO_URING);
+	
+	if (status != -1) {
+		options.io_uring = status;
+	}
+	
+	uring_set_enabled(options.io_uring);
+	
 	loglevel = LOG_STANDARD;
 	
 	/* Log level */
@@ -330,5 +408,10 @@ void options_free(void) {
 	options.force_refresh = 0;
 	options.cache = 0;
 	options.concurrency = 0;
+	options.archive_cache_size = 0;
+	options.stream_unpack = 0;
+	options.decompress_threads = 0;
+	options.read_block_size = 0;
+	options.io_uring = 0;
 	
 }
\ No newline at end of file
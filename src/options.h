@@ -7,7 +7,12 @@ struct Options {
 	int cache;
 	int assume_yes;
 	int maintainer_scripts;
+	int stream_unpack;
+	int io_uring;
 	biguint_t concurrency;
+	biguint_t archive_cache_size;
+	biguint_t decompress_threads;
+	biguint_t read_block_size;
 };
 
 typedef struct Options options_t;
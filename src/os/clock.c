@@ -0,0 +1,31 @@
+#if defined(_WIN32)
+	#include <windows.h>
+#endif
+
+#if !defined(_WIN32)
+	#include <time.h>
+#endif
+
+#include "os/clock.h"
+
+biguint_t clock_monotonic(void) {
+	/*
+	Returns the number of milliseconds elapsed since an arbitrary point in the past.
+	
+	The clock is not affected by changes to the system time, so it is suitable for
+	measuring intervals.
+	*/
+	
+	#if defined(_WIN32)
+		return (biguint_t) GetTickCount64();
+	#else
+		struct timespec now = {0};
+		
+		if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+			return 0;
+		}
+		
+		return (biguint_t) now.tv_sec * 1000 + (biguint_t) now.tv_nsec / 1000000;
+	#endif
+	
+}
@@ -0,0 +1,8 @@
+#if !defined(OS_CLOCK_H)
+#define OS_CLOCK_H
+
+#include "biggestint.h"
+
+biguint_t clock_monotonic(void);
+
+#endif
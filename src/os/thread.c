@@ -0,0 +1,185 @@
+#if defined(_WIN32)
+	#include <windows.h>
+#endif
+
+#if !defined(_WIN32)
+	#include <pthread.h>
+#endif
+
+#include "os/thread.h"
+
+#if defined(_WIN32)
+	static DWORD WINAPI thread_start(LPVOID parameter) {
+		
+		thread_t* const thread = parameter;
+		
+		thread->result = thread->callback(thread->argument);
+		
+		return 0;
+		
+	}
+#else
+	static void* thread_start(void* parameter) {
+		
+		thread_t* const thread = parameter;
+		
+		thread->result = thread->callback(thread->argument);
+		
+		return NULL;
+		
+	}
+#endif
+
+int thread_create(thread_t* const thread, const thread_callback_t callback, void* const argument) {
+	/*
+	Start a new thread running the given callback.
+	
+	The thread structure must stay valid until the thread is joined.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	thread->callback = callback;
+	thread->argument = argument;
+	thread->result = NULL;
+	
+	#if defined(_WIN32)
+		thread->handle = CreateThread(NULL, 0, thread_start, thread, 0, NULL);
+		
+		if (thread->handle == NULL) {
+			return -1;
+		}
+	#else
+		if (pthread_create(&thread->handle, NULL, thread_start, thread) != 0) {
+			return -1;
+		}
+	#endif
+	
+	return 0;
+	
+}
+
+int thread_join(thread_t* const thread, void** const result) {
+	/*
+	Wait for the thread to finish.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	#if defined(_WIN32)
+		if (WaitForSingleObject(thread->handle, INFINITE) == WAIT_FAILED) {
+			return -1;
+		}
+		
+		CloseHandle(thread->handle);
+	#else
+		if (pthread_join(thread->handle, NULL) != 0) {
+			return -1;
+		}
+	#endif
+	
+	if (result != NULL) {
+		*result = thread->result;
+	}
+	
+	return 0;
+	
+}
+
+int mutex_init(mutex_t* const mutex) {
+	
+	#if defined(_WIN32)
+		InitializeCriticalSection(&mutex->handle);
+	#else
+		if (pthread_mutex_init(&mutex->handle, NULL) != 0) {
+			return -1;
+		}
+	#endif
+	
+	return 0;
+	
+}
+
+void mutex_lock(mutex_t* const mutex) {
+	
+	#if defined(_WIN32)
+		EnterCriticalSection(&mutex->handle);
+	#else
+		pthread_mutex_lock(&mutex->handle);
+	#endif
+	
+}
+
+void mutex_unlock(mutex_t* const mutex) {
+	
+	#if defined(_WIN32)
+		LeaveCriticalSection(&mutex->handle);
+	#else
+		pthread_mutex_unlock(&mutex->handle);
+	#endif
+	
+}
+
+void mutex_free(mutex_t* const mutex) {
+	
+	#if defined(_WIN32)
+		DeleteCriticalSection(&mutex->handle);
+	#else
+		pthread_mutex_destroy(&mutex->handle);
+	#endif
+	
+}
+
+int condition_init(condition_t* const condition) {
+	
+	#if defined(_WIN32)
+		InitializeConditionVariable(&condition->handle);
+	#else
+		if (pthread_cond_init(&condition->handle, NULL) != 0) {
+			return -1;
+		}
+	#endif
+	
+	return 0;
+	
+}
+
+void condition_wait(condition_t* const condition, mutex_t* const mutex) {
+	
+	#if defined(_WIN32)
+		SleepConditionVariableCS(&condition->handle, &mutex->handle, INFINITE);
+	#else
+		pthread_cond_wait(&condition->handle, &mutex->handle);
+	#endif
+	
+}
+
+void condition_signal(condition_t* const condition) {
+	
+	#if defined(_WIN32)
+		WakeConditionVariable(&condition->handle);
+	#else
+		pthread_cond_signal(&condition->handle);
+	#endif
+	
+}
+
+void condition_broadcast(condition_t* const condition) {
+	
+	#if defined(_WIN32)
+		WakeAllConditionVariable(&condition->handle);
+	#else
+		pthread_cond_broadcast(&condition->handle);
+	#endif
+	
+}
+
+void condition_free(condition_t* const condition) {
+	
+	#if defined(_WIN32)
+		(void) condition;
+	#else
+		pthread_cond_destroy(&condition->handle);
+	#endif
+	
+}
@@ -0,0 +1,61 @@
+#if !defined(OS_THREAD_H)
+#define OS_THREAD_H
+
+#if defined(_WIN32)
+	#include <windows.h>
+#endif
+
+#if !defined(_WIN32)
+	#include <pthread.h>
+#endif
+
+typedef void* (*thread_callback_t)(void* const argument);
+
+struct Thread {
+#if defined(_WIN32)
+	HANDLE handle;
+#else
+	pthread_t handle;
+#endif
+	thread_callback_t callback;
+	void* argument;
+	void* result;
+};
+
+typedef struct Thread thread_t;
+
+struct Mutex {
+#if defined(_WIN32)
+	CRITICAL_SECTION handle;
+#else
+	pthread_mutex_t handle;
+#endif
+};
+
+typedef struct Mutex mutex_t;
+
+struct Condition {
+#if defined(_WIN32)
+	CONDITION_VARIABLE handle;
+#else
+	pthread_cond_t handle;
+#endif
+};
+
+typedef struct Condition condition_t;
+
+int thread_create(thread_t* const thread, const thread_callback_t callback, void* const argument);
+int thread_join(thread_t* const thread, void** const result);
+
+int mutex_init(mutex_t* const mutex);
+void mutex_lock(mutex_t* const mutex);
+void mutex_unlock(mutex_t* const mutex);
+void mutex_free(mutex_t* const mutex);
+
+int condition_init(condition_t* const condition);
+void condition_wait(condition_t* const condition, mutex_t* const mutex);
+void condition_signal(condition_t* const condition);
+void condition_broadcast(condition_t* const condition);
+void condition_free(condition_t* const condition);
+
+#endif
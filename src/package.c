@@ -221,14 +221,15 @@ void pkg_free(pkg_t* const pkg) {
 	pkg->homepage = NULL;
 	pkg->bugs = NULL;
 	
-	free(pkg->installation.filename);
-	pkg->installation.filename = NULL;
-	
-	query_free(&pkg->installation.metadata);
+	free(pkg->installation.version);
+	pkg->installation.version = NULL;
 	
 	free(pkg->provides);
 	pkg->provides = NULL;
 	
+	free(pkg->sha256);
+	pkg->sha256 = NULL;
+	
 	pkg->size = 0;
 	pkg->installed_size = 0;
 	
@@ -553,8 +554,8 @@ void pkgs_delete(
 			memmove(destination, source, size);
 		}
 		
-		pkgs->items[pkgs->offset] = NULL;
 		pkgs->offset--;
+		pkgs->items[pkgs->offset] = NULL;
 		
 		break;
 	}
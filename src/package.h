@@ -20,6 +20,7 @@
 #define PKG_SECTION_FIELD_SIZE 0x0E
 #define PKG_SECTION_FIELD_INSTALLED_SIZE 0x0F
 #define PKG_SECTION_FIELD_FILENAME 0x10
+#define PKG_SECTION_FIELD_SHA256 0x11
 
 enum Architecture {
 	ARCH_UNKNOWN,
@@ -50,8 +51,7 @@ struct Depends {
 };
 
 struct InstallStatus {
-	hquery_t metadata;
-	char* filename;
+	char* version;
 };
 
 typedef struct InstallStatus installation_t;
@@ -74,6 +74,8 @@ struct Package {
 	biguint_t size;
 	biguint_t installed_size;
 	char* filename;
+	unsigned char* sha256;
+	void* unpack;
 	int obsolete;
 	int resolved;
 	int installed;
@@ -81,6 +83,7 @@ struct Package {
 	int removable;
 	int autoinstall;
 	size_t repo;
+	size_t position;
 	architecture_t arch;
 };
 
@@ -115,6 +118,8 @@ typedef struct Packages pkgs_t;
 typedef struct PkgsIter pkgs_iter_t;
 typedef struct Depends depends_t;
 
+void pkg_free(pkg_t* const pkg);
+
 void pkgs_free(
 	pkgs_t * const pkgs,
 	const int copy
@@ -0,0 +1,1032 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "errors.h"
+#include "pattern.h"
+
+#define NFA_SET (0)
+#define NFA_SPLIT (1)
+#define NFA_EMPTY (2)
+#define NFA_MATCH (3)
+
+#define BITS_PER_WORD (sizeof(unsigned long) * 8)
+
+static const char REGEX_METACHARACTERS[] = ".[()|*+?{\\";
+static const char GLOB_METACHARACTERS[] = "*?[";
+
+struct NfaState {
+	int type;
+	int out;
+	int out1;
+	unsigned char set[32];
+};
+
+typedef struct NfaState nfa_state_t;
+
+struct Nfa {
+	size_t size;
+	size_t offset;
+	nfa_state_t* items;
+	const char* position;
+	const char* end;
+	int type;
+	int error;
+};
+
+typedef struct Nfa nfa_t;
+
+struct NfaFragment {
+	int start;
+	int end;
+};
+
+typedef struct NfaFragment nfa_fragment_t;
+
+static int nfa_add(
+	nfa_t* const nfa,
+	const int type,
+	const int out,
+	const int out1
+) {
+	
+	size_t size = 0;
+	nfa_state_t* items = NULL;
+	nfa_state_t* state = NULL;
+	
+	if (nfa->offset >= PATTERN_MAX_NFA_STATES) {
+		nfa->error = APTERR_PATTERN_TOO_COMPLEX;
+		return -1;
+	}
+	
+	if (nfa->offset == nfa->size) {
+		size = (nfa->size == 0) ? 32 : nfa->size * 2;
+		items = realloc(nfa->items, sizeof(*nfa->items) * size);
+		
+		if (items == NULL) {
+			nfa->error = APTERR_MEM_ALLOC_FAILURE;
+			return -1;
+		}
+		
+		nfa->size = size;
+		nfa->items = items;
+	}
+	
+	state = &nfa->items[nfa->offset];
+	
+	memset(state, 0, sizeof(*state));
+	
+	state->type = type;
+	state->out = out;
+	state->out1 = out1;
+	
+	return (int) nfa->offset++;
+	
+}
+
+static nfa_fragment_t nfa_empty(nfa_t* const nfa) {
+	
+	nfa_fragment_t fragment = {-1, -1};
+	
+	fragment.start = nfa_add(nfa, NFA_EMPTY, -1, -1);
+	fragment.end = fragment.start;
+	
+	return fragment;
+	
+}
+
+static nfa_fragment_t nfa_set(nfa_t* const nfa, const unsigned char* const set) {
+	
+	nfa_fragment_t fragment = {-1, -1};
+	
+	fragment.end = nfa_add(nfa, NFA_EMPTY, -1, -1);
+	
+	if (fragment.end == -1) {
+		return fragment;
+	}
+	
+	fragment.start = nfa_add(nfa, NFA_SET, fragment.end, -1);
+	
+	if (fragment.start != -1) {
+		memcpy(nfa->items[fragment.start].set, set, sizeof(nfa->items[fragment.start].set));
+	}
+	
+	return fragment;
+	
+}
+
+static nfa_fragment_t nfa_literal(nfa_t* const nfa, const unsigned char ch) {
+	
+	unsigned char set[32];
+	
+	memset(set, 0, sizeof(set));
+	set[ch / 8] |= (unsigned char) (1 << (ch % 8));
+	
+	return nfa_set(nfa, set);
+	
+}
+
+static nfa_fragment_t nfa_any(nfa_t* const nfa) {
+	
+	unsigned char set[32];
+	
+	memset(set, 0xFF, sizeof(set));
+	
+	return nfa_set(nfa, set);
+	
+}
+
+static int nfa_invalid(
+	nfa_t* const nfa,
+	const nfa_fragment_t fragment
+) {
+	/*
+	Fragments are left unfinished when building them failed; the error is
+	kept in the automaton.
+	*/
+	
+	if (fragment.start != -1 && fragment.end != -1) {
+		return 0;
+	}
+	
+	if (nfa->error == APTERR_SUCCESS) {
+		nfa->error = APTERR_MEM_ALLOC_FAILURE;
+	}
+	
+	return 1;
+	
+}
+
+static nfa_fragment_t nfa_concat(
+	nfa_t* const nfa,
+	const nfa_fragment_t a,
+	const nfa_fragment_t b
+) {
+	
+	nfa_fragment_t fragment = {-1, -1};
+	
+	if (nfa_invalid(nfa, a) || nfa_invalid(nfa, b)) {
+		return fragment;
+	}
+	
+	fragment.start = a.start;
+	fragment.end = b.end;
+	
+	nfa->items[a.end].out = b.start;
+	
+	return fragment;
+	
+}
+
+static nfa_fragment_t nfa_repeat(
+	nfa_t* const nfa,
+	const nfa_fragment_t a,
+	const char operator
+) {
+	
+	nfa_fragment_t fragment = {-1, -1};
+	
+	int split = -1;
+	
+	if (nfa_invalid(nfa, a)) {
+		return fragment;
+	}
+	
+	fragment.end = nfa_add(nfa, NFA_EMPTY, -1, -1);
+	
+	if (fragment.end == -1) {
+		return fragment;
+	}
+	
+	split = nfa_add(nfa, NFA_SPLIT, a.start, fragment.end);
+	
+	if (split == -1) {
+		fragment.end = -1;
+		return fragment;
+	}
+	
+	switch (operator) {
+		case '*': {
+			nfa->items[a.end].out = split;
+			fragment.start = split;
+			break;
+		}
+		case '+': {
+			nfa->items[a.end].out = split;
+			fragment.start = a.start;
+			break;
+		}
+		default: {
+			nfa->items[a.end].out = fragment.end;
+			fragment.start = split;
+			break;
+		}
+	}
+	
+	return fragment;
+	
+}
+
+static nfa_fragment_t nfa_clone(
+	nfa_t* const nfa,
+	const int first,
+	const int last,
+	const nfa_fragment_t a
+) {
+	/*
+	Copy a fragment made of the states from first up to (but not including)
+	last.
+	*/
+	
+	nfa_fragment_t fragment = {-1, -1};
+	
+	int index = 0;
+	int state = 0;
+	int out = 0;
+	int out1 = 0;
+	
+	const int count = last - first;
+	const int delta = (int) nfa->offset - first;
+	
+	if (nfa_invalid(nfa, a)) {
+		return fragment;
+	}
+	
+	for (index = first; index < first + count; index++) {
+		out = nfa->items[index].out;
+		out1 = nfa->items[index].out1;
+		
+		state = nfa_add(
+			nfa,
+			nfa->items[index].type,
+			(out >= first && out < first + count) ? out + delta : out,
+			(out1 >= first && out1 < first + count) ? out1 + delta : out1
+		);
+		
+		if (state == -1) {
+			return fragment;
+		}
+		
+		memcpy(nfa->items[state].set, nfa->items[index].set, sizeof(nfa->items[state].set));
+	}
+	
+	fragment.start = a.start + delta;
+	fragment.end = a.end + delta;
+	
+	return fragment;
+	
+}
+
+static nfa_fragment_t nfa_bound(
+	nfa_t* const nfa,
+	const nfa_fragment_t a,
+	const int first,
+	const int minimum,
+	const int maximum
+) {
+	/*
+	Repeat a fragment between minimum and maximum times, or at least
+	minimum times if maximum is -1.
+	
+	The states of the fragment are the ones added since the given one. It is
+	copied as many times as needed, with every copy past the minimum made
+	optional.
+	*/
+	
+	nfa_fragment_t fragment = {-1, -1};
+	nfa_fragment_t copy = {-1, -1};
+	
+	int index = 0;
+	int copies = 0;
+	
+	const int last = (int) nfa->offset;
+	
+	copies = (maximum == -1) ? minimum + 1 : maximum;
+	
+	if (copies == 0) {
+		return nfa_empty(nfa);
+	}
+	
+	/*
+	Nested bounds multiply; give up before making any copy if they would not
+	all fit (each optional copy adds two states of its own).
+	*/
+	if ((size_t) (copies - 1) * (size_t) (last - first + 2) > PATTERN_MAX_NFA_STATES - nfa->offset) {
+		nfa->error = APTERR_PATTERN_TOO_COMPLEX;
+		return fragment;
+	}
+	
+	/* The copies are taken before the fragment itself is joined to anything */
+	for (index = 1; index < copies && nfa->error == APTERR_SUCCESS; index++) {
+		copy = nfa_clone(nfa, first, last, a);
+		
+		if (index >= minimum) {
+			copy = nfa_repeat(nfa, copy, (maximum == -1) ? '*' : '?');
+		}
+		
+		fragment = (index == 1) ? copy : nfa_concat(nfa, fragment, copy);
+	}
+	
+	copy = (minimum == 0) ? nfa_repeat(nfa, a, (maximum == -1) ? '*' : '?') : a;
+	
+	return (copies == 1) ? copy : nfa_concat(nfa, copy, fragment);
+	
+}
+
+static int nfa_parse_bound(
+	nfa_t* const nfa,
+	int* const minimum,
+	int* const maximum
+) {
+	/*
+	Parse the bounds of a {m}, {m,} or {m,n} repetition; the opening brace
+	was already consumed.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	int* bound = minimum;
+	
+	*minimum = -1;
+	*maximum = -1;
+	
+	while (nfa->position < nfa->end && *nfa->position != '}') {
+		if (*nfa->position == ',' && bound == minimum && *minimum != -1) {
+			bound = maximum;
+		} else if (*nfa->position >= '0' && *nfa->position <= '9') {
+			*bound = ((*bound == -1) ? 0 : *bound * 10) + (*nfa->position - '0');
+			
+			if (*bound > PATTERN_MAX_REPEAT) {
+				return -1;
+			}
+		} else {
+			return -1;
+		}
+		
+		nfa->position++;
+	}
+	
+	if (nfa->position >= nfa->end || *minimum == -1) {
+		return -1;
+	}
+	
+	nfa->position++;
+	
+	/* {m} is exactly m times */
+	if (bound == minimum) {
+		*maximum = *minimum;
+	}
+	
+	if (*maximum != -1 && *maximum < *minimum) {
+		return -1;
+	}
+	
+	return 0;
+	
+}
+
+static int nfa_parse_bracket(nfa_t* const nfa, unsigned char* const set) {
+	/*
+	Parse a bracket expression such as [a-z0-9] or [^/].
+	
+	Both '^' (regex) and '!' (glob) negate the set.
+	*/
+	
+	int negate = 0;
+	int first = 1;
+	
+	unsigned char low = 0;
+	unsigned char high = 0;
+	unsigned int ch = 0;
+	
+	memset(set, 0, 32);
+	
+	if (nfa->position < nfa->end && (*nfa->position == '^' || (nfa->type == PATTERN_GLOB && *nfa->position == '!'))) {
+		negate = 1;
+		nfa->position++;
+	}
+	
+	while (1) {
+		if (nfa->position >= nfa->end) {
+			return -1;
+		}
+		
+		if (*nfa->position == ']' && !first) {
+			nfa->position++;
+			break;
+		}
+		
+		first = 0;
+		
+		low = (unsigned char) *nfa->position++;
+		high = low;
+		
+		if ((nfa->position + 1) < nfa->end && nfa->position[0] == '-' && nfa->position[1] != ']') {
+			high = (unsigned char) nfa->position[1];
+			nfa->position += 2;
+		}
+		
+		if (low > high) {
+			return -1;
+		}
+		
+		for (ch = low; ch <= high; ch++) {
+			set[ch / 8] |= (unsigned char) (1 << (ch % 8));
+		}
+	}
+	
+	if (negate) {
+		for (ch = 0; ch < 32; ch++) {
+			set[ch] = (unsigned char) ~set[ch];
+		}
+	}
+	
+	return 0;
+	
+}
+
+static nfa_fragment_t nfa_parse_alternation(nfa_t* const nfa);
+
+static nfa_fragment_t nfa_parse_atom(nfa_t* const nfa) {
+	
+	nfa_fragment_t fragment = {-1, -1};
+	
+	unsigned char set[32];
+	const char ch = *nfa->position++;
+	
+	if (nfa->type == PATTERN_GLOB) {
+		switch (ch) {
+			case '*': {
+				return nfa_repeat(nfa, nfa_any(nfa), '*');
+			}
+			case '?': {
+				return nfa_any(nfa);
+			}
+			case '[': {
+				if (nfa_parse_bracket(nfa, set) != 0) {
+					nfa->error = APTERR_PATTERN_INVALID;
+					return fragment;
+				}
+				
+				return nfa_set(nfa, set);
+			}
+			default: {
+				return nfa_literal(nfa, (unsigned char) ch);
+			}
+		}
+	}
+	
+	switch (ch) {
+		case '(': {
+			fragment = nfa_parse_alternation(nfa);
+			
+			if (nfa->error != APTERR_SUCCESS) {
+				return fragment;
+			}
+			
+			if (nfa->position >= nfa->end || *nfa->position != ')') {
+				nfa->error = APTERR_PATTERN_INVALID;
+				return fragment;
+			}
+			
+			nfa->position++;
+			
+			return fragment;
+		}
+		case '.': {
+			return nfa_any(nfa);
+		}
+		case '[': {
+			if (nfa_parse_bracket(nfa, set) != 0) {
+				nfa->error = APTERR_PATTERN_INVALID;
+				return fragment;
+			}
+			
+			return nfa_set(nfa, set);
+		}
+		case '\\': {
+			if (nfa->position >= nfa->end) {
+				nfa->error = APTERR_PATTERN_INVALID;
+				return fragment;
+			}
+			
+			return nfa_literal(nfa, (unsigned char) *nfa->position++);
+		}
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+		case ')': {
+			nfa->error = APTERR_PATTERN_INVALID;
+			return fragment;
+		}
+		default: {
+			return nfa_literal(nfa, (unsigned char) ch);
+		}
+	}
+	
+}
+
+static nfa_fragment_t nfa_parse_concatenation(nfa_t* const nfa) {
+	
+	nfa_fragment_t fragment = {-1, -1};
+	nfa_fragment_t atom = {-1, -1};
+	
+	int first = 0;
+	int minimum = 0;
+	int maximum = 0;
+	
+	while (nfa->position < nfa->end && nfa->error == APTERR_SUCCESS) {
+		if (nfa->type == PATTERN_REGEX && (*nfa->position == '|' || *nfa->position == ')')) {
+			break;
+		}
+		
+		/* Everything the atom (and its quantifiers) adds comes after this */
+		first = (int) nfa->offset;
+		
+		atom = nfa_parse_atom(nfa);
+		
+		while (nfa->error == APTERR_SUCCESS && nfa->type == PATTERN_REGEX && nfa->position < nfa->end) {
+			if (*nfa->position == '{') {
+				nfa->position++;
+				
+				if (nfa_parse_bound(nfa, &minimum, &maximum) != 0) {
+					nfa->error = APTERR_PATTERN_INVALID;
+					break;
+				}
+				
+				atom = nfa_bound(nfa, atom, first, minimum, maximum);
+				continue;
+			}
+			
+			if (*nfa->position != '*' && *nfa->position != '+' && *nfa->position != '?') {
+				break;
+			}
+			
+			atom = nfa_repeat(nfa, atom, *nfa->position++);
+		}
+		
+		if (nfa->error != APTERR_SUCCESS || nfa_invalid(nfa, atom)) {
+			break;
+		}
+		
+		fragment = (fragment.start == -1) ? atom : nfa_concat(nfa, fragment, atom);
+	}
+	
+	if (nfa->error == APTERR_SUCCESS && fragment.start == -1) {
+		fragment = nfa_empty(nfa);
+	}
+	
+	return fragment;
+	
+}
+
+static nfa_fragment_t nfa_parse_alternation(nfa_t* const nfa) {
+	
+	nfa_fragment_t fragment = {-1, -1};
+	nfa_fragment_t other = {-1, -1};
+	
+	int split = -1;
+	int join = -1;
+	
+	fragment = nfa_parse_concatenation(nfa);
+	
+	while (nfa->error == APTERR_SUCCESS && nfa->position < nfa->end && *nfa->position == '|') {
+		nfa->position++;
+		
+		other = nfa_parse_concatenation(nfa);
+		
+		if (nfa->error != APTERR_SUCCESS) {
+			break;
+		}
+		
+		if (nfa_invalid(nfa, fragment) || nfa_invalid(nfa, other)) {
+			break;
+		}
+		
+		join = nfa_add(nfa, NFA_EMPTY, -1, -1);
+		split = nfa_add(nfa, NFA_SPLIT, fragment.start, other.start);
+		
+		if (join == -1 || split == -1) {
+			break;
+		}
+		
+		nfa->items[fragment.end].out = join;
+		nfa->items[other.end].out = join;
+		
+		fragment.start = split;
+		fragment.end = join;
+	}
+	
+	return fragment;
+	
+}
+
+static void nfa_closure(
+	const nfa_t* const nfa,
+	unsigned long* const set,
+	int* const stack
+) {
+	/*
+	Extend the set with every state reachable through empty transitions.
+	*/
+	
+	size_t index = 0;
+	size_t count = 0;
+	
+	int state = 0;
+	int next[2];
+	int subindex = 0;
+	
+	for (index = 0; index < nfa->offset; index++) {
+		if (set[index / BITS_PER_WORD] & (1UL << (index % BITS_PER_WORD))) {
+			stack[count++] = (int) index;
+		}
+	}
+	
+	while (count > 0) {
+		state = stack[--count];
+		
+		if (nfa->items[state].type != NFA_SPLIT && nfa->items[state].type != NFA_EMPTY) {
+			continue;
+		}
+		
+		next[0] = nfa->items[state].out;
+		next[1] = (nfa->items[state].type == NFA_SPLIT) ? nfa->items[state].out1 : -1;
+		
+		for (subindex = 0; subindex < 2; subindex++) {
+			state = next[subindex];
+			
+			if (state == -1 || (set[state / BITS_PER_WORD] & (1UL << (state % BITS_PER_WORD)))) {
+				continue;
+			}
+			
+			set[state / BITS_PER_WORD] |= (1UL << (state % BITS_PER_WORD));
+			stack[count++] = state;
+		}
+	}
+	
+}
+
+static char* pattern_get_prefix(const char* const expression, const int type) {
+	/*
+	Get the literal text every match of the expression must start with.
+	
+	Returns a null pointer if the expression is not anchored to the start
+	of the string, or on error.
+	*/
+	
+	size_t length = 0;
+	
+	const char* position = expression;
+	const char* metacharacters = GLOB_METACHARACTERS;
+	
+	char* prefix = NULL;
+	
+	if (type == PATTERN_REGEX) {
+		if (*position != '^' || strchr(expression, '|') != NULL) {
+			return NULL;
+		}
+		
+		position++;
+		metacharacters = REGEX_METACHARACTERS;
+	}
+	
+	prefix = malloc(strlen(position) + 1);
+	
+	if (prefix == NULL) {
+		return NULL;
+	}
+	
+	while (*position != '\0' && strchr(metacharacters, *position) == NULL) {
+		if (type == PATTERN_REGEX && *position == '$' && position[1] == '\0') {
+			break;
+		}
+		
+		prefix[length++] = *position++;
+	}
+	
+	/* A quantifier applies to the previous character, which is then optional */
+	if (type == PATTERN_REGEX && length > 0 && (*position == '*' || *position == '?' || *position == '{')) {
+		length--;
+	}
+	
+	prefix[length] = '\0';
+	
+	return prefix;
+	
+}
+
+int pattern_guess_type(const char* const expression) {
+	/*
+	Guess whether the expression is a regular expression, a glob or a
+	plain package name.
+	
+	Expressions anchored with '^' or '$' are regular expressions; expressions
+	containing '*', '?' or '[' are globs.
+	*/
+	
+	const size_t length = strlen(expression);
+	
+	if (expression[0] == '^' || (length > 1 && expression[length - 1] == '$' && expression[length - 2] != '\\')) {
+		return PATTERN_REGEX;
+	}
+	
+	if (strpbrk(expression, GLOB_METACHARACTERS) != NULL) {
+		return PATTERN_GLOB;
+	}
+	
+	return PATTERN_NONE;
+	
+}
+
+int pattern_compile(
+	pattern_t* const pattern,
+	const char* const expression,
+	const int type
+) {
+	/*
+	Compile a glob or a regular expression into a deterministic automaton.
+	
+	Globs support '*', '?' and bracket expressions, and always match the
+	whole string. Regular expressions support '.', bracket expressions,
+	'*', '+', '?', bounded repetition ('{m}', '{m,}' and '{m,n}'), '|' and
+	grouping; they match anywhere in the string unless anchored with '^'
+	and/or '$'.
+	
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	size_t subindex = 0;
+	size_t words = 0;
+	size_t state = 0;
+	size_t size = 0;
+	
+	int anchored_start = 1;
+	int anchored_end = 1;
+	int match = -1;
+	int representative = 0;
+	
+	size_t length = strlen(expression);
+	
+	nfa_t nfa = {0};
+	nfa_fragment_t fragment = {-1, -1};
+	nfa_fragment_t wildcard = {-1, -1};
+	const nfa_state_t* nfa_state = NULL;
+	
+	unsigned long* sets = NULL;
+	unsigned long* set = NULL;
+	unsigned long* signatures = NULL;
+	unsigned char representatives[256];
+	
+	unsigned short* table = NULL;
+	unsigned short* grown = NULL;
+	unsigned char* accepting = NULL;
+	unsigned char* marks = NULL;
+	
+	int* stack = NULL;
+	
+	memset(pattern, 0, sizeof(*pattern));
+	
+	nfa.type = type;
+	nfa.position = expression;
+	nfa.end = expression + length;
+	
+	if (type == PATTERN_REGEX) {
+		if (*nfa.position == '^') {
+			nfa.position++;
+		} else {
+			anchored_start = 0;
+		}
+		
+		if (nfa.end > nfa.position && nfa.end[-1] == '$' && (nfa.end - 1 == nfa.position || nfa.end[-2] != '\\')) {
+			nfa.end--;
+		} else {
+			anchored_end = 0;
+		}
+		
+		fragment = nfa_parse_alternation(&nfa);
+		
+		if (nfa.error == APTERR_SUCCESS && nfa.position != nfa.end) {
+			nfa.error = APTERR_PATTERN_INVALID;
+		}
+	} else {
+		fragment = nfa_parse_concatenation(&nfa);
+	}
+	
+	if (nfa.error == APTERR_SUCCESS && !anchored_start) {
+		wildcard = nfa_repeat(&nfa, nfa_any(&nfa), '*');
+		fragment = nfa_concat(&nfa, wildcard, fragment);
+	}
+	
+	if (nfa.error == APTERR_SUCCESS && !anchored_end) {
+		wildcard = nfa_repeat(&nfa, nfa_any(&nfa), '*');
+		fragment = nfa_concat(&nfa, fragment, wildcard);
+	}
+	
+	if (nfa.error == APTERR_SUCCESS && !nfa_invalid(&nfa, fragment)) {
+		match = nfa_add(&nfa, NFA_MATCH, -1, -1);
+	}
+	
+	if (nfa.error != APTERR_SUCCESS || match == -1) {
+		err = (nfa.error == APTERR_SUCCESS) ? APTERR_MEM_ALLOC_FAILURE : nfa.error;
+		goto end;
+	}
+	
+	nfa.items[fragment.end].out = match;
+	
+	words = (nfa.offset + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	
+	stack = malloc(sizeof(*stack) * nfa.offset);
+	signatures = calloc(256 * words, sizeof(*signatures));
+	
+	if (stack == NULL || signatures == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	/* Bytes accepted by exactly the same states behave the same and share a column in the table */
+	for (index = 0; index < 256; index++) {
+		set = &signatures[pattern->classes * words];
+		
+		for (subindex = 0; subindex < nfa.offset; subindex++) {
+			nfa_state = &nfa.items[subindex];
+			
+			if (nfa_state->type == NFA_SET && (nfa_state->set[index / 8] & (1 << (index % 8)))) {
+				set[subindex / BITS_PER_WORD] |= (1UL << (subindex % BITS_PER_WORD));
+			}
+		}
+		
+		for (subindex = 0; subindex < pattern->classes; subindex++) {
+			if (memcmp(&signatures[subindex * words], set, sizeof(*set) * words) == 0) {
+				break;
+			}
+		}
+		
+		if (subindex == pattern->classes) {
+			representatives[pattern->classes++] = (unsigned char) index;
+		} else {
+			memset(set, 0, sizeof(*set) * words);
+		}
+		
+		pattern->map[index] = (unsigned char) subindex;
+	}
+	
+	/* State 0 is the dead state, where no match is possible anymore */
+	size = 64;
+	
+	sets = calloc(size * words, sizeof(*sets));
+	table = malloc(size * pattern->classes * sizeof(*table));
+	accepting = calloc(size, sizeof(*accepting));
+	
+	if (sets == NULL || table == NULL || accepting == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	set = &sets[words];
+	set[fragment.start / BITS_PER_WORD] |= (1UL << (fragment.start % BITS_PER_WORD));
+	
+	nfa_closure(&nfa, set, stack);
+	
+	pattern->states = 2;
+	pattern->start = 1;
+	
+	for (state = 0; state < pattern->states; state++) {
+		accepting[state] = (sets[(state * words) + (match / BITS_PER_WORD)] & (1UL << (match % BITS_PER_WORD))) != 0;
+		
+		for (index = 0; index < pattern->classes; index++) {
+			if (pattern->states == size) {
+				if (size >= PATTERN_MAX_STATES) {
+					err = APTERR_PATTERN_TOO_COMPLEX;
+					goto end;
+				}
+				
+				size *= 2;
+				
+				set = realloc(sets, size * words * sizeof(*sets));
+				
+				if (set == NULL) {
+					err = APTERR_MEM_ALLOC_FAILURE;
+					goto end;
+				}
+				
+				sets = set;
+				
+				grown = realloc(table, size * pattern->classes * sizeof(*table));
+				
+				if (grown == NULL) {
+					err = APTERR_MEM_ALLOC_FAILURE;
+					goto end;
+				}
+				
+				table = grown;
+				
+				marks = realloc(accepting, size * sizeof(*accepting));
+				
+				if (marks == NULL) {
+					err = APTERR_MEM_ALLOC_FAILURE;
+					goto end;
+				}
+				
+				accepting = marks;
+			}
+			
+			/* The next state is built in the first unused slot */
+			set = &sets[pattern->states * words];
+			memset(set, 0, sizeof(*set) * words);
+			
+			representative = representatives[index];
+			
+			for (subindex = 0; subindex < nfa.offset; subindex++) {
+				if ((sets[(state * words) + (subindex / BITS_PER_WORD)] & (1UL << (subindex % BITS_PER_WORD))) == 0) {
+					continue;
+				}
+				
+				nfa_state = &nfa.items[subindex];
+				
+				if (nfa_state->type == NFA_SET && (nfa_state->set[representative / 8] & (1 << (representative % 8)))) {
+					set[nfa_state->out / BITS_PER_WORD] |= (1UL << (nfa_state->out % BITS_PER_WORD));
+				}
+			}
+			
+			nfa_closure(&nfa, set, stack);
+			
+			for (subindex = 0; subindex < pattern->states; subindex++) {
+				if (memcmp(&sets[subindex * words], set, sizeof(*set) * words) == 0) {
+					break;
+				}
+			}
+			
+			if (subindex == pattern->states) {
+				pattern->states++;
+			}
+			
+			table[(state * pattern->classes) + index] = (unsigned short) subindex;
+		}
+	}
+	
+	pattern->table = table;
+	pattern->accepting = accepting;
+	
+	table = NULL;
+	accepting = NULL;
+	
+	pattern->prefix = pattern_get_prefix(expression, type);
+	
+	end:;
+	
+	free(nfa.items);
+	free(stack);
+	free(signatures);
+	free(sets);
+	free(table);
+	free(accepting);
+	
+	return err;
+	
+}
+
+int pattern_match(
+	const pattern_t* const pattern,
+	const char* const string
+) {
+	/*
+	Check whether the string matches the compiled pattern.
+	
+	Returns (1) on match, (0) otherwise.
+	*/
+	
+	const unsigned char* position = (const unsigned char*) string;
+	size_t state = pattern->start;
+	
+	while (*position != '\0') {
+		state = pattern->table[(state * pattern->classes) + pattern->map[*position++]];
+		
+		if (state == 0) {
+			return 0;
+		}
+	}
+	
+	return pattern->accepting[state];
+	
+}
+
+void pattern_free(pattern_t* const pattern) {
+	
+	free(pattern->table);
+	pattern->table = NULL;
+	
+	free(pattern->accepting);
+	pattern->accepting = NULL;
+	
+	free(pattern->prefix);
+	pattern->prefix = NULL;
+	
+	pattern->states = 0;
+	pattern->classes = 0;
+	
+}
@@ -0,0 +1,45 @@
+#if !defined(PATTERN_H)
+#define PATTERN_H
+
+#include <stddef.h>
+
+#define PATTERN_NONE (0)
+#define PATTERN_GLOB (1)
+#define PATTERN_REGEX (2)
+
+#define PATTERN_MAX_STATES (4096)
+
+/* Largest nondeterministic automaton built before a pattern is deemed too complex */
+#define PATTERN_MAX_NFA_STATES (PATTERN_MAX_STATES * 4)
+
+/* Largest bound accepted in a {m,n} repetition */
+#define PATTERN_MAX_REPEAT (255)
+
+struct Pattern {
+	size_t states;
+	size_t classes;
+	unsigned char map[256];
+	unsigned short* table;
+	unsigned char* accepting;
+	unsigned short start;
+	char* prefix;
+};
+
+typedef struct Pattern pattern_t;
+
+int pattern_guess_type(const char* const expression);
+
+int pattern_compile(
+	pattern_t* const pattern,
+	const char* const expression,
+	const int type
+);
+
+int pattern_match(
+	const pattern_t* const pattern,
+	const char* const string
+);
+
+void pattern_free(pattern_t* const pattern);
+
+#endif
@@ -0,0 +1,1419 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "errors.h"
+#include "fs/exists.h"
+#include "fs/fstream.h"
+#include "fs/mmap.h"
+#include "fs/mv.h"
+#include "fs/rm.h"
+#include "fs/sep.h"
+#include "fs/sync.h"
+#include "pkgdb.h"
+
+/*
+On-disk layout of the database (all integers are little-endian):
+
+- Header (32 bytes): magic, version, number of packages, number of paths,
+  number of hash buckets and size of the string table.
+- Package table: one 24-byte entry per installed package, sorted by name.
+  Each entry holds the offsets of its name, version and manifest in the
+  string table, the index of its first path, its number of paths and its
+  flags.
+- Path table: one 12-byte entry per path listed in a manifest. Each entry
+  holds the offset of the path in the string table, its length (without
+  a trailing slash) and the index of the package that owns it. The paths
+  of a package follow each other, in manifest order.
+- Hash table: one 32-bit integer per bucket, holding the index of a path
+  plus one (zero for an empty bucket). The same path may be listed by
+  several packages, and all of them are in the table.
+- String table: for each package, its NUL-terminated name, version and
+  comma-separated manifest. Each entry of a manifest is a path, possibly
+  followed by more fields (which the path table leaves out).
+
+Changes are not written to the database itself. Each one is appended to
+a journal next to it first, as a record holding the new state of the
+package (or its removal), and kept in memory on top of the mapped file.
+Committing writes the whole database out again, replaces the old one and
+removes the journal. A journal that is still there when the database is
+opened is replayed, so that nothing that was recorded is lost.
+*/
+
+static const char PKGDB_MAGIC[] = "NZPD";
+
+static const char PKGDB_FILE[] =
+	PATHSEP_M
+	"packages.db";
+
+static const char PKGDB_JOURNAL_EXT[] = ".journal";
+static const char PKGDB_TEMPORARY_EXT[] = ".tmp";
+
+#define PKGDB_VERSION (1)
+#define PKGDB_HEADER_SIZE (32)
+#define PKGDB_PACKAGE_SIZE (24)
+#define PKGDB_PATH_SIZE (12)
+#define PKGDB_RECORD_SIZE (16)
+#define PKGDB_INITIAL_BUCKETS (1024)
+
+#define PKGDB_RECORD_PUT (1)
+#define PKGDB_RECORD_DELETE (2)
+
+#define PKGDB_FLAG_AUTOINSTALL (0x01)
+
+static void put_uint32(unsigned char* const buffer, const unsigned long value) {
+	
+	buffer[0] = (unsigned char) (value & 0xFF);
+	buffer[1] = (unsigned char) ((value >> 8) & 0xFF);
+	buffer[2] = (unsigned char) ((value >> 16) & 0xFF);
+	buffer[3] = (unsigned char) ((value >> 24) & 0xFF);
+	
+}
+
+static void put_uint64(unsigned char* const buffer, const unsigned long long value) {
+	
+	put_uint32(buffer, (unsigned long) (value & 0xFFFFFFFFUL));
+	put_uint32(buffer + 4, (unsigned long) (value >> 32));
+	
+}
+
+static unsigned long get_uint32(const unsigned char* const buffer) {
+	
+	return (
+		((unsigned long) buffer[0]) |
+		(((unsigned long) buffer[1]) << 8) |
+		(((unsigned long) buffer[2]) << 16) |
+		(((unsigned long) buffer[3]) << 24)
+	);
+	
+}
+
+static unsigned long long get_uint64(const unsigned char* const buffer) {
+	
+	return ((unsigned long long) get_uint32(buffer)) | (((unsigned long long) get_uint32(buffer + 4)) << 32);
+	
+}
+
+static unsigned long hash_bytes(const char* const data, const size_t size) {
+	
+	size_t index = 0;
+	unsigned long hash = 2166136261UL;
+	
+	for (index = 0; index < size; index++) {
+		hash ^= (unsigned char) data[index];
+		hash *= 16777619UL;
+	}
+	
+	return hash & 0xFFFFFFFFUL;
+	
+}
+
+static size_t path_length(const char* const path, size_t size) {
+	/*
+	Directories are listed with a trailing slash; paths are compared
+	without it, and without any fields that follow them.
+	*/
+	
+	const char* const separator = memchr(path, PKGDB_FIELD_SEPARATOR, size);
+	
+	if (separator != NULL) {
+		size = (size_t) (separator - path);
+	}
+	
+	while (size > 1 && path[size - 1] == '/') {
+		size--;
+	}
+	
+	return size;
+	
+}
+
+static char* pkgdb_filename(
+	const char* const directory,
+	const char* const extension
+) {
+	
+	char* filename = NULL;
+	
+	filename = malloc(strlen(directory) + strlen(PKGDB_FILE) + strlen(extension) + 1);
+	
+	if (filename == NULL) {
+		return NULL;
+	}
+	
+	strcpy(filename, directory);
+	strcat(filename, PKGDB_FILE);
+	strcat(filename, extension);
+	
+	return filename;
+	
+}
+
+static const char* base_string(
+	const pkgdb_t* const database,
+	const size_t index,
+	const size_t field
+) {
+	
+	return database->strings + get_uint32(database->package_table + (index * PKGDB_PACKAGE_SIZE) + field);
+	
+}
+
+static void base_view(
+	const pkgdb_t* const database,
+	const size_t index,
+	pkgdb_package_t* const package
+) {
+	
+	const unsigned char* const entry = database->package_table + (index * PKGDB_PACKAGE_SIZE);
+	
+	package->name = base_string(database, index, 0);
+	package->version = base_string(database, index, 4);
+	package->entries = base_string(database, index, 8);
+	package->autoinstall = (get_uint32(entry + 20) & PKGDB_FLAG_AUTOINSTALL) != 0;
+	
+}
+
+static size_t base_find(
+	const pkgdb_t* const database,
+	const char* const name
+) {
+	/*
+	Look up a package in the mapped file.
+	
+	Returns the index of the package, or the number of packages if it is
+	not there.
+	*/
+	
+	size_t low = 0;
+	size_t high = database->packages;
+	size_t middle = 0;
+	
+	int result = 0;
+	
+	while (low < high) {
+		middle = low + ((high - low) / 2);
+		result = strcmp(base_string(database, middle, 0), name);
+		
+		if (result == 0) {
+			return middle;
+		}
+		
+		if (result < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	
+	return database->packages;
+	
+}
+
+static size_t record_find(
+	const pkgdb_t* const database,
+	const char* const name
+) {
+	/*
+	Look up a package among the changes made since the file was written.
+	
+	Returns the index of the record, or the number of records if there is
+	none for the package.
+	*/
+	
+	size_t index = 0;
+	const pkgdb_record_t* record = NULL;
+	
+	for (index = database->offset; index > 0; index--) {
+		record = &database->items[index - 1];
+		
+		if (!record->removed && strcmp(record->name, name) == 0) {
+			return index - 1;
+		}
+	}
+	
+	return database->offset;
+	
+}
+
+static void record_view(
+	const pkgdb_record_t* const record,
+	pkgdb_package_t* const package
+) {
+	
+	package->name = record->name;
+	package->version = record->version;
+	package->entries = record->entries;
+	package->autoinstall = record->autoinstall;
+	
+}
+
+static void record_free(pkgdb_record_t* const record) {
+	
+	free(record->name);
+	record->name = NULL;
+	
+	free(record->version);
+	record->version = NULL;
+	
+	free(record->entries);
+	record->entries = NULL;
+	
+}
+
+static int pkgdb_map(pkgdb_t* const database) {
+	/*
+	Map the database file into memory. A database that was never written
+	is the same as an empty one.
+	
+	Returns (0) on success, or an APTERR_* code if the file is not a valid
+	database.
+	*/
+	
+	const unsigned char* data = NULL;
+	unsigned long long expected = 0;
+	
+	database->packages = 0;
+	database->paths = 0;
+	database->buckets = 0;
+	database->strings_size = 0;
+	
+	if (file_exists(database->filename) == 1) {
+		if (map_file(database->filename, &database->file) != 0) {
+			return APTERR_FSTREAM_OPEN_FAILURE;
+		}
+		
+		data = database->file.data;
+		
+		if (database->file.size < PKGDB_HEADER_SIZE || memcmp(data, PKGDB_MAGIC, 4) != 0 || get_uint32(data + 4) != PKGDB_VERSION) {
+			unmap_file(&database->file);
+			return APTERR_PKGDB_CORRUPTED;
+		}
+		
+		database->packages = (size_t) get_uint32(data + 8);
+		database->paths = (size_t) get_uint32(data + 12);
+		database->buckets = (size_t) get_uint32(data + 16);
+		database->strings_size = (size_t) get_uint64(data + 24);
+		
+		expected = PKGDB_HEADER_SIZE + (database->packages * (unsigned long long) PKGDB_PACKAGE_SIZE) + (database->paths * (unsigned long long) PKGDB_PATH_SIZE) + (database->buckets * 4ULL) + database->strings_size;
+		
+		/* The hash table is never empty, and its size is always a power of two */
+		if (expected != database->file.size || database->buckets == 0 || (database->buckets & (database->buckets - 1)) != 0 || (database->strings_size > 0 && data[database->file.size - 1] != '\0')) {
+			unmap_file(&database->file);
+			
+			database->packages = 0;
+			database->paths = 0;
+			database->buckets = 0;
+			database->strings_size = 0;
+			
+			return APTERR_PKGDB_CORRUPTED;
+		}
+		
+		database->package_table = data + PKGDB_HEADER_SIZE;
+		database->path_table = database->package_table + (database->packages * PKGDB_PACKAGE_SIZE);
+		database->bucket_table = database->path_table + (database->paths * PKGDB_PATH_SIZE);
+		database->strings = (const char*) (database->bucket_table + (database->buckets * 4));
+	}
+	
+	return APTERR_SUCCESS;
+	
+}
+
+static int pkgdb_reset(pkgdb_t* const database) {
+	/*
+	Drop the changes kept in memory, once they are in the mapped file.
+	
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
+	
+	size_t index = 0;
+	
+	for (index = 0; index < database->offset; index++) {
+		record_free(&database->items[index]);
+	}
+	
+	database->offset = 0;
+	database->path_offset = 0;
+	database->changes = 0;
+	
+	free(database->path_slots);
+	database->path_slots = NULL;
+	database->path_buckets = 0;
+	
+	free(database->shadowed);
+	database->shadowed = calloc(database->packages + 1, sizeof(*database->shadowed));
+	
+	if (database->shadowed == NULL) {
+		return APTERR_MEM_ALLOC_FAILURE;
+	}
+	
+	return APTERR_SUCCESS;
+	
+}
+
+static void pkgdb_slot_insert(
+	pkgdb_t* const database,
+	const size_t index
+) {
+	
+	size_t bucket = 0;
+	
+	const pkgdb_path_t* const item = &database->path_items[index];
+	
+	bucket = (size_t) (hash_bytes(item->path, item->length) & (database->path_buckets - 1));
+	
+	while (database->path_slots[bucket] != 0) {
+		bucket = (bucket + 1) & (database->path_buckets - 1);
+	}
+	
+	database->path_slots[bucket] = index + 1;
+	
+}
+
+static int pkgdb_index_path(
+	pkgdb_t* const database,
+	const size_t index
+) {
+	/*
+	Add the path at the given index to the hash table of the paths listed by
+	the changed packages, growing it if it is getting full.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	size_t subindex = 0;
+	size_t buckets = 0;
+	size_t* slots = NULL;
+	
+	if (((index + 1) * 2) > database->path_buckets) {
+		buckets = (database->path_buckets == 0) ? PKGDB_INITIAL_BUCKETS : database->path_buckets * 2;
+		slots = calloc(buckets, sizeof(*slots));
+		
+		if (slots == NULL) {
+			return -1;
+		}
+		
+		free(database->path_slots);
+		
+		database->path_slots = slots;
+		database->path_buckets = buckets;
+		
+		for (subindex = 0; subindex < index; subindex++) {
+			pkgdb_slot_insert(database, subindex);
+		}
+	}
+	
+	pkgdb_slot_insert(database, index);
+	
+	return 0;
+	
+}
+
+static int pkgdb_apply_delete(
+	pkgdb_t* const database,
+	const char* const name
+) {
+	
+	size_t index = 0;
+	
+	index = record_find(database, name);
+	
+	if (index != database->offset) {
+		database->items[index].removed = 1;
+	}
+	
+	index = base_find(database, name);
+	
+	if (index != database->packages) {
+		database->shadowed[index] = 1;
+	}
+	
+	database->changes++;
+	
+	return APTERR_SUCCESS;
+	
+}
+
+static int pkgdb_apply_put(
+	pkgdb_t* const database,
+	const pkgdb_package_t* const package
+) {
+	/*
+	Record the new state of a package in memory, on top of whatever the
+	mapped file or earlier changes say about it.
+	
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
+	
+	size_t size = 0;
+	size_t index = 0;
+	size_t length = 0;
+	
+	const char* position = NULL;
+	const char* end = NULL;
+	
+	pkgdb_record_t* items = NULL;
+	pkgdb_record_t* record = NULL;
+	
+	pkgdb_path_t* path_items = NULL;
+	pkgdb_path_t* path = NULL;
+	
+	if (sizeof(*database->items) * (database->offset + 1) > database->size) {
+		size = database->size + sizeof(*database->items) * (database->offset + 1);
+		items = realloc(database->items, size);
+		
+		if (items == NULL) {
+			return APTERR_MEM_ALLOC_FAILURE;
+		}
+		
+		database->size = size;
+		database->items = items;
+	}
+	
+	record = &database->items[database->offset];
+	memset(record, 0, sizeof(*record));
+	
+	record->name = malloc(strlen(package->name) + 1);
+	record->version = malloc(strlen(package->version) + 1);
+	record->entries = malloc(strlen(package->entries) + 1);
+	
+	if (record->name == NULL || record->version == NULL || record->entries == NULL) {
+		record_free(record);
+		return APTERR_MEM_ALLOC_FAILURE;
+	}
+	
+	strcpy(record->name, package->name);
+	strcpy(record->version, package->version);
+	strcpy(record->entries, package->entries);
+	
+	record->autoinstall = package->autoinstall;
+	
+	pkgdb_apply_delete(database, package->name);
+	
+	index = database->offset++;
+	
+	for (position = record->entries; *position != '\0'; position = (*end == '\0') ? end : end + 1) {
+		end = strchr(position, ',');
+		
+		if (end == NULL) {
+			end = strchr(position, '\0');
+		}
+		
+		length = (size_t) (end - position);
+		
+		if (length == 0) {
+			continue;
+		}
+		
+		if (sizeof(*database->path_items) * (database->path_offset + 1) > database->path_size) {
+			size = database->path_size + sizeof(*database->path_items) * (database->path_offset + 1);
+			path_items = realloc(database->path_items, size);
+			
+			if (path_items == NULL) {
+				return APTERR_MEM_ALLOC_FAILURE;
+			}
+			
+			database->path_size = size;
+			database->path_items = path_items;
+		}
+		
+		path = &database->path_items[database->path_offset];
+		
+		path->record = index;
+		path->path = position;
+		path->length = path_length(position, length);
+		
+		if (pkgdb_index_path(database, database->path_offset++) != 0) {
+			return APTERR_MEM_ALLOC_FAILURE;
+		}
+	}
+	
+	return APTERR_SUCCESS;
+	
+}
+
+static int pkgdb_journal_append(
+	pkgdb_t* const database,
+	const int type,
+	const pkgdb_package_t* const package
+) {
+	/*
+	Append a record to the journal. Each record is a 16-byte header (type,
+	flags, size of the payload and a checksum of it), followed by the
+	NUL-terminated name of the package and, unless it was removed, its
+	version and manifest.
+	
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t size = 0;
+	size_t name_size = 0;
+	size_t version_size = 0;
+	size_t entries_size = 0;
+	
+	unsigned char* record = NULL;
+	unsigned char* payload = NULL;
+	
+	fstream_t* stream = NULL;
+	
+	name_size = strlen(package->name) + 1;
+	
+	if (type == PKGDB_RECORD_PUT) {
+		version_size = strlen(package->version) + 1;
+		entries_size = strlen(package->entries) + 1;
+	}
+	
+	size = name_size + version_size + entries_size;
+	
+	record = malloc(PKGDB_RECORD_SIZE + size);
+	
+	if (record == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	payload = record + PKGDB_RECORD_SIZE;
+	
+	memcpy(payload, package->name, name_size);
+	
+	if (type == PKGDB_RECORD_PUT) {
+		memcpy(payload + name_size, package->version, version_size);
+		memcpy(payload + name_size + version_size, package->entries, entries_size);
+	}
+	
+	put_uint32(record, (unsigned long) type);
+	put_uint32(record + 4, (type == PKGDB_RECORD_PUT && package->autoinstall) ? PKGDB_FLAG_AUTOINSTALL : 0);
+	put_uint32(record + 8, (unsigned long) size);
+	put_uint32(record + 12, hash_bytes((const char*) payload, size));
+	
+	/* The journal is closed right after, so that the record is not left in a buffer */
+	stream = fstream_open(database->journal, FSTREAM_APPEND);
+	
+	if (stream == NULL) {
+		err = APTERR_FSTREAM_OPEN_FAILURE;
+		goto end;
+	}
+	
+	if (fstream_write(stream, (char*) record, PKGDB_RECORD_SIZE + size) == -1) {
+		err = APTERR_FSTREAM_WRITE_FAILURE;
+		goto end;
+	}
+	
+	/* The package is about to be reported as installed; the record has to survive a crash */
+	if (fstream_sync(stream) == -1) {
+		err = APTERR_FS_SYNC_FAILURE;
+		goto end;
+	}
+	
+	end:;
+	
+	if (stream != NULL && fstream_close(stream) == -1 && err == APTERR_SUCCESS) {
+		err = APTERR_FSTREAM_WRITE_FAILURE;
+	}
+	
+	free(record);
+	
+	return err;
+	
+}
+
+static int pkgdb_journal_truncate(
+	pkgdb_t* const database,
+	const size_t size
+) {
+	/*
+	Cut the journal short after its first size bytes, removing it altogether
+	if nothing is left of it.
+	
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	fstream_t* stream = NULL;
+	
+	if (size == 0) {
+		return (remove_file(database->journal) == 0) ? APTERR_SUCCESS : APTERR_FS_RM_FAILURE;
+	}
+	
+	stream = fstream_open(database->journal, FSTREAM_TRUNCATE);
+	
+	if (stream == NULL) {
+		err = APTERR_FSTREAM_OPEN_FAILURE;
+		goto end;
+	}
+	
+	if (fsream_truncate(stream, (long int) size) == -1) {
+		err = APTERR_FSTREAM_WRITE_FAILURE;
+		goto end;
+	}
+	
+	if (fstream_sync(stream) == -1) {
+		err = APTERR_FS_SYNC_FAILURE;
+		goto end;
+	}
+	
+	end:;
+	
+	if (stream != NULL && fstream_close(stream) == -1 && err == APTERR_SUCCESS) {
+		err = APTERR_FSTREAM_WRITE_FAILURE;
+	}
+	
+	return err;
+	
+}
+
+static int pkgdb_journal_replay(pkgdb_t* const database) {
+	/*
+	Apply every complete record of the journal, in order. The last record
+	may have been cut short; it, and anything after it, is ignored.
+	
+	What was ignored is cut off the journal, as records appended after it
+	would never be replayed otherwise.
+	
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t position = 0;
+	size_t size = 0;
+	size_t total = 0;
+	size_t name_size = 0;
+	size_t version_size = 0;
+	
+	unsigned long type = 0;
+	
+	const unsigned char* data = NULL;
+	const char* payload = NULL;
+	
+	mapped_file_t journal = {0};
+	pkgdb_package_t package = {0};
+	
+	if (file_exists(database->journal) != 1) {
+		return APTERR_SUCCESS;
+	}
+	
+	if (map_file(database->journal, &journal) != 0) {
+		return APTERR_FSTREAM_OPEN_FAILURE;
+	}
+	
+	data = journal.data;
+	total = journal.size;
+	
+	while (journal.size - position >= PKGDB_RECORD_SIZE) {
+		type = get_uint32(data + position);
+		size = (size_t) get_uint32(data + position + 8);
+		
+		if (journal.size - position - PKGDB_RECORD_SIZE < size) {
+			break;
+		}
+		
+		payload = (const char*) (data + position + PKGDB_RECORD_SIZE);
+		
+		if (hash_bytes(payload, size) != get_uint32(data + position + 12)) {
+			break;
+		}
+		
+		name_size = (size == 0 || memchr(payload, '\0', size) == NULL) ? 0 : strlen(payload) + 1;
+		
+		if (name_size == 0) {
+			break;
+		}
+		
+		if (type == PKGDB_RECORD_DELETE) {
+			err = pkgdb_apply_delete(database, payload);
+		} else if (type == PKGDB_RECORD_PUT) {
+			version_size = (memchr(payload + name_size, '\0', size - name_size) == NULL) ? 0 : strlen(payload + name_size) + 1;
+			
+			if (version_size == 0 || memchr(payload + name_size + version_size, '\0', size - name_size - version_size) == NULL) {
+				break;
+			}
+			
+			package.name = payload;
+			package.version = payload + name_size;
+			package.entries = payload + name_size + version_size;
+			package.autoinstall = (get_uint32(data + position + 4) & PKGDB_FLAG_AUTOINSTALL) != 0;
+			
+			err = pkgdb_apply_put(database, &package);
+		} else {
+			break;
+		}
+		
+		if (err != APTERR_SUCCESS) {
+			break;
+		}
+		
+		position += PKGDB_RECORD_SIZE + size;
+	}
+	
+	unmap_file(&journal);
+	
+	if (err == APTERR_SUCCESS && position < total) {
+		err = pkgdb_journal_truncate(database, position);
+	}
+	
+	return err;
+	
+}
+
+static int package_compare(const void* a, const void* b) {
+	
+	return strcmp(((const pkgdb_package_t*) a)->name, ((const pkgdb_package_t*) b)->name);
+	
+}
+
+int pkgdb_exists(const char* const directory) {
+	/*
+	Tell whether the database was ever written in the given directory.
+	*/
+	
+	int exists = 0;
+	char* filename = NULL;
+	
+	filename = pkgdb_filename(directory, "");
+	
+	if (filename == NULL) {
+		return 0;
+	}
+	
+	exists = (file_exists(filename) == 1);
+	
+	free(filename);
+	
+	return exists;
+	
+}
+
+int pkgdb_open(
+	pkgdb_t* const database,
+	const char* const directory
+) {
+	/*
+	Map the database kept in the given directory into memory, replaying
+	the journal left behind by an earlier run, if there is one.
+	
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	memset(database, 0, sizeof(*database));
+	
+	database->directory = malloc(strlen(directory) + 1);
+	database->filename = pkgdb_filename(directory, "");
+	database->journal = pkgdb_filename(directory, PKGDB_JOURNAL_EXT);
+	
+	if (database->directory == NULL || database->filename == NULL || database->journal == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	strcpy(database->directory, directory);
+	
+	err = pkgdb_map(database);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	err = pkgdb_reset(database);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	err = pkgdb_journal_replay(database);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	if (database->changes > 0) {
+		err = pkgdb_commit(database);
+	}
+	
+	end:;
+	
+	if (err != APTERR_SUCCESS) {
+		pkgdb_close(database);
+	}
+	
+	return err;
+	
+}
+
+int pkgdb_get(
+	const pkgdb_t* const database,
+	const char* const name,
+	pkgdb_package_t* const package
+) {
+	/*
+	Look up an installed package by name.
+	
+	The strings the package points to stay valid until the database is
+	changed or committed.
+	
+	Returns (0) if the package is installed, (-1) if it is not.
+	*/
+	
+	size_t index = 0;
+	
+	index = record_find(database, name);
+	
+	if (index != database->offset) {
+		record_view(&database->items[index], package);
+		return 0;
+	}
+	
+	index = base_find(database, name);
+	
+	if (index != database->packages && !database->shadowed[index]) {
+		base_view(database, index, package);
+		return 0;
+	}
+	
+	return -1;
+	
+}
+
+int pkgdb_next(
+	const pkgdb_t* const database,
+	pkgdb_iter_t* const iter,
+	pkgdb_package_t* const package
+) {
+	/*
+	Go through the installed packages: first the ones in the mapped file,
+	then the ones that were changed since.
+	
+	Returns (0) while there are packages left, (-1) once there are not.
+	*/
+	
+	size_t index = 0;
+	
+	while (iter->index < database->packages + database->offset) {
+		index = iter->index++;
+		
+		if (index < database->packages) {
+			if (database->shadowed[index]) {
+				continue;
+			}
+			
+			base_view(database, index, package);
+			
+			return 0;
+		}
+		
+		index -= database->packages;
+		
+		if (database->items[index].removed) {
+			continue;
+		}
+		
+		record_view(&database->items[index], package);
+		
+		return 0;
+	}
+	
+	return -1;
+	
+}
+
+static size_t pkgdb_lookup(
+	const pkgdb_t* const database,
+	const char* const path,
+	const size_t size,
+	const char* const exclude,
+	const char** const owners,
+	const size_t maximum
+) {
+	/*
+	Find the installed packages whose manifests list the given path, other
+	than the one named by exclude (which may be a null pointer).
+	
+	Up to maximum names are stored in owners; the search stops there,
+	unless owners is a null pointer, in which case they are only counted.
+	
+	Returns the number of packages found.
+	*/
+	
+	size_t bucket = 0;
+	size_t index = 0;
+	size_t owner = 0;
+	size_t count = 0;
+	
+	unsigned long hash = 0;
+	
+	const unsigned char* entry = NULL;
+	const char* name = NULL;
+	
+	const pkgdb_path_t* item = NULL;
+	const pkgdb_record_t* record = NULL;
+	
+	const size_t length = path_length(path, size);
+	
+	hash = hash_bytes(path, length);
+	
+	if (database->buckets > 0) {
+		bucket = (size_t) (hash & (database->buckets - 1));
+		
+		while ((index = (size_t) get_uint32(database->bucket_table + (bucket * 4))) != 0) {
+			entry = database->path_table + ((index - 1) * PKGDB_PATH_SIZE);
+			owner = (size_t) get_uint32(entry + 8);
+			
+			bucket = (bucket + 1) & (database->buckets - 1);
+			
+			if (owner >= database->packages || get_uint32(entry + 4) != length || memcmp(database->strings + get_uint32(entry), path, length) != 0 || database->shadowed[owner]) {
+				continue;
+			}
+			
+			name = base_string(database, owner, 0);
+			
+			if (exclude != NULL && strcmp(name, exclude) == 0) {
+				continue;
+			}
+			
+			if (owners != NULL) {
+				owners[count] = name;
+			}
+			
+			if (++count == maximum && owners != NULL) {
+				return count;
+			}
+		}
+	}
+	
+	if (database->path_buckets > 0) {
+		bucket = (size_t) (hash & (database->path_buckets - 1));
+		
+		while ((index = database->path_slots[bucket]) != 0) {
+			item = &database->path_items[index - 1];
+			record = &database->items[item->record];
+			
+			bucket = (bucket + 1) & (database->path_buckets - 1);
+			
+			if (item->length != length || memcmp(item->path, path, length) != 0 || record->removed) {
+				continue;
+			}
+			
+			if (exclude != NULL && strcmp(record->name, exclude) == 0) {
+				continue;
+			}
+			
+			if (owners != NULL) {
+				owners[count] = record->name;
+			}
+			
+			if (++count == maximum && owners != NULL) {
+				return count;
+			}
+		}
+	}
+	
+	return count;
+	
+}
+
+const char* pkgdb_owner(
+	const pkgdb_t* const database,
+	const char* const path,
+	const size_t size,
+	const char* const exclude
+) {
+	/*
+	Find an installed package whose manifest lists the given path, other
+	than the one named by exclude (which may be a null pointer).
+	
+	Returns the name of the package, or a null pointer if there is none.
+	*/
+	
+	const char* owner = NULL;
+	
+	if (pkgdb_lookup(database, path, size, exclude, &owner, 1) == 0) {
+		return NULL;
+	}
+	
+	return owner;
+	
+}
+
+size_t pkgdb_owners(
+	const pkgdb_t* const database,
+	const char* const path,
+	const size_t size,
+	const char** const owners,
+	const size_t maximum
+) {
+	/*
+	Find every installed package whose manifest lists the given path.
+	
+	Up to maximum names are stored in owners. If owners is a null pointer,
+	the packages are only counted.
+	
+	The names stay valid until the database is changed or committed.
+	
+	Returns the number of packages found.
+	*/
+	
+	return pkgdb_lookup(database, path, size, NULL, owners, maximum);
+	
+}
+
+int pkgdb_put(
+	pkgdb_t* const database,
+	const pkgdb_package_t* const package
+) {
+	/*
+	Record a package as installed, replacing whatever was recorded for it
+	before. The change goes to the journal before anything else.
+	
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	err = pkgdb_journal_append(database, PKGDB_RECORD_PUT, package);
+	
+	if (err != APTERR_SUCCESS) {
+		return err;
+	}
+	
+	return pkgdb_apply_put(database, package);
+	
+}
+
+int pkgdb_delete(
+	pkgdb_t* const database,
+	const char* const name
+) {
+	/*
+	Record a package as no longer installed.
+	
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	pkgdb_package_t package = {0};
+	
+	package.name = name;
+	
+	err = pkgdb_journal_append(database, PKGDB_RECORD_DELETE, &package);
+	
+	if (err != APTERR_SUCCESS) {
+		return err;
+	}
+	
+	return pkgdb_apply_delete(database, name);
+	
+}
+
+int pkgdb_commit(pkgdb_t* const database) {
+	/*
+	Write out the database with every change made to it, replace the old
+	one and get rid of the journal.
+	
+	The new database is flushed to disk before it replaces the old one, and
+	the journal is only removed after that. Replaying it again over the new
+	database changes nothing.
+	
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	size_t count = 0;
+	size_t paths = 0;
+	size_t buckets = 1;
+	size_t bucket = 0;
+	size_t length = 0;
+	size_t first = 0;
+	
+	unsigned long long strings_size = 0;
+	unsigned long long offset = 0;
+	
+	const char* position = NULL;
+	const char* end = NULL;
+	
+	char* temporary = NULL;
+	
+	unsigned char header[PKGDB_HEADER_SIZE];
+	unsigned char* tables = NULL;
+	unsigned char* package_table = NULL;
+	unsigned char* path_table = NULL;
+	unsigned char* bucket_table = NULL;
+	
+	pkgdb_package_t* packages = NULL;
+	pkgdb_package_t* package = NULL;
+	pkgdb_iter_t iter = {0};
+	
+	fstream_t* stream = NULL;
+	
+	/* There is nothing to write, and the file is already there */
+	if (database->changes == 0 && database->file.data != NULL) {
+		return APTERR_SUCCESS;
+	}
+	
+	packages = malloc(sizeof(*packages) * (database->packages + database->offset + 1));
+	
+	if (packages == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	while (pkgdb_next(database, &iter, &packages[count]) == 0) {
+		package = &packages[count++];
+		
+		strings_size += strlen(package->name) + strlen(package->version) + strlen(package->entries) + 3;
+		
+		for (position = package->entries; *position != '\0'; position = (*end == '\0') ? end : end + 1) {
+			end = strchr(position, ',');
+			
+			if (end == NULL) {
+				end = strchr(position, '\0');
+			}
+			
+			paths += (end != position);
+		}
+	}
+	
+	if (strings_size > 0xFFFFFFFFULL || paths > 0x7FFFFFFFUL) {
+		err = APTERR_PKG_METADATA_WRITE_FAILURE;
+		goto end;
+	}
+	
+	qsort(packages, count, sizeof(*packages), package_compare);
+	
+	while (buckets < paths * 2) {
+		buckets *= 2;
+	}
+	
+	tables = calloc((count * PKGDB_PACKAGE_SIZE) + (paths * PKGDB_PATH_SIZE) + (buckets * 4), 1);
+	
+	if (tables == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	package_table = tables;
+	path_table = package_table + (count * PKGDB_PACKAGE_SIZE);
+	bucket_table = path_table + (paths * PKGDB_PATH_SIZE);
+	
+	paths = 0;
+	
+	for (index = 0; index < count; index++) {
+		package = &packages[index];
+		first = paths;
+		
+		put_uint32(package_table + (index * PKGDB_PACKAGE_SIZE), (unsigned long) offset);
+		offset += strlen(package->name) + 1;
+		
+		put_uint32(package_table + (index * PKGDB_PACKAGE_SIZE) + 4, (unsigned long) offset);
+		offset += strlen(package->version) + 1;
+		
+		put_uint32(package_table + (index * PKGDB_PACKAGE_SIZE) + 8, (unsigned long) offset);
+		
+		for (position = package->entries; *position != '\0'; position = (*end == '\0') ? end : end + 1) {
+			end = strchr(position, ',');
+			
+			if (end == NULL) {
+				end = strchr(position, '\0');
+			}
+			
+			if (end == position) {
+				continue;
+			}
+			
+			length = path_length(position, (size_t) (end - position));
+			
+			put_uint32(path_table + (paths * PKGDB_PATH_SIZE), (unsigned long) (offset + (unsigned long long) (position - package->entries)));
+			put_uint32(path_table + (paths * PKGDB_PATH_SIZE) + 4, (unsigned long) length);
+			put_uint32(path_table + (paths * PKGDB_PATH_SIZE) + 8, (unsigned long) index);
+			
+			bucket = (size_t) (hash_bytes(position, length) & (buckets - 1));
+			
+			while (get_uint32(bucket_table + (bucket * 4)) != 0) {
+				bucket = (bucket + 1) & (buckets - 1);
+			}
+			
+			put_uint32(bucket_table + (bucket * 4), (unsigned long) (paths + 1));
+			
+			paths++;
+		}
+		
+		offset += strlen(package->entries) + 1;
+		
+		put_uint32(package_table + (index * PKGDB_PACKAGE_SIZE) + 12, (unsigned long) first);
+		put_uint32(package_table + (index * PKGDB_PACKAGE_SIZE) + 16, (unsigned long) (paths - first));
+		put_uint32(package_table + (index * PKGDB_PACKAGE_SIZE) + 20, package->autoinstall ? PKGDB_FLAG_AUTOINSTALL : 0);
+	}
+	
+	temporary = pkgdb_filename(database->directory, PKGDB_TEMPORARY_EXT);
+	
+	if (temporary == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	stream = fstream_open(temporary, FSTREAM_WRITE);
+	
+	if (stream == NULL) {
+		err = APTERR_FSTREAM_OPEN_FAILURE;
+		goto end;
+	}
+	
+	memcpy(header, PKGDB_MAGIC, 4);
+	put_uint32(header + 4, PKGDB_VERSION);
+	put_uint32(header + 8, (unsigned long) count);
+	put_uint32(header + 12, (unsigned long) paths);
+	put_uint32(header + 16, (unsigned long) buckets);
+	put_uint32(header + 20, 0);
+	put_uint64(header + 24, strings_size);
+	
+	if (fstream_write(stream, (char*) header, sizeof(header)) == -1) {
+		err = APTERR_FSTREAM_WRITE_FAILURE;
+		goto end;
+	}
+	
+	if (fstream_write(stream, (char*) tables, (count * PKGDB_PACKAGE_SIZE) + (paths * PKGDB_PATH_SIZE) + (buckets * 4)) == -1) {
+		err = APTERR_FSTREAM_WRITE_FAILURE;
+		goto end;
+	}
+	
+	for (index = 0; index < count; index++) {
+		package = &packages[index];
+		
+		if (fstream_write(stream, package->name, strlen(package->name) + 1) == -1) {
+			err = APTERR_FSTREAM_WRITE_FAILURE;
+			goto end;
+		}
+		
+		if (fstream_write(stream, package->version, strlen(package->version) + 1) == -1) {
+			err = APTERR_FSTREAM_WRITE_FAILURE;
+			goto end;
+		}
+		
+		if (fstream_write(stream, package->entries, strlen(package->entries) + 1) == -1) {
+			err = APTERR_FSTREAM_WRITE_FAILURE;
+			goto end;
+		}
+	}
+	
+	if (fstream_close(stream) == -1) {
+		stream = NULL;
+		err = APTERR_FSTREAM_WRITE_FAILURE;
+		goto end;
+	}
+	
+	stream = NULL;
+	
+	if (sync_filesystem(database->directory) != 0) {
+		err = APTERR_FS_SYNC_FAILURE;
+		goto end;
+	}
+	
+	/* Whatever the packages point to goes away with the old file */
+	free(packages);
+	packages = NULL;
+	
+	unmap_file(&database->file);
+	
+	if (move_file(temporary, database->filename) != 0) {
+		err = APTERR_FS_MOVE_FAILURE;
+		
+		/* The changes are still in memory, on top of the old file */
+		if (pkgdb_map(database) != APTERR_SUCCESS) {
+			err = APTERR_PKGDB_CORRUPTED;
+		}
+		
+		goto end;
+	}
+	
+	err = pkgdb_map(database);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	err = pkgdb_reset(database);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	if (file_exists(database->journal) == 1) {
+		if (sync_filesystem(database->directory) != 0) {
+			err = APTERR_FS_SYNC_FAILURE;
+			goto end;
+		}
+		
+		if (remove_file(database->journal) != 0) {
+			err = APTERR_FS_RM_FAILURE;
+			goto end;
+		}
+	}
+	
+	end:;
+	
+	if (stream != NULL) {
+		fstream_close(stream);
+	}
+	
+	if (temporary != NULL && file_exists(temporary) == 1) {
+		remove_file(temporary);
+	}
+	
+	free(temporary);
+	free(tables);
+	free(packages);
+	
+	return err;
+	
+}
+
+int pkgdb_clear(pkgdb_t* const database) {
+	/*
+	Forget about every installed package, and remove the database and its
+	journal from disk.
+	
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
+	
+	unmap_file(&database->file);
+	
+	if (file_exists(database->filename) == 1 && remove_file(database->filename) != 0) {
+		return APTERR_FS_RM_FAILURE;
+	}
+	
+	if (file_exists(database->journal) == 1 && remove_file(database->journal) != 0) {
+		return APTERR_FS_RM_FAILURE;
+	}
+	
+	database->packages = 0;
+	database->paths = 0;
+	database->buckets = 0;
+	database->strings_size = 0;
+	
+	return pkgdb_reset(database);
+	
+}
+
+void pkgdb_close(pkgdb_t* const database) {
+	
+	pkgdb_reset(database);
+	
+	unmap_file(&database->file);
+	
+	free(database->items);
+	free(database->path_items);
+	free(database->shadowed);
+	free(database->filename);
+	free(database->journal);
+	free(database->directory);
+	
+	memset(database, 0, sizeof(*database));
+	
+}
@@ -0,0 +1,121 @@
+#if !defined(PKGDB_H)
+#define PKGDB_H
+
+#include <stddef.h>
+
+#include "fs/mmap.h"
+
+/* Entries of a manifest may carry more fields after their path, each one preceded by this */
+#define PKGDB_FIELD_SEPARATOR '\t'
+
+struct PkgDbPackage {
+	const char* name;
+	const char* version;
+	const char* entries;
+	int autoinstall;
+};
+
+typedef struct PkgDbPackage pkgdb_package_t;
+
+struct PkgDbRecord {
+	char* name;
+	char* version;
+	char* entries;
+	int autoinstall;
+	int removed;
+};
+
+typedef struct PkgDbRecord pkgdb_record_t;
+
+struct PkgDbPath {
+	size_t record;
+	const char* path;
+	size_t length;
+};
+
+typedef struct PkgDbPath pkgdb_path_t;
+
+struct PkgDb {
+	char* filename;
+	char* journal;
+	char* directory;
+	mapped_file_t file;
+	size_t packages;
+	size_t paths;
+	size_t buckets;
+	const unsigned char* package_table;
+	const unsigned char* path_table;
+	const unsigned char* bucket_table;
+	const char* strings;
+	size_t strings_size;
+	unsigned char* shadowed;
+	size_t size;
+	size_t offset;
+	pkgdb_record_t* items;
+	size_t path_size;
+	size_t path_offset;
+	pkgdb_path_t* path_items;
+	size_t path_buckets;
+	size_t* path_slots;
+	size_t changes;
+};
+
+typedef struct PkgDb pkgdb_t;
+
+struct PkgDbIter {
+	size_t index;
+};
+
+typedef struct PkgDbIter pkgdb_iter_t;
+
+int pkgdb_open(
+	pkgdb_t* const database,
+	const char* const directory
+);
+
+int pkgdb_exists(const char* const directory);
+
+int pkgdb_get(
+	const pkgdb_t* const database,
+	const char* const name,
+	pkgdb_package_t* const package
+);
+
+int pkgdb_next(
+	const pkgdb_t* const database,
+	pkgdb_iter_t* const iter,
+	pkgdb_package_t* const package
+);
+
+const char* pkgdb_owner(
+	const pkgdb_t* const database,
+	const char* const path,
+	const size_t size,
+	const char* const exclude
+);
+
+size_t pkgdb_owners(
+	const pkgdb_t* const database,
+	const char* const path,
+	const size_t size,
+	const char** const owners,
+	const size_t maximum
+);
+
+int pkgdb_put(
+	pkgdb_t* const database,
+	const pkgdb_package_t* const package
+);
+
+int pkgdb_delete(
+	pkgdb_t* const database,
+	const char* const name
+);
+
+int pkgdb_commit(pkgdb_t* const database);
+
+int pkgdb_clear(pkgdb_t* const database);
+
+void pkgdb_close(pkgdb_t* const database);
+
+#endif
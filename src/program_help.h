@@ -6,7 +6,7 @@ This file is auto-generated. Use the tool at ../tools/program_help.h.py to regen
 #define PROGRAM_HELP_H
 
 #define PROGRAM_HELP \
-	"usage: nz [-h] [-v] [--update] [-i PACKAGE] [-u PACKAGE] [-s PACKAGE] [-c CONCURRENCY] [-f] [-p PREFIX] [-y] [--loglevel LOGLEVEL]\n"\
+	"usage: nz [-h] [-v] [--update] [-i PACKAGE] [-u PACKAGE] [-s PACKAGE] [--owns PATH] [-c CONCURRENCY] [-f] [-p PREFIX] [-y] [--loglevel LOGLEVEL]\n"\
 	"\n"\
 	"A command-line utility for downloading and installing packages from APT repositories.\n"\
 	"\n"\
@@ -15,11 +15,12 @@ This file is auto-generated. Use the tool at ../tools/program_help.h.py to regen
 	"  -v, --version         Print version information and exit.\n"\
 	"  --update              Update the local package index from remote repositories.\n"\
 	"  -i PACKAGE, --install PACKAGE\n"\
-	"                        Install one or more packages. Use a semicolon-separated list (e.g. 'pkg1;pkg2').\n"\
+	"                        Install one or more packages. Use a semicolon-separated list (e.g. 'pkg1;pkg2'). Globs (e.g. 'lib*-dev') and anchored regular expressions (e.g. '^python3-.*$') match package names.\n"\
 	"  -u PACKAGE, --uninstall PACKAGE\n"\
-	"                        Uninstall one or more packages. Use a semicolon-separated list (e.g. 'pkg1;pkg2').\n"\
+	"                        Uninstall one or more packages. Use a semicolon-separated list (e.g. 'pkg1;pkg2'). Globs and regular expressions match installed package names.\n"\
 	"  -s PACKAGE, --search PACKAGE\n"\
-	"                        Search available repositories for packages matching the given query.\n"\
+	"                        Search available repositories for packages matching the given query. Globs and regular expressions are matched against package names; multi-word queries are matched against package descriptions.\n"\
+	"  --owns PATH           Print the installed packages that own the given file or directory.\n"\
 	"  -c CONCURRENCY, --concurrency CONCURRENCY\n"\
 	"                        Set the number of parallel downloads. Use '0' for automatic detection, or '1' to disable parallelism.\n"\
 	"  -f, --force-refresh   Force a complete rebuild of the local repository index.\n"\
@@ -2,6 +2,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <errno.h>
+
+#if !defined(_WIN32)
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
 #include <curl/curl.h>
 
 #include "ask.h"
@@ -9,9 +16,9 @@
 #include "downloader.h"
 #include "errors.h"
 #include "format.h"
-#include "fs/absrel.h"
 #include "fs/basename.h"
 #include "fs/chdir.h"
+#include "fs/chmod.h"
 #include "fs/exists.h"
 #include "fs/fstream.h"
 #include "fs/getexec.h"
@@ -22,23 +29,34 @@
 #include "fs/splitext.h"
 #include "fs/symlink.h"
 #include "fs/walkdir.h"
+#include "extract.h"
 #include "guess_file_format.h"
 #include "guess_uri.h"
+#include "hex.h"
 #include "logging.h"
+#include "mirrors.h"
 #include "nouzen.h"
 #include "options.h"
+#include "os/cpuinfo.h"
 #include "os/envdir.h"
 #include "os/osdetect.h"
+#include "os/thread.h"
 #include "os/system.h"
 #include "package.h"
+#include "pattern.h"
 #include "pprint.h"
 #include "progress_callback.h"
 #include "query.h"
 #include "repository.h"
+#include "sha256.h"
 #include "strsplit.h"
+#include "stream_unpack.h"
+#include "fs/sync.h"
+#include "fs/uring.h"
 #include "strsub.h"
 #include "term/keyboard.h"
 #include "term/screen.h"
+#include "textindex.h"
 #include "uncompress.h"
 #include "wcurl.h"
 #include "urlencode.h"
@@ -60,10 +78,26 @@ static const char SOURCES_TEMPORARY_DIRECTORY[] =
 	PATHSEP_M
 	"sources.temp";
 
+static const char ARCHIVES_PARTIAL_DIRECTORY[] = 
+	PATHSEP_M
+	"archives.partial";
+
+static const char ARCHIVES_CACHE_DIRECTORY[] = 
+	PATHSEP_M
+	"archives.cache";
+
 static const char PACKAGES_DIRECTORY[] = 
 	PATHSEP_M
 	"packages.installed";
 
+static const char DESCRIPTION_INDEX_FILE[] = 
+	PATHSEP_M
+	"descriptions.idx";
+
+static const char MIRRORS_RANKING_FILE[] = 
+	PATHSEP_M
+	"mirrors.rank";
+
 static const char WCURL_USER_AGENT[] = 
 	PROJECT_NAME
 	PATHSEP_POSIX_M
@@ -237,6 +271,47 @@ char* get_local_temp_dir(void) {
 	
 }
 
+static char* get_local_archives_dir(const char* const name) {
+	/*
+	Unlike the temporary directory, these are not wiped between runs: they hold
+	archives whose download was interrupted, so that it can be resumed later,
+	and archives that were already installed, so that they can be reused.
+	*/
+	
+	char* directory = NULL;
+	char* archives_directory = NULL;
+	
+	directory = repo_get_config_dir();
+	
+	if (directory == NULL) {
+		return directory;
+	}
+	
+	archives_directory = malloc(
+		strlen(directory) +
+		strlen(name) +
+		1
+	);
+	
+	if (archives_directory == NULL) {
+		free(directory);
+		return NULL;
+	}
+	
+	strcpy(archives_directory, directory);
+	strcat(archives_directory, name);
+	
+	free(directory);
+	
+	if (create_directory(archives_directory) != 0) {
+		free(archives_directory);
+		return NULL;
+	}
+	
+	return archives_directory;
+	
+}
+
 int repo_set_config_dir(const char* const directory) {
 	
 	free(local_config_dir);
@@ -369,40 +444,6 @@ char* repo_get_src_dir(void) {
 	
 }
 
-char* pkg_get_installation(const pkg_t* const pkg) {
-	
-	char* pkgs_dir = NULL;
-	char* file = NULL;
-	
-	pkgs_dir = repo_get_pkgs_dir();
-	
-	if (pkgs_dir == NULL) {
-		goto end;
-	}
-	
-	file = malloc(
-		strlen(pkgs_dir) +
-		strlen(PATHSEP_S) +
-		strlen(pkg->name) +
-		1
-	);
-	
-	if (file == NULL) {
-		goto end;
-	}
-	
-	strcpy(file, pkgs_dir);
-	strcat(file, PATHSEP_S);
-	strcat(file, pkg->name);
-	
-	end:;
-	
-	free(pkgs_dir);
-	
-	return file;
-	
-}
-
 char* repo_get_cache_dir(void) {
 	
 	char* config_dir = NULL;
@@ -674,6 +715,8 @@ static const char* pkg_get_field_name(const int type, const int field) {
 					return "Installed-Size";
 				case PKG_SECTION_FIELD_FILENAME:
 					return "Filename";
+				case PKG_SECTION_FIELD_SHA256:
+					return "SHA256";
 			}
 			
 			break;
@@ -728,6 +771,8 @@ static const char* pkg_get_field_name(const int type, const int field) {
 					return "%ISIZE%";
 				case PKG_SECTION_FIELD_FILENAME:
 					return "%FILENAME%";
+				case PKG_SECTION_FIELD_SHA256:
+					return "%SHA256SUM%";
 			}
 			
 			break;
@@ -1256,6 +1301,29 @@ int pkg_parse_section(
 		strcpy(pkg->replaces, value);
 	}
 	
+	/* SHA256 */
+	key = pkg_get_field_name(repo->type, PKG_SECTION_FIELD_SHA256);
+	value = (key == NULL) ? NULL : query_get_string(query, key);
+	
+	/* A digest that cannot be decoded as given would only ever fail to match */
+	if (value != NULL && (strlen(value) != SHA256_DIGEST_SIZE * 2 || strspn(value, "0123456789abcdefABCDEF") != SHA256_DIGEST_SIZE * 2)) {
+		err = APTERR_PACKAGE_SECTION_INVALID;
+		goto end;
+	}
+	
+	if (value != NULL) {
+		pkg->sha256 = malloc(SHA256_DIGEST_SIZE);
+		
+		if (pkg->sha256 == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		for (size = 0; size < SHA256_DIGEST_SIZE; size++) {
+			pkg->sha256[size] = (unsigned char) ((from_hex(value[size * 2]) << 4) | from_hex(value[(size * 2) + 1]));
+		}
+	}
+	
 	/* Size */
 	key = pkg_get_field_name(repo->type, PKG_SECTION_FIELD_SIZE);
 	pkg->size = query_get_uint(query, key);
@@ -1372,7 +1440,7 @@ int repo_load_string(
 			"Package index file is a compressed archive; attempting to decompress"
 		);
 		
-		err = uncompress(string, size, NULL, NULL, NULL);
+		err = uncompress(string, size, NULL, NULL, NULL, NULL, NULL);
 		
 		if (err != 0) {
 			err = APTERR_ARCHIVE_UNCOMPRESS_FAILURE;
@@ -1538,6 +1606,7 @@ int repo_load_string(
 			err = pkg_parse_section(repo, &pkg, &query);
 			
 			if (err != APTERR_SUCCESS) {
+				pkg_free(&pkg);
 				goto end;
 			}
 			
@@ -1906,6 +1975,124 @@ char* spec_get_url(const repo_t* const repo) {
 	
 }
 
+static int repolist_migrate_installed(
+	repolist_t* const list,
+	const char* const directory
+) {
+	/*
+	Move the state of installed packages from the files that used to keep
+	it (one for each package, in the packages directory) into the installed
+	package database. The files are removed once the database has it all.
+	
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	walkdir_t walkdir = {0};
+	const walkdir_item_t* item = NULL;
+	
+	hquery_t query = {0};
+	pkgdb_package_t package = {0};
+	
+	char* filename = NULL;
+	
+	if (walkdir_init(&walkdir, directory) == -1) {
+		err = APTERR_FS_WALKDIR_FAILURE;
+		goto end;
+	}
+	
+	while ((item = walkdir_next(&walkdir)) != NULL) {
+		if (item->type != WALKDIR_ITEM_FILE) {
+			continue;
+		}
+		
+		free(filename);
+		filename = malloc(strlen(directory) + strlen(PATHSEP_S) + strlen(item->name) + 1);
+		
+		if (filename == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		strcpy(filename, directory);
+		strcat(filename, PATHSEP_S);
+		strcat(filename, item->name);
+		
+		query_free(&query);
+		query_init(&query, '\n', ":");
+		
+		if (query_load_file(&query, filename) != 0) {
+			err = APTERR_PACKAGE_SECTION_INVALID;
+			goto end;
+		}
+		
+		package.name = item->name;
+		package.version = query_get_string(&query, "Version");
+		package.entries = query_get_string(&query, "Entries");
+		package.autoinstall = query_get_bool(&query, "Auto-Install");
+		
+		if (package.version == NULL || package.entries == NULL) {
+			err = APTERR_REPO_CONF_MISSING_FIELD;
+			goto end;
+		}
+		
+		loggln(LOG_VERBOSE, "Migrating installed package state from '%s'", filename);
+		
+		err = pkgdb_put(&list->database, &package);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	err = pkgdb_commit(&list->database);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	walkdir_free(&walkdir);
+	
+	if (walkdir_init(&walkdir, directory) == -1) {
+		err = APTERR_FS_WALKDIR_FAILURE;
+		goto end;
+	}
+	
+	while ((item = walkdir_next(&walkdir)) != NULL) {
+		if (item->type != WALKDIR_ITEM_FILE || pkgdb_get(&list->database, item->name, &package) != 0) {
+			continue;
+		}
+		
+		free(filename);
+		filename = malloc(strlen(directory) + strlen(PATHSEP_S) + strlen(item->name) + 1);
+		
+		if (filename == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		strcpy(filename, directory);
+		strcat(filename, PATHSEP_S);
+		strcat(filename, item->name);
+		
+		if (remove_file(filename) != 0) {
+			err = APTERR_FS_RM_FAILURE;
+			goto end;
+		}
+	}
+	
+	end:;
+	
+	query_free(&query);
+	walkdir_free(&walkdir);
+	
+	free(filename);
+	
+	return err;
+	
+}
+
 int repolist_load(repolist_t* const list) {
 	
 	int err = APTERR_SUCCESS;
@@ -1936,6 +2123,14 @@ int repolist_load(repolist_t* const list) {
 	const char* specification = NULL;
 	int type = 0;
 	
+	char* rankings_file = NULL;
+	char* mirror_url = NULL;
+	
+	mirrors_t mirrors = {0};
+	mirror_t* mirror = NULL;
+	size_t mirror_index = 0;
+	int probe = 0;
+	
 	const char* file_extension = NULL;
 	const char* value = NULL;
 	
@@ -1956,6 +2151,10 @@ int repolist_load(repolist_t* const list) {
 	walkdir_t walkdir = {0};
 	const walkdir_item_t* item = NULL;
 	
+	pkgdb_iter_t iter = {0};
+	pkgdb_package_t package = {0};
+	int migrate = 0;
+	
 	operating_system = osdetect_getplatform();
 	
 	if (operating_system == NULL) {
@@ -2004,6 +2203,16 @@ int repolist_load(repolist_t* const list) {
 		goto end;
 	}
 	
+	rankings_file = malloc(strlen(config_dir) + strlen(MIRRORS_RANKING_FILE) + 1);
+	
+	if (rankings_file == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	strcpy(rankings_file, config_dir);
+	strcat(rankings_file, MIRRORS_RANKING_FILE);
+	
 	pkgs_directory = repo_get_pkgs_dir();
 	
 	if (pkgs_directory == NULL) {
@@ -2097,15 +2306,59 @@ int repolist_load(repolist_t* const list) {
 		
 		loggln(LOG_VERBOSE, "Repository format '%s' matched as value '%i'", value, type);
 		
-		/* Repository */
-		repository = query_get_string(&query, "repository");
+		/* Repository (there may be several mirrors of it) */
+		mirrors_free(&mirrors);
+		
+		for (index = 0; index < query.offset; index++) {
+			if (strcmp(query.parameters[index].key, "repository") != 0) {
+				continue;
+			}
+			
+			strsplit_init(&split, &part, query.parameters[index].value, " ");
+			
+			while (strsplit_next(&split, &part) != NULL) {
+				if (part.size == 0) {
+					continue;
+				}
+				
+				free(mirror_url);
+				mirror_url = malloc(part.size + 1);
+				
+				if (mirror_url == NULL) {
+					err = APTERR_MEM_ALLOC_FAILURE;
+					goto end;
+				}
+				
+				memcpy(mirror_url, part.begin, part.size);
+				mirror_url[part.size] = '\0';
+				
+				loggln(LOG_VERBOSE, "Read repository property (repository = %s)", mirror_url);
+				
+				err = mirrors_add(&mirrors, mirror_url);
+				
+				if (err != APTERR_SUCCESS) {
+					goto end;
+				}
+			}
+		}
 		
-		if (repository == NULL) {
+		if (mirrors.offset == 0) {
 			err = APTERR_REPO_CONF_MISSING_FIELD;
 			goto end;
 		}
 		
-		loggln(LOG_VERBOSE, "Read repository property (repository = %s)", repository);
+		err = mirrors_load(&mirrors, rankings_file);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+		
+		mirrors_rank(&mirrors);
+		
+		/* Rankings are refreshed along with the index */
+		probe = (mirrors.offset > 1);
+		
+		repository = mirrors.items[0].url;
 		
 		/* Release */
 		release = query_get_string(&query, "release");
@@ -2288,6 +2541,12 @@ int repolist_load(repolist_t* const list) {
 				goto end;
 			}
 			
+			err = mirrors_copy(&repo.mirrors, &mirrors);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+			
 			if (fetch_cache) {
 				err = repo_load(&repo, url, repository, 0);
 				
@@ -2327,22 +2586,64 @@ int repolist_load(repolist_t* const list) {
 			
 			match = strchr(url, '\0');
 			
-			for (index = 0; index < sizeof(PACKAGES_FILE_EXT) / sizeof(*PACKAGES_FILE_EXT); index++) {
-				file_extension = PACKAGES_FILE_EXT[index];
-				strcpy(match, file_extension);
+			/* Fall back to the other mirrors, from best to worst, if the index cannot be fetched */
+			for (mirror_index = 0; mirror_index < repo.mirrors.offset; mirror_index++) {
+				mirror = &repo.mirrors.items[mirror_index];
+				
+				for (index = 0; index < sizeof(PACKAGES_FILE_EXT) / sizeof(*PACKAGES_FILE_EXT); index++) {
+					file_extension = PACKAGES_FILE_EXT[index];
+					strcpy(match, file_extension);
+					
+					free(mirror_url);
+					mirror_url = malloc(strlen(mirror->url) + strlen(url + strlen(repository)) + 1);
+					
+					if (mirror_url == NULL) {
+						err = APTERR_MEM_ALLOC_FAILURE;
+						goto end;
+					}
+					
+					strcpy(mirror_url, mirror->url);
+					strcat(mirror_url, url + strlen(repository));
+					
+					repo.index = repo_index;
+					err = repo_load(&repo, mirror_url, mirror->url, options->cache);
+					
+					if (err == APTERR_WCURL_REQUEST_FAILURE || err == APTERR_REPO_EMPTY) {
+						continue;
+					}
+					
+					if (err != APTERR_SUCCESS) {
+						goto end;
+					}
+					
+					break;
+				}
+				
+				if (err != APTERR_WCURL_REQUEST_FAILURE || mirror_index + 1 == repo.mirrors.offset) {
+					break;
+				}
+				
+				loggln(LOG_WARN, "Could not fetch the index of '%s' from %s; trying the next mirror", repo.name, mirror->url);
+			}
+			
+			if (err == APTERR_SUCCESS && probe) {
+				match = mirror_url + strlen(mirror->url);
 				
-				repo.index = repo_index;
-				err = repo_load(&repo, url, repository, options->cache);
+				while (*match == '/') {
+					match++;
+				}
 				
-				if (err == APTERR_WCURL_REQUEST_FAILURE || err == APTERR_REPO_EMPTY) {
-					continue;
+				/* A probe failing is not a reason to stop; the mirrors keep their current order */
+				if (mirrors_probe(&mirrors, match) == APTERR_SUCCESS && mirrors_save(&mirrors, rankings_file) == APTERR_SUCCESS) {
+					mirrors_free(&repo.mirrors);
+					err = mirrors_copy(&repo.mirrors, &mirrors);
 				}
 				
 				if (err != APTERR_SUCCESS) {
 					goto end;
 				}
 				
-				break;
+				probe = 0;
 			}
 			
 			if (err == APTERR_REPO_EMPTY) {
@@ -2374,19 +2675,33 @@ int repolist_load(repolist_t* const list) {
 	
 	loggln(LOG_INFO, "Loaded repository configuration from %zu source files", sources);
 	
-	walkdir_free(&walkdir);
+	if (options->force_refresh) {
+		err = repolist_build_description_index(list);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
 	
-	if (walkdir_init(&walkdir, pkgs_directory) == -1) {
-		err = APTERR_FS_WALKDIR_FAILURE;
+	/* Installed packages were kept in a file each, before there was a database for them */
+	migrate = !pkgdb_exists(config_dir);
+	
+	err = pkgdb_open(&list->database, config_dir);
+	
+	if (err != APTERR_SUCCESS) {
 		goto end;
 	}
 	
-	while ((item = walkdir_next(&walkdir)) != NULL) {
-		if (strcmp(item->name, ".") == 0 || strcmp(item->name, "..") == 0) {
-			continue;
-		}
+	if (migrate) {
+		err = repolist_migrate_installed(list, pkgs_directory);
 		
-		pkg = repolist_get_pkg(list, item->name);
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	while (pkgdb_next(&list->database, &iter, &package) == 0) {
+		pkg = repolist_get_pkg(list, package.name);
 		
 		if (pkg == NULL) {
 			continue;
@@ -2406,6 +2721,7 @@ int repolist_load(repolist_t* const list) {
 	end:;
 	
 	query_free(&query);
+	mirrors_free(&mirrors);
 	
 	free(url);
 	free(config_dir);
@@ -2413,6 +2729,8 @@ int repolist_load(repolist_t* const list) {
 	free(sources_directory);
 	free(pkgs_directory);
 	free(user_agent);
+	free(rankings_file);
+	free(mirror_url);
 	
 	walkdir_free(&walkdir);
 	
@@ -2460,7 +2778,13 @@ int repolist_destroy(repolist_t* const list) {
 	remove_directory_contents(pkgs_directory);
 	remove_directory_contents(options->prefix);
 	
-	pkgs_free(&list->installed, 0);
+	err = pkgdb_clear(&list->database);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	pkgs_free(&list->installed, 0);
 	
 	end:;
 	
@@ -2625,1377 +2949,4637 @@ repo_t* repolist_get_pkg_repo(
 	
 }
 
-ssize_t repolist_search_pkg(
-	const repolist_t* const list,
-	const char* const query,
-	const pkgs_paging_t paging,
-	pkgs_t* const results
-) {
-	/*
-	Search all repositories for packages matching the given query.
-	
-	Returns the number of matched results, or -1 on error.
-	*/
+static int pkgs_compare_name(const void* a, const void* b) {
 	
-	int matches = 0;
-	
-	size_t index = 0;
-	size_t subindex = 0;
-	
-	ssize_t offset = 0;
-	
-	const size_t skip = (paging.maximum * paging.position);
-	
-	size_t current = 0;
-	
-	repo_t* repo = NULL;
-	pkg_t* pkg = NULL;
-	
-	for (index = 0; index < list->offset; index++) {
-		repo = &list->items[index];
-		
-		for (subindex = 0; subindex < repo->pkgs.offset; subindex++) {
-			pkg = repo->pkgs.items[subindex];
-			
-			matches = (query == NULL);
-			
-			if (!matches) {
-				matches = strstr(pkg->name, query) != NULL;
-			}
-			
-			if (!matches) {
-				matches = pkg->provides != NULL && strstr(pkg->provides, query) != NULL;
-			}
-			
-			if (!matches) {
-				matches = pkg->replaces != NULL && strstr(pkg->replaces, query) != NULL;
-			}
-			
-			if (!matches) {
-				continue;
-			}
-			
-			current++;
-			
-			if (skip != 0 && current <= skip) {
-				continue;
-			}
-			
-			if (pkgs_append(results, pkg, 0) != APTERR_SUCCESS) {
-				return -1;
-			}
-			
-			offset++;
-			
-			if (((size_t) offset) >= paging.maximum) {
-				return offset;
-			}
-		}
-	}
+	const pkg_t* const first = *(const pkg_t* const*) a;
+	const pkg_t* const second = *(const pkg_t* const*) b;
 	
-	return offset;
+	return strcmp(first->name, second->name);
 	
 }
 
-int repolist_resolve_maintainers(
-	const repolist_t* const list,
-	pkg_t* const pkg
-) {
+static int repo_build_name_index(repo_t* const repo) {
+	/*
+	Build the list of packages of this repository sorted by name.
 	
-	int err = APTERR_SUCCESS;
+	This allows patterns with a literal prefix to only look at the range
+	of packages starting with that prefix.
+	*/
 	
-	maintainers_t maintainers = {0};
+	const size_t size = sizeof(*repo->pkgs.items) * repo->pkgs.offset;
 	
-	(void) list;
+	if (repo->sorted.offset == repo->pkgs.offset) {
+		return APTERR_SUCCESS;
+	}
 	
-	err = maintainers_parse(&maintainers, pkg->maintainer);
+	pkgs_free(&repo->sorted, 0);
 	
-	if (err != APTERR_SUCCESS) {
-		goto end;
+	if (size == 0) {
+		return APTERR_SUCCESS;
 	}
 	
-	pkg->maintainer = malloc(sizeof(maintainers));
+	repo->sorted.items = malloc(size);
 	
-	if (pkg->maintainer == NULL) {
-		err = APTERR_MEM_ALLOC_FAILURE;
-		goto end;
+	if (repo->sorted.items == NULL) {
+		return APTERR_MEM_ALLOC_FAILURE;
 	}
 	
-	memcpy(pkg->maintainer, &maintainers, sizeof(maintainers));
+	memcpy(repo->sorted.items, repo->pkgs.items, size);
 	
-	end:;
+	repo->sorted.size = size;
+	repo->sorted.offset = repo->pkgs.offset;
 	
-	if (err != APTERR_SUCCESS) {
-		maintainers_free(&maintainers);
-	}
+	qsort(repo->sorted.items, repo->sorted.offset, sizeof(*repo->sorted.items), pkgs_compare_name);
 	
-	return err;
+	return APTERR_SUCCESS;
 	
 }
 
-int repolist_resolve_related(
-	const repolist_t* const list,
-	pkg_t* const pkg,
-	const int action
+static size_t pkgs_lower_bound(
+	const pkgs_t* const sorted,
+	const char* const prefix
 ) {
+	/*
+	Get the position of the first package whose name is not less than
+	the prefix.
+	*/
 	
-	int err = APTERR_SUCCESS;
+	size_t low = 0;
+	size_t high = sorted->offset;
+	size_t middle = 0;
 	
-	const int ignore_unsatisfied = (action != REPOLIST_RESOLVE_DEPENDS);
+	while (low < high) {
+		middle = low + ((high - low) / 2);
+		
+		if (strcmp(sorted->items[middle]->name, prefix) < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
 	
-	char* name = NULL;
-	char* value = NULL;
+	return low;
 	
-	strsplit_t split = {0};
-	strsplit_part_t part = {0};
+}
+
+struct PatternJob {
+	repo_t* repo;
+	const pattern_t* pattern;
+	int installed;
+	pkgs_t results;
+	int err;
+};
+
+typedef struct PatternJob pattern_job_t;
+
+static void* repo_match_pkgs(void* const argument) {
+	/*
+	Collect the packages of a single repository whose names match the
+	compiled pattern.
+	*/
 	
-	pkg_t* item = NULL;
+	size_t index = 0;
+	size_t length = 0;
 	
-	pkgs_t pkgs = {0};
+	pkg_t* pkg = NULL;
+	pattern_job_t* const job = argument;
 	
-	pkgs_t* items = NULL;
+	const char* const prefix = job->pattern->prefix;
 	
-	void** destination = NULL;
+	job->err = repo_build_name_index(job->repo);
 	
-	switch (action) {
-		case REPOLIST_RESOLVE_DEPENDS:
-			value = pkg->depends;
-			destination = &pkg->depends;
-			break;
-		case REPOLIST_RESOLVE_BREAKS:
-			value = pkg->breaks;
-			destination = &pkg->breaks;
-			break;
-		case REPOLIST_RESOLVE_REPLACES:
-			value = pkg->replaces;
-			destination = &pkg->replaces;
-			break;
-		case REPOLIST_RESOLVE_SUGGESTS:
-			value = pkg->suggests;
-			destination = &pkg->suggests;
-			break;
-		case REPOLIST_RESOLVE_RECOMMENDS:
-			value = pkg->recommends;
-			destination = &pkg->recommends;
-			break;
+	if (job->err != APTERR_SUCCESS) {
+		return NULL;
 	}
 	
-	strsplit_init(&split, &part, value, ",");
+	if (prefix != NULL) {
+		length = strlen(prefix);
+		index = pkgs_lower_bound(&job->repo->sorted, prefix);
+	}
 	
-	while (1) {
-		if (pkglist_split_next(&split, &part) == NULL) {
-			break;
-		}
-		
-		free(name);
-		
-		name = malloc(part.size + 1);
-		
-		if (name == NULL) {
-			err = APTERR_MEM_ALLOC_FAILURE;
-			goto end;
-		}
+	for (; index < job->repo->sorted.offset; index++) {
+		pkg = job->repo->sorted.items[index];
 		
-		strncpy(name, part.begin, part.size);
-		name[part.size] = '\0';
-		
-		item = repolist_get_pkg(list, name);
-		
-		if (item == pkg) {
-			if (action != REPOLIST_RESOLVE_DEPENDS) {
-				continue;
-			}
-			
-			err = APTERR_PACKAGE_DEPENDENCY_LOOP;
-			goto end;
+		if (length > 0 && strncmp(pkg->name, prefix, length) != 0) {
+			break;
 		}
 		
-		if (item == NULL) {
-			if (ignore_unsatisfied) {
-				continue;
-			}
-			
-			loggln(
-				LOG_ERROR,
-				"Dependency on package '%s' cannot be satisfied; either it does not exist, is obsolete, or is no longer available",
-				name
-			);
-			
-			err = APTERR_PACKAGE_UNSATISFIED_DEPENDENCY;
-			goto end;
+		if (job->installed && !pkg->installed) {
+			continue;
 		}
 		
-		if (pkgs_exists(&pkgs, item)) {
+		if (!pattern_match(job->pattern, pkg->name)) {
 			continue;
 		}
 		
-		err = pkgs_append(&pkgs, item, 0);
+		job->err = pkgs_append(&job->results, pkg, 0);
 		
-		if (err != APTERR_SUCCESS) {
-			goto end;
+		if (job->err != APTERR_SUCCESS) {
+			break;
 		}
 	}
 	
-	free(*destination);
-	*destination = NULL;
+	return NULL;
 	
-	if (pkgs.offset < 1) {
+}
+
+int repolist_match_pkgs(
+	repolist_t* const list,
+	const char* const expression,
+	const int type,
+	const int installed,
+	pkgs_t* const results
+) {
+	/*
+	Get all packages whose names match the given glob or regular expression.
+	
+	The expression is compiled once into a deterministic automaton, and
+	each repository is matched on its own thread. Results are sorted by
+	name within each repository, and repositories keep their configured
+	order.
+	
+	If installed is nonzero, only installed packages are considered.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	size_t subindex = 0;
+	size_t started = 0;
+	
+	pattern_t pattern = {0};
+	
+	pattern_job_t* jobs = NULL;
+	pattern_job_t* job = NULL;
+	thread_t* threads = NULL;
+	
+	err = pattern_compile(&pattern, expression, type);
+	
+	if (err != APTERR_SUCCESS) {
 		goto end;
 	}
 	
-	items = malloc(sizeof(pkgs));
+	loggln(LOG_VERBOSE, "Compiled pattern '%s' into %zu states over %zu byte classes", expression, pattern.states, pattern.classes);
 	
-	if (items == NULL) {
+	jobs = calloc(list->offset, sizeof(*jobs));
+	threads = calloc(list->offset, sizeof(*threads));
+	
+	if (list->offset > 0 && (jobs == NULL || threads == NULL)) {
 		err = APTERR_MEM_ALLOC_FAILURE;
 		goto end;
 	}
 	
-	memcpy(items, &pkgs, sizeof(pkgs));
+	for (index = 0; index < list->offset; index++) {
+		job = &jobs[index];
+		
+		job->repo = &list->items[index];
+		job->pattern = &pattern;
+		job->installed = installed;
+	}
 	
-	*destination = items;
+	/* There is no point in spawning a thread when there is a single repository to look at */
+	if (list->offset == 1) {
+		repo_match_pkgs(&jobs[0]);
+	} else {
+		for (started = 0; started < list->offset; started++) {
+			if (thread_create(&threads[started], repo_match_pkgs, &jobs[started]) != 0) {
+				break;
+			}
+		}
+		
+		/* Whatever could not be handed to a thread is matched on this one */
+		for (index = started; index < list->offset; index++) {
+			repo_match_pkgs(&jobs[index]);
+		}
+		
+		for (index = 0; index < started; index++) {
+			thread_join(&threads[index], NULL);
+		}
+	}
+	
+	for (index = 0; index < list->offset; index++) {
+		job = &jobs[index];
+		
+		if (job->err != APTERR_SUCCESS) {
+			err = job->err;
+			goto end;
+		}
+		
+		for (subindex = 0; subindex < job->results.offset; subindex++) {
+			err = pkgs_append(results, job->results.items[subindex], 0);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+		}
+	}
 	
 	end:;
 	
-	if (err != APTERR_SUCCESS) {
-		pkgs_free(&pkgs, 0);
+	for (index = 0; jobs != NULL && index < list->offset; index++) {
+		pkgs_free(&jobs[index].results, 0);
 	}
 	
-	free(name);
+	free(jobs);
+	free(threads);
+	
+	pattern_free(&pattern);
 	
 	return err;
 	
 }
 
-int repolist_fix_loops(
-	const repolist_t* const list,
-	pkg_t* const pkg
-) {
+static int repolist_build_name_tree(repolist_t* const list) {
+	/*
+	Build the BK-tree used to suggest package names for misspelled ones.
+	*/
 	
 	int err = APTERR_SUCCESS;
 	
-	pkg_t* dependency = NULL;
+	size_t index = 0;
+	size_t subindex = 0;
 	
-	strsplit_t split = {0};
-	strsplit_part_t part = {0};
+	repo_t* repo = NULL;
+	bktree_t* const names = &list->names;
 	
-	strsplit_t subsplit = {0};
-	strsplit_part_t subpart = {0};
+	if (names->ready) {
+		return err;
+	}
 	
-	char* start = NULL;
-	size_t size = 0;
-	
-	char* name = NULL;
-	
-	if (pkg->resolved) {
-		return 0;
-	}
-	
-	if (pkg->depends == NULL) {
-		return 0;
-	}
-
-	strsplit_init(&split, &part, pkg->depends, ",");
-	
-	while (1) {
-		if (pkglist_split_next(&split, &part) == NULL) {
-			break;
-		}
-		
-		free(name);
-		
-		name = malloc(part.size + 1);
-		
-		if (name == NULL) {
-			err = APTERR_MEM_ALLOC_FAILURE;
-			goto end;
-		}
-		
-		strncpy(name, part.begin, part.size);
-		name[part.size] = '\0';
-		
-		dependency = repolist_get_pkg(list, name);
-		
-		if (dependency == NULL) {
-			continue;
-		}
-		
-		if (strcmp(dependency->name, pkg->name) == 0) {
-			start = (char*) part.begin;
-			err = APTERR_PACKAGE_DEPENDENCY_LOOP;
-			
-			if (pkglist_split_next(&split, &part) == NULL) {
-				*start = '\0';
-				
-				if (start == pkg->depends) {
-					free(pkg->depends);
-					pkg->depends = NULL;
-				}
-				
-				goto end;
-			}
-			
-			size = strlen(part.begin) + 1;
-			memmove(start, part.begin, size);
-			
-			goto end;
-		}
-		
-		if (dependency->resolved || dependency->depends == NULL) {
-			continue;
-		}
-		
-		strsplit_init(&subsplit, &subpart, dependency->depends, ",");
-		
-		while (1) {
-			if (pkglist_split_next(&subsplit, &subpart) == NULL) {
-				break;
-			}
-			
-			free(name);
-			
-			name = malloc(subpart.size + 1);
-			
-			if (name == NULL) {
-				err = APTERR_MEM_ALLOC_FAILURE;
-				goto end;
-			}
-			
-			strncpy(name, subpart.begin, subpart.size);
-			name[subpart.size] = '\0';
+	for (index = 0; index < list->offset; index++) {
+		repo = &list->items[index];
 		
-			if (strcmp(name, pkg->name) != 0) {
-				continue;
-			}
-			
-			err = APTERR_PACKAGE_DEPENDENCY_LOOP;
-			
-			start = (char*) subpart.begin;
+		for (subindex = 0; subindex < repo->pkgs.offset; subindex++) {
+			err = bktree_add(names, repo->pkgs.items[subindex]);
 			
-			if (pkglist_split_next(&subsplit, &subpart) == NULL) {
-				*start = '\0';
-				
-				if (start == dependency->depends) {
-					free(dependency->depends);
-					dependency->depends = NULL;
-				}
-				
-				goto end;
+			if (err != APTERR_SUCCESS) {
+				bktree_free(names);
+				return err;
 			}
-			
-			size = strlen(subpart.begin) + 1;
-			memmove(start, subpart.begin, size);
-			
-			goto end;
 		}
 	}
 	
-	end:;
-	
-	free(name);
+	names->ready = 1;
 	
-	if (err == APTERR_PACKAGE_DEPENDENCY_LOOP) {
-		loggln(
-			LOG_VERBOSE,
-			"Package '%s' depends on '%s', but '%s' also depends on '%s' (dependency loop)",
-			pkg->name,
-			dependency->name,
-			dependency->name,
-			pkg->name
-		);
-	}
-				
+	loggln(LOG_VERBOSE, "Indexed %zu distinct package names for suggestions", names->offset);
 	
 	return err;
 	
 }
 
-int repolist_resolve_deps(
+int repolist_suggest_pkg(
 	repolist_t* const list,
-	pkg_t* const pkg
+	const char* const name,
+	char** const suggestions
 ) {
+	/*
+	Suggest existing package names that are close to the given one.
 	
-	int err = APTERR_SUCCESS;
-	pkgs_iter_t iter = {0};
-	
-	pkgs_t* dependencies = NULL;
-	pkg_t* dependency = NULL;
+	On success, suggestions points to a string like "'a', 'b' or 'c'"
+	listing the closest names, or to a null pointer if no package name is
+	within REPOLIST_SUGGEST_MAX_DISTANCE edits of the given one.
+	*/
 	
-	repo_t* repo = NULL;
-	base_uri_t* base_uri = NULL;
+	int err = APTERR_SUCCESS;
 	
-	installation_t* installation = NULL;
-	hquery_t* query = NULL;
+	size_t index = 0;
+	size_t count = 0;
+	size_t size = 0;
 	
-	const char* value = NULL;
-	char* uri = NULL;
+	bktree_matches_t matches = {0};
+	const bktree_match_t* match = NULL;
 	
-	installation = &pkg->installation;
-	query = &installation->metadata;
+	*suggestions = NULL;
 	
-	loggln(
-		LOG_INFO,
-		"Resolving dependencies from package '%s'",
-		pkg->name
-	);
+	err = repolist_build_name_tree(list);
 	
-	if (pkg->resolved) {
+	if (err != APTERR_SUCCESS) {
 		goto end;
 	}
 	
-	err = APTERR_PACKAGE_DEPENDENCY_LOOP;
-	
-	while (err == APTERR_PACKAGE_DEPENDENCY_LOOP) {
-		err = repolist_fix_loops(list, pkg);
-	}
+	err = bktree_query(&list->names, name, REPOLIST_SUGGEST_MAX_DISTANCE, &matches);
 	
 	if (err != APTERR_SUCCESS) {
 		goto end;
 	}
 	
-	repo = repolist_get_pkg_repo(list, pkg);
-	base_uri = repo_get_uri(repo);
-	
-	err = uri_resolve(base_uri, pkg->filename, &uri);
+	count = matches.offset;
 	
-	if (err != BASEURI_ERR_SUCCESS) {
-		err = APTERR_PKG_RESOLVE_URI_FAILURE;
+	if (count == 0) {
 		goto end;
 	}
 	
-	free(pkg->filename);
-	pkg->filename = uri;
+	if (count > REPOLIST_SUGGEST_MAX_RESULTS) {
+		count = REPOLIST_SUGGEST_MAX_RESULTS;
+	}
+	
+	for (index = 0; index < count; index++) {
+		match = &matches.items[index];
+		size += strlen(match->pkg->name) + strlen("'' or ");
+	}
 	
-	installation->filename = pkg_get_installation(pkg);
+	*suggestions = malloc(size + 1);
 	
-	if (installation->filename == NULL) {
+	if (*suggestions == NULL) {
 		err = APTERR_MEM_ALLOC_FAILURE;
 		goto end;
 	}
 	
-	pkg->installed = pkgs_exists(&list->installed, pkg);
+	(*suggestions)[0] = '\0';
 	
-	if (pkg->installed) {
-		query_init(query, '\n', ":");
-		
-		err = query_load_file(query, installation->filename);
-		
-		if (err != 0) {
-			err = APTERR_PACKAGE_SECTION_INVALID;
-			goto end;
-		}
+	for (index = 0; index < count; index++) {
+		match = &matches.items[index];
 		
-		value = query_get_string(query, "Version");
-		
-		if (value == NULL) {
-			err = APTERR_REPO_CONF_MISSING_FIELD;
-			goto end;
+		if (index > 0) {
+			strcat(*suggestions, ((index + 1) == count) ? " or " : ", ");
 		}
 		
-		pkg->upgradable = strcmp(pkg->version, value) != 0;
-		pkg->autoinstall = query_get_bool(query, "Auto-Install");
+		strcat(*suggestions, "'");
+		strcat(*suggestions, match->pkg->name);
+		strcat(*suggestions, "'");
 	}
 	
-	loggln(
-		LOG_VERBOSE,
-		"State info for '%s': (installed = %i, upgradable = %i, autoinstall = %i, metadata = '%s')",
-		pkg->name,
-		pkg->installed,
-		pkg->upgradable,
-		pkg->autoinstall,
-		installation->filename
-	);
+	end:;
 	
-	if (pkg->upgradable) {
-		loggln(
-			LOG_VERBOSE,
-			"Version info for '%s': (old = '%s', new = '%s')",
-			pkg->name,
-			value,
-			pkg->version
-		);
-	}
+	bktree_matches_free(&matches);
 	
-	if (pkg->breaks != NULL) {
-		err = repolist_resolve_related(list, pkg, REPOLIST_RESOLVE_BREAKS);
+	return err;
 	
-		if (err != APTERR_SUCCESS) {
-			goto end;
-		}
-	}
+}
+
+static int pkg_matches_query(
+	const pkg_t* const pkg,
+	const char* const query
+) {
 	
-	if (pkg->suggests != NULL) {
-		err = repolist_resolve_related(list, pkg, REPOLIST_RESOLVE_SUGGESTS);
+	int matches = 0;
 	
-		if (err != APTERR_SUCCESS) {
-			goto end;
-		}
+	matches = (query == NULL);
+	
+	if (!matches) {
+		matches = strstr(pkg->name, query) != NULL;
 	}
 	
-	if (pkg->recommends != NULL) {
-		err = repolist_resolve_related(list, pkg, REPOLIST_RESOLVE_RECOMMENDS);
+	if (!matches) {
+		matches = pkg->provides != NULL && strstr(pkg->provides, query) != NULL;
+	}
 	
-		if (err != APTERR_SUCCESS) {
-			goto end;
-		}
+	if (!matches) {
+		matches = pkg->replaces != NULL && strstr(pkg->replaces, query) != NULL;
 	}
 	
-	if (pkg->replaces != NULL) {
-		err = repolist_resolve_related(list, pkg, REPOLIST_RESOLVE_REPLACES);
+	return matches;
 	
-		if (err != APTERR_SUCCESS) {
-			goto end;
-		}
+}
+
+static int repolist_build_search_index(repolist_t* const list) {
+	/*
+	Build the trigram index used for substring searches.
+	
+	Packages are indexed in the same order they are laid out in the
+	repository list, so that indexed and unindexed searches return
+	results in the same order.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	size_t subindex = 0;
+	
+	repo_t* repo = NULL;
+	trigram_index_t* const search_index = &list->search_index;
+	
+	if (search_index->ready) {
+		return err;
 	}
 	
-	if (pkg->maintainer != NULL) {
-		err = repolist_resolve_maintainers(list, pkg);
+	for (index = 0; index < list->offset; index++) {
+		repo = &list->items[index];
 		
-		if (err != APTERR_SUCCESS) {
-			goto end;
+		for (subindex = 0; subindex < repo->pkgs.offset; subindex++) {
+			err = trigram_index_add(search_index, repo->pkgs.items[subindex]);
+			
+			if (err != APTERR_SUCCESS) {
+				trigram_index_free(search_index);
+				return err;
+			}
 		}
 	}
 	
-	pkg->resolved = 1;
+	search_index->ready = 1;
 	
-	if (pkg->depends == NULL) {
-		goto end;
-	}
+	loggln(LOG_VERBOSE, "Indexed %zu packages into %zu distinct trigrams", search_index->offset, search_index->count);
 	
-	err = repolist_resolve_related(list, pkg, REPOLIST_RESOLVE_DEPENDS);
+	return err;
 	
-	if (err == APTERR_PACKAGE_UNSATISFIED_DEPENDENCY) {
-		loggln(
-			LOG_ERROR,
-			"Package '%s' has unsatisfied dependencies; marking it obsolete",
-			pkg->name
-		);
-		
-		pkg->obsolete = 1;
-		pkg->depends = NULL;
-		
-		goto end;
-	}
+}
+
+int repolist_search_init(
+	repolist_t* const list,
+	pkgs_search_t* const search,
+	const char* const query
+) {
+	/*
+	Start a new search session for the given query.
 	
-	if (err != APTERR_SUCCESS) {
-		goto end;
-	}
+	Queries of at least 3 characters are looked up in the trigram index
+	once, and the resulting candidates are kept for the whole session.
+	Shorter queries scan the repositories directly.
 	
-	dependencies = pkg->depends;
+	Globs and regular expressions are matched against package names
+	once, and the matches are kept for the whole session instead.
+	*/
 	
-	pkgsiter_init(&iter, dependencies);
+	int err = APTERR_SUCCESS;
 	
-	while ((dependency = pkgsiter_next(&iter)) != NULL) {
-		if (dependency->resolved) {
-			continue;
+	memset(search, 0, sizeof(*search));
+	
+	search->query = query;
+	
+	if (query != NULL) {
+		search->type = pattern_guess_type(query);
+	}
+	
+	if (search->type != PATTERN_NONE) {
+		return repolist_match_pkgs(list, query, search->type, 0, &search->matches);
+	}
+	
+	if (query != NULL) {
+		err = repolist_build_search_index(list);
+		
+		if (err != APTERR_SUCCESS) {
+			return err;
 		}
 		
-		err = repolist_resolve_deps(list, dependency);
+		err = trigram_index_query(&list->search_index, query, &search->candidates);
 		
-		if (err != APTERR_SUCCESS) {
-			goto end;
+		if (err != APTERR_SUCCESS && err != 1) {
+			return err;
 		}
 		
-		loggln(
-			LOG_VERBOSE,
-			"Resolved dependency '%s' from package '%s'",
-			dependency->name,
-			pkg->name
-		);
+		search->indexed = (err == APTERR_SUCCESS);
+		
+		err = APTERR_SUCCESS;
 	}
 	
-	loggln(
-		LOG_INFO,
-		"Package '%s' resolved to %zu direct dependencies",
-		pkg->name,
-		dependencies->offset
-	);
-	
-	end:;
-	
 	return err;
 	
 }
 
-int pkgs_collect(
-	pkgs_t* const pkgs,
-	pkg_t* const pkg
+static int pkgs_cursors_append(
+	pkgs_cursors_t* const cursors,
+	const pkgs_cursor_t* const cursor
 ) {
 	
-	int err = APTERR_SUCCESS;
-	
-	size_t index = 0;
-	
-	pkg_t* subpkg = NULL;
-	const pkgs_t* const depends = pkg->depends;
-	
-	if (pkgs_exists(pkgs, pkg)) {
-		goto end;
-	}
-	
-	err = pkgs_append(pkgs, pkg, 0);
-	
-	if (err != APTERR_SUCCESS) {
-		goto end;
-	}
+	size_t size = 0;
+	pkgs_cursor_t* items = NULL;
 	
-	if (depends == NULL) {
-		goto end;
-	}
+	size = sizeof(*cursors->items) * (cursors->offset + 1);
 	
-	for (index = 0; index < depends->offset; index++) {
-		subpkg = depends->items[index];
-		
-		err = pkgs_collect(pkgs, subpkg);
+	if (size > cursors->size) {
+		items = realloc(cursors->items, size);
 		
-		if (err != APTERR_SUCCESS) {
-			goto end;
+		if (items == NULL) {
+			return APTERR_MEM_ALLOC_FAILURE;
 		}
+		
+		cursors->size = size;
+		cursors->items = items;
 	}
 	
-	end:;
+	cursors->items[cursors->offset++] = *cursor;
 	
-	return err;
+	return APTERR_SUCCESS;
 	
 }
 
-int repolist_get_dependants(
-	repolist_t* const list,
-	const pkg_t* const dependency,
-	pkgs_t* const dependants
+static ssize_t repolist_search_next(
+	const repolist_t* const list,
+	const pkgs_search_t* const search,
+	pkgs_cursor_t* const cursor,
+	const size_t maximum,
+	pkgs_t* const results
 ) {
+	/*
+	Collect up to the given number of matches, starting at the cursor.
 	
-	int err = 0;
-	
-	size_t index = 0;
-	
-	repo_t* repo = NULL;
-	pkg_t* pkg = NULL;
-	pkg_t* subpkg = NULL;
-	
-	int matches = 0;
-	
-	strsplit_t split = {0};
-	strsplit_part_t part = {0};
+	On return, the cursor points right past the last package that was
+	looked at. For indexed and pattern searches, the cursor index is a
+	position in the candidate or match list instead of a position in a
+	repository.
 	
-	pkgs_iter_t iter = {0};
-	pkgs_iter_t subiter = {0};
+	If results is a null pointer, matches are counted but not collected.
 	
-	const size_t size = strlen(dependency->name) + 1;
+	Returns the number of matched results, or -1 on error.
+	*/
 	
-	loggln(LOG_VERBOSE, "Fetching dependants on dependency '%s'", dependency->name);
+	ssize_t offset = 0;
 	
-	for (index = 0; index < list->offset; index++) {
-		repo = &list->items[index];
-		
-		pkgsiter_init(&iter, &repo->pkgs);
+	const repo_t* repo = NULL;
+	pkg_t* pkg = NULL;
 	
-		while ((pkg = pkgsiter_next(&iter)) != NULL) {
-			if (pkg->depends == NULL) {
-				continue;
+	while (((size_t) offset) < maximum) {
+		if (search->type != PATTERN_NONE) {
+			if (cursor->index >= search->matches.offset) {
+				break;
 			}
 			
-			if (!pkgs_exists(&list->installed, pkg)) {
-				continue;
+			pkg = search->matches.items[cursor->index++];
+			
+			if (results != NULL && pkgs_append(results, pkg, 0) != APTERR_SUCCESS) {
+				return -1;
 			}
 			
-			matches = 0;
+			offset++;
 			
-			if (pkg->resolved) {
-				pkgsiter_init(&subiter, pkg->depends);
-				
-				while ((subpkg = pkgsiter_next(&subiter)) != NULL) {
-					matches = strcmp(subpkg->name, dependency->name) == 0;
-					
-					if (matches) {
-						break;
-					}
-				}
-			} else {
-				strsplit_init(&split, &part, pkg->depends, ",");
-				
-				while (pkglist_split_next(&split, &part) != NULL) {
-					matches = strncmp(dependency->name, part.begin, size) == 0;
-					
-					if (matches) {
-						break;
-					}
-				}
+			continue;
+		}
+		
+		if (search->indexed) {
+			if (cursor->index >= search->candidates.offset) {
+				break;
 			}
 			
-			if (!matches) {
-				continue;
+			pkg = list->search_index.items[search->candidates.items[cursor->index]];
+		} else {
+			if (cursor->repo >= list->offset) {
+				break;
 			}
 			
-			err = pkgs_append(dependants, pkg, 0);
+			repo = &list->items[cursor->repo];
 			
-			if (err != APTERR_SUCCESS) {
-				goto end;
+			if (cursor->index >= repo->pkgs.offset) {
+				cursor->repo++;
+				cursor->index = 0;
+				
+				continue;
 			}
+			
+			pkg = repo->pkgs.items[cursor->index];
 		}
+		
+		cursor->index++;
+		
+		if (!pkg_matches_query(pkg, search->query)) {
+			continue;
+		}
+		
+		if (results != NULL && pkgs_append(results, pkg, 0) != APTERR_SUCCESS) {
+			return -1;
+		}
+		
+		offset++;
 	}
 	
-	loggln(LOG_VERBOSE, "The package '%s' has %zu installed dependants", dependency->name, dependants->offset);
-	
-	end:;
-	
-	return err;
+	return offset;
 	
 }
 
-int repolist_fetch_packages(
+ssize_t repolist_search_pkg(
 	repolist_t* const list,
-	char* const* const packages,
-	pkgs_t * const direct,
-	pkgs_t * const indirect
+	pkgs_search_t* const search,
+	const pkgs_paging_t paging,
+	pkgs_t* const results
 ) {
+	/*
+	Get a page of results for the given search session.
 	
-	int err = 0;
+	The position where each page starts is remembered the first time the
+	page is reached, so turning pages back and forth only ever looks at the
+	packages of the requested page.
 	
-	size_t package_index = 0;
+	Returns the number of matched results, or -1 on error.
+	*/
 	
-	const char* name = NULL;
+	ssize_t offset = 0;
 	
-	pkg_t* pkg = NULL;
-	pkgs_t pkgs = {0};
+	pkgs_cursor_t cursor = {0};
+	pkgs_cursors_t* const pages = &search->pages;
 	
-	pkgs_t queue = {0};
+	if (pages->offset == 0 && pkgs_cursors_append(pages, &cursor) != APTERR_SUCCESS) {
+		return -1;
+	}
 	
-	while (1) {
-		name = packages[package_index++];
-		
-		if (name == NULL) {
-			break;
-		}
-		
-		pkg = repolist_get_pkg(list, name);
-		
-		if (pkg == NULL) {
-			loggln(
-				LOG_WARN,
-				"Package '%s' does not exist; ignoring",
-				name
-			);
-			
-			continue;
-		}
-		
-		err = pkgs_append(direct, pkg, 0);
-		
-		if (err != APTERR_SUCCESS) {
-			goto end;
-		}
+	/* Walk forward from the last known page boundary */
+	while (pages->offset <= paging.position) {
+		cursor = pages->items[pages->offset - 1];
 		
-		err = repolist_resolve_deps(list, pkg);
+		offset = repolist_search_next(list, search, &cursor, paging.maximum, NULL);
 		
-		if (err != APTERR_SUCCESS) {
-			goto end;
+		if (offset == -1) {
+			return -1;
 		}
 		
-		pkgs_free(&pkgs, 0);
-		
-		err = pkgs_collect(indirect, pkg);
-		
-		if (err != APTERR_SUCCESS) {
-			goto end;
+		if (pkgs_cursors_append(pages, &cursor) != APTERR_SUCCESS) {
+			return -1;
 		}
 	}
 	
-	end:;
+	cursor = pages->items[paging.position];
 	
-	pkgs_free(&queue, 0);
-	pkgs_free(&pkgs, 0);
+	offset = repolist_search_next(list, search, &cursor, paging.maximum, results);
 	
-	return err;
+	if (offset != -1 && (paging.position + 1) == pages->offset) {
+		if (pkgs_cursors_append(pages, &cursor) != APTERR_SUCCESS) {
+			return -1;
+		}
+	}
+	
+	return offset;
 	
 }
 
-int repolist_remove_package(
-	repolist_t* const list,
-	char* const* const packages
-) {
+void repolist_search_free(pkgs_search_t* const search) {
 	
-	int err = 0;
+	trigram_candidates_free(&search->candidates);
+	pkgs_free(&search->matches, 0);
 	
-	int answer = ASK_ANSWER_YES;
+	free(search->pages.items);
+	search->pages.items = NULL;
 	
-	biguint_t freed_disk_space = 0;
+	search->pages.size = 0;
+	search->pages.offset = 0;
 	
-	pkgs_iter_t iter = {0};
-	pkgs_iter_t subiter = {0};
+	free(search->documents);
+	search->documents = NULL;
 	
-	pkgs_t direct = {0};
-	pkgs_t indirect = {0};
-	pkgs_t dependants = {0};
-	pkgs_t dependencies = {0};
-	pkgs_t removables = {0};
+	textindex_scores_free(&search->scores);
+	textindex_hits_free(&search->hits);
 	
-	pkg_t* pkg = NULL;
-	pkg_t* subpkg = NULL;
+	search->query = NULL;
+	search->indexed = 0;
+	search->ranked = 0;
+	search->type = PATTERN_NONE;
 	
-	options_t* options = NULL;
+}
+
+char* repo_get_description_index(void) {
 	
-	char format[BTOS_MAX_SIZE];
+	char* cache_dir = NULL;
+	char* filename = NULL;
 	
-	options = get_options();
+	cache_dir = repo_get_cache_dir();
+	
+	if (cache_dir == NULL) {
+		goto end;
+	}
 	
-	err = repolist_fetch_packages(list, packages, &direct, &indirect);
+	filename = malloc(strlen(cache_dir) + strlen(DESCRIPTION_INDEX_FILE) + 1);
 	
-	if (err != APTERR_SUCCESS) {
+	if (filename == NULL) {
 		goto end;
 	}
 	
-	pkgs_free(&indirect, 0);
+	strcpy(filename, cache_dir);
+	strcat(filename, DESCRIPTION_INDEX_FILE);
 	
-	pkgsiter_init(&iter, &direct);
+	end:;
 	
-	while ((pkg = pkgsiter_next(&iter)) != NULL) {
-		if (!pkg->installed) {
-			loggln(LOG_WARN, "Package '%s' is not installed; ignoring", pkg->name);
-			pkgs_delete(&direct, pkg);
+	free(cache_dir);
+	
+	return filename;
+	
+}
+
+static pkg_t** repolist_get_documents(
+	const repolist_t* const list,
+	size_t* const count,
+	unsigned long long* const signature
+) {
+	/*
+	Lay out all packages from all repositories in a flat list.
+	
+	The position of a package in this list is its document id in the
+	description index. The signature identifies the exact package list
+	the ids refer to, so that a stale index is never used against a
+	different one.
+	*/
+	
+	size_t index = 0;
+	size_t subindex = 0;
+	size_t total = 0;
+	
+	const unsigned char* position = NULL;
+	unsigned long long hash = 14695981039346656037ULL;
+	
+	repo_t* repo = NULL;
+	pkg_t* pkg = NULL;
+	pkg_t** documents = NULL;
+	
+	for (index = 0; index < list->offset; index++) {
+		total += list->items[index].pkgs.offset;
+	}
+	
+	documents = malloc(sizeof(*documents) * ((total == 0) ? 1 : total));
+	
+	if (documents == NULL) {
+		return NULL;
+	}
+	
+	total = 0;
+	
+	for (index = 0; index < list->offset; index++) {
+		repo = &list->items[index];
+		
+		for (subindex = 0; subindex < repo->pkgs.offset; subindex++) {
+			pkg = repo->pkgs.items[subindex];
+			documents[total++] = pkg;
 			
-			continue;
+			for (position = (const unsigned char*) pkg->name; *position != '\0'; position++) {
+				hash = (hash ^ *position) * 1099511628211ULL;
+			}
+			
+			hash = (hash ^ ' ') * 1099511628211ULL;
+			
+			for (position = (const unsigned char*) pkg->version; *position != '\0'; position++) {
+				hash = (hash ^ *position) * 1099511628211ULL;
+			}
+			
+			hash = (hash ^ '\n') * 1099511628211ULL;
 		}
+	}
+	
+	*count = total;
+	*signature = hash;
+	
+	return documents;
+	
+}
+
+int repolist_build_description_index(repolist_t* const list) {
+	/*
+	Build the description index used for ranked searches and save it
+	to the cache directory.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t count = 0;
+	unsigned long long signature = 0;
+	
+	char* filename = NULL;
+	pkg_t** documents = NULL;
+	
+	textindex_close(&list->description_index);
+	
+	filename = repo_get_description_index();
+	
+	if (filename == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	documents = repolist_get_documents(list, &count, &signature);
+	
+	if (documents == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	loggln(LOG_VERBOSE, "Building description index for %zu packages at '%s'", count, filename);
+	
+	err = textindex_build(filename, documents, count, signature);
+	
+	end:;
+	
+	free(filename);
+	free(documents);
+	
+	return err;
+	
+}
+
+static int repolist_boost_name(
+	repolist_t* const list,
+	textindex_scores_t* const scores,
+	const char* const name,
+	const double value
+) {
+	/*
+	Boost the score of every package with exactly the given name.
+	
+	The packages are found through the name index of each repository; the
+	document id of a package is its position within its repository, offset
+	by the packages of the repositories before it.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	size_t subindex = 0;
+	size_t base = 0;
+	
+	repo_t* repo = NULL;
+	pkg_t* pkg = NULL;
+	
+	for (index = 0; index < list->offset; index++) {
+		repo = &list->items[index];
 		
-		err = repolist_get_dependants(list, pkg, &direct);
+		err = repo_build_name_index(repo);
 		
 		if (err != APTERR_SUCCESS) {
-			goto end;
+			return err;
+		}
+		
+		for (subindex = pkgs_lower_bound(&repo->sorted, name); subindex < repo->sorted.offset; subindex++) {
+			pkg = repo->sorted.items[subindex];
+			
+			if (strcmp(pkg->name, name) != 0) {
+				break;
+			}
+			
+			if (pkg->index >= repo->pkgs.offset || repo->pkgs.items[pkg->index] != pkg) {
+				continue;
+			}
+			
+			err = textindex_boost(scores, base + pkg->index, value);
+			
+			if (err != APTERR_SUCCESS) {
+				return err;
+			}
 		}
+		
+		base += repo->pkgs.offset;
 	}
 	
-	pkgsiter_init(&iter, &direct);
+	return err;
+	
+}
 
-	while ((pkg = pkgsiter_next(&iter)) != NULL) {
-		err = repolist_resolve_deps(list, pkg);
+static int repolist_rank_descriptions(
+	repolist_t* const list,
+	pkgs_search_t* const search,
+	const char* const query
+) {
+	/*
+	Score every package matching the given words.
+	
+	Only the packages that matched at all are scored, and that is done once
+	for the whole search session; the best of them are then picked as the
+	pages are needed.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	size_t count = 0;
+	size_t length = 0;
+	
+	unsigned long long signature = 0;
+	
+	const char* position = NULL;
+	
+	char token[TEXTINDEX_MAX_TOKEN_LEN + 1];
+	
+	char* filename = NULL;
+	char* joined = NULL;
+	
+	textindex_t* const description_index = &list->description_index;
+	
+	textindex_scores_t* const scores = &search->scores;
+	
+	search->documents = repolist_get_documents(list, &count, &signature);
+	
+	if (search->documents == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	filename = repo_get_description_index();
+	
+	if (filename == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	if (description_index->file.size == 0) {
+		err = textindex_open(description_index, filename);
 		
-		if (err != APTERR_SUCCESS) {
-			goto end;
+		if (err == APTERR_SUCCESS && (description_index->signature != signature || description_index->documents != count)) {
+			loggln(LOG_VERBOSE, "Description index at '%s' is out of date", filename);
+			textindex_close(description_index);
+			err = APTERR_TEXTINDEX_CORRUPTED;
 		}
 		
-		err = pkgs_collect(&indirect, pkg);
-		
 		if (err != APTERR_SUCCESS) {
-			goto end;
+			err = repolist_build_description_index(list);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+			
+			err = textindex_open(description_index, filename);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
 		}
 	}
 	
-	pkgsiter_init(&iter, &indirect);
+	err = textindex_score(description_index, query, scores);
 	
-	while ((pkg = pkgsiter_next(&iter)) != NULL) {
-		if (pkg->removable != -1) {
-			continue;
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	/* Package names are usually written with hyphens in place of spaces */
+	joined = malloc(strlen(query) + 1);
+	
+	if (joined == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	position = query;
+	
+	while ((position = textindex_next_token(position, token)) != NULL) {
+		if (length != 0) {
+			joined[length++] = '-';
 		}
 		
-		pkgs_free(&dependants, 0);
-		
-		err = repolist_get_dependants(list, pkg, &dependants);
-		
-		if (err != APTERR_SUCCESS) {
-			goto end;
-		}
+		strcpy(joined + length, token);
+		length += strlen(token);
+	}
+	
+	joined[length] = '\0';
+	
+	if (length == 0) {
+		search->ranked = 1;
+		goto end;
+	}
+	
+	err = repolist_boost_name(list, scores, joined, TEXTINDEX_NAME_BOOST * 2);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	/*
+	The words are the parts of the joined name. A name matching more than one
+	of them (or the whole query) is only boosted once.
+	*/
+	for (position = joined; *position != '\0'; position += length + (position[length] == '-')) {
+		length = strcspn(position, "-");
 		
-		pkg->removable = 1;
+		memcpy(token, position, length);
+		token[length] = '\0';
 		
-		if (dependants.offset < 1) {
+		if (strcmp(token, joined) == 0) {
 			continue;
 		}
 		
-		pkg->removable = 1;
-		
-		pkgsiter_init(&subiter, &dependants);
-		
-		while ((subpkg = pkgsiter_next(&subiter)) != NULL) {
-			pkg->removable = !subpkg->installed || pkgs_exists(&indirect, subpkg);
-			
-			loggln(LOG_VERBOSE, "Package '%s' (%savailable) depends on '%s'", subpkg->name, (pkg->removable) ? "not ": "", pkg->name);
-			
-			if (!pkg->removable) {
+		for (index = 0; index < (size_t) (position - joined); index += strcspn(joined + index, "-") + 1) {
+			if (strncmp(joined + index, token, length) == 0 && (joined[index + length] == '-' || joined[index + length] == '\0')) {
 				break;
 			}
 		}
 		
-		if (pkg->removable) {
+		if (index < (size_t) (position - joined)) {
 			continue;
 		}
 		
-		err = repolist_resolve_deps(list, pkg);
+		err = repolist_boost_name(list, scores, token, TEXTINDEX_NAME_BOOST);
 		
 		if (err != APTERR_SUCCESS) {
 			goto end;
 		}
+	}
+	
+	search->ranked = 1;
+	
+	end:;
+	
+	free(filename);
+	free(joined);
+	
+	return err;
+	
+}
+
+ssize_t repolist_search_description(
+	repolist_t* const list,
+	pkgs_search_t* const search,
+	const char* const query,
+	const pkgs_paging_t paging,
+	pkgs_t* const results
+) {
+	/*
+	Search package names and descriptions for the given words.
+	
+	Matches are ranked using BM25, with packages whose name is exactly the
+	query (or one of its words) ranked first. The index is mapped from the
+	cache directory, and rebuilt if it is missing or was built against a
+	different package list.
+	
+	The scores are kept in the search session. Only the best hits up to the
+	end of the requested page are ranked, and more are picked only once a
+	later page is asked for.
+	
+	Returns the number of matched results, or -1 on error.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	size_t end = 0;
+	
+	ssize_t offset = 0;
+	
+	if (!search->ranked) {
+		err = repolist_rank_descriptions(list, search, query);
 		
-		err = pkgs_collect(&dependencies, pkg);
+		if (err != APTERR_SUCCESS) {
+			return -1;
+		}
+	}
+	
+	end = paging.maximum * (paging.position + 1);
+	
+	if (end > search->scores.offset) {
+		end = search->scores.offset;
+	}
+	
+	/* All scored packages were picked already if fewer hits than that were kept */
+	if (end > search->hits.offset && search->hits.offset < search->scores.offset) {
+		err = textindex_top(&search->scores, end, &search->hits);
 		
 		if (err != APTERR_SUCCESS) {
-			goto end;
+			return -1;
 		}
+	}
+	
+	if (end > search->hits.offset) {
+		end = search->hits.offset;
+	}
+	
+	for (index = paging.maximum * paging.position; index < end; index++) {
+		err = pkgs_append(results, search->documents[search->hits.items[index].document], 0);
 		
-		pkgsiter_init(&subiter, &dependencies);
+		if (err != APTERR_SUCCESS) {
+			return -1;
+		}
 		
-		while ((subpkg = pkgsiter_next(&subiter)) != NULL) {
-			if (!pkgs_exists(&indirect, subpkg)) {
-				continue;
-			}
-			
-			subpkg->removable = 0;
+		offset++;
+	}
+	
+	return offset;
+	
+}
+
+int repolist_resolve_maintainers(
+	const repolist_t* const list,
+	pkg_t* const pkg
+) {
+	
+	int err = APTERR_SUCCESS;
+	
+	maintainers_t maintainers = {0};
+	
+	(void) list;
+	
+	err = maintainers_parse(&maintainers, pkg->maintainer);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	pkg->maintainer = malloc(sizeof(maintainers));
+	
+	if (pkg->maintainer == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	memcpy(pkg->maintainer, &maintainers, sizeof(maintainers));
+	
+	end:;
+	
+	if (err != APTERR_SUCCESS) {
+		maintainers_free(&maintainers);
+	}
+	
+	return err;
+	
+}
+
+int repolist_resolve_related(
+	const repolist_t* const list,
+	pkg_t* const pkg,
+	const int action
+) {
+	
+	int err = APTERR_SUCCESS;
+	
+	const int ignore_unsatisfied = (action != REPOLIST_RESOLVE_DEPENDS);
+	
+	char* name = NULL;
+	char* value = NULL;
+	
+	strsplit_t split = {0};
+	strsplit_part_t part = {0};
+	
+	pkg_t* item = NULL;
+	
+	pkgs_t pkgs = {0};
+	
+	pkgs_t* items = NULL;
+	
+	void** destination = NULL;
+	
+	switch (action) {
+		case REPOLIST_RESOLVE_DEPENDS:
+			value = pkg->depends;
+			destination = &pkg->depends;
+			break;
+		case REPOLIST_RESOLVE_BREAKS:
+			value = pkg->breaks;
+			destination = &pkg->breaks;
+			break;
+		case REPOLIST_RESOLVE_REPLACES:
+			value = pkg->replaces;
+			destination = &pkg->replaces;
+			break;
+		case REPOLIST_RESOLVE_SUGGESTS:
+			value = pkg->suggests;
+			destination = &pkg->suggests;
+			break;
+		case REPOLIST_RESOLVE_RECOMMENDS:
+			value = pkg->recommends;
+			destination = &pkg->recommends;
+			break;
+	}
+	
+	strsplit_init(&split, &part, value, ",");
+	
+	while (1) {
+		if (pkglist_split_next(&split, &part) == NULL) {
+			break;
+		}
+		
+		free(name);
+		
+		name = malloc(part.size + 1);
+		
+		if (name == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		strncpy(name, part.begin, part.size);
+		name[part.size] = '\0';
+		
+		item = repolist_get_pkg(list, name);
+		
+		if (item == pkg) {
+			if (action != REPOLIST_RESOLVE_DEPENDS) {
+				continue;
+			}
+			
+			err = APTERR_PACKAGE_DEPENDENCY_LOOP;
+			goto end;
+		}
+		
+		if (item == NULL) {
+			if (ignore_unsatisfied) {
+				continue;
+			}
+			
+			loggln(
+				LOG_ERROR,
+				"Dependency on package '%s' cannot be satisfied; either it does not exist, is obsolete, or is no longer available",
+				name
+			);
+			
+			err = APTERR_PACKAGE_UNSATISFIED_DEPENDENCY;
+			goto end;
+		}
+		
+		if (pkgs_exists(&pkgs, item)) {
+			continue;
+		}
+		
+		err = pkgs_append(&pkgs, item, 0);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	free(*destination);
+	*destination = NULL;
+	
+	if (pkgs.offset < 1) {
+		goto end;
+	}
+	
+	items = malloc(sizeof(pkgs));
+	
+	if (items == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	memcpy(items, &pkgs, sizeof(pkgs));
+	
+	*destination = items;
+	
+	end:;
+	
+	if (err != APTERR_SUCCESS) {
+		pkgs_free(&pkgs, 0);
+	}
+	
+	free(name);
+	
+	return err;
+	
+}
+
+int repolist_fix_loops(
+	const repolist_t* const list,
+	pkg_t* const pkg
+) {
+	
+	int err = APTERR_SUCCESS;
+	
+	pkg_t* dependency = NULL;
+	
+	strsplit_t split = {0};
+	strsplit_part_t part = {0};
+	
+	strsplit_t subsplit = {0};
+	strsplit_part_t subpart = {0};
+	
+	char* start = NULL;
+	size_t size = 0;
+	
+	char* name = NULL;
+	
+	if (pkg->resolved) {
+		return 0;
+	}
+	
+	if (pkg->depends == NULL) {
+		return 0;
+	}
+
+	strsplit_init(&split, &part, pkg->depends, ",");
+	
+	while (1) {
+		if (pkglist_split_next(&split, &part) == NULL) {
+			break;
+		}
+		
+		free(name);
+		
+		name = malloc(part.size + 1);
+		
+		if (name == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		strncpy(name, part.begin, part.size);
+		name[part.size] = '\0';
+		
+		dependency = repolist_get_pkg(list, name);
+		
+		if (dependency == NULL) {
+			continue;
+		}
+		
+		if (strcmp(dependency->name, pkg->name) == 0) {
+			start = (char*) part.begin;
+			err = APTERR_PACKAGE_DEPENDENCY_LOOP;
+			
+			if (pkglist_split_next(&split, &part) == NULL) {
+				*start = '\0';
+				
+				if (start == pkg->depends) {
+					free(pkg->depends);
+					pkg->depends = NULL;
+				}
+				
+				goto end;
+			}
+			
+			size = strlen(part.begin) + 1;
+			memmove(start, part.begin, size);
+			
+			goto end;
+		}
+		
+		if (dependency->resolved || dependency->depends == NULL) {
+			continue;
+		}
+		
+		strsplit_init(&subsplit, &subpart, dependency->depends, ",");
+		
+		while (1) {
+			if (pkglist_split_next(&subsplit, &subpart) == NULL) {
+				break;
+			}
+			
+			free(name);
+			
+			name = malloc(subpart.size + 1);
+			
+			if (name == NULL) {
+				err = APTERR_MEM_ALLOC_FAILURE;
+				goto end;
+			}
+			
+			strncpy(name, subpart.begin, subpart.size);
+			name[subpart.size] = '\0';
+		
+			if (strcmp(name, pkg->name) != 0) {
+				continue;
+			}
+			
+			err = APTERR_PACKAGE_DEPENDENCY_LOOP;
+			
+			start = (char*) subpart.begin;
+			
+			if (pkglist_split_next(&subsplit, &subpart) == NULL) {
+				*start = '\0';
+				
+				if (start == dependency->depends) {
+					free(dependency->depends);
+					dependency->depends = NULL;
+				}
+				
+				goto end;
+			}
+			
+			size = strlen(subpart.begin) + 1;
+			memmove(start, subpart.begin, size);
+			
+			goto end;
+		}
+	}
+	
+	end:;
+	
+	free(name);
+	
+	if (err == APTERR_PACKAGE_DEPENDENCY_LOOP) {
+		loggln(
+			LOG_VERBOSE,
+			"Package '%s' depends on '%s', but '%s' also depends on '%s' (dependency loop)",
+			pkg->name,
+			dependency->name,
+			dependency->name,
+			pkg->name
+		);
+	}
+				
+	
+	return err;
+	
+}
+
+int repolist_resolve_deps(
+	repolist_t* const list,
+	pkg_t* const pkg
+) {
+	
+	int err = APTERR_SUCCESS;
+	pkgs_iter_t iter = {0};
+	
+	pkgs_t* dependencies = NULL;
+	pkg_t* dependency = NULL;
+	
+	repo_t* repo = NULL;
+	base_uri_t* base_uri = NULL;
+	
+	installation_t* installation = NULL;
+	pkgdb_package_t package = {0};
+	
+	char* uri = NULL;
+	
+	installation = &pkg->installation;
+	
+	loggln(
+		LOG_INFO,
+		"Resolving dependencies from package '%s'",
+		pkg->name
+	);
+	
+	if (pkg->resolved) {
+		goto end;
+	}
+	
+	err = APTERR_PACKAGE_DEPENDENCY_LOOP;
+	
+	while (err == APTERR_PACKAGE_DEPENDENCY_LOOP) {
+		err = repolist_fix_loops(list, pkg);
+	}
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	repo = repolist_get_pkg_repo(list, pkg);
+	base_uri = repo_get_uri(repo);
+	
+	err = uri_resolve(base_uri, pkg->filename, &uri);
+	
+	if (err != BASEURI_ERR_SUCCESS) {
+		err = APTERR_PKG_RESOLVE_URI_FAILURE;
+		goto end;
+	}
+	
+	free(pkg->filename);
+	pkg->filename = uri;
+	
+	pkg->installed = pkgs_exists(&list->installed, pkg);
+	
+	if (pkg->installed && pkgdb_get(&list->database, pkg->name, &package) == 0) {
+		free(installation->version);
+		installation->version = malloc(strlen(package.version) + 1);
+		
+		if (installation->version == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		strcpy(installation->version, package.version);
+		
+		pkg->upgradable = strcmp(pkg->version, installation->version) != 0;
+		pkg->autoinstall = package.autoinstall;
+	}
+	
+	loggln(
+		LOG_VERBOSE,
+		"State info for '%s': (installed = %i, upgradable = %i, autoinstall = %i)",
+		pkg->name,
+		pkg->installed,
+		pkg->upgradable,
+		pkg->autoinstall
+	);
+	
+	if (pkg->upgradable) {
+		loggln(
+			LOG_VERBOSE,
+			"Version info for '%s': (old = '%s', new = '%s')",
+			pkg->name,
+			installation->version,
+			pkg->version
+		);
+	}
+	
+	if (pkg->breaks != NULL) {
+		err = repolist_resolve_related(list, pkg, REPOLIST_RESOLVE_BREAKS);
+	
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	if (pkg->suggests != NULL) {
+		err = repolist_resolve_related(list, pkg, REPOLIST_RESOLVE_SUGGESTS);
+	
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	if (pkg->recommends != NULL) {
+		err = repolist_resolve_related(list, pkg, REPOLIST_RESOLVE_RECOMMENDS);
+	
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	if (pkg->replaces != NULL) {
+		err = repolist_resolve_related(list, pkg, REPOLIST_RESOLVE_REPLACES);
+	
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	if (pkg->maintainer != NULL) {
+		err = repolist_resolve_maintainers(list, pkg);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	pkg->resolved = 1;
+	
+	if (pkg->depends == NULL) {
+		goto end;
+	}
+	
+	err = repolist_resolve_related(list, pkg, REPOLIST_RESOLVE_DEPENDS);
+	
+	if (err == APTERR_PACKAGE_UNSATISFIED_DEPENDENCY) {
+		loggln(
+			LOG_ERROR,
+			"Package '%s' has unsatisfied dependencies; marking it obsolete",
+			pkg->name
+		);
+		
+		pkg->obsolete = 1;
+		pkg->depends = NULL;
+		
+		goto end;
+	}
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	dependencies = pkg->depends;
+	
+	pkgsiter_init(&iter, dependencies);
+	
+	while ((dependency = pkgsiter_next(&iter)) != NULL) {
+		if (dependency->resolved) {
+			continue;
+		}
+		
+		err = repolist_resolve_deps(list, dependency);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+		
+		loggln(
+			LOG_VERBOSE,
+			"Resolved dependency '%s' from package '%s'",
+			dependency->name,
+			pkg->name
+		);
+	}
+	
+	loggln(
+		LOG_INFO,
+		"Package '%s' resolved to %zu direct dependencies",
+		pkg->name,
+		dependencies->offset
+	);
+	
+	end:;
+	
+	return err;
+	
+}
+
+int pkgs_collect(
+	pkgs_t* const pkgs,
+	pkg_t* const pkg
+) {
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	
+	pkg_t* subpkg = NULL;
+	const pkgs_t* const depends = pkg->depends;
+	
+	if (pkgs_exists(pkgs, pkg)) {
+		goto end;
+	}
+	
+	err = pkgs_append(pkgs, pkg, 0);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	if (depends == NULL) {
+		goto end;
+	}
+	
+	for (index = 0; index < depends->offset; index++) {
+		subpkg = depends->items[index];
+		
+		err = pkgs_collect(pkgs, subpkg);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	end:;
+	
+	return err;
+	
+}
+
+int repolist_get_dependants(
+	repolist_t* const list,
+	const pkg_t* const dependency,
+	pkgs_t* const dependants
+) {
+	
+	int err = 0;
+	
+	size_t index = 0;
+	
+	repo_t* repo = NULL;
+	pkg_t* pkg = NULL;
+	pkg_t* subpkg = NULL;
+	
+	int matches = 0;
+	
+	strsplit_t split = {0};
+	strsplit_part_t part = {0};
+	
+	pkgs_iter_t iter = {0};
+	pkgs_iter_t subiter = {0};
+	
+	const size_t size = strlen(dependency->name) + 1;
+	
+	loggln(LOG_VERBOSE, "Fetching dependants on dependency '%s'", dependency->name);
+	
+	for (index = 0; index < list->offset; index++) {
+		repo = &list->items[index];
+		
+		pkgsiter_init(&iter, &repo->pkgs);
+	
+		while ((pkg = pkgsiter_next(&iter)) != NULL) {
+			if (pkg->depends == NULL) {
+				continue;
+			}
+			
+			if (!pkgs_exists(&list->installed, pkg)) {
+				continue;
+			}
+			
+			matches = 0;
+			
+			if (pkg->resolved) {
+				pkgsiter_init(&subiter, pkg->depends);
+				
+				while ((subpkg = pkgsiter_next(&subiter)) != NULL) {
+					matches = strcmp(subpkg->name, dependency->name) == 0;
+					
+					if (matches) {
+						break;
+					}
+				}
+			} else {
+				strsplit_init(&split, &part, pkg->depends, ",");
+				
+				while (pkglist_split_next(&split, &part) != NULL) {
+					matches = strncmp(dependency->name, part.begin, size) == 0;
+					
+					if (matches) {
+						break;
+					}
+				}
+			}
+			
+			if (!matches) {
+				continue;
+			}
+			
+			err = pkgs_append(dependants, pkg, 0);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+		}
+	}
+	
+	loggln(LOG_VERBOSE, "The package '%s' has %zu installed dependants", dependency->name, dependants->offset);
+	
+	end:;
+	
+	return err;
+	
+}
+
+int repolist_fetch_packages(
+	repolist_t* const list,
+	char* const* const packages,
+	const int installed,
+	pkgs_t * const direct,
+	pkgs_t * const indirect
+) {
+	/*
+	Look up the requested packages along with all of their dependencies.
+	
+	Names that look like globs or regular expressions are expanded to
+	every package whose name matches them. If installed is nonzero, only
+	installed packages are considered for expansion.
+	*/
+	
+	int err = 0;
+	int type = PATTERN_NONE;
+	
+	size_t package_index = 0;
+	size_t index = 0;
+	
+	const char* name = NULL;
+	char* suggestions = NULL;
+	
+	pkg_t* pkg = NULL;
+	pkgs_t pkgs = {0};
+	
+	pkgs_t queue = {0};
+	
+	while (1) {
+		name = packages[package_index++];
+		
+		if (name == NULL) {
+			break;
+		}
+		
+		pkgs_free(&pkgs, 0);
+		
+		type = pattern_guess_type(name);
+		
+		if (type == PATTERN_NONE) {
+			pkg = repolist_get_pkg(list, name);
+			
+			if (pkg == NULL) {
+				free(suggestions);
+				
+				err = repolist_suggest_pkg(list, name, &suggestions);
+				
+				if (err != APTERR_SUCCESS) {
+					goto end;
+				}
+				
+				if (suggestions == NULL) {
+					loggln(
+						LOG_WARN,
+						"Package '%s' does not exist; ignoring",
+						name
+					);
+				} else {
+					loggln(
+						LOG_WARN,
+						"Package '%s' does not exist (did you mean %s?); ignoring",
+						name,
+						suggestions
+					);
+				}
+				
+				continue;
+			}
+			
+			err = pkgs_append(&pkgs, pkg, 0);
+		} else {
+			err = repolist_match_pkgs(list, name, type, installed, &pkgs);
+			
+			if (err == APTERR_SUCCESS && pkgs.offset == 0) {
+				loggln(
+					LOG_WARN,
+					"No package matches '%s'; ignoring",
+					name
+				);
+				
+				continue;
+			}
+			
+			loggln(LOG_VERBOSE, "Pattern '%s' matches %zu packages", name, pkgs.offset);
+		}
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+		
+		for (index = 0; index < pkgs.offset; index++) {
+			pkg = pkgs.items[index];
+			
+			if (pkgs_exists(direct, pkg)) {
+				continue;
+			}
+			
+			err = pkgs_append(direct, pkg, 0);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+			
+			err = repolist_resolve_deps(list, pkg);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+			
+			err = pkgs_collect(indirect, pkg);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+		}
+	}
+	
+	end:;
+	
+	pkgs_free(&queue, 0);
+	pkgs_free(&pkgs, 0);
+	
+	free(suggestions);
+	
+	return err;
+	
+}
+
+int repolist_remove_package(
+	repolist_t* const list,
+	char* const* const packages
+) {
+	
+	int err = 0;
+	
+	int answer = ASK_ANSWER_YES;
+	
+	biguint_t freed_disk_space = 0;
+	
+	pkgs_iter_t iter = {0};
+	pkgs_iter_t subiter = {0};
+	
+	pkgs_t direct = {0};
+	pkgs_t indirect = {0};
+	pkgs_t dependants = {0};
+	pkgs_t dependencies = {0};
+	pkgs_t removables = {0};
+	
+	pkg_t* pkg = NULL;
+	pkg_t* subpkg = NULL;
+	
+	options_t* options = NULL;
+	
+	char format[BTOS_MAX_SIZE];
+	
+	options = get_options();
+	
+	err = repolist_fetch_packages(list, packages, 1, &direct, &indirect);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	pkgs_free(&indirect, 0);
+	
+	pkgsiter_init(&iter, &direct);
+	
+	while ((pkg = pkgsiter_next(&iter)) != NULL) {
+		if (!pkg->installed) {
+			loggln(LOG_WARN, "Package '%s' is not installed; ignoring", pkg->name);
+			pkgs_delete(&direct, pkg);
+			
+			continue;
+		}
+		
+		err = repolist_get_dependants(list, pkg, &direct);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	pkgsiter_init(&iter, &direct);
+
+	while ((pkg = pkgsiter_next(&iter)) != NULL) {
+		err = repolist_resolve_deps(list, pkg);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+		
+		err = pkgs_collect(&indirect, pkg);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	pkgsiter_init(&iter, &indirect);
+	
+	while ((pkg = pkgsiter_next(&iter)) != NULL) {
+		if (pkg->removable != -1) {
+			continue;
+		}
+		
+		pkgs_free(&dependants, 0);
+		
+		err = repolist_get_dependants(list, pkg, &dependants);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+		
+		pkg->removable = 1;
+		
+		if (dependants.offset < 1) {
+			continue;
+		}
+		
+		pkg->removable = 1;
+		
+		pkgsiter_init(&subiter, &dependants);
+		
+		while ((subpkg = pkgsiter_next(&subiter)) != NULL) {
+			pkg->removable = !subpkg->installed || pkgs_exists(&indirect, subpkg);
+			
+			loggln(LOG_VERBOSE, "Package '%s' (%savailable) depends on '%s'", subpkg->name, (pkg->removable) ? "not ": "", pkg->name);
+			
+			if (!pkg->removable) {
+				break;
+			}
+		}
+		
+		if (pkg->removable) {
+			continue;
+		}
+		
+		err = repolist_resolve_deps(list, pkg);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+		
+		err = pkgs_collect(&dependencies, pkg);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+		
+		pkgsiter_init(&subiter, &dependencies);
+		
+		while ((subpkg = pkgsiter_next(&subiter)) != NULL) {
+			if (!pkgs_exists(&indirect, subpkg)) {
+				continue;
+			}
+			
+			subpkg->removable = 0;
+		}
+	}
+	
+	pkgsiter_init(&iter, &indirect);
+	
+	while ((pkg = pkgsiter_next(&iter)) != NULL) {
+		if (!pkg->removable) {
+			continue;
+		}
+		
+		err = pkgs_append(&removables, pkg, 0);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+		
+		freed_disk_space += pkg->installed_size;
+	}
+	
+	if (removables.offset == 0) {
+		goto end;
+	}
+	
+	loggln(LOG_STANDARD, "The following packages will be REMOVED:");
+	pprint_packages(&removables);
+	
+	loggln(LOG_STANDARD, "%zu upgraded, %zu newly installed, %zu to remove and %zu not upgraded.", 0, 0, removables.offset, list->installed.offset - removables.offset);
+	
+	btos(freed_disk_space, format);
+	loggln(LOG_STANDARD, "After this operation, %s disk space will be freed.", format);
+	
+	if (!options->assume_yes) {
+		answer = ask();
+	}
+	
+	if (answer != ASK_ANSWER_YES) {
+		err = APTERR_CLI_USER_INTERRUPTED;
+		goto end;
+	}
+	
+	pkgsiter_init(&iter, &removables);
+	
+	while ((pkg = pkgsiter_next(&iter)) != NULL) {
+		err = repolist_remove_single_package(list, pkg);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	err = pkgdb_commit(&list->database);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	end:;
+	
+	pkgs_free(&direct, 0);
+	pkgs_free(&indirect, 0);
+	pkgs_free(&dependants, 0);
+	pkgs_free(&dependencies, 0);
+	pkgs_free(&removables, 0);
+	
+	return err;
+	
+}
+
+static unsigned long path_claims_hash(
+	const char* const path,
+	const size_t length
+) {
+	
+	size_t index = 0;
+	unsigned long hash = 2166136261UL;
+	
+	for (index = 0; index < length; index++) {
+		hash ^= (unsigned char) path[index];
+		hash *= 16777619UL;
+	}
+	
+	return hash & 0xFFFFFFFFUL;
+	
+}
+
+static void path_claims_slot(
+	path_claims_t* const claims,
+	const size_t index
+) {
+	
+	size_t bucket = 0;
+	
+	const path_claim_t* const item = &claims->items[index];
+	
+	bucket = (size_t) (path_claims_hash(item->path, item->length) & (claims->buckets - 1));
+	
+	while (claims->slots[bucket] != 0) {
+		bucket = (bucket + 1) & (claims->buckets - 1);
+	}
+	
+	claims->slots[bucket] = index + 1;
+	
+}
+
+static size_t path_claims_find(
+	const path_claims_t* const claims,
+	const char* const path,
+	const size_t length
+) {
+	/*
+	Returns the index of the claim on the given path, or the number of
+	claims if there is none.
+	*/
+	
+	size_t bucket = 0;
+	size_t index = 0;
+	
+	const path_claim_t* item = NULL;
+	
+	if (claims->buckets == 0) {
+		return claims->offset;
+	}
+	
+	bucket = (size_t) (path_claims_hash(path, length) & (claims->buckets - 1));
+	
+	while ((index = claims->slots[bucket]) != 0) {
+		item = &claims->items[index - 1];
+		
+		if (item->length == length && memcmp(item->path, path, length) == 0) {
+			return index - 1;
+		}
+		
+		bucket = (bucket + 1) & (claims->buckets - 1);
+	}
+	
+	return claims->offset;
+	
+}
+
+static int path_claims_add(
+	path_claims_t* const claims,
+	const char* const path,
+	const size_t length,
+	const pkg_t* const pkg
+) {
+	/*
+	Record that the given package is about to write to the given path.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	size_t size = 0;
+	size_t index = 0;
+	size_t buckets = 0;
+	size_t* slots = NULL;
+	
+	path_claim_t* items = NULL;
+	path_claim_t* item = NULL;
+	
+	if (sizeof(*claims->items) * (claims->offset + 1) > claims->size) {
+		size = claims->size + sizeof(*claims->items) * (claims->offset + 1);
+		items = realloc(claims->items, size);
+		
+		if (items == NULL) {
+			return -1;
+		}
+		
+		claims->size = size;
+		claims->items = items;
+	}
+	
+	if (((claims->offset + 1) * 2) > claims->buckets) {
+		buckets = (claims->buckets == 0) ? PATH_CLAIMS_INITIAL_BUCKETS : claims->buckets * 2;
+		slots = calloc(buckets, sizeof(*slots));
+		
+		if (slots == NULL) {
+			return -1;
+		}
+		
+		free(claims->slots);
+		
+		claims->slots = slots;
+		claims->buckets = buckets;
+		
+		for (index = 0; index < claims->offset; index++) {
+			path_claims_slot(claims, index);
+		}
+	}
+	
+	item = &claims->items[claims->offset];
+	
+	item->path = malloc(length + 1);
+	
+	if (item->path == NULL) {
+		return -1;
+	}
+	
+	memcpy(item->path, path, length);
+	item->path[length] = '\0';
+	
+	item->length = length;
+	item->pkg = pkg;
+	
+	path_claims_slot(claims, claims->offset++);
+	
+	return 0;
+	
+}
+
+static void path_claims_release(
+	path_claims_t* const claims,
+	const pkg_t* const pkg
+) {
+	/*
+	Give up every path claimed by the given package. The paths stay in the
+	table, unclaimed, so that nothing has to be rehashed.
+	*/
+	
+	size_t index = 0;
+	
+	for (index = 0; index < claims->offset; index++) {
+		if (claims->items[index].pkg == pkg) {
+			claims->items[index].pkg = NULL;
+		}
+	}
+	
+}
+
+static void path_claims_free(path_claims_t* const claims) {
+	
+	size_t index = 0;
+	
+	for (index = 0; index < claims->offset; index++) {
+		free(claims->items[index].path);
+	}
+	
+	free(claims->items);
+	free(claims->slots);
+	
+	memset(claims, 0, sizeof(*claims));
+	
+}
+
+#define PIPELINE_PKG_DOWNLOADING (0)
+#define PIPELINE_PKG_DOWNLOADED (1)
+#define PIPELINE_PKG_UNPACKING (2)
+#define PIPELINE_PKG_UNPACKED (3)
+
+/* Packages are unpacked by up to this many threads at once */
+#define PIPELINE_MAX_WORKERS (64)
+
+struct InstallPipeline {
+	repolist_t* list;
+	const pkgs_t* pkgs;
+	int* states;
+	size_t* starts;
+	size_t* waits;
+	size_t unpacked;
+	size_t active;
+	int exclusive;
+	int downloaded;
+	int err;
+	mutex_t mutex;
+	condition_t condition;
+};
+
+typedef struct InstallPipeline install_pipeline_t;
+
+static size_t pipeline_position(
+	const install_pipeline_t* const pipeline,
+	const pkg_t* const pkg
+) {
+	/*
+	Returns the position of the package within the transaction, or the number
+	of packages in it if it is not part of it.
+	*/
+	
+	const pkgs_t* const pkgs = pipeline->pkgs;
+	
+	if (pkg->position < pkgs->offset && pkgs->items[pkg->position] == pkg) {
+		return pkg->position;
+	}
+	
+	return pkgs->offset;
+	
+}
+
+static int pipeline_waits(install_pipeline_t* const pipeline) {
+	/*
+	Work out, once for the whole transaction, which other packages of it each
+	package waits for: its dependencies, and the packages it takes files over
+	from. The positions of those for the package at some position are stored
+	in waits, from starts[position] up to starts[position + 1].
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	int pass = 0;
+	
+	size_t index = 0;
+	size_t subindex = 0;
+	size_t position = 0;
+	size_t count = 0;
+	
+	const pkg_t* pkg = NULL;
+	const pkgs_t* related = NULL;
+	
+	const pkgs_t* const pkgs = pipeline->pkgs;
+	
+	for (index = 0; index < pkgs->offset; index++) {
+		pkgs->items[index]->position = index;
+	}
+	
+	pipeline->starts = malloc(sizeof(*pipeline->starts) * (pkgs->offset + 1));
+	
+	if (pipeline->starts == NULL) {
+		return -1;
+	}
+	
+	/* The first pass only counts them */
+	for (pass = 0; pass < 2; pass++) {
+		count = 0;
+		
+		for (index = 0; index < pkgs->offset; index++) {
+			pkg = pkgs->items[index];
+			pipeline->starts[index] = count;
+			
+			for (related = pkg->depends; related != NULL; related = (related == pkg->depends) ? pkg->replaces : NULL) {
+				for (subindex = 0; subindex < related->offset; subindex++) {
+					position = pipeline_position(pipeline, related->items[subindex]);
+					
+					if (position == index || position == pkgs->offset) {
+						continue;
+					}
+					
+					if (pass == 1) {
+						pipeline->waits[count] = position;
+					}
+					
+					count++;
+				}
+			}
+		}
+		
+		pipeline->starts[pkgs->offset] = count;
+		
+		if (pass == 0) {
+			pipeline->waits = malloc(sizeof(*pipeline->waits) * (count + 1));
+			
+			if (pipeline->waits == NULL) {
+				return -1;
+			}
+		}
+	}
+	
+	return 0;
+	
+}
+
+static int pipeline_blocked(
+	const install_pipeline_t* const pipeline,
+	const size_t index
+) {
+	/*
+	Check whether any of the packages the given one waits for was not
+	unpacked yet.
+	*/
+	
+	size_t subindex = 0;
+	
+	for (subindex = pipeline->starts[index]; subindex < pipeline->starts[index + 1]; subindex++) {
+		if (pipeline->states[pipeline->waits[subindex]] != PIPELINE_PKG_UNPACKED) {
+			return 1;
+		}
+	}
+	
+	return 0;
+	
+}
+
+static size_t pipeline_next(const install_pipeline_t* const pipeline) {
+	/*
+	Get the next package that can be unpacked right away.
+	
+	A package can be unpacked once its archive has been downloaded and
+	all of its dependencies within the transaction have been unpacked.
+	Packages that take over files from others (Replaces) wait for those
+	too, so the files end up owned by the same package as when unpacking
+	one package at a time.
+	
+	Upgrades remove the files that the old version had and the new one
+	does not, so they are unpacked while nothing else is.
+	
+	Returns the position of the package, or the number of packages in the
+	transaction if none can be unpacked yet.
+	*/
+	
+	size_t index = 0;
+	
+	const pkg_t* pkg = NULL;
+	
+	if (pipeline->exclusive) {
+		return pipeline->pkgs->offset;
+	}
+	
+	for (index = 0; index < pipeline->pkgs->offset; index++) {
+		if (pipeline->states[index] != PIPELINE_PKG_DOWNLOADED) {
+			continue;
+		}
+		
+		pkg = pipeline->pkgs->items[index];
+		
+		if (pkg->upgradable && pipeline->active > 0) {
+			continue;
+		}
+		
+		if (pipeline_blocked(pipeline, index)) {
+			continue;
+		}
+		
+		break;
+	}
+	
+	return index;
+	
+}
+
+static biguint_t pipeline_level(
+	const pkgs_t* const pkgs,
+	biguint_t* const levels,
+	int* const marks,
+	const size_t index
+) {
+	/*
+	Compute how much data has to arrive, along the longest chain of packages
+	that cannot be unpacked before this one, starting from this one.
+	
+	Dependency cycles are cut at the first package that is visited twice.
+	*/
+	
+	size_t position = 0;
+	size_t subindex = 0;
+	
+	biguint_t level = 0;
+	biguint_t longest = 0;
+	
+	const pkg_t* const pkg = pkgs->items[index];
+	const pkgs_t* depends = NULL;
+	
+	if (marks[index] == 2) {
+		return levels[index];
+	}
+	
+	if (marks[index] == 1) {
+		return 0;
+	}
+	
+	marks[index] = 1;
+	
+	for (position = 0; position < pkgs->offset; position++) {
+		depends = pkgs->items[position]->depends;
+		
+		if (position == index || depends == NULL) {
+			continue;
+		}
+		
+		for (subindex = 0; subindex < depends->offset; subindex++) {
+			if (depends->items[subindex] == pkg) {
+				break;
+			}
+		}
+		
+		if (subindex == depends->offset) {
+			continue;
+		}
+		
+		level = pipeline_level(pkgs, levels, marks, position);
+		
+		if (level > longest) {
+			longest = level;
+		}
+	}
+	
+	marks[index] = 2;
+	levels[index] = pkg->size + longest;
+	
+	return levels[index];
+	
+}
+
+static int pipeline_prioritize(
+	downloader_t* const downloader,
+	const pkgs_t* const pkgs
+) {
+	/*
+	Give priority to the downloads on the critical path of the transaction.
+	
+	A package cannot be unpacked before its dependencies, so the packages that
+	others wait on are fetched first, the largest chains of them before the
+	smaller ones. Without dependencies, this is the same as starting the
+	largest archives first.
+	*/
+	
+	size_t index = 0;
+	
+	biguint_t* levels = NULL;
+	int* marks = NULL;
+	
+	levels = calloc(pkgs->offset + 1, sizeof(*levels));
+	marks = calloc(pkgs->offset + 1, sizeof(*marks));
+	
+	if (levels == NULL || marks == NULL) {
+		free(levels);
+		free(marks);
+		
+		return APTERR_MEM_ALLOC_FAILURE;
+	}
+	
+	for (index = 0; index < pkgs->offset; index++) {
+		downloader_prioritize(downloader, pkgs->items[index], pipeline_level(pkgs, levels, marks, index));
+	}
+	
+	free(levels);
+	free(marks);
+	
+	return APTERR_SUCCESS;
+	
+}
+
+static void* pipeline_unpack(void* const argument) {
+	/*
+	Unpack packages as soon as they become ready, until all of them were
+	unpacked or something failed.
+	
+	Several of these may run at once, each unpacking a different package.
+	
+	Once all downloads are over and nothing is being unpacked, packages
+	still waiting on each other (dependency cycles) are unpacked in
+	transaction order.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	int exclusive = 0;
+	
+	size_t index = 0;
+	
+	pkg_t* pkg = NULL;
+	install_pipeline_t* const pipeline = argument;
+	
+	const size_t total = pipeline->pkgs->offset;
+	
+	mutex_lock(&pipeline->mutex);
+	
+	while (pipeline->err == APTERR_SUCCESS && pipeline->unpacked < total) {
+		index = pipeline_next(pipeline);
+		
+		if (index == total && (!pipeline->downloaded || pipeline->active > 0)) {
+			condition_wait(&pipeline->condition, &pipeline->mutex);
+			continue;
+		}
+		
+		if (index == total) {
+			for (index = 0; index < total; index++) {
+				if (pipeline->states[index] == PIPELINE_PKG_DOWNLOADED) {
+					break;
+				}
+			}
+			
+			if (index == total) {
+				break;
+			}
+			
+			loggln(LOG_VERBOSE, "Unpacking '%s' before its dependencies to break a dependency cycle", pipeline->pkgs->items[index]->name);
+		}
+		
+		pkg = pipeline->pkgs->items[index];
+		pipeline->states[index] = PIPELINE_PKG_UNPACKING;
+		pipeline->active++;
+		
+		exclusive = pkg->upgradable;
+		pipeline->exclusive = exclusive;
+		
+		mutex_unlock(&pipeline->mutex);
+		
+		erase_line();
+		
+		err = repolist_install_single_package(pipeline->list, pkg);
+		
+		mutex_lock(&pipeline->mutex);
+		
+		pipeline->states[index] = PIPELINE_PKG_UNPACKED;
+		pipeline->unpacked++;
+		pipeline->active--;
+		
+		if (exclusive) {
+			pipeline->exclusive = 0;
+		}
+		
+		if (err != APTERR_SUCCESS) {
+			pipeline->err = err;
+		}
+		
+		/* Packages that depend on this one may now be ready */
+		condition_broadcast(&pipeline->condition);
+	}
+	
+	condition_broadcast(&pipeline->condition);
+	
+	mutex_unlock(&pipeline->mutex);
+	
+	return NULL;
+	
+}
+
+static int pipeline_downloaded(pkg_t* const pkg, void* const argument) {
+	/*
+	Mark the package as downloaded, and wake up the unpackers.
+	
+	Returns the error the unpacker ran into, if any, so that the remaining
+	downloads are cancelled.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	install_pipeline_t* const pipeline = argument;
+	
+	mutex_lock(&pipeline->mutex);
+	
+	pipeline->states[pipeline_position(pipeline, pkg)] = PIPELINE_PKG_DOWNLOADED;
+	err = pipeline->err;
+	
+	condition_broadcast(&pipeline->condition);
+	
+	mutex_unlock(&pipeline->mutex);
+	
+	return err;
+	
+}
+
+static int repolist_install_pipelined(
+	repolist_t* const list,
+	const pkgs_t* const pkgs,
+	dlopts_t* const dlopts
+) {
+	/*
+	Download and unpack the given packages.
+	
+	Downloads run on the calling thread while a pool of worker threads
+	unpacks each package as soon as its archive is complete and its
+	dependencies were unpacked, so the network, the disk and every core
+	are kept busy at the same time. Unrelated packages are unpacked in
+	parallel.
+	
+	If no worker thread can be started, all packages are unpacked after
+	the downloads finish instead.
+	
+	With the stream-unpack option, .deb archives are extracted into a
+	staging directory while they are received, and the unpacker only has
+	to move the files into place.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	size_t workers = 0;
+	size_t started = 0;
+	
+	ssize_t nproc = 0;
+	
+	pkg_t* pkg = NULL;
+	repo_t* repo = NULL;
+	
+	options_t* options = NULL;
+	
+	downloader_t downloader = {0};
+	
+	install_pipeline_t pipeline = {0};
+	thread_t* threads = NULL;
+	
+	options = get_options();
+	
+	pipeline.list = list;
+	pipeline.pkgs = pkgs;
+	pipeline.states = calloc(pkgs->offset + 1, sizeof(*pipeline.states));
+	
+	if (pipeline.states == NULL) {
+		return APTERR_MEM_ALLOC_FAILURE;
+	}
+	
+	if (mutex_init(&pipeline.mutex) != 0) {
+		free(pipeline.states);
+		return APTERR_THREAD_INIT_FAILURE;
+	}
+	
+	if (condition_init(&pipeline.condition) != 0) {
+		mutex_free(&pipeline.mutex);
+		free(pipeline.states);
+		return APTERR_THREAD_INIT_FAILURE;
+	}
+	
+	if (pipeline_waits(&pipeline) != 0) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	for (index = 0; index < pkgs->offset; index++) {
+		pkg = pkgs->items[index];
+		
+		/* Packages that are already installed and up to date have nothing left to do */
+		if (!(pkg->upgradable || !pkg->installed)) {
+			pipeline.states[index] = PIPELINE_PKG_UNPACKED;
+			pipeline.unpacked++;
+			
+			continue;
+		}
+		
+		repo = repolist_get_pkg_repo(list, pkg);
+		
+		/* Only .deb archives can be unpacked while they are being received */
+		dlopts->unpack_prefix = (options->stream_unpack && repo->type == REPO_TYPE_APT) ? options->prefix : NULL;
+		
+		err = downloader_add(&downloader, dlopts, pkg, &repo->mirrors);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	err = pipeline_prioritize(&downloader, pkgs);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	/*
+	The workers never change directories, as that would affect all of them;
+	maintainer scripts are run from the prefix, as before.
+	*/
+	if (set_current_directory(options->prefix) != 0) {
+		err = APTERR_FS_CHDIR_FAILURE;
+		goto end;
+	}
+	
+	nproc = get_nproc();
+	workers = (nproc < 1) ? 1 : (size_t) nproc;
+	
+	if (workers > pkgs->offset - pipeline.unpacked) {
+		workers = pkgs->offset - pipeline.unpacked;
+	}
+	
+	if (workers > PIPELINE_MAX_WORKERS) {
+		workers = PIPELINE_MAX_WORKERS;
+	}
+	
+	threads = malloc(sizeof(*threads) * (workers + 1));
+	
+	if (threads == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	/*
+	Nothing else runs yet, so the handles the extractors write to disk with
+	can be made without other threads seeing the umask cleared.
+	*/
+	if (extractor_reserve(pkgs->offset - pipeline.unpacked) != 0) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	list->lock = &pipeline.mutex;
+	
+	dlopts->complete_callback = pipeline_downloaded;
+	dlopts->complete_argument = &pipeline;
+	
+	for (started = 0; started < workers; started++) {
+		if (thread_create(&threads[started], pipeline_unpack, &pipeline) != 0) {
+			break;
+		}
+	}
+	
+	if (started == 0 && workers > 0) {
+		loggln(LOG_VERBOSE, "Could not start the unpacker threads; packages will be unpacked after all downloads finish");
+	}
+	
+	if (started > 0) {
+		loggln(LOG_VERBOSE, "Unpacking packages with %zu threads", started);
+	}
+	
+	err = downloader_wait(&downloader, dlopts);
+	
+	mutex_lock(&pipeline.mutex);
+	
+	pipeline.downloaded = 1;
+	
+	if (pipeline.err == APTERR_SUCCESS) {
+		pipeline.err = err;
+	}
+	
+	condition_broadcast(&pipeline.condition);
+	
+	mutex_unlock(&pipeline.mutex);
+	
+	for (index = 0; index < started; index++) {
+		thread_join(&threads[index], NULL);
+	}
+	
+	if (started == 0) {
+		pipeline_unpack(&pipeline);
+	}
+	
+	err = pipeline.err;
+	
+	/*
+	Nothing is flushed while packages are being unpacked; all of the files
+	go to disk at once here, before the installation is reported as done.
+	*/
+	if (err == APTERR_SUCCESS) {
+		loggln(LOG_VERBOSE, "Flushing unpacked files to disk");
+		
+		if (sync_filesystem(options->prefix) != 0) {
+			err = APTERR_FS_SYNC_FAILURE;
+			goto end;
+		}
+	}
+	
+	end:;
+	
+	dlopts->complete_callback = NULL;
+	dlopts->complete_argument = NULL;
+	dlopts->unpack_prefix = NULL;
+	
+	list->lock = NULL;
+	
+	/* Everything unpacked is in the database by now */
+	path_claims_free(&list->claims);
+	
+	free(threads);
+	
+	downloader_free(&downloader);
+	
+	/* Packages that were staged but never committed are discarded */
+	for (index = 0; index < pkgs->offset; index++) {
+		pkg = pkgs->items[index];
+		
+		if (pkg->unpack == NULL) {
+			continue;
+		}
+		
+		stream_unpack_free(pkg->unpack);
+		
+		free(pkg->unpack);
+		pkg->unpack = NULL;
+	}
+	
+	extractor_unreserve();
+	
+	condition_free(&pipeline.condition);
+	mutex_free(&pipeline.mutex);
+	
+	free(pipeline.states);
+	free(pipeline.starts);
+	free(pipeline.waits);
+	
+	return err;
+	
+}
+
+struct PrefixLink {
+	char* name;
+	char* target;
+};
+
+typedef struct PrefixLink prefix_link_t;
+
+struct PrefixLinks {
+	const char* prefix;
+	int descriptor;
+	size_t size;
+	size_t offset;
+	prefix_link_t* items;
+	size_t buckets;
+	size_t* slots;
+	int err;
+};
+
+typedef struct PrefixLinks prefix_links_t;
+
+static void prefix_links_slot(
+	prefix_links_t* const links,
+	const size_t index
+) {
+	
+	size_t bucket = 0;
+	
+	const char* const name = links->items[index].name;
+	
+	bucket = (size_t) (path_claims_hash(name, strlen(name)) & (links->buckets - 1));
+	
+	while (links->slots[bucket] != 0) {
+		bucket = (bucket + 1) & (links->buckets - 1);
+	}
+	
+	links->slots[bucket] = index + 1;
+	
+}
+
+static int prefix_links_add(
+	prefix_links_t* const links,
+	const char* const name,
+	const size_t length
+) {
+	/*
+	Record that the given name (at the top of the symlink prefix) should be
+	linked from the prefix too. Names that were recorded already are looked
+	up in a hash table, as there may be thousands of them.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	size_t index = 0;
+	size_t size = 0;
+	size_t bucket = 0;
+	size_t buckets = 0;
+	size_t* slots = NULL;
+	
+	prefix_link_t* items = NULL;
+	prefix_link_t* item = NULL;
+	
+	const options_t* const options = get_options();
+	
+	if (links->buckets > 0) {
+		bucket = (size_t) (path_claims_hash(name, length) & (links->buckets - 1));
+		
+		while ((index = links->slots[bucket]) != 0) {
+			item = &links->items[index - 1];
+			
+			if (strlen(item->name) == length && strncmp(item->name, name, length) == 0) {
+				return 0;
+			}
+			
+			bucket = (bucket + 1) & (links->buckets - 1);
+		}
+	}
+	
+	if (((links->offset + 1) * 2) > links->buckets) {
+		buckets = (links->buckets == 0) ? PATH_CLAIMS_INITIAL_BUCKETS : links->buckets * 2;
+		slots = calloc(buckets, sizeof(*slots));
+		
+		if (slots == NULL) {
+			return -1;
+		}
+		
+		free(links->slots);
+		
+		links->slots = slots;
+		links->buckets = buckets;
+		
+		for (index = 0; index < links->offset; index++) {
+			prefix_links_slot(links, index);
+		}
+	}
+	
+	if (sizeof(*links->items) * (links->offset + 1) > links->size) {
+		size = links->size + sizeof(*links->items) * (links->offset + 1);
+		items = realloc(links->items, size);
+		
+		if (items == NULL) {
+			return -1;
+		}
+		
+		links->items = items;
+		links->size = size;
+	}
+	
+	item = &links->items[links->offset];
+	
+	item->name = malloc(length + 1);
+	item->target = malloc(strlen(options->symlink_prefix) + strlen(PATHSEP_S) + length + 1);
+	
+	if (item->name == NULL || item->target == NULL) {
+		free(item->name);
+		free(item->target);
+		return -1;
+	}
+	
+	memcpy(item->name, name, length);
+	item->name[length] = '\0';
+	
+	strcpy(item->target, options->symlink_prefix);
+	strcat(item->target, PATHSEP_S);
+	strcat(item->target, item->name);
+	
+	prefix_links_slot(links, links->offset++);
+	
+	return 0;
+	
+}
+
+static int prefix_links_collect(
+	prefix_links_t* const links,
+	const char* const directory,
+	const char* const entries
+) {
+	/*
+	Record the names at the top of the given directory (relative to the
+	prefix) that show up in a manifest.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	strsplit_t split = {0};
+	strsplit_part_t part = {0};
+	
+	size_t size = 0;
+	size_t length = 0;
+	
+	const char* name = NULL;
+	const char* end = NULL;
+	
+	length = strlen(directory);
+	
+	strsplit_init(&split, &part, entries, ",");
+	
+	while (strsplit_next(&split, &part) != NULL) {
+		end = memchr(part.begin, PKGDB_FIELD_SEPARATOR, part.size);
+		size = (end == NULL) ? part.size : (size_t) (end - part.begin);
+		
+		if (!(size > length + 1 && strncmp(part.begin, directory, length) == 0 && part.begin[length] == '/')) {
+			continue;
+		}
+		
+		name = part.begin + length + 1;
+		size -= length + 1;
+		
+		end = memchr(name, '/', size);
+		
+		if (end != NULL) {
+			size = (size_t) (end - name);
+		}
+		
+		if (size == 0) {
+			continue;
+		}
+		
+		if (prefix_links_add(links, name, size) != 0) {
+			return -1;
+		}
+	}
+	
+	return 0;
+	
+}
+
+static void prefix_links_complete(
+	void* const data,
+	const unsigned long tag,
+	const int result
+) {
+	
+	prefix_links_t* const links = data;
+	const prefix_link_t* const item = &links->items[tag];
+	
+	if (result == 0) {
+		loggln(LOG_VERBOSE, "Symlinking '%s' to '%s'", item->target, item->name);
+		return;
+	}
+	
+	/* Linked by an earlier transaction, or shipped by a package */
+	if (result == -EEXIST) {
+		return;
+	}
+	
+	links->err = -1;
+	
+}
+
+static int prefix_links_create(
+	prefix_links_t* const links,
+	uring_t* const ring,
+	const size_t index
+) {
+	/*
+	Link the name at the given index, or queue it if there is a ring.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	int result = 0;
+	
+	const prefix_link_t* const item = &links->items[index];
+	
+	#if defined(_WIN32)
+		char* path = NULL;
+		
+		(void) ring;
+		
+		path = malloc(strlen(links->prefix) + strlen(PATHSEP_S) + strlen(item->name) + 1);
+		
+		if (path == NULL) {
+			return -1;
+		}
+		
+		strcpy(path, links->prefix);
+		strcat(path, PATHSEP_S);
+		strcat(path, item->name);
+		
+		if (symlink_exists(path) == 1 || file_exists(path) == 1 || directory_exists(path) == 1) {
+			result = -EEXIST;
+		} else if (mklink(item->target, path) != 0) {
+			result = -1;
+		}
+		
+		free(path);
+	#else
+		if (ring != NULL) {
+			if (uring_space(ring) == 0 && uring_submit(ring, prefix_links_complete, links) == -1) {
+				return -1;
+			}
+			
+			uring_symlinkat(ring, item->target, links->descriptor, item->name, 0, (unsigned long) index);
+			
+			return 0;
+		}
+		
+		if (symlinkat(item->target, links->descriptor, item->name) == -1) {
+			result = -errno;
+		}
+	#endif
+	
+	prefix_links_complete(links, (unsigned long) index, result);
+	
+	return 0;
+	
+}
+
+static int repolist_link_prefix(
+	repolist_t* const list,
+	const pkgs_t* const pkgs
+) {
+	/*
+	Make what the given packages put at the top of the symlink prefix
+	available from the prefix too.
+	
+	This runs once per transaction. When the symlink prefix is inside of the
+	prefix, the names to link are taken from the manifests of the packages
+	that were just unpacked; otherwise nothing the packages did can be told
+	apart, and it is listed as a whole. The links are then all created in a
+	single batch, through io_uring where available; names that are already
+	there are left alone.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	int has_ring = 0;
+	
+	size_t index = 0;
+	size_t length = 0;
+	
+	char* directory = NULL;
+	
+	const pkg_t* pkg = NULL;
+	
+	const options_t* const options = get_options();
+	
+	pkgdb_package_t package = {0};
+	
+	walkdir_t walkdir = {0};
+	const walkdir_item_t* item = NULL;
+	
+	uring_t ring = {0};
+	prefix_links_t links = {0};
+	
+	links.prefix = options->prefix;
+	links.descriptor = -1;
+	
+	if (options->symlink_prefix == NULL) {
+		goto end;
+	}
+	
+	length = strlen(options->prefix);
+	
+	if (strncmp(options->symlink_prefix, options->prefix, length) == 0 && ((unsigned char) options->symlink_prefix[length] == PATHSEP || options->symlink_prefix[length] == '/')) {
+		directory = malloc(strlen(options->symlink_prefix + length) + 1);
+		
+		if (directory == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		strcpy(directory, options->symlink_prefix + length + 1);
+		
+		/* Manifests always use forward slashes */
+		for (index = 0; directory[index] != '\0'; index++) {
+			if ((unsigned char) directory[index] == PATHSEP) {
+				directory[index] = '/';
+			}
+		}
+		
+		while (index > 0 && directory[index - 1] == '/') {
+			directory[--index] = '\0';
+		}
+	}
+	
+	if (directory != NULL && *directory != '\0') {
+		for (index = 0; index < pkgs->offset; index++) {
+			pkg = pkgs->items[index];
+			
+			if (pkgdb_get(&list->database, pkg->name, &package) != 0) {
+				continue;
+			}
+			
+			if (prefix_links_collect(&links, directory, package.entries) != 0) {
+				err = APTERR_MEM_ALLOC_FAILURE;
+				goto end;
+			}
+		}
+	} else {
+		if (directory_exists(options->symlink_prefix) != 1) {
+			goto end;
+		}
+		
+		if (walkdir_init(&walkdir, options->symlink_prefix) == -1) {
+			err = APTERR_FS_WALKDIR_FAILURE;
+			goto end;
+		}
+		
+		while ((item = walkdir_next(&walkdir)) != NULL) {
+			if (strcmp(item->name, ".") == 0 || strcmp(item->name, "..") == 0) {
+				continue;
+			}
+			
+			if (prefix_links_add(&links, item->name, strlen(item->name)) != 0) {
+				err = APTERR_MEM_ALLOC_FAILURE;
+				goto end;
+			}
+		}
+	}
+	
+	if (links.offset == 0) {
+		goto end;
+	}
+	
+	#if !defined(_WIN32)
+		links.descriptor = open(options->prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		
+		if (links.descriptor == -1) {
+			err = APTERR_FS_SYMLINK_FAILURE;
+			goto end;
+		}
+	#endif
+	
+	has_ring = (uring_init(&ring) == 0);
+	
+	for (index = 0; index < links.offset; index++) {
+		if (prefix_links_create(&links, has_ring ? &ring : NULL, index) != 0) {
+			err = APTERR_FS_SYMLINK_FAILURE;
+			goto end;
+		}
+	}
+	
+	if (has_ring && uring_submit(&ring, prefix_links_complete, &links) == -1) {
+		err = APTERR_FS_SYMLINK_FAILURE;
+		goto end;
+	}
+	
+	if (links.err != 0) {
+		err = APTERR_FS_SYMLINK_FAILURE;
+		goto end;
+	}
+	
+	end:;
+	
+	#if !defined(_WIN32)
+		if (links.descriptor != -1) {
+			close(links.descriptor);
+		}
+	#endif
+	
+	if (has_ring) {
+		uring_free(&ring);
+	}
+	
+	for (index = 0; index < links.offset; index++) {
+		free(links.items[index].name);
+		free(links.items[index].target);
+	}
+	
+	free(links.items);
+	free(links.slots);
+	free(directory);
+	
+	walkdir_free(&walkdir);
+	
+	return err;
+	
+}
+
+int repolist_install_package(
+	repolist_t* const list,
+	char* const* const packages
+) {
+	
+	int err = 0;
+	int status = 0;
+	
+	int answer = ASK_ANSWER_YES;
+	int upgrade_or_install = 0;
+	
+	options_t* options = NULL;
+	
+	pkg_t* pkg = NULL;
+	pkg_t* subpkg = NULL;
+	
+	pkgs_t direct = {0};
+	pkgs_t indirect = {0};
+	
+	pkgs_t suggests = {0};
+	pkgs_t recommends = {0};
+	pkgs_t additional = {0};
+	pkgs_t installs = {0};
+	pkgs_t upgrades = {0};
+	pkgs_t non_upgradable = {0};
+	pkgs_t unpacks = {0};
+	
+	size_t install = 0;
+	size_t upgrade = 0;
+	
+	biguint_t required_disk_space = 0;
+	biguint_t download_size = 0;
+	
+	pkgs_iter_t iter = {0};
+	pkgs_iter_t subiter = {0};
+	
+	dlopts_t dlopts = {0};
+	
+	char* directory = NULL;
+	char format[BTOS_MAX_SIZE];
+	
+	options = get_options();
+	
+	err = repolist_fetch_packages(list, packages, 0, &direct, &indirect);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	pkgsiter_init(&iter, &indirect);
+	
+	while ((pkg = pkgsiter_next(&iter)) != NULL) {
+		install += !pkg->installed;
+		upgrade += pkg->upgradable;
+		
+		if (pkg->autoinstall == -1) {
+			pkg->autoinstall = !pkgs_exists(&direct, pkg);
+		}
+		
+		if (pkg->installed && !pkg->upgradable && pkgs_exists(&direct, pkg)) {
+			loggln(LOG_STANDARD, "%s is already the newest version (%s).", pkg->name, pkg->version);
+		}
+		
+		if (!pkgs_exists(&direct, pkg) && !pkg->installed) {
+			err = pkgs_append(&additional, pkg, 0);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+		}
+		
+		if (!pkg->installed) {
+			err = pkgs_append(&installs, pkg, 0);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+		}
+		
+		if (pkg->upgradable) {
+			err = pkgs_append(&upgrades, pkg, 0);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+		}
+		
+		if (!(pkg->upgradable || !pkg->installed)) {
+			continue;
+		}
+		
+		err = pkgs_append(&unpacks, pkg, 0);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+		
+		required_disk_space += pkg->installed_size;
+		download_size += pkg->size;
+	}
+	
+	upgrade_or_install = (upgrade || install);
+	
+	pkgsiter_init(&iter, &direct);
+	
+	while ((pkg = pkgsiter_next(&iter)) != NULL) {
+		pkgsiter_init(&subiter, pkg->suggests);
+		
+		while ((subpkg = pkgsiter_next(&subiter)) != NULL) {
+			if (pkgs_exists(&indirect, subpkg)) {
+				continue;
+			}
+			
+			err = pkgs_append(&suggests, subpkg, 0);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+		}
+		
+		pkgsiter_init(&subiter, pkg->recommends);
+		
+		while ((subpkg = pkgsiter_next(&subiter)) != NULL) {
+			if (pkgs_exists(&indirect, subpkg)) {
+				continue;
+			}
+			
+			err = pkgs_append(&recommends, subpkg, 0);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+		}
+	}
+	
+	pkgsiter_init(&iter, &list->installed);
+	
+	while ((pkg = pkgsiter_next(&iter)) != NULL) {
+		if (pkg->upgradable) {
+			continue;
+		}
+		
+		err = pkgs_append(&non_upgradable, pkg, 0);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
+	if (additional.offset != 0) {
+		loggln(LOG_STANDARD, "The following additional packages will be installed:");
+		pprint_packages(&additional);
+	}
+	
+	if (upgrade_or_install && suggests.offset != 0) {
+		loggln(LOG_STANDARD, "Suggested packages:");
+		pprint_packages(&suggests);
+	}
+		
+	if (upgrade_or_install && recommends.offset != 0) {
+		loggln(LOG_STANDARD, "Recommended packages:");
+		pprint_packages(&recommends);
+	}
+	
+	if (installs.offset != 0) {
+		loggln(LOG_STANDARD, "The following NEW packages will be installed:");
+		pprint_packages(&installs);
+	}
+	
+	if (upgrades.offset != 0) {
+		loggln(LOG_STANDARD, "The following packages will be upgraded:");
+		pprint_packages(&upgrades);
+	}
+	
+	loggln(LOG_STANDARD, "%zu upgraded, %zu newly installed, %zu to remove and %zu not upgraded.", upgrades.offset, installs.offset, 0, non_upgradable.offset);
+	
+	if (upgrade_or_install) {
+		btos(download_size, format);
+		loggln(LOG_STANDARD, "Need to get %s of archives.", format);
+		
+		btos(required_disk_space, format);
+		loggln(LOG_STANDARD, "After this operation, %s of additional disk space will be used.", format);
+	}
+	
+	if (!upgrade_or_install) {
+		goto end;
+	}
+	
+	if (!options->assume_yes) {
+		answer = ask();
+	}
+	
+	if (answer != ASK_ANSWER_YES) {
+		err = APTERR_CLI_USER_INTERRUPTED;
+		goto end;
+	}
+	
+	dlopts.concurrency = options->concurrency;
+	dlopts.temporary_directory = get_local_temp_dir();
+	dlopts.partial_directory = get_local_archives_dir(ARCHIVES_PARTIAL_DIRECTORY);
+	dlopts.progress_callback = download_progress_callback;
+	dlopts.segment_threshold = DOWNLOADER_SEGMENT_THRESHOLD;
+	dlopts.retry = 8;
+	
+	if (dlopts.temporary_directory == NULL || dlopts.partial_directory == NULL) {
+		err = APTERR_NO_TMPDIR;
+		goto end;
+	}
+	
+	if (options->archive_cache_size > 0) {
+		directory = get_local_archives_dir(ARCHIVES_CACHE_DIRECTORY);
+		
+		if (directory == NULL || archive_cache_open(&dlopts.archive_cache, directory, options->archive_cache_size * 1024 * 1024) != APTERR_SUCCESS) {
+			loggln(LOG_WARN, "Could not open the archive cache; packages will be downloaded again");
+		}
+		
+		free(directory);
+		directory = NULL;
+	}
+	
+	err = repolist_install_pipelined(list, &indirect, &dlopts);
+	
+	/* Whatever made it into the prefix is linked, even if the rest did not */
+	status = repolist_link_prefix(list, &unpacks);
+	
+	if (err == APTERR_SUCCESS) {
+		err = status;
+	}
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	/* A transaction that did not go through is left in the journal, and picked up on the next run */
+	err = pkgdb_commit(&list->database);
+	
+	if (err != APTERR_SUCCESS) {
+		goto end;
+	}
+	
+	end:;
+	
+	pkgs_free(&direct, 0);
+	pkgs_free(&indirect, 0);
+	pkgs_free(&suggests, 0);
+	pkgs_free(&recommends, 0);
+	pkgs_free(&additional, 0);
+	pkgs_free(&installs, 0);
+	pkgs_free(&upgrades, 0);
+	pkgs_free(&non_upgradable, 0);
+	pkgs_free(&unpacks, 0);
+	
+	dlopts_free(&dlopts);
+	
+	return err;
+	
+}
+
+static void repolist_lock(repolist_t* const list) {
+	/*
+	Packages may be installed from several threads at once; the list of
+	installed packages is shared between them.
+	*/
+	
+	if (list->lock != NULL) {
+		mutex_lock(list->lock);
+	}
+	
+}
+
+static void repolist_unlock(repolist_t* const list) {
+	
+	if (list->lock != NULL) {
+		mutex_unlock(list->lock);
+	}
+	
+}
+
+struct MaintainerScripts {
+	const char* directory;
+	const char* version;
+	const pkg_t* pkg;
+	int enabled;
+	int err;
+	char* postinst;
+	size_t postinst_size;
+};
+
+typedef struct MaintainerScripts maintainer_scripts_t;
+
+static int maintainer_script_execute(
+	const char* const directory,
+	const char* const name,
+	const char* const data,
+	const size_t size,
+	const char* const action,
+	const char* const a,
+	const char* const b
+) {
+	/*
+	Write a maintainer script kept in memory to the temporary directory and
+	run it with the given arguments. Arguments that are NULL are omitted.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	char* filename = NULL;
+	char* command = NULL;
+	
+	fstream_t* stream = NULL;
+	
+	filename = malloc(strlen(directory) + strlen(PATHSEP_S) + strlen(name) + 1);
+	
+	if (filename == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	strcpy(filename, directory);
+	strcat(filename, PATHSEP_S);
+	strcat(filename, name);
+	
+	stream = fstream_open(filename, FSTREAM_WRITE);
+	
+	if (stream == NULL) {
+		err = APTERR_FSTREAM_OPEN_FAILURE;
+		goto end;
+	}
+	
+	if (fstream_write(stream, data, size) == -1) {
+		err = APTERR_FSTREAM_WRITE_FAILURE;
+		goto end;
+	}
+	
+	fstream_close(stream);
+	stream = NULL;
+	
+	if (chmod_setmode(filename, CHMOD_USER_READ | CHMOD_USER_WRITE | CHMOD_USER_EXEC) != 0) {
+		err = APTERR_FS_CHMOD_FAILURE;
+		goto end;
+	}
+	
+	command = malloc(
+		strlen(filename) + 1 +
+		strlen(action) + 1 +
+		((a == NULL) ? 0 : strlen(a)) + 1 +
+		((b == NULL) ? 0 : strlen(b)) + 1
+	);
+	
+	if (command == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	strcpy(command, filename);
+	strcat(command, " ");
+	strcat(command, action);
+	
+	if (a != NULL) {
+		strcat(command, " ");
+		strcat(command, a);
+	}
+	
+	if (b != NULL) {
+		strcat(command, " ");
+		strcat(command, b);
+	}
+	
+	loggln(LOG_VERBOSE, "Execute subprocess: '%s'", command);
+	
+	execute_shell_command(command);
+	
+	end:;
+	
+	fstream_close(stream);
+	
+	free(filename);
+	free(command);
+	
+	return err;
+	
+}
+
+static int maintainer_scripts_callback(
+	const archive_members_t* const members,
+	void* const data
+) {
+	/*
+	Called once the control archive has been read, before any of the package
+	files are extracted. The pre-install script runs right away; the
+	post-install script is kept until the package files are in place.
+	*/
+	
+	maintainer_scripts_t* const scripts = data;
+	const archive_member_t* member = NULL;
+	
+	if (!scripts->enabled) {
+		return 0;
+	}
+	
+	member = archive_members_get(members, "preinst");
+	
+	if (member != NULL) {
+		loggln(LOG_VERBOSE, "Found pre-install script in '%s'", scripts->pkg->filename);
+		
+		if (scripts->version != NULL) {
+			scripts->err = maintainer_script_execute(
+				scripts->directory,
+				member->name,
+				member->data,
+				member->size,
+				KUPGRADE,
+				scripts->version,
+				scripts->pkg->version
+			);
+		} else {
+			scripts->err = maintainer_script_execute(
+				scripts->directory,
+				member->name,
+				member->data,
+				member->size,
+				KINSTALL,
+				NULL,
+				NULL
+			);
+		}
+		
+		if (scripts->err != APTERR_SUCCESS) {
+			return -1;
+		}
+	}
+	
+	member = archive_members_get(members, "postinst");
+	
+	if (member != NULL) {
+		scripts->postinst = malloc(member->size);
+		
+		if (scripts->postinst == NULL && member->size != 0) {
+			scripts->err = APTERR_MEM_ALLOC_FAILURE;
+			return -1;
+		}
+		
+		memcpy(scripts->postinst, member->data, member->size);
+		scripts->postinst_size = member->size;
+	}
+	
+	return 0;
+	
+}
+
+struct RemovalEntry {
+	const char* path;
+	int directory;
+	int shared;
+};
+
+typedef struct RemovalEntry removal_entry_t;
+
+struct Removal {
+	const char* prefix;
+	int descriptor;
+	size_t offset;
+	removal_entry_t* items;
+};
+
+typedef struct Removal removal_t;
+
+/* Longest text that follows the path of a regular file: its size, mode and digest, each preceded by a separator */
+#define MANIFEST_FIELDS_SIZE (1 + 20 + 1 + 11 + 1 + SHA256_DIGEST_SIZE * 2)
+
+struct ManifestItem {
+	char* path;
+	extract_digest_t digest;
+};
+
+typedef struct ManifestItem manifest_item_t;
+
+static int manifest_compare(const void* a, const void* b) {
+	
+	return strcmp(((const manifest_item_t*) a)->path, ((const manifest_item_t*) b)->path);
+	
+}
+
+static int removal_compare(const void* a, const void* b) {
+	
+	return strcmp(((const removal_entry_t*) a)->path, ((const removal_entry_t*) b)->path);
+	
+}
+
+static char* manifest_create(const archive_entries_t* const entries) {
+	/*
+	Join the paths of the given archive entries into the comma-separated
+	manifest that goes into the Entries field of an installed package.
+	
+	Paths are relative to the prefix and sorted, with directories marked by
+	a trailing slash. Every directory then comes before anything inside of
+	it, so the package can be removed in a single pass over the manifest.
+	
+	Regular files are followed by their size, mode (in octal) and SHA-256
+	digest, which is what upgrades compare the next version against.
+	
+	Returns NULL on error.
+	*/
+	
+	size_t index = 0;
+	size_t subindex = 0;
+	size_t count = 0;
+	size_t size = 1;
+	size_t length = 0;
+	
+	manifest_item_t* items = NULL;
+	manifest_item_t* item = NULL;
+	
+	const char* entry = NULL;
+	const char* previous = NULL;
+	
+	char* manifest = NULL;
+	char* position = NULL;
+	
+	items = malloc(sizeof(*items) * (entries->offset + 1));
+	
+	if (items == NULL) {
+		return NULL;
+	}
+	
+	for (index = 0; index < entries->offset; index++) {
+		entry = entries->items[index];
+		
+		if (strncmp("./", entry, 2) == 0) {
+			entry += 2;
+		}
+		
+		if (*entry == '\0') {
+			continue;
+		}
+		
+		item = &items[count++];
+		
+		item->path = (char*) entry;
+		item->digest.valid = 0;
+		
+		if (entries->digests != NULL) {
+			item->digest = entries->digests[index];
 		}
+		
+		size += strlen(entry) + 1 + (item->digest.valid ? MANIFEST_FIELDS_SIZE : 0);
 	}
 	
-	pkgsiter_init(&iter, &indirect);
+	qsort(items, count, sizeof(*items), manifest_compare);
 	
-	while ((pkg = pkgsiter_next(&iter)) != NULL) {
-		if (!pkg->removable) {
+	manifest = malloc(size);
+	
+	if (manifest == NULL) {
+		free(items);
+		return NULL;
+	}
+	
+	position = manifest;
+	
+	for (index = 0; index < count; index++) {
+		item = &items[index];
+		entry = item->path;
+		
+		/* Archives may list the same path more than once */
+		if (previous != NULL && strcmp(previous, entry) == 0) {
 			continue;
 		}
 		
-		err = pkgs_append(&removables, pkg, 0);
+		if (position != manifest) {
+			*position++ = ',';
+		}
 		
-		if (err != APTERR_SUCCESS) {
-			goto end;
+		length = strlen(entry);
+		memcpy(position, entry, length);
+		position += length;
+		
+		if (item->digest.valid) {
+			position += sprintf(
+				position,
+				"%c%"FORMAT_BIGGEST_UINT_T"%c%o%c",
+				PKGDB_FIELD_SEPARATOR,
+				(biguint_t) item->digest.size,
+				PKGDB_FIELD_SEPARATOR,
+				(unsigned int) item->digest.mode,
+				PKGDB_FIELD_SEPARATOR
+			);
+			
+			for (subindex = 0; subindex < sizeof(item->digest.hash); subindex++) {
+				*position++ = (char) to_hex(item->digest.hash[subindex] >> 4);
+				*position++ = (char) to_hex(item->digest.hash[subindex] & 15);
+			}
 		}
 		
-		freed_disk_space += pkg->installed_size;
+		previous = entry;
 	}
 	
-	if (removables.offset == 0) {
-		goto end;
+	*position = '\0';
+	
+	free(items);
+	
+	return manifest;
+	
+}
+
+static void manifest_parse_fields(
+	const char* fields,
+	const size_t size,
+	extract_digest_t* const digest
+) {
+	/*
+	Read the size, mode and digest that follow the path of a regular file in
+	a manifest. Manifests written before these were recorded have none.
+	*/
+	
+	size_t index = 0;
+	
+	char* end = NULL;
+	
+	const char* const limit = fields + size;
+	
+	digest->valid = 0;
+	
+	if (size == 0 || *fields != PKGDB_FIELD_SEPARATOR) {
+		return;
 	}
 	
-	loggln(LOG_STANDARD, "The following packages will be REMOVED:");
-	pprint_packages(&removables);
+	digest->size = (size_t) strtobui(fields + 1, &end, 10);
 	
-	loggln(LOG_STANDARD, "%zu upgraded, %zu newly installed, %zu to remove and %zu not upgraded.", 0, 0, removables.offset, list->installed.offset - removables.offset);
+	if (end >= limit || *end != PKGDB_FIELD_SEPARATOR) {
+		return;
+	}
 	
-	btos(freed_disk_space, format);
-	loggln(LOG_STANDARD, "After this operation, %s disk space will be freed.", format);
+	digest->mode = (int) strtoul(end + 1, &end, 8);
 	
-	if (!options->assume_yes) {
-		answer = ask();
+	if (end >= limit || *end != PKGDB_FIELD_SEPARATOR) {
+		return;
 	}
 	
-	if (answer != ASK_ANSWER_YES) {
-		err = APTERR_CLI_USER_INTERRUPTED;
-		goto end;
+	fields = end + 1;
+	
+	if ((size_t) (limit - fields) != sizeof(digest->hash) * 2) {
+		return;
 	}
 	
-	pkgsiter_init(&iter, &removables);
+	for (index = 0; index < sizeof(digest->hash); index++) {
+		digest->hash[index] = (unsigned char) ((from_hex((unsigned char) fields[index * 2]) << 4) | from_hex((unsigned char) fields[index * 2 + 1]));
+	}
 	
-	while ((pkg = pkgsiter_next(&iter)) != NULL) {
-		err = repolist_remove_single_package(list, pkg);
+	digest->valid = 1;
+	
+}
+
+static int manifest_load(
+	const char* const manifest,
+	archive_entries_t* const entries
+) {
+	/*
+	Split a manifest back into a list of entries, sorted by path, along with
+	whatever was recorded about each of them.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	int err = 0;
+	
+	size_t index = 0;
+	size_t count = 1;
+	size_t length = 0;
+	
+	const char* position = NULL;
+	const char* separator = NULL;
+	
+	manifest_item_t* items = NULL;
+	manifest_item_t* item = NULL;
+	
+	strsplit_t split = {0};
+	strsplit_part_t part = {0};
+	
+	for (position = manifest; *position != '\0'; position++) {
+		count += (*position == ',');
+	}
+	
+	items = malloc(sizeof(*items) * count);
+	
+	if (items == NULL) {
+		return -1;
+	}
+	
+	count = 0;
+	
+	strsplit_init(&split, &part, manifest, ",");
+	
+	while (strsplit_next(&split, &part) != NULL) {
+		if (part.size == 0) {
+			continue;
+		}
 		
-		if (err != APTERR_SUCCESS) {
+		separator = memchr(part.begin, PKGDB_FIELD_SEPARATOR, part.size);
+		length = (separator == NULL) ? part.size : (size_t) (separator - part.begin);
+		
+		item = &items[count];
+		item->path = malloc(length + 1);
+		
+		if (item->path == NULL) {
+			err = -1;
 			goto end;
 		}
+		
+		memcpy(item->path, part.begin, length);
+		item->path[length] = '\0';
+		
+		manifest_parse_fields(part.begin + length, part.size - length, &item->digest);
+		
+		count++;
+	}
+	
+	/* Manifests written before they were kept sorted */
+	qsort(items, count, sizeof(*items), manifest_compare);
+	
+	entries->items = malloc(sizeof(*entries->items) * (count + 1));
+	entries->digests = malloc(sizeof(*entries->digests) * (count + 1));
+	
+	if (entries->items == NULL || entries->digests == NULL) {
+		err = -1;
+		goto end;
+	}
+	
+	entries->size = sizeof(*entries->items) * (count + 1);
+	
+	for (index = 0; index < count; index++) {
+		entries->items[index] = items[index].path;
+		entries->digests[index] = items[index].digest;
+		
+		items[index].path = NULL;
 	}
 	
+	entries->offset = count;
+	
 	end:;
 	
-	pkgs_free(&direct, 0);
-	pkgs_free(&indirect, 0);
-	pkgs_free(&dependants, 0);
-	pkgs_free(&dependencies, 0);
-	pkgs_free(&removables, 0);
+	for (index = 0; index < count; index++) {
+		free(items[index].path);
+	}
+	
+	free(items);
+	
+	if (err != 0) {
+		archive_entries_free(entries);
+	}
 	
 	return err;
 	
 }
 
-int repolist_install_package(
-	repolist_t* const list,
-	char* const* const packages
+static char* manifest_difference(
+	const archive_entries_t* const entries,
+	const archive_entries_t* const other
 ) {
+	/*
+	Join the paths of the given entries that are not in the other list into
+	a manifest. Both lists must be sorted, as manifest_load() leaves them.
 	
-	int err = 0;
+	Returns NULL on error.
+	*/
 	
-	int answer = ASK_ANSWER_YES;
-	int upgrade_or_install = 0;
+	int order = 0;
 	
-	options_t* options = NULL;
+	size_t index = 0;
+	size_t subindex = 0;
+	size_t size = 1;
+	size_t length = 0;
 	
-	pkg_t* pkg = NULL;
-	pkg_t* subpkg = NULL;
+	const char* path = NULL;
 	
-	pkgs_t direct = {0};
-	pkgs_t indirect = {0};
+	char* manifest = NULL;
+	char* position = NULL;
 	
-	pkgs_t suggests = {0};
-	pkgs_t recommends = {0};
-	pkgs_t additional = {0};
-	pkgs_t installs = {0};
-	pkgs_t upgrades = {0};
-	pkgs_t non_upgradable = {0};
+	for (index = 0; index < entries->offset; index++) {
+		size += strlen(entries->items[index]) + 1;
+	}
 	
-	size_t install = 0;
-	size_t upgrade = 0;
+	manifest = malloc(size);
 	
-	biguint_t required_disk_space = 0;
-	biguint_t download_size = 0;
+	if (manifest == NULL) {
+		return NULL;
+	}
 	
-	pkgs_iter_t iter = {0};
-	pkgs_iter_t subiter = {0};
+	position = manifest;
 	
-	downloader_t downloader = {0};
-	dlopts_t dlopts = {0};
+	for (index = 0; index < entries->offset; index++) {
+		path = entries->items[index];
+		order = 1;
+		
+		while (subindex < other->offset && (order = strcmp(other->items[subindex], path)) < 0) {
+			subindex++;
+		}
+		
+		if (subindex < other->offset && order == 0) {
+			continue;
+		}
+		
+		if (position != manifest) {
+			*position++ = ',';
+		}
+		
+		length = strlen(path);
+		memcpy(position, path, length);
+		position += length;
+	}
 	
-	char format[BTOS_MAX_SIZE];
+	*position = '\0';
 	
-	options = get_options();
+	return manifest;
+	
+}
+
+static void removal_complete(
+	void* const data,
+	const unsigned long tag,
+	const int result
+) {
 	
-	err = repolist_fetch_packages(list, packages, &direct, &indirect);
+	removal_t* const removal = data;
+	removal_entry_t* const item = &removal->items[tag];
 	
-	if (err != APTERR_SUCCESS) {
-		goto end;
+	if (result == 0) {
+		loggln(LOG_VERBOSE, "Removed '%s%s%s'", removal->prefix, PATHSEP_S, item->path);
+		return;
 	}
 	
-	pkgsiter_init(&iter, &indirect);
+	/* Manifests written before directories were marked; it goes with the other directories */
+	if (result == -EISDIR) {
+		item->directory = 1;
+	}
 	
-	while ((pkg = pkgsiter_next(&iter)) != NULL) {
-		install += !pkg->installed;
-		upgrade += pkg->upgradable;
+}
+
+static int removal_unlink(
+	removal_t* const removal,
+	uring_t* const ring,
+	const size_t index,
+	const int directory,
+	const int chain
+) {
+	/*
+	Remove the file (or empty directory) at the given index of the
+	manifest, or queue its removal if there is a ring.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	int result = 0;
+	
+	const char* const path = removal->items[index].path;
+	
+	#if defined(_WIN32)
+		char* name = NULL;
 		
-		if (pkg->autoinstall == -1) {
-			pkg->autoinstall = !pkgs_exists(&direct, pkg);
+		(void) ring;
+		(void) chain;
+		
+		name = malloc(strlen(removal->prefix) + strlen(PATHSEP_S) + strlen(path) + 1);
+		
+		if (name == NULL) {
+			return -1;
 		}
 		
-		if (pkg->installed && !pkg->upgradable && pkgs_exists(&direct, pkg)) {
-			loggln(LOG_STANDARD, "%s is already the newest version (%s).", pkg->name, pkg->version);
+		strcpy(name, removal->prefix);
+		strcat(name, PATHSEP_S);
+		strcat(name, path);
+		
+		if ((directory ? remove_empty_directory(name) : remove_file(name)) != 0) {
+			result = (!directory && directory_exists(name) == 1) ? -EISDIR : -1;
 		}
 		
-		if (!pkgs_exists(&direct, pkg) && !pkg->installed) {
-			err = pkgs_append(&additional, pkg, 0);
-			
-			if (err != APTERR_SUCCESS) {
-				goto end;
+		free(name);
+	#else
+		if (ring != NULL) {
+			if (uring_space(ring) == 0 && uring_submit(ring, removal_complete, removal) == -1) {
+				return -1;
 			}
+			
+			uring_unlinkat(ring, removal->descriptor, path, directory ? AT_REMOVEDIR : 0, chain, (unsigned long) index);
+			
+			return 0;
 		}
 		
-		if (!pkg->installed) {
-			err = pkgs_append(&installs, pkg, 0);
-			
-			if (err != APTERR_SUCCESS) {
-				goto end;
-			}
+		if (unlinkat(removal->descriptor, path, directory ? AT_REMOVEDIR : 0) == -1) {
+			result = -errno;
 		}
+	#endif
+	
+	removal_complete(removal, (unsigned long) index, result);
+	
+	return 0;
+	
+}
+
+static int repolist_remove_entries(
+	repolist_t* const list,
+	const pkg_t* const pkg,
+	char* const manifest
+) {
+	/*
+	Remove the files and directories listed in the manifest of an installed
+	package, in a single pass: files first, then directories, the deepest
+	ones first. Paths that the installed package database says some other
+	package owns too are left alone.
+	
+	Everything is removed relative to the prefix. Where io_uring is
+	available, files are unlinked in batches, and directories are chained
+	so that they still go in order.
+	
+	The manifest is split in place.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	int has_ring = 0;
+	
+	size_t index = 0;
+	size_t count = 1;
+	
+	char* position = NULL;
+	char* separator = NULL;
+	char* end = NULL;
+	
+	options_t* const options = get_options();
+	
+	uring_t ring = {0};
+	removal_t removal = {0};
+	removal_entry_t* item = NULL;
+	
+	removal.prefix = options->prefix;
+	removal.descriptor = -1;
+	
+	for (position = manifest; *position != '\0'; position++) {
+		count += (*position == ',');
+	}
+	
+	removal.items = malloc(sizeof(*removal.items) * count);
+	
+	if (removal.items == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	/* The manifest is split in place; nothing is copied for each path */
+	for (position = manifest; position != NULL; position = (end == NULL) ? NULL : end + 1) {
+		end = strchr(position, ',');
 		
-		if (pkg->upgradable) {
-			err = pkgs_append(&upgrades, pkg, 0);
-			
-			if (err != APTERR_SUCCESS) {
-				goto end;
-			}
+		if (end != NULL) {
+			*end = '\0';
 		}
 		
-		if (!(pkg->upgradable || !pkg->installed)) {
+		/* Only the path is needed */
+		separator = strchr(position, PKGDB_FIELD_SEPARATOR);
+		
+		if (separator != NULL) {
+			*separator = '\0';
+		}
+		
+		if (*position == '\0') {
 			continue;
 		}
 		
-		required_disk_space += pkg->installed_size;
-		download_size += pkg->size;
+		item = &removal.items[removal.offset++];
+		
+		item->path = position;
+		item->directory = position[strlen(position) - 1] == '/';
+		item->shared = 0;
 	}
 	
-	upgrade_or_install = (upgrade || install);
+	/* Manifests written before they were kept sorted */
+	for (index = 1; index < removal.offset; index++) {
+		if (strcmp(removal.items[index - 1].path, removal.items[index].path) > 0) {
+			qsort(removal.items, removal.offset, sizeof(*removal.items), removal_compare);
+			break;
+		}
+	}
 	
-	pkgsiter_init(&iter, &direct);
+	repolist_lock(list);
 	
-	while ((pkg = pkgsiter_next(&iter)) != NULL) {
-		pkgsiter_init(&subiter, pkg->suggests);
-		
-		while ((subpkg = pkgsiter_next(&subiter)) != NULL) {
-			if (pkgs_exists(&indirect, subpkg)) {
-				continue;
-			}
-			
-			err = pkgs_append(&suggests, subpkg, 0);
-			
-			if (err != APTERR_SUCCESS) {
-				goto end;
-			}
-		}
-		
-		pkgsiter_init(&subiter, pkg->recommends);
+	for (index = 0; index < removal.offset; index++) {
+		item = &removal.items[index];
+		item->shared = pkgdb_owner(&list->database, item->path, strlen(item->path), pkg->name) != NULL;
+	}
+	
+	repolist_unlock(list);
+	
+	#if !defined(_WIN32)
+		removal.descriptor = open(options->prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 		
-		while ((subpkg = pkgsiter_next(&subiter)) != NULL) {
-			if (pkgs_exists(&indirect, subpkg)) {
-				continue;
-			}
-			
-			err = pkgs_append(&recommends, subpkg, 0);
-			
-			if (err != APTERR_SUCCESS) {
+		if (removal.descriptor == -1) {
+			/* Nothing is left to remove */
+			if (errno == ENOENT) {
 				goto end;
 			}
+			
+			err = APTERR_FS_RM_FAILURE;
+			goto end;
 		}
-	}
+	#endif
 	
-	pkgsiter_init(&iter, &list->installed);
+	has_ring = (uring_init(&ring) == 0);
 	
-	while ((pkg = pkgsiter_next(&iter)) != NULL) {
-		if (pkg->upgradable) {
+	for (index = 0; index < removal.offset; index++) {
+		item = &removal.items[index];
+		
+		if (item->directory || item->shared) {
 			continue;
 		}
 		
-		err = pkgs_append(&non_upgradable, pkg, 0);
-		
-		if (err != APTERR_SUCCESS) {
+		if (removal_unlink(&removal, has_ring ? &ring : NULL, index, 0, 0) != 0) {
+			err = APTERR_FS_RM_FAILURE;
 			goto end;
 		}
 	}
 	
-	if (additional.offset != 0) {
-		loggln(LOG_STANDARD, "The following additional packages will be installed:");
-		pprint_packages(&additional);
+	/* Whatever turned out to be a directory is only known once the files are gone */
+	if (has_ring && uring_submit(&ring, removal_complete, &removal) == -1) {
+		err = APTERR_FS_RM_FAILURE;
+		goto end;
 	}
 	
-	if (upgrade_or_install && suggests.offset != 0) {
-		loggln(LOG_STANDARD, "Suggested packages:");
-		pprint_packages(&suggests);
-	}
+	/* Going backwards, everything inside of a directory comes before it */
+	for (index = removal.offset; index > 0; index--) {
+		item = &removal.items[index - 1];
 		
-	if (upgrade_or_install && recommends.offset != 0) {
-		loggln(LOG_STANDARD, "Recommended packages:");
-		pprint_packages(&recommends);
+		if (!item->directory || item->shared) {
+			continue;
+		}
+		
+		if (removal_unlink(&removal, has_ring ? &ring : NULL, index - 1, 1, URING_HARDLINK) != 0) {
+			err = APTERR_FS_RM_FAILURE;
+			goto end;
+		}
 	}
 	
-	if (installs.offset != 0) {
-		loggln(LOG_STANDARD, "The following NEW packages will be installed:");
-		pprint_packages(&installs);
+	if (has_ring && uring_submit(&ring, removal_complete, &removal) == -1) {
+		err = APTERR_FS_RM_FAILURE;
+		goto end;
 	}
 	
-	if (upgrades.offset != 0) {
-		loggln(LOG_STANDARD, "The following packages will be upgraded:");
-		pprint_packages(&upgrades);
-	}
+	end:;
 	
-	loggln(LOG_STANDARD, "%zu upgraded, %zu newly installed, %zu to remove and %zu not upgraded.", upgrades.offset, installs.offset, 0, non_upgradable.offset);
+	#if !defined(_WIN32)
+		if (removal.descriptor != -1) {
+			close(removal.descriptor);
+		}
+	#endif
 	
-	if (upgrade_or_install) {
-		btos(download_size, format);
-		loggln(LOG_STANDARD, "Need to get %s of archives.", format);
-		
-		btos(required_disk_space, format);
-		loggln(LOG_STANDARD, "After this operation, %s of additional disk space will be used.", format);
+	if (has_ring) {
+		uring_free(&ring);
 	}
 	
-	if (!upgrade_or_install) {
-		goto end;
-	}
+	free(removal.items);
 	
-	if (!options->assume_yes) {
-		answer = ask();
-	}
+	return err;
 	
-	if (answer != ASK_ANSWER_YES) {
-		err = APTERR_CLI_USER_INTERRUPTED;
-		goto end;
-	}
+}
+
+int repolist_remove_single_package(
+	repolist_t* const list,
+	pkg_t* const pkg
+) {
 	
-	dlopts.concurrency = options->concurrency;
-	dlopts.temporary_directory = get_local_temp_dir();
-	dlopts.progress_callback = download_progress_callback;
-	dlopts.retry = 8;
+	int err = APTERR_SUCCESS;
 	
-	if (dlopts.temporary_directory == NULL) {
-		err = APTERR_NO_TMPDIR;
+	char* manifest = NULL;
+	
+	pkgdb_package_t package = {0};
+	
+	if (!pkg->installed) {
 		goto end;
 	}
 	
-	pkgsiter_init(&iter, &indirect);
+	loggln(LOG_STANDARD, "Removing %s (%s) ...", pkg->name, pkg->version);
 	
-	while ((pkg = pkgsiter_next(&iter)) != NULL) {
-		err = downloader_add(&downloader, &dlopts, pkg);
+	loggln(LOG_VERBOSE, "Removing package files from '%s'", pkg->name);
+	
+	repolist_lock(list);
+	
+	if (pkgdb_get(&list->database, pkg->name, &package) == 0) {
+		manifest = malloc(strlen(package.entries) + 1);
 		
-		if (err != APTERR_SUCCESS) {
-			goto end;
+		if (manifest != NULL) {
+			strcpy(manifest, package.entries);
 		}
 	}
 	
-	err = downloader_wait(&downloader, &dlopts);
+	repolist_unlock(list);
+	
+	if (package.entries == NULL) {
+		err = APTERR_REPO_CONF_MISSING_FIELD;
+		goto end;
+	}
+	
+	if (manifest == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	err = repolist_remove_entries(list, pkg, manifest);
 	
 	if (err != APTERR_SUCCESS) {
 		goto end;
 	}
 	
-	pkgsiter_init(&iter, &indirect);
+	loggln(LOG_VERBOSE, "Marking '%s' as not installed", pkg->name);
 	
-	while ((pkg = pkgsiter_next(&iter)) != NULL) {
-		err = repolist_install_single_package(list, pkg);
-		
-		if (err != APTERR_SUCCESS) {
-			goto end;
-		}
+	repolist_lock(list);
+	
+	err = pkgdb_delete(&list->database, pkg->name);
+	
+	if (err == APTERR_SUCCESS) {
+		pkg->installed = 0;
+		pkgs_delete(&list->installed, pkg);
 	}
 	
-	end:;
+	repolist_unlock(list);
 	
-	pkgs_free(&direct, 0);
-	pkgs_free(&indirect, 0);
-	pkgs_free(&suggests, 0);
-	pkgs_free(&recommends, 0);
-	pkgs_free(&additional, 0);
-	pkgs_free(&installs, 0);
-	pkgs_free(&upgrades, 0);
-	pkgs_free(&non_upgradable, 0);
+	end:;
 	
-	downloader_free(&downloader);
-	dlopts_free(&dlopts);
+	free(manifest);
 	
 	return err;
 	
 }
 
-char* find_file(const char* const directory, const char* const name) {
+
+struct OwnershipCheck {
+	repolist_t* list;
+	const pkg_t* pkg;
+	char* path;
+	char* owner;
+};
+
+typedef struct OwnershipCheck ownership_check_t;
+
+static int ownership_check(const char* const entry, void* const data) {
+	/*
+	Make sure that the given archive entry does not belong to some other
+	installed package, unless this one replaces it.
+	
+	Packages unpacked alongside this one are only recorded as installed once
+	they are done, so the paths written in the current transaction are also
+	claimed by their package, and checked the same way.
+	
+	Directories are shared between packages, so only the other kinds of
+	entries are checked. The conflicting path and its owner are copied, as
+	the entry is gone once it has been refused.
+	
+	Returns (0) if the entry can be written, (-1) otherwise. Running out of
+	memory also refuses the entry, but without an owner.
+	*/
+	
+	int err = 0;
 	
 	size_t index = 0;
-	const char* file_extension = NULL;
+	size_t length = 0;
+	size_t claim = 0;
 	
-	char* filename = NULL;
-	char* match = NULL;
+	const char* path = entry;
+	const char* owner = NULL;
 	
-	filename = malloc(
-		strlen(directory) +
-		strlen(PATHSEP_S) +
-		strlen(name) +
-		strlen(TAR_FILE_EXT) +
-		+ 16
-	);
+	const pkgs_t* replaces = NULL;
+	const pkg_t* claimant = NULL;
 	
-	if (filename == NULL) {
-		return NULL;
+	path_claims_t* claims = NULL;
+	
+	ownership_check_t* const check = data;
+	
+	if (strncmp(path, "./", 2) == 0) {
+		path += 2;
 	}
 	
-	strcpy(filename, directory);
-	strcat(filename, PATHSEP_S);
-	strcat(filename, name);
-	strcat(filename, TAR_FILE_EXT);
+	length = strlen(path);
+	
+	if (length == 0 || path[length - 1] == '/') {
+		return 0;
+	}
+	
+	replaces = check->pkg->replaces;
 	
-	match = strchr(filename, '\0');
+	repolist_lock(check->list);
+	
+	owner = pkgdb_owner(&check->list->database, path, length, check->pkg->name);
+	
+	claims = &check->list->claims;
+	claim = path_claims_find(claims, path, length);
+	
+	claimant = (claim == claims->offset) ? NULL : claims->items[claim].pkg;
+	
+	if (owner == NULL && claimant != NULL && strcmp(claimant->name, check->pkg->name) != 0) {
+		owner = claimant->name;
+	}
+	
+	for (index = 0; owner != NULL && replaces != NULL && index < replaces->offset; index++) {
+		if (strcmp(replaces->items[index]->name, owner) == 0) {
+			loggln(LOG_VERBOSE, "Taking over '%s' from '%s'", path, owner);
+			owner = NULL;
+		}
+	}
 	
-	for (index = 0; index < sizeof(PACKAGES_FILE_EXT) / sizeof(*PACKAGES_FILE_EXT); index++) {
-		file_extension = PACKAGES_FILE_EXT[index];
-		strcpy(match, file_extension);
+	if (owner != NULL) {
+		free(check->path);
+		free(check->owner);
 		
-		if (file_exists(filename) != 1) {
-			continue;
+		check->path = malloc(length + 1);
+		check->owner = malloc(strlen(owner) + 1);
+		
+		if (check->path != NULL) {
+			strcpy(check->path, path);
+		}
+		
+		if (check->owner != NULL) {
+			strcpy(check->owner, owner);
 		}
 		
-		return filename;
+		err = -1;
+	} else if (claim == claims->offset) {
+		err = path_claims_add(claims, path, length, check->pkg);
+	} else {
+		claims->items[claim].pkg = check->pkg;
 	}
 	
-	match -= strlen(TAR_FILE_EXT);
+	repolist_unlock(check->list);
+	
+	return err;
+	
+}
+
+static int repolist_check_entries(
+	repolist_t* const list,
+	const pkg_t* const pkg,
+	const archive_entries_t* const entries
+) {
+	/*
+	Check the given archive entries for files that belong to some other
+	installed package.
+	
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	
+	ownership_check_t check = {0};
 	
-	*(match) = '\0';
+	check.list = list;
+	check.pkg = pkg;
 	
-	if (file_exists(filename) == 1) {
-		return filename;
+	for (index = 0; index < entries->offset; index++) {
+		if (ownership_check(entries->items[index], &check) == 0) {
+			continue;
+		}
+		
+		if (check.path == NULL || check.owner == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			break;
+		}
+		
+		loggln(LOG_ERROR, "Trying to overwrite '%s', which is also in package '%s'", check.path, check.owner);
+		err = APTERR_PACKAGE_FILE_CONFLICT;
+		break;
 	}
 	
-	free(filename);
+	free(check.path);
+	free(check.owner);
 	
-	return NULL;
+	return err;
 	
 }
 
-int repolist_remove_single_package(
+static int repolist_check_package(
 	repolist_t* const list,
-	pkg_t* const pkg
+	const pkg_t* const pkg,
+	const int type
 ) {
+	/*
+	Check every entry of the given package file for files that belong to
+	some other installed package, before any of them is written.
 	
-	int err = APTERR_SUCCESS;
+	The entries are read without extracting anything, so a conflict leaves
+	nothing behind to clean up.
 	
-	int status = 0;
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
 	
-	strsplit_t split = {0};
-	strsplit_part_t part = {0};
+	int err = APTERR_SUCCESS;
+	int status = 0;
 	
-	installation_t* installation = NULL;
-	hquery_t* query = NULL;
-	options_t* options = NULL;
+	ownership_check_t check = {0};
+	archive_entries_t entries = {0};
 	
-	const char* entries = NULL;
+	check.list = list;
+	check.pkg = pkg;
 	
-	size_t removed = 0;
+	entries.callback = ownership_check;
+	entries.callback_data = &check;
 	
-	char* name = NULL;
+	if (type == REPO_TYPE_APT) {
+		status = uncompress_deb_list(pkg->filename, &entries);
+	} else {
+		status = uncompress_list(pkg->filename, &entries);
+	}
 	
-	if (!pkg->installed) {
-		goto end;
+	if (status != 0 && check.path != NULL && check.owner != NULL) {
+		loggln(LOG_ERROR, "Trying to overwrite '%s', which is also in package '%s'", check.path, check.owner);
+		err = APTERR_PACKAGE_FILE_CONFLICT;
+	} else if (status != 0) {
+		err = APTERR_ARCHIVE_UNCOMPRESS_FAILURE;
 	}
 	
-	installation = &pkg->installation;
-	query = &installation->metadata;
+	free(check.path);
+	free(check.owner);
 	
-	loggln(LOG_STANDARD, "Removing %s (%s) ...", pkg->name, pkg->version);
+	archive_entries_free(&entries);
 	
-	loggln(LOG_VERBOSE, "Removing package files from '%s'", pkg->name);
+	return err;
 	
-	options = get_options();
+}
+
+static int repolist_remove_obsolete(
+	repolist_t* const list,
+	const pkg_t* const pkg,
+	const char* const manifest,
+	const archive_entries_t* const previous
+) {
+	/*
+	Remove whatever was installed for the given package before (as listed
+	in previous) that is not in its new manifest.
 	
-	entries = query_get_string(query, "Entries");
+	Returns (0) on success, or an APTERR_* code on error.
+	*/
 	
-	if (entries == NULL) {
-		err = APTERR_REPO_CONF_MISSING_FIELD;
-		goto end;
-	}
+	int err = APTERR_SUCCESS;
 	
-	strsplit_init(&split, &part, entries, ",");
+	char* obsolete = NULL;
 	
-	while (1) {
-		if (strsplit_next(&split, &part) == NULL) {
-			if (!removed) {
-				break;
-			}
-			
-			removed = 0;
-			
-			strsplit_init(&split, &part, entries, ",");
-			
-			continue;
-		}
-		
-		name = malloc(strlen(options->prefix) + strlen(PATHSEP_S) + part.size + 1);
-		
-		if (name == NULL) {
-			err = APTERR_MEM_ALLOC_FAILURE;
-			goto end;
-		}
-		
-		strcpy(name, options->prefix);
-		strcat(name, PATHSEP_S);
-		strncat(name, part.begin, part.size);
-		
-		status = -1;
-		
-		if (file_exists(name) == 1) {
-			status = remove_file(name);
-		} else if (directory_exists(name) == 1) {
-			status = remove_empty_directory(name);
-		}
-		
-		removed += (status == 0);
-		
-		if (status != 0) {
-			continue;
-		}
-		
-		loggln(LOG_VERBOSE, "Removed '%s'", name);
+	archive_entries_t current = {0};
+	
+	if (manifest_load(manifest, &current) != 0) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
 	}
 	
-	remove_file(installation->filename);
+	obsolete = manifest_difference(previous, &current);
 	
-	loggln(LOG_VERBOSE, "Removed '%s'", installation->filename);
+	if (obsolete == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
 	
-	loggln(LOG_VERBOSE, "Marking '%s' as not installed", pkg->name);
+	if (*obsolete == '\0') {
+		goto end;
+	}
 	
-	pkg->installed = 0;
-	pkgs_delete(&list->installed, pkg);
+	err = repolist_remove_entries(list, pkg, obsolete);
 	
 	end:;
 	
+	free(obsolete);
+	archive_entries_free(&current);
+	
 	return err;
 	
 }
 
-
 int repolist_install_single_package(
 	repolist_t* const list,
 	pkg_t* const pkg
@@ -4004,24 +7588,23 @@ int repolist_install_single_package(
 	int err = APTERR_SUCCESS;
 	
 	installation_t* installation = NULL;
-	hquery_t* query = NULL;
 	options_t* options = NULL;
 	
-	logging_t loglevel = 0;
+	pkgdb_package_t package = {0};
 	
 	archive_entries_t entries = {0};
-	
-	size_t index = 0;
-	size_t size = 0;
+	archive_entries_t previous = {0};
 	
 	ssize_t status = 0;
 	
 	repo_t* repo = NULL;
 	
-	char* command = NULL;
+	maintainer_scripts_t scripts = {0};
+	stream_unpack_t* unpack = NULL;
+	
+	extract_stats_t stats = {0};
 	
 	const char* version = NULL;
-	const char* entry = NULL;
 	const char* file_extension = NULL;
 	const char* loader = NULL;
 	const char* triplet = NULL;
@@ -4032,15 +7615,7 @@ int repolist_install_single_package(
 	char* directory = NULL;
 	char* temporary_directory = NULL;
 	
-	char* filename = NULL;
-	
-	char* src = NULL;
-	
 	char* buffer = NULL;
-	char* match = NULL;
-	
-	walkdir_t walkdir = {0};
-	const walkdir_item_t* item = NULL;
 	
 	fstream_t* stream = NULL;
 	
@@ -4049,7 +7624,6 @@ int repolist_install_single_package(
 	repo = repolist_get_pkg_repo(list, pkg);
 	
 	installation = &pkg->installation;
-	query = &installation->metadata;
 	
 	if (!(pkg->upgradable || !pkg->installed)) {
 		goto end;
@@ -4085,147 +7659,129 @@ int repolist_install_single_package(
 		goto end;
 	}
 	
+	/* The files of the old version are replaced in place, rather than removed first */
 	if (pkg->upgradable) {
-		loglevel = loglevel_get();
-		loglevel_set(LOG_QUIET);
+		repolist_lock(list);
 		
-		err = repolist_remove_single_package(list, pkg);
+		if (pkgdb_get(&list->database, pkg->name, &package) == 0 && manifest_load(package.entries, &previous) != 0) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+		}
 		
-		loglevel_set(loglevel);
+		repolist_unlock(list);
 		
 		if (err != APTERR_SUCCESS) {
 			goto end;
 		}
+		
+		if (package.entries == NULL) {
+			err = APTERR_REPO_CONF_MISSING_FIELD;
+			goto end;
+		}
+		
+		entries.previous = &previous;
 	}
 	
 	logg(LOG_STANDARD, "Unpacking %s (%s)", pkg->name, pkg->version);
 	
 	if (pkg->upgradable) {
-		version = query_get_string(query, "Version");
+		version = installation->version;
 		logg(LOG_STANDARD, " over (%s)", version);
 	}
 	
 	loggln(LOG_STANDARD, " ...");
 	
-	if (repo->type == REPO_TYPE_APT) {
-		if (set_current_directory(temporary_directory) != 0) {
-			err = APTERR_FS_CHDIR_FAILURE;
-			goto end;
-		}
-		
-		loggln(LOG_VERBOSE, "Unpacking '%s' to '%s'", pkg->filename, temporary_directory);
-		
-		err = uncompress(pkg->filename, 0, NULL, NULL, NULL);
-		
-		if (err != 0) {
-			err = APTERR_ARCHIVE_UNCOMPRESS_FAILURE;
-			goto end;
-		}
-		
-		err = remove_file(pkg->filename);
-		
-		if (err != 0) {
-			err = APTERR_FS_RM_FAILURE;
-			goto end;
-		}
-		
-		free(filename);
-		filename = find_file(temporary_directory, "control");
-		
-		if (filename == NULL) {
-			err = APTERR_PKG_CONTROL_FILE_MISSING;
-			goto end;
-		}
-		
-		loggln(LOG_VERBOSE, "Found control file at '%s'", filename);
-		
-		err = uncompress(filename, 0, NULL, NULL, NULL);
+	/*
+	Every entry is checked against the installed packages before anything is
+	written; upgrades replace the files of the old version in place, so
+	nothing of it may be touched before the whole package is known to fit.
+	Staged packages are checked before they are moved into the prefix.
+	*/
+	if (pkg->unpack == NULL) {
+		err = repolist_check_package(list, pkg, repo->type);
 		
-		if (err != 0) {
-			err = APTERR_ARCHIVE_UNCOMPRESS_FAILURE;
+		if (err != APTERR_SUCCESS) {
 			goto end;
 		}
 	}
 	
-	if (set_current_directory(options->prefix) != 0) {
-		err = APTERR_FS_CHDIR_FAILURE;
-		goto end;
-	}
+	/* Absolute links are made to point inside of the prefix as they are extracted */
+	entries.root = options->prefix;
 	
 	switch (repo->type) {
 		case REPO_TYPE_APT: {
-			free(filename);
-			filename = find_file(temporary_directory, "preinst");
-			
-			if (options->maintainer_scripts && filename != NULL) {
-				loggln(LOG_VERBOSE, "Found pre-install script at '%s'", filename);
+			/*
+			The control and data archives are read straight out of the .deb; only
+			the maintainer scripts that actually run are ever written to disk.
+			*/
+			scripts.directory = temporary_directory;
+			scripts.version = pkg->upgradable ? version : NULL;
+			scripts.pkg = pkg;
+			scripts.enabled = options->maintainer_scripts;
+			
+			if (pkg->unpack != NULL) {
+				unpack = pkg->unpack;
 				
-				free(command);
+				err = maintainer_scripts_callback(&unpack->members, &scripts);
 				
-				if (pkg->upgradable) {
-					command = malloc(
-						strlen(filename) + 1 +
-						strlen(KUPGRADE) + 1 +
-						strlen(version) + 1 +
-						strlen(pkg->version) + 1
-					);
-					
-					if (command == NULL) {
-						err = APTERR_MEM_ALLOC_FAILURE;
-						goto end;
-					}
-					
-					strcpy(command, filename);
-					strcat(command, " ");
-					strcat(command, KUPGRADE);
-					strcat(command, " ");
-					strcat(command, version);
-					strcat(command, " ");
-					strcat(command, pkg->version);
-				} else {
-					command = malloc(
-						strlen(filename) + 1 +
-						strlen(KINSTALL) + 1
-					);
-					
-					if (command == NULL) {
-						err = APTERR_MEM_ALLOC_FAILURE;
-						goto end;
-					}
-					
-					strcpy(command, filename);
-					strcat(command, " ");
-					strcat(command, KINSTALL);
+				if (scripts.err != APTERR_SUCCESS) {
+					err = scripts.err;
+					goto end;
+				}
+				
+				/* Staged files are checked before any of them are moved into the prefix */
+				err = repolist_check_entries(list, pkg, &unpack->entries);
+				
+				if (err != APTERR_SUCCESS) {
+					goto end;
+				}
+				
+				loggln(LOG_VERBOSE, "Moving package files staged at '%s' to '%s'", unpack->directory, options->prefix);
+				
+				err = stream_unpack_commit(unpack, options->prefix, &entries);
+				
+				if (err != APTERR_SUCCESS) {
+					goto end;
 				}
 				
-				loggln(LOG_VERBOSE, "Execute subprocess: '%s'", command);
+				extract_stats_add(&stats, &unpack->stats);
 				
-				execute_shell_command(command);
+				break;
 			}
 			
-			free(filename);
-			filename = find_file(temporary_directory, "data");
+			loggln(LOG_VERBOSE, "Unpacking package files from '%s' to '%s'", pkg->filename, options->prefix);
+			
+			err = uncompress_deb(pkg->filename, options->prefix, maintainer_scripts_callback, &scripts, &entries, &stats);
+			
+			if (scripts.err != APTERR_SUCCESS) {
+				err = scripts.err;
+				goto end;
+			}
 			
-			if (filename == NULL) {
-				err = APTERR_PKG_DATA_FILE_MISSING;
+			if (err != 0) {
+				err = APTERR_ARCHIVE_UNCOMPRESS_FAILURE;
 				goto end;
 			}
 			
-			loggln(LOG_VERBOSE, "Found data file at '%s'", filename);
+			err = remove_file(pkg->filename);
+			
+			if (err != 0) {
+				err = APTERR_FS_RM_FAILURE;
+				goto end;
+			}
 			
 			break;
 		}
 		case REPO_TYPE_APK:
 		case REPO_TYPE_PACMAN: {
-			filename = malloc(strlen(pkg->filename) + 1);
+			loggln(LOG_VERBOSE, "Unpacking package files from '%s' to '%s'", pkg->filename, options->prefix);
 			
-			if (filename == NULL) {
-				err = APTERR_MEM_ALLOC_FAILURE;
+			err = uncompress(pkg->filename, 0, NULL, NULL, options->prefix, &entries, &stats);
+			
+			if (err != 0) {
+				err = APTERR_ARCHIVE_UNCOMPRESS_FAILURE;
 				goto end;
 			}
 			
-			strcpy(filename, pkg->filename);
-			
 			break;
 		}
 		default: {
@@ -4234,50 +7790,54 @@ int repolist_install_single_package(
 		}
 	}
 	
-	loggln(LOG_VERBOSE, "Unpacking package files from '%s' to '%s'", filename, options->prefix);
+	loggln(
+		LOG_VERBOSE,
+		"Unpacked %zu files, %zu links and %zu directories of '%s' with %zu system calls (%zu entries left to libarchive)",
+		stats.files,
+		stats.links,
+		stats.directories,
+		pkg->name,
+		stats.syscalls,
+		stats.delegated
+	);
 	
-	err = uncompress(filename, 0, NULL, NULL, &entries);
+	buffer = manifest_create(&entries);
 	
-	if (err != 0) {
-		err = APTERR_ARCHIVE_UNCOMPRESS_FAILURE;
+	if (buffer == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
 		goto end;
 	}
 	
+	if (pkg->upgradable) {
+		loggln(LOG_VERBOSE, "Left %zu files and links of '%s' untouched; removing those the new version no longer has", stats.unchanged, pkg->name);
+		
+		err = repolist_remove_obsolete(list, pkg, buffer, &previous);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+	}
+	
 	loggln(LOG_STANDARD, "Setting up %s (%s) ...", pkg->name, pkg->version);
 	
 	switch (repo->type) {
 		case REPO_TYPE_APT: {
-			free(filename);
-			filename = find_file(temporary_directory, "postinst");
-			
-			if (options->maintainer_scripts && filename != NULL) {
-				loggln(LOG_VERBOSE, "Found post-install script at '%s'", filename);
+			if (scripts.postinst != NULL) {
+				loggln(LOG_VERBOSE, "Found post-install script in '%s'", pkg->filename);
 				
-				free(command);
-				
-				command = malloc(
-					strlen(filename) + 1 +
-					strlen(KCONFIGURE) + 1 +
-					((version == NULL) ? 0 : strlen(version)) + 1
+				err = maintainer_script_execute(
+					temporary_directory,
+					"postinst",
+					scripts.postinst,
+					scripts.postinst_size,
+					KCONFIGURE,
+					version,
+					NULL
 				);
 				
-				if (command == NULL) {
-					err = APTERR_MEM_ALLOC_FAILURE;
+				if (err != APTERR_SUCCESS) {
 					goto end;
 				}
-				
-				strcpy(command, filename);
-				strcat(command, " ");
-				strcat(command, KCONFIGURE);
-				
-				if (version != NULL) {
-					strcat(command, " ");
-					strcat(command, version);
-				}
-				
-				loggln(LOG_VERBOSE, "Execute subprocess: '%s'", command);
-				
-				execute_shell_command(command);
 			}
 			
 			break;
@@ -4301,215 +7861,65 @@ int repolist_install_single_package(
 		goto end;
 	}
 	
-	for (index = 0; index < entries.offset; index++) {
-		entry = entries.items[index];
-		size += strlen(entry) + 1;
-	}
-	
-	size++;
-	
-	buffer = malloc(size);
-	
-	if (buffer == NULL) {
-		err = APTERR_MEM_ALLOC_FAILURE;
-		goto end;
-	}
-	
-	buffer[0] = '\0';
-	
-	for (index = 0; index < entries.offset; index++) {
-		entry = entries.items[index];
-		
-		if (strncmp("./", entry, 2) == 0) {
-			entry += 2;
-		}
-		
-		if (*entry == '\0') {
-			continue;
-		}
-		
-		if (*buffer != '\0') {
-			strcat(buffer, ",");
-		}
-		
-		strcat(buffer, entry);
-		
-		match = strchr(buffer, '\0');
-		
-		if (match == buffer) {
-			continue;
-		}
-		
-		match--;
-		
-		if (*match != '/') {
-			continue;
-		}
-		
-		*match = '\0';
-	}
-	
 	loader = get_loader(pkg->arch);
 	triplet = get_triplet(pkg->arch);
 	
 	a = basename(loader);
 	
-	for (index = 0; index < entries.offset; index++) {
-		entry = entries.items[index];
-		
-		if (strncmp("./", entry, 2) == 0) {
-			entry += 2;
-		}
-		
-		if (*entry == '\0') {
-			continue;
-		}
-		
-		if (symlink_exists(entry) != 1) {
-			continue;
-		}
-		
-		free(filename);
-		filename = get_symlink(entry);
-		
-		if (filename == NULL) {
-			err = APTERR_FS_READLINK_FAILURE;
-			goto end;
-		}
-		
-		if (!isabsolute(filename)) {
-			continue;
-		}
-		
-		loggln(LOG_VERBOSE, "Removing hardcoded symlink at '%s'", entry);
-		
-		if (remove_file(entry) != 0) {
-			err = APTERR_FS_RM_FAILURE;
-			goto end;
-		}
-		
-		src = malloc(strlen(options->prefix) + strlen(filename) + 1);
-		
-		if (src == NULL) {
-			err = APTERR_MEM_ALLOC_FAILURE;
-			goto end;
-		}
-		
-		strcpy(src, options->prefix);
-		strcat(src, filename);
-		
-		free(filename);
-		filename = src;
-		
-		loggln(LOG_VERBOSE, "Symlinking '%s' to '%s'", filename, entry);
-		
-		if (mklink(filename, entry) != 0) {
-			err = APTERR_FS_SYMLINK_FAILURE;
-			goto end;
-		}
-	}
-	
-	if (options->symlink_prefix != NULL && directory_exists(options->symlink_prefix) == 1) {
-		if (walkdir_init(&walkdir, options->symlink_prefix) == -1) {
-			err = APTERR_FS_WALKDIR_FAILURE;
-			goto end;
-		}
-		
-		while ((item = walkdir_next(&walkdir)) != NULL) {
-			if (strcmp(item->name, ".") == 0 || strcmp(item->name, "..") == 0) {
-				continue;
-			}
-			
-			if (symlink_exists(item->name) == 1) {
-				continue;
-			}
-			
-			free(filename);
-			filename = malloc(strlen(options->symlink_prefix) + strlen(PATHSEP_S) + strlen(item->name) + 1);
-			
-			if (filename == NULL) {
-				err = APTERR_MEM_ALLOC_FAILURE;
-				goto end;
-			}
-			
-			strcpy(filename, options->symlink_prefix);
-			strcat(filename, PATHSEP_S);
-			strcat(filename, item->name);
-			
-			loggln(LOG_VERBOSE, "Symlinking '%s' to '%s'", filename, item->name);
-			
-			if (mklink(filename, item->name) != 0) {
-				err = APTERR_FS_SYMLINK_FAILURE;
-				goto end;
-			}
-		}
-	}
-	
-	query_init(query, '\n', ": ");
-	
-	err = query_add_string(query, "Package", pkg->name);
-	
-	if (err != 0) {
-		err = APTERR_PKG_METADATA_WRITE_FAILURE;
-		goto end;
-	}
+	loggln(LOG_VERBOSE, "Marking '%s' as installed", pkg->name);
 	
-	err = query_add_string(query, "Version", pkg->version);
+	package.name = pkg->name;
+	package.version = pkg->version;
+	package.entries = buffer;
+	package.autoinstall = pkg->autoinstall;
 	
-	if (err != 0) {
-		err = APTERR_PKG_METADATA_WRITE_FAILURE;
-		goto end;
-	}
+	repolist_lock(list);
 	
-	err = query_add_uint(query, "Auto-Install", pkg->autoinstall);
+	err = pkgdb_put(&list->database, &package);
 	
-	if (err != 0) {
-		err = APTERR_PKG_METADATA_WRITE_FAILURE;
-		goto end;
+	/* Upgraded packages are in the list already */
+	if (err == APTERR_SUCCESS && !pkg->installed) {
+		err = pkgs_append(&list->installed, pkg, 0);
 	}
 	
-	err = query_add_string(query, "Entries", buffer);
-	
-	if (err != 0) {
-		err = APTERR_PKG_METADATA_WRITE_FAILURE;
-		goto end;
+	if (err == APTERR_SUCCESS) {
+		pkg->upgradable = 0;
+		pkg->installed = 1;
+		pkg->removable = -1;
 	}
 	
-	loggln(LOG_VERBOSE, "Exporting package metadata to '%s'", installation->filename);
-	
-	err = query_dump_file(query, installation->filename);
+	repolist_unlock(list);
 	
-	if (err != 0) {
-		err = APTERR_PKG_METADATA_WRITE_FAILURE;
+	if (err != APTERR_SUCCESS) {
 		goto end;
 	}
 	
-	loggln(LOG_VERBOSE, "Marking '%s' as installed", pkg->name);
-	
-	pkg->upgradable = 0;
-	pkg->installed = 1;
-	pkg->removable = -1;
-	
-	err = pkgs_append(&list->installed, pkg, 0);
+	end:;
 	
+	/* Packages that failed to unpack do not keep others from writing their files */
 	if (err != APTERR_SUCCESS) {
-		goto end;
+		repolist_lock(list);
+		path_claims_release(&list->claims, pkg);
+		repolist_unlock(list);
 	}
 	
-	end:;
-	
 	free(temporary_directory);
 	free(directory);
-	free(filename);
 	free(buffer);
-	free(command);
+	free(scripts.postinst);
+	
+	if (unpack != NULL) {
+		stream_unpack_free(unpack);
+		
+		free(unpack);
+		pkg->unpack = NULL;
+	}
 	
 	archive_entries_free(&entries);
+	archive_entries_free(&previous);
 	
 	fstream_close(stream);
 	
-	walkdir_free(&walkdir);
-	
 	return err;
 	
 }
@@ -4536,11 +7946,14 @@ void repo_free(repo_t* const repo) {
 	free(repo->specification);
 	repo->specification = NULL;
 	
+	pkgs_free(&repo->sorted, 0);
 	pkgs_free(&repo->pkgs, 1);
 	
 	uri_free(&repo->uri);
 	uri_free(&repo->base_uri);
 	
+	mirrors_free(&repo->mirrors);
+	
 }
 
 void repolist_free(repolist_t* const list) {
@@ -4549,6 +7962,11 @@ void repolist_free(repolist_t* const list) {
 	repo_t* repo = NULL;
 	
 	pkgs_free(&list->installed, 0);
+	pkgdb_close(&list->database);
+	path_claims_free(&list->claims);
+	trigram_index_free(&list->search_index);
+	bktree_free(&list->names);
+	textindex_close(&list->description_index);
 	
 	for (index = 0; index < list->offset; index++) {
 		repo = &list->items[index];
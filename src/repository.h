@@ -9,11 +9,20 @@
 
 #include "package.h"
 #include "base_uri.h"
+#include "mirrors.h"
+#include "os/thread.h"
+#include "bktree.h"
+#include "pkgdb.h"
 #include "query.h"
+#include "textindex.h"
+#include "trigram.h"
 
 #define APT_MAX_PKG_INDEX_LEN ((1024 * 1024 * 100) + 1) /* 100 MiB */
 #define APT_MAX_PKG_SECTION_LEN ((1024 * 1024 * 1) + 1) /* 1 MiB */
 
+#define REPOLIST_SUGGEST_MAX_DISTANCE (2)
+#define REPOLIST_SUGGEST_MAX_RESULTS (3)
+
 #define REPOLIST_RESOLVE_DEPENDS (0x00)
 #define REPOLIST_RESOLVE_BREAKS (0x01)
 #define REPOLIST_RESOLVE_SUGGESTS (0x02)
@@ -25,6 +34,8 @@
 #define REPO_TYPE_PACMAN (2)
 #define REPO_TYPE_UNKNOWN (1000)
 
+#define PATH_CLAIMS_INITIAL_BUCKETS (1024)
+
 struct Repository {
 	int type;
 	size_t index;
@@ -36,17 +47,43 @@ struct Repository {
 	char* specification;
 	architecture_t architecture;
 	pkgs_t pkgs;
+	pkgs_t sorted;
 	base_uri_t uri;
 	base_uri_t base_uri;
+	mirrors_t mirrors;
 };
 
 typedef struct Repository repo_t;
 
+struct PathClaim {
+	char* path;
+	size_t length;
+	const pkg_t* pkg;
+};
+
+typedef struct PathClaim path_claim_t;
+
+struct PathClaims {
+	size_t size;
+	size_t offset;
+	path_claim_t* items;
+	size_t buckets;
+	size_t* slots;
+};
+
+typedef struct PathClaims path_claims_t;
+
 struct RepoList {
 	size_t size;
 	size_t offset;
 	repo_t* items;
 	pkgs_t installed;
+	pkgdb_t database;
+	mutex_t* lock;
+	path_claims_t claims;
+	trigram_index_t search_index;
+	bktree_t names;
+	textindex_t description_index;
 };
 
 typedef struct RepoList repolist_t;
@@ -58,6 +95,36 @@ struct PkgsPaging {
 
 typedef struct PkgsPaging pkgs_paging_t;
 
+struct PkgsCursor {
+	size_t repo;
+	size_t index;
+};
+
+typedef struct PkgsCursor pkgs_cursor_t;
+
+struct PkgsCursors {
+	size_t size;
+	size_t offset;
+	pkgs_cursor_t* items;
+};
+
+typedef struct PkgsCursors pkgs_cursors_t;
+
+struct PkgsSearch {
+	const char* query;
+	int indexed;
+	int type;
+	pkgs_t matches;
+	trigram_candidates_t candidates;
+	pkgs_cursors_t pages;
+	int ranked;
+	pkg_t** documents;
+	textindex_scores_t scores;
+	textindex_hits_t hits;
+};
+
+typedef struct PkgsSearch pkgs_search_t;
+
 int repolist_resolve_deps(
 	repolist_t* const list,
 	pkg_t* const pkg
@@ -95,13 +162,45 @@ pkg_t* repolist_get_pkg(
 	const char* const name
 );
 
+int repolist_match_pkgs(
+	repolist_t* const list,
+	const char* const expression,
+	const int type,
+	const int installed,
+	pkgs_t* const results
+);
+
+int repolist_suggest_pkg(
+	repolist_t* const list,
+	const char* const name,
+	char** const suggestions
+);
+
+int repolist_search_init(
+	repolist_t* const list,
+	pkgs_search_t* const search,
+	const char* const query
+);
+
 ssize_t repolist_search_pkg(
-	const repolist_t* const list,
+	repolist_t* const list,
+	pkgs_search_t* const search,
+	const pkgs_paging_t paging,
+	pkgs_t* const results
+);
+
+void repolist_search_free(pkgs_search_t* const search);
+
+ssize_t repolist_search_description(
+	repolist_t* const list,
+	pkgs_search_t* const search,
 	const char* const query,
 	const pkgs_paging_t paging,
 	pkgs_t* const results
 );
 
+int repolist_build_description_index(repolist_t* const list);
+
 repo_t* repolist_get_pkg_repo(
 	const repolist_t* const list,
 	const pkg_t* const pkg
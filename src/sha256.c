@@ -0,0 +1,339 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	#define SHA256_X86
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+	#define SHA256_ARM
+#endif
+
+#if defined(SHA256_X86)
+	#include <cpuid.h>
+	#include <immintrin.h>
+#endif
+
+#if defined(SHA256_ARM)
+	#include <arm_neon.h>
+#endif
+
+#if defined(SHA256_ARM) && defined(__linux__)
+	#include <sys/auxv.h>
+	#include <asm/hwcap.h>
+#endif
+
+#include <bearssl_hash.h>
+
+#include "sha256.h"
+
+#if defined(SHA256_X86) || defined(SHA256_ARM)
+static const uint32_t SHA256_INITIAL_STATE[] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint32_t SHA256_ROUND_CONSTANTS[] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+#endif
+
+#if defined(SHA256_X86)
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_compress(
+	uint32_t* const state,
+	const unsigned char* data,
+	size_t blocks
+) {
+	/*
+	Process whole 64-byte blocks with the Intel SHA extensions.
+	*/
+	
+	size_t index = 0;
+	
+	__m128i state0;
+	__m128i state1;
+	__m128i message;
+	__m128i temporary;
+	__m128i abef;
+	__m128i cdgh;
+	__m128i schedule[4];
+	
+	const __m128i mask = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+	
+	/* The SHA-NI instructions expect the state as ABEF/CDGH pairs */
+	temporary = _mm_loadu_si128((const __m128i*) &state[0]);
+	state1 = _mm_loadu_si128((const __m128i*) &state[4]);
+	
+	temporary = _mm_shuffle_epi32(temporary, 0xB1);
+	state1 = _mm_shuffle_epi32(state1, 0x1B);
+	state0 = _mm_alignr_epi8(temporary, state1, 8);
+	state1 = _mm_blend_epi16(state1, temporary, 0xF0);
+	
+	while (blocks-- > 0) {
+		abef = state0;
+		cdgh = state1;
+		
+		for (index = 0; index < 16; index++) {
+			if (index < 4) {
+				schedule[index] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + (index * 16))), mask);
+			} else {
+				temporary = _mm_alignr_epi8(schedule[(index + 3) & 3], schedule[(index + 2) & 3], 4);
+				message = _mm_sha256msg1_epu32(schedule[index & 3], schedule[(index + 1) & 3]);
+				message = _mm_add_epi32(message, temporary);
+				schedule[index & 3] = _mm_sha256msg2_epu32(message, schedule[(index + 3) & 3]);
+			}
+			
+			message = _mm_add_epi32(schedule[index & 3], _mm_loadu_si128((const __m128i*) &SHA256_ROUND_CONSTANTS[index * 4]));
+			
+			state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+			message = _mm_shuffle_epi32(message, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, message);
+		}
+		
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+		
+		data += SHA256_BLOCK_SIZE;
+	}
+	
+	temporary = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(temporary, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, temporary, 8);
+	
+	_mm_storeu_si128((__m128i*) &state[0], state0);
+	_mm_storeu_si128((__m128i*) &state[4], state1);
+	
+}
+#endif
+
+#if defined(SHA256_ARM)
+#if defined(__clang__)
+__attribute__((target("crypto")))
+#else
+__attribute__((target("+crypto")))
+#endif
+static void sha256_compress(
+	uint32_t* const state,
+	const unsigned char* data,
+	size_t blocks
+) {
+	/*
+	Process whole 64-byte blocks with the ARMv8 cryptography extensions.
+	*/
+	
+	size_t index = 0;
+	
+	uint32x4_t state0;
+	uint32x4_t state1;
+	uint32x4_t previous;
+	uint32x4_t message;
+	uint32x4_t abcd;
+	uint32x4_t efgh;
+	uint32x4_t schedule[4];
+	
+	state0 = vld1q_u32(&state[0]);
+	state1 = vld1q_u32(&state[4]);
+	
+	while (blocks-- > 0) {
+		abcd = state0;
+		efgh = state1;
+		
+		for (index = 0; index < 16; index++) {
+			if (index < 4) {
+				schedule[index] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + (index * 16))));
+			} else {
+				message = vsha256su0q_u32(schedule[index & 3], schedule[(index + 1) & 3]);
+				schedule[index & 3] = vsha256su1q_u32(message, schedule[(index + 2) & 3], schedule[(index + 3) & 3]);
+			}
+			
+			message = vaddq_u32(schedule[index & 3], vld1q_u32(&SHA256_ROUND_CONSTANTS[index * 4]));
+			
+			previous = state0;
+			state0 = vsha256hq_u32(state0, state1, message);
+			state1 = vsha256h2q_u32(state1, previous, message);
+		}
+		
+		state0 = vaddq_u32(state0, abcd);
+		state1 = vaddq_u32(state1, efgh);
+		
+		data += SHA256_BLOCK_SIZE;
+	}
+	
+	vst1q_u32(&state[0], state0);
+	vst1q_u32(&state[4], state1);
+	
+}
+#endif
+
+int sha256_accelerated(void) {
+	/*
+	Check whether the processor has instructions for computing SHA-256.
+	
+	The result is computed once and cached.
+	
+	Returns (1) if so, (0) otherwise.
+	*/
+	
+	static int accelerated = -1;
+	
+	#if defined(SHA256_X86)
+		unsigned int eax = 0;
+		unsigned int ebx = 0;
+		unsigned int ecx = 0;
+		unsigned int edx = 0;
+	#endif
+	
+	if (accelerated != -1) {
+		return accelerated;
+	}
+	
+	accelerated = 0;
+	
+	#if defined(SHA256_X86)
+		/* SSSE3 and SSE4.1 are used alongside the SHA extensions */
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 9)) && (ecx & (1 << 19))) {
+			accelerated = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 29));
+		}
+	#elif defined(SHA256_ARM) && defined(__APPLE__)
+		accelerated = 1;
+	#elif defined(SHA256_ARM) && defined(__linux__) && defined(HWCAP_SHA2)
+		accelerated = (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+	#endif
+	
+	return accelerated;
+	
+}
+
+void sha256_init(sha256_t* const context) {
+	/*
+	Start a new SHA-256 computation.
+	
+	The hardware implementation is used if the processor supports it;
+	otherwise, this falls back to the BearSSL software implementation.
+	*/
+	
+	context->accelerated = sha256_accelerated();
+	context->used = 0;
+	context->length = 0;
+	
+	if (!context->accelerated) {
+		br_sha256_init(&context->software);
+		return;
+	}
+	
+	#if defined(SHA256_X86) || defined(SHA256_ARM)
+		memcpy(context->state, SHA256_INITIAL_STATE, sizeof(context->state));
+	#endif
+	
+}
+
+void sha256_update(
+	sha256_t* const context,
+	const void* const data,
+	const size_t size
+) {
+	
+	#if defined(SHA256_X86) || defined(SHA256_ARM)
+		const unsigned char* position = data;
+		size_t remaining = size;
+		size_t chunk = 0;
+	#endif
+	
+	if (!context->accelerated) {
+		br_sha256_update(&context->software, data, size);
+		return;
+	}
+	
+	#if defined(SHA256_X86) || defined(SHA256_ARM)
+		context->length += size;
+		
+		/* Complete the partially filled block first */
+		if (context->used > 0) {
+			chunk = SHA256_BLOCK_SIZE - context->used;
+			
+			if (chunk > remaining) {
+				chunk = remaining;
+			}
+			
+			memcpy(context->buffer + context->used, position, chunk);
+			
+			context->used += chunk;
+			position += chunk;
+			remaining -= chunk;
+			
+			if (context->used < SHA256_BLOCK_SIZE) {
+				return;
+			}
+			
+			sha256_compress(context->state, context->buffer, 1);
+			context->used = 0;
+		}
+		
+		chunk = remaining / SHA256_BLOCK_SIZE;
+		
+		if (chunk > 0) {
+			sha256_compress(context->state, position, chunk);
+			
+			position += chunk * SHA256_BLOCK_SIZE;
+			remaining -= chunk * SHA256_BLOCK_SIZE;
+		}
+		
+		memcpy(context->buffer, position, remaining);
+		context->used = remaining;
+	#endif
+	
+}
+
+void sha256_final(
+	sha256_t* const context,
+	unsigned char* const digest
+) {
+	
+	#if defined(SHA256_X86) || defined(SHA256_ARM)
+		size_t index = 0;
+		unsigned long long bits = 0;
+	#endif
+	
+	if (!context->accelerated) {
+		br_sha256_out(&context->software, digest);
+		return;
+	}
+	
+	#if defined(SHA256_X86) || defined(SHA256_ARM)
+		bits = context->length * 8;
+		
+		context->buffer[context->used++] = 0x80;
+		
+		if (context->used > (SHA256_BLOCK_SIZE - 8)) {
+			memset(context->buffer + context->used, 0, SHA256_BLOCK_SIZE - context->used);
+			sha256_compress(context->state, context->buffer, 1);
+			context->used = 0;
+		}
+		
+		memset(context->buffer + context->used, 0, (SHA256_BLOCK_SIZE - 8) - context->used);
+		
+		for (index = 0; index < 8; index++) {
+			context->buffer[(SHA256_BLOCK_SIZE - 1) - index] = (unsigned char) (bits >> (index * 8));
+		}
+		
+		sha256_compress(context->state, context->buffer, 1);
+		
+		for (index = 0; index < 8; index++) {
+			digest[(index * 4) + 0] = (unsigned char) (context->state[index] >> 24);
+			digest[(index * 4) + 1] = (unsigned char) (context->state[index] >> 16);
+			digest[(index * 4) + 2] = (unsigned char) (context->state[index] >> 8);
+			digest[(index * 4) + 3] = (unsigned char) context->state[index];
+		}
+	#endif
+	
+}
@@ -0,0 +1,38 @@
+#if !defined(SHA256_H)
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bearssl_hash.h>
+
+#define SHA256_DIGEST_SIZE (32)
+#define SHA256_BLOCK_SIZE (64)
+
+struct Sha256 {
+	int accelerated;
+	br_sha256_context software;
+	uint32_t state[8];
+	unsigned char buffer[SHA256_BLOCK_SIZE];
+	size_t used;
+	unsigned long long length;
+};
+
+typedef struct Sha256 sha256_t;
+
+void sha256_init(sha256_t* const context);
+
+void sha256_update(
+	sha256_t* const context,
+	const void* const data,
+	const size_t size
+);
+
+void sha256_final(
+	sha256_t* const context,
+	unsigned char* const digest
+);
+
+int sha256_accelerated(void);
+
+#endif
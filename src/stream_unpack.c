@@ -0,0 +1,460 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "errors.h"
+#include "fs/exists.h"
+#include "fs/mkdir.h"
+#include "fs/mv.h"
+#include "fs/rm.h"
+#include "fs/sep.h"
+#include "stream_unpack.h"
+#include "uncompress.h"
+
+static long stream_unpack_read(void* const data, const void** const buffer) {
+	/*
+	Hand the extractor the next contiguous run of received bytes.
+	
+	The bytes handed out last time stay in the ring until this is called
+	again, as libarchive may still be looking at them until then.
+	*/
+	
+	long rsize = 0;
+	size_t size = 0;
+	
+	stream_unpack_t* const unpack = data;
+	
+	mutex_lock(&unpack->mutex);
+	
+	unpack->head = (unpack->head + unpack->pending) % STREAM_UNPACK_BUFFER_SIZE;
+	unpack->length -= unpack->pending;
+	unpack->pending = 0;
+	
+	condition_broadcast(&unpack->condition);
+	
+	/* The transfer was paused waiting for room in the ring */
+	if (unpack->paused && unpack->length <= STREAM_UNPACK_RESUME_LENGTH && unpack->wakeup != NULL) {
+		(*unpack->wakeup)(unpack->argument);
+	}
+	
+	while (unpack->length == 0 && !unpack->closed && !unpack->aborted) {
+		condition_wait(&unpack->condition, &unpack->mutex);
+	}
+	
+	if (unpack->aborted) {
+		rsize = -1;
+	} else if (unpack->length > 0) {
+		size = STREAM_UNPACK_BUFFER_SIZE - unpack->head;
+		
+		if (size > unpack->length) {
+			size = unpack->length;
+		}
+		
+		*buffer = unpack->buffer + unpack->head;
+		
+		unpack->pending = size;
+		rsize = (long) size;
+	}
+	
+	mutex_unlock(&unpack->mutex);
+	
+	return rsize;
+	
+}
+
+static int stream_unpack_control(
+	const archive_members_t* const members,
+	void* const data
+) {
+	/*
+	Maintainer scripts can only run once the package is committed, so keep
+	a copy of them until then.
+	*/
+	
+	stream_unpack_t* const unpack = data;
+	
+	return archive_members_copy(&unpack->members, members);
+	
+}
+
+static void* stream_unpack_run(void* const argument) {
+	
+	int err = 0;
+	
+	stream_unpack_t* const unpack = argument;
+	
+	err = uncompress_deb_stream(
+		stream_unpack_read,
+		unpack,
+		unpack->directory,
+		stream_unpack_control,
+		unpack,
+		&unpack->entries,
+		&unpack->stats
+	);
+	
+	mutex_lock(&unpack->mutex);
+	
+	unpack->err = (err == 0) ? 0 : -1;
+	unpack->done = 1;
+	
+	condition_broadcast(&unpack->condition);
+	
+	if (unpack->paused && unpack->wakeup != NULL) {
+		(*unpack->wakeup)(unpack->argument);
+	}
+	
+	mutex_unlock(&unpack->mutex);
+	
+	return NULL;
+	
+}
+
+int stream_unpack_open(
+	stream_unpack_t* const unpack,
+	const char* const prefix,
+	const char* const name
+) {
+	/*
+	Prepare to extract a package while it is still being received.
+	
+	The package is extracted into a staging directory inside the prefix, and
+	only moved into place by stream_unpack_commit() once the whole archive has
+	been received and verified. Keeping it on the same filesystem as the
+	prefix makes that a matter of a few renames.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	memset(unpack, 0, sizeof(*unpack));
+	
+	if (mutex_init(&unpack->mutex) != 0) {
+		return APTERR_THREAD_INIT_FAILURE;
+	}
+	
+	if (condition_init(&unpack->condition) != 0) {
+		mutex_free(&unpack->mutex);
+		return APTERR_THREAD_INIT_FAILURE;
+	}
+	
+	unpack->buffer = malloc(STREAM_UNPACK_BUFFER_SIZE);
+	
+	unpack->directory = malloc(
+		strlen(prefix) +
+		strlen(PATHSEP_S) +
+		strlen(STREAM_UNPACK_STAGING_DIRECTORY) +
+		strlen(PATHSEP_S) +
+		strlen(name) +
+		1
+	);
+	
+	if (unpack->buffer == NULL || unpack->directory == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	strcpy(unpack->directory, prefix);
+	strcat(unpack->directory, PATHSEP_S);
+	strcat(unpack->directory, STREAM_UNPACK_STAGING_DIRECTORY);
+	strcat(unpack->directory, PATHSEP_S);
+	strcat(unpack->directory, name);
+	
+	/* Links are staged pointing to where they will be once committed */
+	unpack->entries.root = prefix;
+	
+	/* Whatever an interrupted run left behind is of no use */
+	if (directory_exists(unpack->directory) == 1 && remove_directory(unpack->directory) != 0) {
+		err = APTERR_FS_RM_FAILURE;
+		goto end;
+	}
+	
+	if (create_directory(unpack->directory) != 0) {
+		err = APTERR_FS_MKDIR_FAILURE;
+		goto end;
+	}
+	
+	end:;
+	
+	if (err != APTERR_SUCCESS) {
+		stream_unpack_free(unpack);
+	}
+	
+	return err;
+	
+}
+
+int stream_unpack_write(
+	stream_unpack_t* const unpack,
+	const char* const data,
+	const size_t size
+) {
+	/*
+	Pass the given bytes on to the extractor, starting it if needed.
+	
+	This never waits for the extractor: if the bytes do not fit in the ring,
+	none of them are taken and the writer is marked as paused, so that the
+	transfer can be paused rather than stalling every other transfer with it.
+	stream_unpack_resume() tells when to try again. Only writes larger than
+	the whole ring wait for the extractor to make room.
+	
+	Returns (0) on success, (STREAM_UNPACK_FULL) if the ring is full, (-1) if
+	the extractor failed.
+	*/
+	
+	int err = 0;
+	
+	size_t offset = 0;
+	size_t tail = 0;
+	size_t chunk = 0;
+	
+	if (!unpack->started) {
+		if (thread_create(&unpack->thread, stream_unpack_run, unpack) != 0) {
+			return -1;
+		}
+		
+		unpack->started = 1;
+	}
+	
+	mutex_lock(&unpack->mutex);
+	
+	if (!unpack->done && size <= STREAM_UNPACK_BUFFER_SIZE && size > STREAM_UNPACK_BUFFER_SIZE - unpack->length) {
+		unpack->paused = 1;
+		mutex_unlock(&unpack->mutex);
+		
+		return STREAM_UNPACK_FULL;
+	}
+	
+	while (offset < size) {
+		while (unpack->length == STREAM_UNPACK_BUFFER_SIZE && !unpack->done) {
+			condition_wait(&unpack->condition, &unpack->mutex);
+		}
+		
+		/* Anything after data.tar.* is of no interest to the extractor */
+		if (unpack->done) {
+			err = unpack->err;
+			break;
+		}
+		
+		tail = (unpack->head + unpack->length) % STREAM_UNPACK_BUFFER_SIZE;
+		chunk = STREAM_UNPACK_BUFFER_SIZE - unpack->length;
+		
+		if (chunk > STREAM_UNPACK_BUFFER_SIZE - tail) {
+			chunk = STREAM_UNPACK_BUFFER_SIZE - tail;
+		}
+		
+		if (chunk > size - offset) {
+			chunk = size - offset;
+		}
+		
+		memcpy(unpack->buffer + tail, data + offset, chunk);
+		
+		unpack->length += chunk;
+		offset += chunk;
+		
+		condition_broadcast(&unpack->condition);
+	}
+	
+	mutex_unlock(&unpack->mutex);
+	
+	return err;
+	
+}
+
+int stream_unpack_resume(stream_unpack_t* const unpack) {
+	/*
+	Check whether a writer that was told the ring is full may go on.
+	
+	Writers are only let go on once the extractor has drained a good part of
+	the ring, so that the transfer is not paused again on the next write.
+	
+	Returns (1) if it was paused and there is room in the ring now, or the
+	extractor is done, (0) otherwise.
+	*/
+	
+	int resume = 0;
+	
+	mutex_lock(&unpack->mutex);
+	
+	resume = unpack->paused && (unpack->length <= STREAM_UNPACK_RESUME_LENGTH || unpack->done);
+	
+	if (resume) {
+		unpack->paused = 0;
+	}
+	
+	mutex_unlock(&unpack->mutex);
+	
+	return resume;
+	
+}
+
+int stream_unpack_finish(stream_unpack_t* const unpack) {
+	/*
+	Tell the extractor that the whole package was received, and wait for it
+	to finish.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	if (!unpack->started) {
+		return -1;
+	}
+	
+	mutex_lock(&unpack->mutex);
+	
+	unpack->closed = 1;
+	condition_broadcast(&unpack->condition);
+	
+	mutex_unlock(&unpack->mutex);
+	
+	thread_join(&unpack->thread, NULL);
+	unpack->started = 0;
+	
+	return unpack->err;
+	
+}
+
+int stream_unpack_commit(
+	stream_unpack_t* const unpack,
+	const char* const prefix,
+	archive_entries_t* const entries
+) {
+	/*
+	Move the staged package files into the prefix.
+	
+	Entries are visited in archive order. A directory that does not exist in
+	the prefix yet is moved as a whole, and the entries under it are skipped;
+	otherwise, its contents are merged one by one. Other packages may be
+	committed at the same time.
+	
+	The list of extracted entries is handed over to the caller.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	size_t size = 0;
+	
+	const char* entry = NULL;
+	
+	char* source = NULL;
+	char* destination = NULL;
+	
+	for (index = 0; index < unpack->entries.offset; index++) {
+		entry = unpack->entries.items[index];
+		
+		if (strncmp(entry, "./", 2) == 0) {
+			entry += 2;
+		}
+		
+		size = strlen(entry);
+		
+		while (size > 0 && entry[size - 1] == '/') {
+			size--;
+		}
+		
+		if (size == 0) {
+			continue;
+		}
+		
+		free(source);
+		free(destination);
+		
+		source = malloc(strlen(unpack->directory) + strlen(PATHSEP_S) + size + 1);
+		destination = malloc(strlen(prefix) + strlen(PATHSEP_S) + size + 1);
+		
+		if (source == NULL || destination == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		strcpy(source, unpack->directory);
+		strcat(source, PATHSEP_S);
+		strncat(source, entry, size);
+		
+		strcpy(destination, prefix);
+		strcat(destination, PATHSEP_S);
+		strncat(destination, entry, size);
+		
+		/* Already moved along with its parent directory */
+		if (symlink_exists(source) != 1 && file_exists(source) != 1 && directory_exists(source) != 1) {
+			continue;
+		}
+		
+		if (symlink_exists(source) != 1 && directory_exists(source) == 1 && directory_exists(destination) == 1) {
+			continue;
+		}
+		
+		if (move_file(source, destination) == 0) {
+			continue;
+		}
+		
+		/* Another package created the same directory in the meantime */
+		if (symlink_exists(source) != 1 && directory_exists(source) == 1 && directory_exists(destination) == 1) {
+			continue;
+		}
+		
+		err = APTERR_FS_MOVE_FAILURE;
+		goto end;
+	}
+	
+	*entries = unpack->entries;
+	memset(&unpack->entries, 0, sizeof(unpack->entries));
+	
+	if (remove_directory(unpack->directory) != 0) {
+		err = APTERR_FS_RM_FAILURE;
+		goto end;
+	}
+	
+	end:;
+	
+	free(source);
+	free(destination);
+	
+	return err;
+	
+}
+
+void stream_unpack_free(stream_unpack_t* const unpack) {
+	/*
+	Stop the extractor if it is still running, and discard whatever was
+	staged but not committed.
+	*/
+	
+	char* separator = NULL;
+	
+	if (unpack->started) {
+		mutex_lock(&unpack->mutex);
+		
+		unpack->aborted = 1;
+		condition_broadcast(&unpack->condition);
+		
+		mutex_unlock(&unpack->mutex);
+		
+		thread_join(&unpack->thread, NULL);
+		unpack->started = 0;
+	}
+	
+	if (unpack->directory != NULL && directory_exists(unpack->directory) == 1) {
+		remove_directory(unpack->directory);
+	}
+	
+	/* Other packages may still be staged next to this one */
+	separator = (unpack->directory == NULL) ? NULL : strrchr(unpack->directory, PATHSEP);
+	
+	if (separator != NULL) {
+		*separator = '\0';
+		remove_empty_directory(unpack->directory);
+	}
+	
+	free(unpack->directory);
+	unpack->directory = NULL;
+	
+	free(unpack->buffer);
+	unpack->buffer = NULL;
+	
+	archive_members_free(&unpack->members);
+	archive_entries_free(&unpack->entries);
+	
+	condition_free(&unpack->condition);
+	mutex_free(&unpack->mutex);
+	
+}
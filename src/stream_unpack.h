@@ -0,0 +1,71 @@
+#if !defined(STREAM_UNPACK_H)
+#define STREAM_UNPACK_H
+
+#include <stddef.h>
+
+#include "os/thread.h"
+#include "uncompress.h"
+
+/* How much of a package may be received ahead of the extractor */
+#define STREAM_UNPACK_BUFFER_SIZE (1024 * 1024)
+
+/* Packages are extracted here, inside the prefix, until they are committed */
+#define STREAM_UNPACK_STAGING_DIRECTORY ".nouzen.staging"
+
+/* Paused transfers are resumed once no more than this much is left in the ring */
+#define STREAM_UNPACK_RESUME_LENGTH (STREAM_UNPACK_BUFFER_SIZE / 2)
+
+/* Returned by stream_unpack_write() when the bytes do not fit in the ring yet */
+#define STREAM_UNPACK_FULL (1)
+
+typedef void (*stream_unpack_wakeup_t)(void* const);
+
+struct StreamUnpack {
+	mutex_t mutex;
+	condition_t condition;
+	thread_t thread;
+	int started;
+	char* buffer;
+	size_t head;
+	size_t length;
+	size_t pending;
+	int closed;
+	int paused;
+	int aborted;
+	int done;
+	int err;
+	char* directory;
+	archive_members_t members;
+	archive_entries_t entries;
+	extract_stats_t stats;
+	stream_unpack_wakeup_t wakeup;
+	void* argument;
+};
+
+typedef struct StreamUnpack stream_unpack_t;
+
+int stream_unpack_open(
+	stream_unpack_t* const unpack,
+	const char* const prefix,
+	const char* const name
+);
+
+int stream_unpack_write(
+	stream_unpack_t* const unpack,
+	const char* const data,
+	const size_t size
+);
+
+int stream_unpack_resume(stream_unpack_t* const unpack);
+
+int stream_unpack_finish(stream_unpack_t* const unpack);
+
+int stream_unpack_commit(
+	stream_unpack_t* const unpack,
+	const char* const prefix,
+	archive_entries_t* const entries
+);
+
+void stream_unpack_free(stream_unpack_t* const unpack);
+
+#endif
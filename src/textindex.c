@@ -0,0 +1,1093 @@
+#include <ctype.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "errors.h"
+#include "fs/fstream.h"
+#include "fs/mmap.h"
+#include "fs/mv.h"
+#include "fs/rm.h"
+#include "textindex.h"
+
+/*
+On-disk layout of the index (all integers are little-endian):
+
+- Header (48 bytes): magic, version, number of documents, number of terms,
+  sum of all document lengths, signature of the package list it was built
+  from, size of the string table and size of the postings.
+- Document lengths: one 32-bit integer per document.
+- Term table: one 16-byte entry per term, sorted by term. Each entry holds the
+  offset of the term in the string table, its document frequency and the
+  offset of its posting list.
+- String table: NUL-terminated terms.
+- Postings: for each term, a sequence of (document delta, term frequency)
+  pairs encoded as varints.
+*/
+
+static const char TEXTINDEX_MAGIC[] = "NZTI";
+static const char TEXTINDEX_TEMPORARY_EXT[] = ".tmp";
+
+#define TEXTINDEX_VERSION (1)
+#define TEXTINDEX_HEADER_SIZE (48)
+#define TEXTINDEX_TERM_SIZE (16)
+#define TEXTINDEX_INITIAL_BUCKETS (16384)
+
+#define TEXTINDEX_BM25_K1 (1.2)
+#define TEXTINDEX_BM25_B (0.75)
+
+struct TextIndexTerm {
+	char* term;
+	size_t frequency;
+	size_t documents;
+	size_t last;
+	size_t size;
+	size_t offset;
+	unsigned char* postings;
+};
+
+typedef struct TextIndexTerm textindex_term_t;
+
+struct TextIndexTerms {
+	size_t buckets;
+	size_t count;
+	textindex_term_t** items;
+};
+
+typedef struct TextIndexTerms textindex_terms_t;
+
+static void put_uint32(unsigned char* const buffer, const unsigned long value) {
+	
+	buffer[0] = (unsigned char) (value & 0xFF);
+	buffer[1] = (unsigned char) ((value >> 8) & 0xFF);
+	buffer[2] = (unsigned char) ((value >> 16) & 0xFF);
+	buffer[3] = (unsigned char) ((value >> 24) & 0xFF);
+	
+}
+
+static void put_uint64(unsigned char* const buffer, const unsigned long long value) {
+	
+	put_uint32(buffer, (unsigned long) (value & 0xFFFFFFFFUL));
+	put_uint32(buffer + 4, (unsigned long) (value >> 32));
+	
+}
+
+static unsigned long get_uint32(const unsigned char* const buffer) {
+	
+	return (
+		((unsigned long) buffer[0]) |
+		(((unsigned long) buffer[1]) << 8) |
+		(((unsigned long) buffer[2]) << 16) |
+		(((unsigned long) buffer[3]) << 24)
+	);
+	
+}
+
+static unsigned long long get_uint64(const unsigned char* const buffer) {
+	
+	return ((unsigned long long) get_uint32(buffer)) | (((unsigned long long) get_uint32(buffer + 4)) << 32);
+	
+}
+
+static unsigned long hash_string(const char* const string) {
+	
+	const unsigned char* position = (const unsigned char*) string;
+	unsigned long hash = 2166136261UL;
+	
+	while (*position != '\0') {
+		hash ^= *position++;
+		hash *= 16777619UL;
+	}
+	
+	return hash;
+	
+}
+
+const char* textindex_next_token(
+	const char* const string,
+	char* const token
+) {
+	/*
+	Extract the next token from the string.
+	
+	Tokens are runs of ASCII letters and digits, lowercased and truncated
+	to TEXTINDEX_MAX_TOKEN_LEN characters. Single-character tokens are skipped.
+	
+	Returns a pointer to where the next token should be looked for, or
+	a null pointer if there are no more tokens.
+	*/
+	
+	const char* position = string;
+	size_t length = 0;
+	
+	while (1) {
+		while (*position != '\0' && !isalnum((unsigned char) *position)) {
+			position++;
+		}
+		
+		if (*position == '\0') {
+			return NULL;
+		}
+		
+		length = 0;
+		
+		while (isalnum((unsigned char) *position)) {
+			if (length < TEXTINDEX_MAX_TOKEN_LEN) {
+				token[length++] = (char) tolower((unsigned char) *position);
+			}
+			
+			position++;
+		}
+		
+		if (length > 1) {
+			break;
+		}
+	}
+	
+	token[length] = '\0';
+	
+	return position;
+	
+}
+
+static textindex_term_t** textindex_terms_lookup(
+	const textindex_terms_t* const terms,
+	const char* const term
+) {
+	
+	size_t bucket = 0;
+	
+	textindex_term_t** item = NULL;
+	
+	bucket = (size_t) (hash_string(term) & (terms->buckets - 1));
+	
+	while (1) {
+		item = &terms->items[bucket];
+		
+		if (*item == NULL || strcmp((*item)->term, term) == 0) {
+			break;
+		}
+		
+		bucket = (bucket + 1) & (terms->buckets - 1);
+	}
+	
+	return item;
+	
+}
+
+static int textindex_terms_grow(textindex_terms_t* const terms) {
+	
+	size_t bucket = 0;
+	
+	const size_t buckets = terms->buckets;
+	textindex_term_t** const items = terms->items;
+	
+	terms->buckets = (buckets == 0) ? TEXTINDEX_INITIAL_BUCKETS : buckets * 2;
+	terms->items = calloc(terms->buckets, sizeof(*terms->items));
+	
+	if (terms->items == NULL) {
+		terms->buckets = buckets;
+		terms->items = items;
+		
+		return APTERR_MEM_ALLOC_FAILURE;
+	}
+	
+	for (bucket = 0; bucket < buckets; bucket++) {
+		if (items[bucket] == NULL) {
+			continue;
+		}
+		
+		*textindex_terms_lookup(terms, items[bucket]->term) = items[bucket];
+	}
+	
+	free(items);
+	
+	return APTERR_SUCCESS;
+	
+}
+
+static textindex_term_t* textindex_terms_get(
+	textindex_terms_t* const terms,
+	const char* const term
+) {
+	
+	textindex_term_t** item = NULL;
+	
+	if (((terms->count + 1) * 10) > (terms->buckets * 7)) {
+		if (textindex_terms_grow(terms) != APTERR_SUCCESS) {
+			return NULL;
+		}
+	}
+	
+	item = textindex_terms_lookup(terms, term);
+	
+	if (*item != NULL) {
+		return *item;
+	}
+	
+	*item = calloc(1, sizeof(**item));
+	
+	if (*item == NULL) {
+		return NULL;
+	}
+	
+	(*item)->term = malloc(strlen(term) + 1);
+	
+	if ((*item)->term == NULL) {
+		free(*item);
+		*item = NULL;
+		
+		return NULL;
+	}
+	
+	strcpy((*item)->term, term);
+	
+	terms->count++;
+	
+	return *item;
+	
+}
+
+static void textindex_terms_free(textindex_terms_t* const terms) {
+	
+	size_t bucket = 0;
+	
+	textindex_term_t* item = NULL;
+	
+	for (bucket = 0; bucket < terms->buckets; bucket++) {
+		item = terms->items[bucket];
+		
+		if (item == NULL) {
+			continue;
+		}
+		
+		free(item->term);
+		free(item->postings);
+		free(item);
+	}
+	
+	free(terms->items);
+	terms->items = NULL;
+	
+	terms->buckets = 0;
+	terms->count = 0;
+	
+}
+
+static int textindex_term_put_varint(
+	textindex_term_t* const term,
+	unsigned long long value
+) {
+	
+	size_t size = 0;
+	unsigned char* postings = NULL;
+	
+	if ((term->offset + 10) > term->size) {
+		size = (term->size == 0) ? 16 : term->size * 2;
+		postings = realloc(term->postings, size);
+		
+		if (postings == NULL) {
+			return APTERR_MEM_ALLOC_FAILURE;
+		}
+		
+		term->size = size;
+		term->postings = postings;
+	}
+	
+	while (value >= 0x80) {
+		term->postings[term->offset++] = (unsigned char) ((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	
+	term->postings[term->offset++] = (unsigned char) value;
+	
+	return APTERR_SUCCESS;
+	
+}
+
+static const unsigned char* get_varint(
+	const unsigned char* position,
+	const unsigned char* const end,
+	unsigned long long* const value
+) {
+	
+	int shift = 0;
+	
+	*value = 0;
+	
+	while (position < end && shift < 64) {
+		*value |= ((unsigned long long) (*position & 0x7F)) << shift;
+		
+		if ((*position++ & 0x80) == 0) {
+			return position;
+		}
+		
+		shift += 7;
+	}
+	
+	return NULL;
+	
+}
+
+static int term_compare(const void* const a, const void* const b) {
+	
+	const textindex_term_t* const x = *(const textindex_term_t* const*) a;
+	const textindex_term_t* const y = *(const textindex_term_t* const*) b;
+	
+	return strcmp(x->term, y->term);
+	
+}
+
+static int textindex_add_text(
+	textindex_terms_t* const terms,
+	const char* const text,
+	textindex_term_t*** const touched,
+	size_t* const touched_count,
+	size_t* const touched_size,
+	size_t* const length
+) {
+	
+	const char* position = text;
+	char token[TEXTINDEX_MAX_TOKEN_LEN + 1];
+	
+	textindex_term_t* term = NULL;
+	textindex_term_t** items = NULL;
+	
+	if (text == NULL) {
+		return APTERR_SUCCESS;
+	}
+	
+	while ((position = textindex_next_token(position, token)) != NULL) {
+		term = textindex_terms_get(terms, token);
+		
+		if (term == NULL) {
+			return APTERR_MEM_ALLOC_FAILURE;
+		}
+		
+		(*length)++;
+		
+		if (term->frequency++ != 0) {
+			continue;
+		}
+		
+		if (*touched_count == *touched_size) {
+			*touched_size = (*touched_size == 0) ? 64 : *touched_size * 2;
+			items = realloc(*touched, sizeof(**touched) * (*touched_size));
+			
+			if (items == NULL) {
+				return APTERR_MEM_ALLOC_FAILURE;
+			}
+			
+			*touched = items;
+		}
+		
+		(*touched)[(*touched_count)++] = term;
+	}
+	
+	return APTERR_SUCCESS;
+	
+}
+
+int textindex_build(
+	const char* const filename,
+	pkg_t* const* const documents,
+	const size_t count,
+	const unsigned long long signature
+) {
+	/*
+	Build an inverted index over the names and descriptions of the given
+	packages and save it to disk.
+	
+	Document ids are positions in the given package list. The index is
+	first written to a temporary file and then moved into place, so that
+	concurrent readers never see a partially written index.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index = 0;
+	size_t subindex = 0;
+	size_t length = 0;
+	
+	unsigned long long total_length = 0;
+	unsigned long long strings_size = 0;
+	unsigned long long postings_size = 0;
+	
+	unsigned char header[TEXTINDEX_HEADER_SIZE];
+	unsigned char entry[TEXTINDEX_TERM_SIZE];
+	
+	unsigned char* lengths = NULL;
+	
+	char* temporary = NULL;
+	
+	textindex_terms_t terms = {0};
+	
+	textindex_term_t* term = NULL;
+	textindex_term_t** sorted = NULL;
+	
+	textindex_term_t** touched = NULL;
+	size_t touched_count = 0;
+	size_t touched_size = 0;
+	
+	fstream_t* stream = NULL;
+	
+	const pkg_t* pkg = NULL;
+	
+	lengths = malloc((count == 0) ? 1 : count * 4);
+	
+	if (lengths == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	for (index = 0; index < count; index++) {
+		pkg = documents[index];
+		
+		length = 0;
+		touched_count = 0;
+		
+		err = textindex_add_text(&terms, pkg->name, &touched, &touched_count, &touched_size, &length);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+		
+		err = textindex_add_text(&terms, pkg->description, &touched, &touched_count, &touched_size, &length);
+		
+		if (err != APTERR_SUCCESS) {
+			goto end;
+		}
+		
+		for (subindex = 0; subindex < touched_count; subindex++) {
+			term = touched[subindex];
+			
+			/* Document ids are delta-coded against the previous document in the same posting list */
+			err = textindex_term_put_varint(term, (unsigned long long) (index - term->last));
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+			
+			err = textindex_term_put_varint(term, (unsigned long long) term->frequency);
+			
+			if (err != APTERR_SUCCESS) {
+				goto end;
+			}
+			
+			term->last = index;
+			term->frequency = 0;
+			term->documents++;
+		}
+		
+		put_uint32(lengths + (index * 4), (unsigned long) length);
+		total_length += length;
+	}
+	
+	sorted = malloc(sizeof(*sorted) * ((terms.count == 0) ? 1 : terms.count));
+	
+	if (sorted == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	subindex = 0;
+	
+	for (index = 0; index < terms.buckets; index++) {
+		if (terms.items[index] == NULL) {
+			continue;
+		}
+		
+		term = terms.items[index];
+		
+		sorted[subindex++] = term;
+		
+		strings_size += strlen(term->term) + 1;
+		postings_size += term->offset;
+	}
+	
+	qsort(sorted, terms.count, sizeof(*sorted), term_compare);
+	
+	temporary = malloc(strlen(filename) + strlen(TEXTINDEX_TEMPORARY_EXT) + 1);
+	
+	if (temporary == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	strcpy(temporary, filename);
+	strcat(temporary, TEXTINDEX_TEMPORARY_EXT);
+	
+	stream = fstream_open(temporary, FSTREAM_WRITE);
+	
+	if (stream == NULL) {
+		err = APTERR_FSTREAM_OPEN_FAILURE;
+		goto end;
+	}
+	
+	memcpy(header, TEXTINDEX_MAGIC, 4);
+	put_uint32(header + 4, TEXTINDEX_VERSION);
+	put_uint32(header + 8, (unsigned long) count);
+	put_uint32(header + 12, (unsigned long) terms.count);
+	put_uint64(header + 16, total_length);
+	put_uint64(header + 24, signature);
+	put_uint64(header + 32, strings_size);
+	put_uint64(header + 40, postings_size);
+	
+	if (fstream_write(stream, (char*) header, sizeof(header)) == -1) {
+		err = APTERR_FSTREAM_WRITE_FAILURE;
+		goto end;
+	}
+	
+	if (count > 0 && fstream_write(stream, (char*) lengths, count * 4) == -1) {
+		err = APTERR_FSTREAM_WRITE_FAILURE;
+		goto end;
+	}
+	
+	strings_size = 0;
+	postings_size = 0;
+	
+	for (index = 0; index < terms.count; index++) {
+		term = sorted[index];
+		
+		put_uint32(entry, (unsigned long) strings_size);
+		put_uint32(entry + 4, (unsigned long) term->documents);
+		put_uint64(entry + 8, postings_size);
+		
+		if (fstream_write(stream, (char*) entry, sizeof(entry)) == -1) {
+			err = APTERR_FSTREAM_WRITE_FAILURE;
+			goto end;
+		}
+		
+		strings_size += strlen(term->term) + 1;
+		postings_size += term->offset;
+	}
+	
+	for (index = 0; index < terms.count; index++) {
+		term = sorted[index];
+		
+		if (fstream_write(stream, term->term, strlen(term->term) + 1) == -1) {
+			err = APTERR_FSTREAM_WRITE_FAILURE;
+			goto end;
+		}
+	}
+	
+	for (index = 0; index < terms.count; index++) {
+		term = sorted[index];
+		
+		if (fstream_write(stream, (char*) term->postings, term->offset) == -1) {
+			err = APTERR_FSTREAM_WRITE_FAILURE;
+			goto end;
+		}
+	}
+	
+	fstream_close(stream);
+	stream = NULL;
+	
+	if (move_file(temporary, filename) != 0) {
+		err = APTERR_FS_MOVE_FAILURE;
+		goto end;
+	}
+	
+	end:;
+	
+	if (stream != NULL) {
+		fstream_close(stream);
+	}
+	
+	if (err != APTERR_SUCCESS && temporary != NULL) {
+		remove_file(temporary);
+	}
+	
+	free(temporary);
+	free(lengths);
+	free(sorted);
+	free(touched);
+	
+	textindex_terms_free(&terms);
+	
+	return err;
+	
+}
+
+int textindex_open(
+	textindex_t* const index,
+	const char* const filename
+) {
+	/*
+	Map a previously built index into memory.
+	
+	Returns (0) on success, or an APTERR_* code if the file does not
+	exist or is not a valid index.
+	*/
+	
+	const unsigned char* data = NULL;
+	unsigned long long expected = 0;
+	
+	memset(index, 0, sizeof(*index));
+	
+	if (map_file(filename, &index->file) != 0) {
+		return APTERR_FSTREAM_OPEN_FAILURE;
+	}
+	
+	data = index->file.data;
+	
+	if (index->file.size < TEXTINDEX_HEADER_SIZE || memcmp(data, TEXTINDEX_MAGIC, 4) != 0 || get_uint32(data + 4) != TEXTINDEX_VERSION) {
+		textindex_close(index);
+		return APTERR_TEXTINDEX_CORRUPTED;
+	}
+	
+	index->documents = (size_t) get_uint32(data + 8);
+	index->terms = (size_t) get_uint32(data + 12);
+	index->signature = get_uint64(data + 24);
+	index->strings_size = (size_t) get_uint64(data + 32);
+	index->postings_size = get_uint64(data + 40);
+	
+	expected = TEXTINDEX_HEADER_SIZE + (index->documents * 4ULL) + (index->terms * (unsigned long long) TEXTINDEX_TERM_SIZE) + index->strings_size + index->postings_size;
+	
+	if (expected != index->file.size) {
+		textindex_close(index);
+		return APTERR_TEXTINDEX_CORRUPTED;
+	}
+	
+	index->average_length = (index->documents == 0) ? 0 : ((double) get_uint64(data + 16)) / index->documents;
+	
+	index->lengths = data + TEXTINDEX_HEADER_SIZE;
+	index->table = index->lengths + (index->documents * 4);
+	index->strings = (const char*) (index->table + (index->terms * TEXTINDEX_TERM_SIZE));
+	index->postings = ((const unsigned char*) index->strings) + index->strings_size;
+	
+	return APTERR_SUCCESS;
+	
+}
+
+static const unsigned char* textindex_find_term(
+	const textindex_t* const index,
+	const char* const term,
+	const unsigned char** const end,
+	size_t* const frequency
+) {
+	
+	size_t low = 0;
+	size_t high = index->terms;
+	size_t middle = 0;
+	
+	int status = 0;
+	
+	unsigned long offset = 0;
+	unsigned long long start = 0;
+	unsigned long long stop = 0;
+	
+	const unsigned char* entry = NULL;
+	
+	while (low < high) {
+		middle = low + ((high - low) / 2);
+		entry = index->table + (middle * TEXTINDEX_TERM_SIZE);
+		
+		offset = get_uint32(entry);
+		
+		if (offset >= index->strings_size) {
+			return NULL;
+		}
+		
+		status = strcmp(term, index->strings + offset);
+		
+		if (status == 0) {
+			break;
+		}
+		
+		if (status < 0) {
+			high = middle;
+		} else {
+			low = middle + 1;
+		}
+	}
+	
+	if (low >= high) {
+		return NULL;
+	}
+	
+	*frequency = (size_t) get_uint32(entry + 4);
+	
+	start = get_uint64(entry + 8);
+	stop = ((middle + 1) == index->terms) ? index->postings_size : get_uint64(entry + TEXTINDEX_TERM_SIZE + 8);
+	
+	if (start > stop || stop > index->postings_size) {
+		return NULL;
+	}
+	
+	*end = index->postings + stop;
+	
+	return index->postings + start;
+	
+}
+
+static size_t* scores_lookup(
+	const textindex_scores_t* const scores,
+	const size_t document
+) {
+	
+	size_t bucket = (size_t) ((document * 2654435761UL) & (scores->buckets - 1));
+	
+	while (scores->slots[bucket] != 0 && scores->items[scores->slots[bucket] - 1] != document) {
+		bucket = (bucket + 1) & (scores->buckets - 1);
+	}
+	
+	return &scores->slots[bucket];
+	
+}
+
+static int scores_grow(textindex_scores_t* const scores) {
+	/*
+	Make room for one more scored document, keeping the table of slots at
+	most half full.
+	*/
+	
+	size_t index = 0;
+	size_t size = 0;
+	size_t buckets = 0;
+	
+	size_t* items = NULL;
+	size_t* slots = NULL;
+	double* values = NULL;
+	
+	if (scores->offset == scores->size) {
+		size = (scores->size == 0) ? 256 : scores->size * 2;
+		
+		items = realloc(scores->items, sizeof(*scores->items) * size);
+		
+		if (items == NULL) {
+			return APTERR_MEM_ALLOC_FAILURE;
+		}
+		
+		scores->items = items;
+		
+		values = realloc(scores->values, sizeof(*scores->values) * size);
+		
+		if (values == NULL) {
+			return APTERR_MEM_ALLOC_FAILURE;
+		}
+		
+		scores->values = values;
+		scores->size = size;
+	}
+	
+	if ((scores->offset + 1) * 2 <= scores->buckets) {
+		return APTERR_SUCCESS;
+	}
+	
+	buckets = (scores->buckets == 0) ? 512 : scores->buckets * 2;
+	slots = calloc(buckets, sizeof(*slots));
+	
+	if (slots == NULL) {
+		return APTERR_MEM_ALLOC_FAILURE;
+	}
+	
+	free(scores->slots);
+	
+	scores->slots = slots;
+	scores->buckets = buckets;
+	
+	for (index = 0; index < scores->offset; index++) {
+		*scores_lookup(scores, scores->items[index]) = index + 1;
+	}
+	
+	return APTERR_SUCCESS;
+	
+}
+
+int textindex_boost(
+	textindex_scores_t* const scores,
+	const size_t document,
+	const double value
+) {
+	/*
+	Add the given value to the score of a document.
+	
+	Only the documents that were scored at all are kept, so this costs the
+	same whatever the size of the index.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t* slot = NULL;
+	
+	if (scores->buckets != 0) {
+		slot = scores_lookup(scores, document);
+		
+		if (*slot != 0) {
+			scores->values[*slot - 1] += value;
+			return APTERR_SUCCESS;
+		}
+	}
+	
+	err = scores_grow(scores);
+	
+	if (err != APTERR_SUCCESS) {
+		return err;
+	}
+	
+	slot = scores_lookup(scores, document);
+	*slot = scores->offset + 1;
+	
+	scores->items[scores->offset] = document;
+	scores->values[scores->offset] = value;
+	scores->offset++;
+	
+	return APTERR_SUCCESS;
+	
+}
+
+int textindex_score(
+	const textindex_t* const index,
+	const char* const query,
+	textindex_scores_t* const scores
+) {
+	/*
+	Score all documents matching any of the query terms using BM25.
+	
+	Only documents with a non-zero score are tracked, so that selecting the
+	best matches afterwards does not need to look at the whole index.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	const char* position = query;
+	const char* previous = NULL;
+	char token[TEXTINDEX_MAX_TOKEN_LEN + 1];
+	char other[TEXTINDEX_MAX_TOKEN_LEN + 1];
+	
+	const unsigned char* postings = NULL;
+	const unsigned char* end = NULL;
+	
+	size_t frequency = 0;
+	size_t document = 0;
+	
+	unsigned long long delta = 0;
+	unsigned long long count = 0;
+	
+	double idf = 0;
+	double length = 0;
+	double value = 0;
+	
+	while ((position = textindex_next_token(position, token)) != NULL) {
+		/* Repeated query terms are only scored once */
+		previous = query;
+		
+		while ((previous = textindex_next_token(previous, other)) != NULL && previous < position) {
+			if (strcmp(token, other) == 0) {
+				break;
+			}
+		}
+		
+		if (previous != NULL && previous < position) {
+			continue;
+		}
+		
+		postings = textindex_find_term(index, token, &end, &frequency);
+		
+		if (postings == NULL) {
+			continue;
+		}
+		
+		idf = log(1 + ((index->documents - frequency + 0.5) / (frequency + 0.5)));
+		document = 0;
+		
+		while (postings < end) {
+			postings = get_varint(postings, end, &delta);
+			
+			if (postings == NULL) {
+				return APTERR_TEXTINDEX_CORRUPTED;
+			}
+			
+			postings = get_varint(postings, end, &count);
+			
+			if (postings == NULL) {
+				return APTERR_TEXTINDEX_CORRUPTED;
+			}
+			
+			document += (size_t) delta;
+			
+			if (document >= index->documents) {
+				return APTERR_TEXTINDEX_CORRUPTED;
+			}
+			
+			length = (double) get_uint32(index->lengths + (document * 4));
+			
+			value = idf * (count * (TEXTINDEX_BM25_K1 + 1)) / (
+				count + TEXTINDEX_BM25_K1 * (1 - TEXTINDEX_BM25_B + TEXTINDEX_BM25_B * (length / index->average_length))
+			);
+			
+			err = textindex_boost(scores, document, value);
+			
+			if (err != APTERR_SUCCESS) {
+				return err;
+			}
+		}
+	}
+	
+	return err;
+	
+}
+
+static int hit_is_better(const textindex_hit_t* const a, const textindex_hit_t* const b) {
+	
+	if (a->score != b->score) {
+		return a->score > b->score;
+	}
+	
+	return a->document < b->document;
+	
+}
+
+static int hit_compare(const void* const a, const void* const b) {
+	
+	const textindex_hit_t* const x = a;
+	const textindex_hit_t* const y = b;
+	
+	if (hit_is_better(x, y)) {
+		return -1;
+	}
+	
+	if (hit_is_better(y, x)) {
+		return 1;
+	}
+	
+	return 0;
+	
+}
+
+int textindex_top(
+	const textindex_scores_t* const scores,
+	const size_t maximum,
+	textindex_hits_t* const hits
+) {
+	/*
+	Select the best scored documents, ordered from best to worst.
+	
+	This keeps a min-heap of at most the requested number of hits, so that
+	only those are ever materialized.
+	*/
+	
+	size_t index = 0;
+	size_t parent = 0;
+	size_t child = 0;
+	
+	textindex_hit_t hit = {0};
+	textindex_hit_t swap = {0};
+	
+	textindex_hit_t* items = NULL;
+	
+	hits->offset = 0;
+	
+	if (maximum == 0) {
+		return APTERR_SUCCESS;
+	}
+	
+	if (hits->size < maximum) {
+		items = realloc(hits->items, sizeof(*hits->items) * maximum);
+		
+		if (items == NULL) {
+			return APTERR_MEM_ALLOC_FAILURE;
+		}
+		
+		hits->size = maximum;
+		hits->items = items;
+	}
+	
+	items = hits->items;
+	
+	for (index = 0; index < scores->offset; index++) {
+		hit.document = scores->items[index];
+		hit.score = scores->values[index];
+		
+		if (hits->offset < maximum) {
+			child = hits->offset++;
+			items[child] = hit;
+			
+			while (child > 0) {
+				parent = (child - 1) / 2;
+				
+				if (!hit_is_better(&items[parent], &items[child])) {
+					break;
+				}
+				
+				swap = items[parent];
+				items[parent] = items[child];
+				items[child] = swap;
+				
+				child = parent;
+			}
+			
+			continue;
+		}
+		
+		if (!hit_is_better(&hit, &items[0])) {
+			continue;
+		}
+		
+		items[0] = hit;
+		parent = 0;
+		
+		while (1) {
+			child = (parent * 2) + 1;
+			
+			if (child >= hits->offset) {
+				break;
+			}
+			
+			if ((child + 1) < hits->offset && hit_is_better(&items[child], &items[child + 1])) {
+				child++;
+			}
+			
+			if (!hit_is_better(&items[parent], &items[child])) {
+				break;
+			}
+			
+			swap = items[parent];
+			items[parent] = items[child];
+			items[child] = swap;
+			
+			parent = child;
+		}
+	}
+	
+	qsort(items, hits->offset, sizeof(*items), hit_compare);
+	
+	return APTERR_SUCCESS;
+	
+}
+
+void textindex_close(textindex_t* const index) {
+	
+	unmap_file(&index->file);
+	memset(index, 0, sizeof(*index));
+	
+}
+
+void textindex_scores_free(textindex_scores_t* const scores) {
+	
+	free(scores->items);
+	scores->items = NULL;
+	
+	free(scores->values);
+	scores->values = NULL;
+	
+	free(scores->slots);
+	scores->slots = NULL;
+	
+	scores->buckets = 0;
+	scores->size = 0;
+	scores->offset = 0;
+	
+}
+
+void textindex_hits_free(textindex_hits_t* const hits) {
+	
+	free(hits->items);
+	hits->items = NULL;
+	
+	hits->size = 0;
+	hits->offset = 0;
+	
+}
@@ -0,0 +1,93 @@
+#if !defined(TEXTINDEX_H)
+#define TEXTINDEX_H
+
+#include <stddef.h>
+
+#include "fs/mmap.h"
+#include "package.h"
+
+#define TEXTINDEX_MAX_TOKEN_LEN (32)
+#define TEXTINDEX_NAME_BOOST (100.0)
+
+struct TextIndex {
+	mapped_file_t file;
+	size_t documents;
+	size_t terms;
+	double average_length;
+	unsigned long long signature;
+	const unsigned char* lengths;
+	const unsigned char* table;
+	const char* strings;
+	size_t strings_size;
+	const unsigned char* postings;
+	unsigned long long postings_size;
+};
+
+typedef struct TextIndex textindex_t;
+
+struct TextIndexScores {
+	size_t size;
+	size_t offset;
+	size_t* items;
+	double* values;
+	size_t buckets;
+	size_t* slots;
+};
+
+typedef struct TextIndexScores textindex_scores_t;
+
+struct TextIndexHit {
+	size_t document;
+	double score;
+};
+
+typedef struct TextIndexHit textindex_hit_t;
+
+struct TextIndexHits {
+	size_t size;
+	size_t offset;
+	textindex_hit_t* items;
+};
+
+typedef struct TextIndexHits textindex_hits_t;
+
+const char* textindex_next_token(
+	const char* const string,
+	char* const token
+);
+
+int textindex_build(
+	const char* const filename,
+	pkg_t* const* const documents,
+	const size_t count,
+	const unsigned long long signature
+);
+
+int textindex_open(
+	textindex_t* const index,
+	const char* const filename
+);
+
+int textindex_score(
+	const textindex_t* const index,
+	const char* const query,
+	textindex_scores_t* const scores
+);
+
+int textindex_boost(
+	textindex_scores_t* const scores,
+	const size_t document,
+	const double value
+);
+
+int textindex_top(
+	const textindex_scores_t* const scores,
+	const size_t maximum,
+	textindex_hits_t* const hits
+);
+
+void textindex_close(textindex_t* const index);
+void textindex_scores_free(textindex_scores_t* const scores);
+void textindex_hits_free(textindex_hits_t* const hits);
+
+#endif
@@ -0,0 +1,384 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trigram.h"
+#include "errors.h"
+
+#define TRIGRAM_INITIAL_BUCKETS (4096)
+#define TRIGRAM_INITIAL_POSTINGS (4)
+
+static unsigned long trigram_pack(const char* const string) {
+	
+	const unsigned char* const value = (const unsigned char*) string;
+	
+	return (((unsigned long) value[0]) << 16) | (((unsigned long) value[1]) << 8) | ((unsigned long) value[2]);
+	
+}
+
+static trigram_posting_t* trigram_index_lookup(
+	const trigram_index_t* const index,
+	const unsigned long trigram
+) {
+	/*
+	Find the bucket holding the posting list for this trigram.
+	
+	Returns the matching bucket, or the first empty one where it
+	would have been inserted.
+	*/
+	
+	size_t bucket = 0;
+	
+	trigram_posting_t* posting = NULL;
+	
+	bucket = (size_t) ((trigram * 2654435761UL) & (index->buckets - 1));
+	
+	while (1) {
+		posting = &index->postings[bucket];
+		
+		if (posting->size == 0 || posting->trigram == trigram) {
+			break;
+		}
+		
+		bucket = (bucket + 1) & (index->buckets - 1);
+	}
+	
+	return posting;
+	
+}
+
+static int trigram_index_grow(trigram_index_t* const index) {
+	
+	size_t bucket = 0;
+	
+	const size_t buckets = index->buckets;
+	trigram_posting_t* const postings = index->postings;
+	
+	trigram_posting_t* posting = NULL;
+	
+	index->buckets = (buckets == 0) ? TRIGRAM_INITIAL_BUCKETS : buckets * 2;
+	index->postings = calloc(index->buckets, sizeof(*index->postings));
+	
+	if (index->postings == NULL) {
+		index->buckets = buckets;
+		index->postings = postings;
+		
+		return APTERR_MEM_ALLOC_FAILURE;
+	}
+	
+	for (bucket = 0; bucket < buckets; bucket++) {
+		if (postings[bucket].size == 0) {
+			continue;
+		}
+		
+		posting = trigram_index_lookup(index, postings[bucket].trigram);
+		*posting = postings[bucket];
+	}
+	
+	free(postings);
+	
+	return APTERR_SUCCESS;
+	
+}
+
+static int trigram_index_insert(
+	trigram_index_t* const index,
+	const unsigned long trigram,
+	const size_t id
+) {
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t size = 0;
+	size_t* items = NULL;
+	
+	trigram_posting_t* posting = NULL;
+	
+	if (((index->count + 1) * 10) > (index->buckets * 7)) {
+		err = trigram_index_grow(index);
+		
+		if (err != APTERR_SUCCESS) {
+			return err;
+		}
+	}
+	
+	posting = trigram_index_lookup(index, trigram);
+	
+	if (posting->size == 0) {
+		posting->items = malloc(sizeof(*posting->items) * TRIGRAM_INITIAL_POSTINGS);
+		
+		if (posting->items == NULL) {
+			return APTERR_MEM_ALLOC_FAILURE;
+		}
+		
+		posting->trigram = trigram;
+		posting->size = TRIGRAM_INITIAL_POSTINGS;
+		posting->offset = 0;
+		
+		index->count++;
+	}
+	
+	/* Ids are always inserted in ascending order, so duplicates can only be the last item */
+	if (posting->offset > 0 && posting->items[posting->offset - 1] == id) {
+		return APTERR_SUCCESS;
+	}
+	
+	if (posting->offset == posting->size) {
+		size = posting->size * 2;
+		items = realloc(posting->items, sizeof(*posting->items) * size);
+		
+		if (items == NULL) {
+			return APTERR_MEM_ALLOC_FAILURE;
+		}
+		
+		posting->size = size;
+		posting->items = items;
+	}
+	
+	posting->items[posting->offset++] = id;
+	
+	return err;
+	
+}
+
+static int trigram_index_add_string(
+	trigram_index_t* const index,
+	const char* const string,
+	const size_t id
+) {
+	
+	int err = APTERR_SUCCESS;
+	
+	const char* position = NULL;
+	
+	if (string == NULL) {
+		return err;
+	}
+	
+	for (position = string; position[0] != '\0' && position[1] != '\0' && position[2] != '\0'; position++) {
+		err = trigram_index_insert(index, trigram_pack(position), id);
+		
+		if (err != APTERR_SUCCESS) {
+			break;
+		}
+	}
+	
+	return err;
+	
+}
+
+int trigram_index_add(
+	trigram_index_t* const index,
+	pkg_t* const pkg
+) {
+	/*
+	Add the package to the index.
+	
+	Its name, provided names and replaced names are split into trigrams,
+	each one pointing back to the package through its position in the
+	index. Packages must be added in the same order they are expected to
+	be returned by searches.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t id = 0;
+	size_t size = 0;
+	pkg_t** items = NULL;
+	
+	if (index->offset == index->size) {
+		size = (index->size == 0) ? 1024 : index->size * 2;
+		items = realloc(index->items, sizeof(*index->items) * size);
+		
+		if (items == NULL) {
+			return APTERR_MEM_ALLOC_FAILURE;
+		}
+		
+		index->size = size;
+		index->items = items;
+	}
+	
+	id = index->offset;
+	index->items[index->offset++] = pkg;
+	
+	err = trigram_index_add_string(index, pkg->name, id);
+	
+	if (err != APTERR_SUCCESS) {
+		return err;
+	}
+	
+	err = trigram_index_add_string(index, pkg->provides, id);
+	
+	if (err != APTERR_SUCCESS) {
+		return err;
+	}
+	
+	err = trigram_index_add_string(index, pkg->replaces, id);
+	
+	return err;
+	
+}
+
+static int posting_compare(const void* const a, const void* const b) {
+	
+	const trigram_posting_t* const x = *(const trigram_posting_t* const*) a;
+	const trigram_posting_t* const y = *(const trigram_posting_t* const*) b;
+	
+	if (x->offset < y->offset) {
+		return -1;
+	}
+	
+	if (x->offset > y->offset) {
+		return 1;
+	}
+	
+	return 0;
+	
+}
+
+int trigram_index_query(
+	const trigram_index_t* const index,
+	const char* const query,
+	trigram_candidates_t* const candidates
+) {
+	/*
+	Collect the ids of all packages that contain every trigram of the query.
+	
+	Candidates are returned in ascending order. They are not guaranteed to
+	match the query and must be verified by the caller.
+	
+	Returns (1) if the query is too short to be looked up in the index, (0) on
+	success, or an APTERR_* code on error.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	
+	size_t index_a = 0;
+	size_t index_b = 0;
+	size_t position = 0;
+	size_t count = 0;
+	size_t length = 0;
+	
+	const size_t* items = NULL;
+	size_t* buffer = NULL;
+	size_t offset = 0;
+	
+	const trigram_posting_t** postings = NULL;
+	const trigram_posting_t* posting = NULL;
+	
+	candidates->offset = 0;
+	
+	length = strlen(query);
+	
+	if (length < 3 || index->buckets == 0) {
+		return 1;
+	}
+	
+	postings = malloc(sizeof(*postings) * (length - 2));
+	
+	if (postings == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	for (position = 0; position < (length - 2); position++) {
+		posting = trigram_index_lookup(index, trigram_pack(query + position));
+		
+		/* No package contains this trigram, so nothing can match */
+		if (posting->size == 0) {
+			goto end;
+		}
+		
+		for (index_a = 0; index_a < count; index_a++) {
+			if (postings[index_a] == posting) {
+				break;
+			}
+		}
+		
+		if (index_a == count) {
+			postings[count++] = posting;
+		}
+	}
+	
+	/* Start from the shortest posting list, so that intersections only ever shrink it */
+	qsort((void*) postings, count, sizeof(*postings), posting_compare);
+	
+	if (candidates->size < postings[0]->offset) {
+		buffer = realloc(candidates->items, sizeof(*candidates->items) * postings[0]->offset);
+		
+		if (buffer == NULL) {
+			err = APTERR_MEM_ALLOC_FAILURE;
+			goto end;
+		}
+		
+		candidates->size = postings[0]->offset;
+		candidates->items = buffer;
+	}
+	
+	memcpy(candidates->items, postings[0]->items, sizeof(*candidates->items) * postings[0]->offset);
+	candidates->offset = postings[0]->offset;
+	
+	for (position = 1; position < count && candidates->offset > 0; position++) {
+		posting = postings[position];
+		
+		items = posting->items;
+		offset = 0;
+		
+		index_a = 0;
+		index_b = 0;
+		
+		while (index_a < candidates->offset && index_b < posting->offset) {
+			if (candidates->items[index_a] < items[index_b]) {
+				index_a++;
+			} else if (candidates->items[index_a] > items[index_b]) {
+				index_b++;
+			} else {
+				candidates->items[offset++] = candidates->items[index_a];
+				
+				index_a++;
+				index_b++;
+			}
+		}
+		
+		candidates->offset = offset;
+	}
+	
+	end:;
+	
+	free((void*) postings);
+	
+	return err;
+	
+}
+
+void trigram_index_free(trigram_index_t* const index) {
+	
+	size_t bucket = 0;
+	
+	for (bucket = 0; bucket < index->buckets; bucket++) {
+		free(index->postings[bucket].items);
+	}
+	
+	free(index->postings);
+	index->postings = NULL;
+	
+	free(index->items);
+	index->items = NULL;
+	
+	index->size = 0;
+	index->offset = 0;
+	index->buckets = 0;
+	index->count = 0;
+	index->ready = 0;
+	
+}
+
+void trigram_candidates_free(trigram_candidates_t* const candidates) {
+	
+	free(candidates->items);
+	candidates->items = NULL;
+	
+	candidates->size = 0;
+	candidates->offset = 0;
+	
+}
@@ -0,0 +1,55 @@
+#if !defined(TRIGRAM_H)
+#define TRIGRAM_H
+
+#include <stddef.h>
+
+#if !defined(_WIN32)
+	#include <sys/types.h>
+#endif
+
+#include "package.h"
+
+struct TrigramPosting {
+	unsigned long trigram;
+	size_t size;
+	size_t offset;
+	size_t* items;
+};
+
+typedef struct TrigramPosting trigram_posting_t;
+
+struct TrigramIndex {
+	size_t size;
+	size_t offset;
+	pkg_t** items;
+	size_t buckets;
+	size_t count;
+	trigram_posting_t* postings;
+	int ready;
+};
+
+typedef struct TrigramIndex trigram_index_t;
+
+struct TrigramCandidates {
+	size_t size;
+	size_t offset;
+	size_t* items;
+};
+
+typedef struct TrigramCandidates trigram_candidates_t;
+
+int trigram_index_add(
+	trigram_index_t* const index,
+	pkg_t* const pkg
+);
+
+int trigram_index_query(
+	const trigram_index_t* const index,
+	const char* const query,
+	trigram_candidates_t* const candidates
+);
+
+void trigram_index_free(trigram_index_t* const index);
+void trigram_candidates_free(trigram_candidates_t* const candidates);
+
+#endif
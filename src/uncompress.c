@@ -1,7 +1,8 @@
+#include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
-#include <locale.h>
 #include <sys/types.h>
 
 #include <archive.h>
@@ -12,64 +13,370 @@
 #endif
 
 #include "uncompress.h"
+#include "decompress.h"
+#include "fs/absrel.h"
+#include "fs/mmap.h"
 
-static const size_t ARCHIVE_BLOCK_SIZE = 10240;
+/* Archives are read (and decoded) in blocks of this size */
+static size_t uncompress_block_size = UNCOMPRESS_BLOCK_SIZE;
+
+/* xz and zstd streams are decoded on separate threads when this is above 1 */
+static size_t uncompress_threads = 1;
+
+/* The umask of the process, read once at startup */
+static int uncompress_umask = 0;
+
+/* The only members of control.tar.* that are needed after unpacking */
+static const char* const CONTROL_MEMBERS[] = {
+	"preinst",
+	"postinst",
+	"prerm",
+	"postrm",
+	"conffiles"
+};
+
+struct NestedArchive {
+	struct archive* parent;
+	char* buffer;
+	decompress_t decompress;
+	int decoding;
+};
+
+typedef struct NestedArchive nested_archive_t;
+
+struct UncompressReader {
+	uncompress_read_callback_t callback;
+	void* data;
+};
+
+typedef struct UncompressReader uncompress_reader_t;
+
+struct UncompressSource {
+	const char* data;
+	size_t size;
+	size_t offset;
+};
+
+typedef struct UncompressSource uncompress_source_t;
+
+void uncompress_set_block_size(const size_t size) {
+	uncompress_block_size = (size < 1) ? UNCOMPRESS_BLOCK_SIZE : size;
+}
+
+void uncompress_set_threads(const size_t threads) {
+	uncompress_threads = (threads < 1) ? 1 : threads;
+}
+
+void uncompress_set_umask(const int mask) {
+	uncompress_umask = mask;
+}
+
+static la_ssize_t decoded_read(
+	struct archive* archive,
+	void* data,
+	const void** buffer
+) {
+	
+	long rsize = 0;
+	
+	decompress_t* const decompress = data;
+	
+	rsize = decompress_read(decompress, buffer);
+	
+	if (rsize < 0) {
+		archive_set_error(archive, EIO, "could not decode the archive");
+	}
+	
+	return (la_ssize_t) rsize;
+	
+}
+
+static long source_read(void* const data, const void** const buffer) {
+	/*
+	Hand the decoder the next block of an archive that is in memory.
+	*/
+	
+	uncompress_source_t* const source = data;
+	
+	size_t size = source->size - source->offset;
+	
+	if (size > uncompress_block_size) {
+		size = uncompress_block_size;
+	}
+	
+	*buffer = source->data + source->offset;
+	source->offset += size;
+	
+	return (long) size;
+	
+}
 
 int entries_append(
 	archive_entries_t* const entries,
-	const char* const entry
+	struct archive_entry* const entry
 ) {
+	/*
+	Record the path of the given archive entry. Directories always get a
+	trailing slash, so that they can be told apart later on.
+	
+	The entry callback, if any, gets to see the path first, and can refuse
+	it before anything is written to disk.
+	*/
 	
 	size_t size = 0;
+	size_t length = 0;
 	
 	char* item = NULL;
 	char** items = NULL;
 	
-	item = malloc(strlen(entry) + 1);
+	extract_digest_t* digests = NULL;
+	
+	const char* const pathname = archive_entry_pathname(entry);
+	
+	int slash = archive_entry_filetype(entry) == AE_IFDIR && archive_entry_hardlink(entry) == NULL;
+	
+	length = strlen(pathname);
+	slash = slash && (length == 0 || pathname[length - 1] != '/');
+	
+	item = malloc(length + (size_t) slash + 1);
 	
 	if (item == NULL) {
 		return -1;
 	}
 	
-	strcpy(item, entry);
+	strcpy(item, pathname);
+	
+	if (slash) {
+		strcat(item, "/");
+	}
+	
+	if (entries->callback != NULL && (*entries->callback)(item, entries->callback_data) != 0) {
+		free(item);
+		return -1;
+	}
 	
 	if (sizeof(*entries->items) * (entries->offset + 1) > entries->size) {
 		size = entries->size + sizeof(*entries->items) * (entries->offset + 1);
 		items = realloc(entries->items, size);
 		
 		if (items == NULL) {
+			free(item);
 			return -1;
 		}
 		
-		entries->size = size;
 		entries->items = items;
+		
+		digests = realloc(entries->digests, (size / sizeof(*entries->items)) * sizeof(*entries->digests));
+		
+		if (digests == NULL) {
+			free(item);
+			return -1;
+		}
+		
+		entries->size = size;
+		entries->digests = digests;
 	}
 	
+	entries->digests[entries->offset].valid = 0;
 	entries->items[entries->offset++] = item;
 	
 	return 0;
 	
 }
 
+static const extract_digest_t* entries_previous(const archive_entries_t* const entries) {
+	/*
+	Find the last recorded entry in the list of entries of the earlier
+	version, if there is one. Both lists hold paths relative to the same
+	directory; the earlier one is sorted.
+	
+	Returns NULL if the entry is new.
+	*/
+	
+	int order = 0;
+	
+	size_t low = 0;
+	size_t high = 0;
+	size_t middle = 0;
+	
+	const char* path = NULL;
+	const char* item = NULL;
+	
+	const archive_entries_t* const previous = entries->previous;
+	
+	if (previous == NULL || entries->offset == 0) {
+		return NULL;
+	}
+	
+	path = entries->items[entries->offset - 1];
+	
+	if (strncmp(path, "./", 2) == 0) {
+		path += 2;
+	}
+	
+	high = previous->offset;
+	
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		item = previous->items[middle];
+		
+		order = strcmp(item, path);
+		
+		if (order == 0) {
+			return &previous->digests[middle];
+		}
+		
+		if (order < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	
+	return NULL;
+	
+}
+
+static char* prefix_path(const char* const directory, const char* const name) {
+	
+	char* path = malloc(strlen(directory) + 1 + strlen(name) + 1);
+	
+	if (path == NULL) {
+		return NULL;
+	}
+	
+	strcpy(path, directory);
+	strcat(path, "/");
+	strcat(path, name);
+	
+	return path;
+	
+}
+
+static int entry_relocate(
+	struct archive_entry* const entry,
+	const char* const directory
+) {
+	/*
+	Make the entry extract under the given directory instead of the current one.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	char* path = NULL;
+	const char* name = NULL;
+	
+	path = prefix_path(directory, archive_entry_pathname(entry));
+	
+	if (path == NULL) {
+		return -1;
+	}
+	
+	archive_entry_set_pathname(entry, path);
+	free(path);
+	
+	name = archive_entry_hardlink(entry);
+	
+	if (name == NULL) {
+		return 0;
+	}
+	
+	path = prefix_path(directory, name);
+	
+	if (path == NULL) {
+		return -1;
+	}
+	
+	archive_entry_set_hardlink(entry, path);
+	free(path);
+	
+	return 0;
+	
+}
+
+static int symlink_relocate(
+	struct archive_entry* const entry,
+	const char* const root
+) {
+	/*
+	Symbolic links with an absolute target point outside of the prefix the
+	package is installed to; make them point to the same place inside of it.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	char* target = NULL;
+	const char* name = NULL;
+	
+	if (root == NULL || archive_entry_filetype(entry) != AE_IFLNK || archive_entry_hardlink(entry) != NULL) {
+		return 0;
+	}
+	
+	name = archive_entry_symlink(entry);
+	
+	if (name == NULL || !isabsolute(name)) {
+		return 0;
+	}
+	
+	target = malloc(strlen(root) + strlen(name) + 1);
+	
+	if (target == NULL) {
+		return -1;
+	}
+	
+	strcpy(target, root);
+	strcat(target, name);
+	
+	archive_entry_copy_symlink(entry, target);
+	free(target);
+	
+	return 0;
+	
+}
+
 int uncompress(
 	const char* const source,
 	const size_t size,
 	uncompress_callback_t callback,
 	void* const callback_data,
-	archive_entries_t* const entries
+	const char* const directory,
+	archive_entries_t* const entries,
+	extract_stats_t* const stats
 ) {
+	/*
+	Extract the given archive (or pass its contents to the callback).
+	
+	Files are extracted under the given directory, or into the current one
+	if it is NULL. If entries is not NULL and has a root, absolute symbolic
+	links are made to point under it.
+	
+	Files are read through a memory mapping where possible. xz and zstd
+	archives are decoded by decompress_open() instead of libarchive when more
+	than one thread is allowed.
+	
+	If stats is not NULL, what it took to extract the files is added to it.
+	*/
 	
 	int code = 0;
 	int err = 0;
+	int format = DECOMPRESS_FORMAT_UNKNOWN;
+	int decoding = 0;
+	int extracting = 0;
+	int mapped = 0;
+	
+	const char* data = source;
+	size_t length = size;
+	
+	mapped_file_t file = {0};
 	
-	const char* pathname = NULL;
+	uncompress_source_t input = {0};
+	decompress_t decompress = {0};
+	
+	extractor_t extractor = {0};
 	
 	struct archive* input_archive = archive_read_new();
-	struct archive* output_archive = NULL;
 	
 	struct archive_entry* entry = NULL;
-	
-	const int flags = ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_ACL | ARCHIVE_EXTRACT_FFLAGS;
 	const void* chunk = NULL;
 	
 	size_t rsize = 0;
@@ -80,12 +387,6 @@ int uncompress(
 		off_t offset = 0;
 	#endif
 	
-	/* Required for proper handling of Unicode characters in filenames */
-	if (setlocale(LC_ALL, "") == NULL) {
-		err = -1;
-		goto end;
-	}
-	
 	if (input_archive == NULL) {
 		err = -1;
 		goto end;
@@ -141,27 +442,45 @@ int uncompress(
 	}
 	
 	if (callback == NULL) {
-		output_archive = archive_write_disk_new();
-		
-		if (output_archive == NULL) {
+		if (extractor_init(&extractor, directory, uncompress_umask) != 0) {
 			err = -1;
 			goto end;
 		}
+		
+		/* The files of the earlier version are replaced in place */
+		extractor.replace = (entries != NULL && entries->previous != NULL);
+		
+		extracting = 1;
 	}
 	
-	if (output_archive != NULL) {
-		code = archive_write_disk_set_options(output_archive, flags);
+	/* Empty files cannot be mapped; libarchive will have to tell what they are */
+	if (size == 0 && map_file(source, &file) == 0) {
+		mapped = 1;
 		
-		if (code != ARCHIVE_OK) {
+		data = file.data;
+		length = file.size;
+	}
+	
+	if (length > 0 && uncompress_threads > 1) {
+		format = decompress_guess(data, length);
+		
+		input.data = data;
+		input.size = length;
+	}
+	
+	if (format != DECOMPRESS_FORMAT_UNKNOWN) {
+		if (decompress_open(&decompress, format, uncompress_threads, uncompress_block_size, source_read, &input) != 0) {
 			err = -1;
 			goto end;
 		}
-	}
-	
-	if (size > 0) {
-		code = archive_read_open_memory(input_archive, source, size);
+		
+		decoding = 1;
+		
+		code = archive_read_open(input_archive, &decompress, NULL, decoded_read, NULL);
+	} else if (length > 0) {
+		code = archive_read_open_memory(input_archive, data, length);
 	} else {
-		code = archive_read_open_filename(input_archive, source, ARCHIVE_BLOCK_SIZE);
+		code = archive_read_open_filename(input_archive, source, uncompress_block_size);
 	}
 	
 	if (code != ARCHIVE_OK) {
@@ -183,8 +502,7 @@ int uncompress(
 		}
 		
 		if (entries != NULL) {
-			pathname = archive_entry_pathname(entry);
-			err = entries_append(entries, pathname);
+			err = entries_append(entries, entry);
 			
 			if (err != 0) {
 				err = -1;
@@ -192,12 +510,29 @@ int uncompress(
 			}
 		}
 		
-		if (output_archive != NULL) {
-			code = archive_write_header(output_archive, entry);
+		if (extracting && directory != NULL && entry_relocate(entry, directory) != 0) {
+			err = -1;
+			goto end;
+		}
+		
+		if (extracting && entries != NULL && symlink_relocate(entry, entries->root) != 0) {
+			err = -1;
+			goto end;
+		}
+		
+		if (extracting) {
+			extractor.expected = (entries == NULL) ? NULL : entries_previous(entries);
 			
-			if (code != ARCHIVE_OK) {
-				continue;
+			if (extractor_write(&extractor, input_archive, entry) == -1) {
+				err = -1;
+				goto end;
+			}
+			
+			if (entries != NULL) {
+				entries->digests[entries->offset - 1] = extractor.digest;
 			}
+			
+			continue;
 		}
 		
 		while (1) {
@@ -223,50 +558,1022 @@ int uncompress(
 				
 				err = 0;
 			}
-			
-			if (output_archive != NULL) {
-				code = archive_write_data_block(output_archive, chunk, rsize, offset);
-				
-				if (code != ARCHIVE_OK) {
-					err = -1;
-					goto end;
-				}
-			}
 		}
 	}
 	
+	if (extracting && extractor_finish(&extractor) != 0) {
+		err = -1;
+		goto end;
+	}
+	
 	end:;
 	
-	if (err != 0) {
+	/* A path refused by the entry callback is not an archive error */
+	if (err != 0 && archive_error_string(input_archive) != NULL) {
 		fprintf(stderr, "uncompress(): %s\n", archive_error_string(input_archive));
 	}
 	
 	archive_read_close(input_archive);
 	archive_read_free(input_archive);
 	
-	if (output_archive != NULL) {
-		archive_write_close(output_archive);
-		archive_write_free(output_archive);
+	if (decoding) {
+		decompress_free(&decompress);
+	}
+	
+	if (mapped) {
+		unmap_file(&file);
+	}
+	
+	if (extracting) {
+		if (stats != NULL) {
+			extract_stats_add(stats, &extractor.stats);
+		}
+		
+		extractor_free(&extractor);
 	}
 	
 	return err;
 	
 }
 
-void archive_entries_free(archive_entries_t* const entries) {
+int uncompress_list(
+	const char* const source,
+	archive_entries_t* const entries
+) {
+	/*
+	Record the paths of the entries of the given archive, without writing
+	anything to disk.
 	
-	size_t index = 0;
-	char* value = NULL;
+	This is the same as uncompress() minus the extraction, so that the entry
+	callback gets to refuse any of the paths before the first one is
+	written.
 	
-	for (index = 0; index < entries->offset; index++) {
-		value = entries->items[index];
-		free(value);
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	int err = 0;
+	int code = 0;
+	int mapped = 0;
+	
+	mapped_file_t file = {0};
+	
+	struct archive* archive = archive_read_new();
+	struct archive_entry* entry = NULL;
+	
+	if (archive == NULL) {
+		err = -1;
+		goto end;
 	}
 	
-	free(entries->items);
-	entries->items = NULL;
+	code = archive_read_support_filter_xz(archive);
 	
-	entries->size = 0;
-	entries->offset = 0;
+	if (code == ARCHIVE_OK) {
+		code = archive_read_support_filter_zstd(archive);
+		
+		if (code == ARCHIVE_WARN) {
+			code = ARCHIVE_OK;
+		}
+	}
+	
+	if (code == ARCHIVE_OK) {
+		code = archive_read_support_filter_gzip(archive);
+	}
+	
+	if (code == ARCHIVE_OK) {
+		code = archive_read_support_filter_bzip2(archive);
+	}
+	
+	if (code == ARCHIVE_OK) {
+		code = archive_read_support_format_tar(archive);
+	}
+	
+	mapped = (code == ARCHIVE_OK && map_file(source, &file) == 0 && file.data != NULL);
+	
+	if (mapped) {
+		code = archive_read_open_memory(archive, file.data, file.size);
+	} else if (code == ARCHIVE_OK) {
+		code = archive_read_open_filename(archive, source, uncompress_block_size);
+	}
+	
+	if (code != ARCHIVE_OK) {
+		err = -1;
+		goto end;
+	}
+	
+	while (1) {
+		code = archive_read_next_header(archive, &entry);
+		
+		if (code == ARCHIVE_EOF) {
+			break;
+		}
+		
+		if (code != ARCHIVE_OK || entries_append(entries, entry) != 0) {
+			err = -1;
+			goto end;
+		}
+	}
+	
+	end:;
+	
+	if (archive != NULL) {
+		/* A path refused by the entry callback is not an archive error */
+		if (err != 0 && archive_error_string(archive) != NULL) {
+			fprintf(stderr, "uncompress(): %s\n", archive_error_string(archive));
+		}
+		
+		archive_read_close(archive);
+		archive_read_free(archive);
+	}
+	
+	if (mapped) {
+		unmap_file(&file);
+	}
+	
+	return err;
+	
+}
+
+static int members_append(
+	archive_members_t* const members,
+	const char* const name,
+	char* const data,
+	const size_t length
+) {
+	
+	size_t size = 0;
+	
+	archive_member_t* member = NULL;
+	archive_member_t* items = NULL;
+	
+	if (sizeof(*members->items) * (members->offset + 1) > members->size) {
+		size = members->size + sizeof(*members->items) * (members->offset + 1);
+		items = realloc(members->items, size);
+		
+		if (items == NULL) {
+			return -1;
+		}
+		
+		members->size = size;
+		members->items = items;
+	}
+	
+	member = &members->items[members->offset];
+	member->name = malloc(strlen(name) + 1);
+	
+	if (member->name == NULL) {
+		return -1;
+	}
+	
+	strcpy(member->name, name);
+	
+	member->data = data;
+	member->size = length;
+	
+	members->offset++;
+	
+	return 0;
+	
+}
+
+static la_ssize_t nested_read(
+	struct archive* archive,
+	void* data,
+	const void** buffer
+) {
+	/*
+	Feed the contents of the current member of the parent archive to the
+	nested reader.
+	*/
+	
+	nested_archive_t* const nested = data;
+	
+	if (nested->decoding) {
+		return decoded_read(archive, &nested->decompress, buffer);
+	}
+	
+	*buffer = nested->buffer;
+	
+	return archive_read_data(nested->parent, nested->buffer, uncompress_block_size);
+	
+}
+
+static long nested_read_compressed(void* const data, const void** const buffer) {
+	/*
+	Feed the compressed contents of the current member of the parent archive
+	to the decoder.
+	*/
+	
+	nested_archive_t* const nested = data;
+	
+	*buffer = nested->buffer;
+	
+	return (long) archive_read_data(nested->parent, nested->buffer, uncompress_block_size);
+	
+}
+
+static void nested_close(
+	nested_archive_t* const nested,
+	struct archive* const archive
+) {
+	
+	archive_read_close(archive);
+	archive_read_free(archive);
+	
+	if (nested->decoding) {
+		decompress_free(&nested->decompress);
+		nested->decoding = 0;
+	}
+	
+}
+
+static struct archive* nested_open(
+	nested_archive_t* const nested,
+	const char* const name
+) {
+	/*
+	Open a reader for the tarball stored in the current member of the parent
+	archive.
+	
+	Members compressed with xz or zstd are decoded on a separate thread
+	when more than one is allowed; libarchive takes care of the rest.
+	*/
+	
+	int code = ARCHIVE_OK;
+	int format = DECOMPRESS_FORMAT_UNKNOWN;
+	
+	struct archive* archive = archive_read_new();
+	
+	if (archive == NULL) {
+		return NULL;
+	}
+	
+	nested->decoding = 0;
+	
+	if (uncompress_threads > 1) {
+		format = decompress_guess_name(name);
+	}
+	
+	if (format != DECOMPRESS_FORMAT_UNKNOWN) {
+		if (decompress_open(&nested->decompress, format, uncompress_threads, uncompress_block_size, nested_read_compressed, nested) != 0) {
+			archive_read_free(archive);
+			return NULL;
+		}
+		
+		nested->decoding = 1;
+	}
+	
+	code = archive_read_support_filter_xz(archive);
+	
+	if (code == ARCHIVE_OK) {
+		code = archive_read_support_filter_zstd(archive);
+		
+		if (code == ARCHIVE_WARN) {
+			code = ARCHIVE_OK;
+		}
+	}
+	
+	if (code == ARCHIVE_OK) {
+		code = archive_read_support_filter_gzip(archive);
+	}
+	
+	if (code == ARCHIVE_OK) {
+		code = archive_read_support_filter_bzip2(archive);
+	}
+	
+	if (code == ARCHIVE_OK) {
+		code = archive_read_support_format_tar(archive);
+	}
+	
+	if (code == ARCHIVE_OK) {
+		code = archive_read_open(archive, nested, NULL, nested_read, NULL);
+	}
+	
+	if (code != ARCHIVE_OK) {
+		fprintf(stderr, "uncompress_deb(): %s\n", archive_error_string(archive));
+		nested_close(nested, archive);
+		
+		return NULL;
+	}
+	
+	return archive;
+	
+}
+
+static int uncompress_control(
+	nested_archive_t* const nested,
+	const char* const member,
+	archive_members_t* const members
+) {
+	/*
+	Keep the maintainer scripts and the list of configuration files from
+	control.tar.* in memory. Everything else in it is skipped.
+	*/
+	
+	int err = 0;
+	int code = 0;
+	
+	size_t index = 0;
+	size_t size = 0;
+	
+	la_ssize_t rsize = 0;
+	
+	const char* name = NULL;
+	char* data = NULL;
+	
+	struct archive* archive = NULL;
+	struct archive_entry* entry = NULL;
+	
+	archive = nested_open(nested, member);
+	
+	if (archive == NULL) {
+		err = -1;
+		goto end;
+	}
+	
+	while (1) {
+		code = archive_read_next_header(archive, &entry);
+		
+		if (code == ARCHIVE_EOF) {
+			break;
+		}
+		
+		if (code != ARCHIVE_OK) {
+			err = -1;
+			goto end;
+		}
+		
+		if (archive_entry_filetype(entry) != AE_IFREG) {
+			continue;
+		}
+		
+		name = archive_entry_pathname(entry);
+		
+		if (strncmp(name, "./", 2) == 0) {
+			name += 2;
+		}
+		
+		for (index = 0; index < sizeof(CONTROL_MEMBERS) / sizeof(*CONTROL_MEMBERS); index++) {
+			if (strcmp(name, CONTROL_MEMBERS[index]) == 0) {
+				break;
+			}
+		}
+		
+		if (index == sizeof(CONTROL_MEMBERS) / sizeof(*CONTROL_MEMBERS)) {
+			continue;
+		}
+		
+		data = malloc((size_t) archive_entry_size(entry) + 1);
+		
+		if (data == NULL) {
+			err = -1;
+			goto end;
+		}
+		
+		size = 0;
+		
+		while (size < (size_t) archive_entry_size(entry)) {
+			rsize = archive_read_data(archive, data + size, (size_t) archive_entry_size(entry) - size);
+			
+			if (rsize <= 0) {
+				err = -1;
+				goto end;
+			}
+			
+			size += (size_t) rsize;
+		}
+		
+		data[size] = '\0';
+		
+		if (members_append(members, name, data, size) != 0) {
+			err = -1;
+			goto end;
+		}
+		
+		data = NULL;
+	}
+	
+	end:;
+	
+	if (err != 0 && archive != NULL && archive_error_string(archive) != NULL) {
+		fprintf(stderr, "uncompress_deb(): %s\n", archive_error_string(archive));
+	}
+	
+	free(data);
+	
+	if (archive != NULL) {
+		nested_close(nested, archive);
+	}
+	
+	return err;
+	
+}
+
+static int uncompress_data(
+	nested_archive_t* const nested,
+	const char* const member,
+	const char* const directory,
+	archive_entries_t* const entries,
+	extract_stats_t* const stats
+) {
+	/*
+	Extract data.tar.* as it is read from the package, without storing it
+	anywhere else first.
+	
+	Files are extracted under the given directory, or into the current one
+	if it is NULL.
+	*/
+	
+	int err = 0;
+	int code = 0;
+	int extracting = 0;
+	
+	struct archive* archive = NULL;
+	struct archive_entry* entry = NULL;
+	
+	extractor_t extractor = {0};
+	
+	archive = nested_open(nested, member);
+	
+	if (archive == NULL) {
+		err = -1;
+		goto end;
+	}
+	
+	if (extractor_init(&extractor, directory, uncompress_umask) != 0) {
+		err = -1;
+		goto end;
+	}
+	
+	/* The files of the earlier version are replaced in place */
+	extractor.replace = (entries != NULL && entries->previous != NULL);
+	
+	extracting = 1;
+	
+	while (1) {
+		code = archive_read_next_header(archive, &entry);
+		
+		if (code == ARCHIVE_EOF) {
+			break;
+		}
+		
+		if (code != ARCHIVE_OK) {
+			err = -1;
+			goto end;
+		}
+		
+		if (entries != NULL && entries_append(entries, entry) != 0) {
+			err = -1;
+			goto end;
+		}
+		
+		if (directory != NULL && entry_relocate(entry, directory) != 0) {
+			err = -1;
+			goto end;
+		}
+		
+		if (entries != NULL && symlink_relocate(entry, entries->root) != 0) {
+			err = -1;
+			goto end;
+		}
+		
+		extractor.expected = (entries == NULL) ? NULL : entries_previous(entries);
+		
+		if (extractor_write(&extractor, archive, entry) == -1) {
+			err = -1;
+			goto end;
+		}
+		
+		if (entries != NULL) {
+			entries->digests[entries->offset - 1] = extractor.digest;
+		}
+	}
+	
+	if (extractor_finish(&extractor) != 0) {
+		err = -1;
+		goto end;
+	}
+	
+	end:;
+	
+	if (err != 0 && archive != NULL && archive_error_string(archive) != NULL) {
+		fprintf(stderr, "uncompress_deb(): %s\n", archive_error_string(archive));
+	}
+	
+	if (archive != NULL) {
+		nested_close(nested, archive);
+	}
+	
+	if (extracting) {
+		if (stats != NULL) {
+			extract_stats_add(stats, &extractor.stats);
+		}
+		
+		extractor_free(&extractor);
+	}
+	
+	return err;
+	
+}
+
+static int list_data(
+	nested_archive_t* const nested,
+	const char* const member,
+	archive_entries_t* const entries
+) {
+	/*
+	Record the paths of the entries of data.tar.*, skipping their contents.
+	*/
+	
+	int err = 0;
+	int code = 0;
+	
+	struct archive* archive = NULL;
+	struct archive_entry* entry = NULL;
+	
+	archive = nested_open(nested, member);
+	
+	if (archive == NULL) {
+		return -1;
+	}
+	
+	while (1) {
+		code = archive_read_next_header(archive, &entry);
+		
+		if (code == ARCHIVE_EOF) {
+			break;
+		}
+		
+		if (code != ARCHIVE_OK) {
+			fprintf(stderr, "uncompress_deb(): %s\n", archive_error_string(archive));
+			
+			err = -1;
+			break;
+		}
+		
+		if (entries_append(entries, entry) != 0) {
+			err = -1;
+			break;
+		}
+	}
+	
+	nested_close(nested, archive);
+	
+	return err;
+	
+}
+
+static int deb_unpack(
+	struct archive* const input_archive,
+	const char* const directory,
+	uncompress_control_callback_t callback,
+	void* const callback_data,
+	archive_entries_t* const entries,
+	extract_stats_t* const stats
+) {
+	
+	int err = 0;
+	int code = 0;
+	
+	int control = 0;
+	int data = 0;
+	
+	const char* name = NULL;
+	
+	struct archive_entry* entry = NULL;
+	
+	nested_archive_t* nested = NULL;
+	archive_members_t members = {0};
+	
+	nested = malloc(sizeof(*nested));
+	
+	if (nested == NULL) {
+		err = -1;
+		goto end;
+	}
+	
+	nested->parent = input_archive;
+	nested->decoding = 0;
+	nested->buffer = malloc(uncompress_block_size);
+	
+	if (nested->buffer == NULL) {
+		err = -1;
+		goto end;
+	}
+	
+	while (!data) {
+		code = archive_read_next_header(input_archive, &entry);
+		
+		if (code == ARCHIVE_EOF) {
+			break;
+		}
+		
+		if (code != ARCHIVE_OK) {
+			fprintf(stderr, "uncompress_deb(): %s\n", archive_error_string(input_archive));
+			
+			err = -1;
+			goto end;
+		}
+		
+		name = archive_entry_pathname(entry);
+		
+		if (strncmp(name, "control.tar", 11) == 0 && !control) {
+			err = uncompress_control(nested, name, &members);
+			
+			if (err != 0) {
+				goto end;
+			}
+			
+			control = 1;
+			
+			if (callback != NULL) {
+				err = (*callback)(&members, callback_data);
+				
+				if (err != 0) {
+					goto end;
+				}
+			}
+			
+			continue;
+		}
+		
+		if (strncmp(name, "data.tar", 8) == 0) {
+			if (!control) {
+				fprintf(stderr, "uncompress_deb(): data member found before the control member\n");
+				
+				err = -1;
+				goto end;
+			}
+			
+			err = uncompress_data(nested, name, directory, entries, stats);
+			
+			if (err != 0) {
+				goto end;
+			}
+			
+			data = 1;
+		}
+	}
+	
+	if (!data) {
+		fprintf(stderr, "uncompress_deb(): no data member found\n");
+		
+		err = -1;
+		goto end;
+	}
+	
+	end:;
+	
+	if (nested != NULL) {
+		free(nested->buffer);
+	}
+	
+	free(nested);
+	
+	archive_members_free(&members);
+	
+	return err;
+	
+}
+
+int uncompress_deb(
+	const char* const source,
+	const char* const directory,
+	uncompress_control_callback_t callback,
+	void* const callback_data,
+	archive_entries_t* const entries,
+	extract_stats_t* const stats
+) {
+	/*
+	Unpack a Debian package in a single pass over it.
+	
+	The outer ar archive is read sequentially: the maintainer scripts from
+	control.tar.* are kept in memory and handed to the callback, and then
+	data.tar.* is decompressed and extracted under the given directory (or the
+	current one, if it is NULL) as it is read. Nothing is written to disk other
+	than the package files.
+	
+	Like dpkg-deb, this requires control.tar.* to come before data.tar.*.
+	
+	The package is read through a memory mapping where possible. If stats is
+	not NULL, what it took to extract the files is added to it.
+	
+	Returns (0) on success, (-1) on error, or whatever non-zero value the
+	callback returned.
+	*/
+	
+	int err = 0;
+	int code = 0;
+	int mapped = 0;
+	
+	mapped_file_t file = {0};
+	
+	struct archive* input_archive = archive_read_new();
+	
+	if (input_archive == NULL) {
+		err = -1;
+		goto end;
+	}
+	
+	mapped = (map_file(source, &file) == 0 && file.data != NULL);
+	
+	code = archive_read_support_format_ar(input_archive);
+	
+	if (code == ARCHIVE_OK && mapped) {
+		code = archive_read_open_memory(input_archive, file.data, file.size);
+	} else if (code == ARCHIVE_OK) {
+		code = archive_read_open_filename(input_archive, source, uncompress_block_size);
+	}
+	
+	if (code != ARCHIVE_OK) {
+		fprintf(stderr, "uncompress_deb(): %s\n", archive_error_string(input_archive));
+		
+		err = -1;
+		goto end;
+	}
+	
+	err = deb_unpack(input_archive, directory, callback, callback_data, entries, stats);
+	
+	end:;
+	
+	if (input_archive != NULL) {
+		archive_read_close(input_archive);
+		archive_read_free(input_archive);
+	}
+	
+	if (mapped) {
+		unmap_file(&file);
+	}
+	
+	return err;
+	
+}
+
+int uncompress_deb_list(
+	const char* const source,
+	archive_entries_t* const entries
+) {
+	/*
+	Record the paths of the entries of data.tar.* in the given Debian
+	package, without writing anything to disk.
+	
+	Along with uncompress_deb(), this makes two passes over the package (both
+	through the same memory mapping), so that the entry callback gets to
+	refuse any of the paths before the first one is written.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	int err = 0;
+	int code = 0;
+	int mapped = 0;
+	int data = 0;
+	
+	const char* name = NULL;
+	
+	mapped_file_t file = {0};
+	
+	nested_archive_t nested = {0};
+	
+	struct archive* input_archive = archive_read_new();
+	struct archive_entry* entry = NULL;
+	
+	if (input_archive == NULL) {
+		err = -1;
+		goto end;
+	}
+	
+	nested.parent = input_archive;
+	nested.buffer = malloc(uncompress_block_size);
+	
+	if (nested.buffer == NULL) {
+		err = -1;
+		goto end;
+	}
+	
+	mapped = (map_file(source, &file) == 0 && file.data != NULL);
+	
+	code = archive_read_support_format_ar(input_archive);
+	
+	if (code == ARCHIVE_OK && mapped) {
+		code = archive_read_open_memory(input_archive, file.data, file.size);
+	} else if (code == ARCHIVE_OK) {
+		code = archive_read_open_filename(input_archive, source, uncompress_block_size);
+	}
+	
+	if (code != ARCHIVE_OK) {
+		fprintf(stderr, "uncompress_deb(): %s\n", archive_error_string(input_archive));
+		
+		err = -1;
+		goto end;
+	}
+	
+	while (!data) {
+		code = archive_read_next_header(input_archive, &entry);
+		
+		if (code == ARCHIVE_EOF) {
+			break;
+		}
+		
+		if (code != ARCHIVE_OK) {
+			fprintf(stderr, "uncompress_deb(): %s\n", archive_error_string(input_archive));
+			
+			err = -1;
+			goto end;
+		}
+		
+		name = archive_entry_pathname(entry);
+		
+		if (strncmp(name, "data.tar", 8) != 0) {
+			continue;
+		}
+		
+		err = list_data(&nested, name, entries);
+		
+		if (err != 0) {
+			goto end;
+		}
+		
+		data = 1;
+	}
+	
+	if (!data) {
+		fprintf(stderr, "uncompress_deb(): no data member found\n");
+		
+		err = -1;
+		goto end;
+	}
+	
+	end:;
+	
+	free(nested.buffer);
+	
+	if (input_archive != NULL) {
+		archive_read_close(input_archive);
+		archive_read_free(input_archive);
+	}
+	
+	if (mapped) {
+		unmap_file(&file);
+	}
+	
+	return err;
+	
+}
+
+static la_ssize_t stream_read(
+	struct archive* archive,
+	void* data,
+	const void** buffer
+) {
+	
+	uncompress_reader_t* const reader = data;
+	
+	(void) archive;
+	
+	return (la_ssize_t) (*reader->callback)(reader->data, buffer);
+	
+}
+
+int uncompress_deb_stream(
+	uncompress_read_callback_t read,
+	void* const read_data,
+	const char* const directory,
+	uncompress_control_callback_t callback,
+	void* const callback_data,
+	archive_entries_t* const entries,
+	extract_stats_t* const stats
+) {
+	/*
+	Same as uncompress_deb(), but the package is read through the given
+	callback as it becomes available.
+	*/
+	
+	int err = 0;
+	int code = 0;
+	
+	uncompress_reader_t reader = {0};
+	
+	struct archive* input_archive = archive_read_new();
+	
+	if (input_archive == NULL) {
+		err = -1;
+		goto end;
+	}
+	
+	reader.callback = read;
+	reader.data = read_data;
+	
+	code = archive_read_support_format_ar(input_archive);
+	
+	if (code == ARCHIVE_OK) {
+		code = archive_read_open(input_archive, &reader, NULL, stream_read, NULL);
+	}
+	
+	if (code != ARCHIVE_OK) {
+		fprintf(stderr, "uncompress_deb(): %s\n", archive_error_string(input_archive));
+		
+		err = -1;
+		goto end;
+	}
+	
+	err = deb_unpack(input_archive, directory, callback, callback_data, entries, stats);
+	
+	end:;
+	
+	if (input_archive != NULL) {
+		archive_read_close(input_archive);
+		archive_read_free(input_archive);
+	}
+	
+	return err;
+	
+}
+
+const archive_member_t* archive_members_get(
+	const archive_members_t* const members,
+	const char* const name
+) {
+	
+	size_t index = 0;
+	
+	for (index = 0; index < members->offset; index++) {
+		if (strcmp(members->items[index].name, name) == 0) {
+			return &members->items[index];
+		}
+	}
+	
+	return NULL;
+	
+}
+
+int archive_members_copy(
+	archive_members_t* const destination,
+	const archive_members_t* const source
+) {
+	
+	size_t index = 0;
+	
+	char* data = NULL;
+	const archive_member_t* member = NULL;
+	
+	for (index = 0; index < source->offset; index++) {
+		member = &source->items[index];
+		data = malloc(member->size + 1);
+		
+		if (data == NULL) {
+			return -1;
+		}
+		
+		memcpy(data, member->data, member->size);
+		data[member->size] = '\0';
+		
+		if (members_append(destination, member->name, data, member->size) != 0) {
+			free(data);
+			return -1;
+		}
+	}
+	
+	return 0;
+	
+}
+
+void archive_entries_free(archive_entries_t* const entries) {
+	
+	size_t index = 0;
+	char* value = NULL;
+	
+	for (index = 0; index < entries->offset; index++) {
+		value = entries->items[index];
+		free(value);
+	}
+	
+	free(entries->items);
+	entries->items = NULL;
+	
+	free(entries->digests);
+	entries->digests = NULL;
+	
+	entries->size = 0;
+	entries->offset = 0;
+	
+}
+
+void archive_members_free(archive_members_t* const members) {
+	
+	size_t index = 0;
+	archive_member_t* member = NULL;
+	
+	for (index = 0; index < members->offset; index++) {
+		member = &members->items[index];
+		
+		free(member->name);
+		free(member->data);
+	}
+	
+	free(members->items);
+	members->items = NULL;
+	
+	members->size = 0;
+	members->offset = 0;
 	
 }
@@ -1,19 +1,103 @@
+#if !defined(UNCOMPRESS_H)
+#define UNCOMPRESS_H
+
+#include <stddef.h>
+
+#include "extract.h"
+
+/* Archives are read in blocks of this size, unless told otherwise */
+#define UNCOMPRESS_BLOCK_SIZE (1024 * 1024)
+
+/* Called with the path of each entry before it is extracted; a nonzero return stops the extraction */
+typedef int (*uncompress_entry_callback_t)(const char* const, void* const);
+
 struct ArchiveEntries {
 	size_t size;
 	size_t offset;
 	char** items;
+	extract_digest_t* digests;
+	uncompress_entry_callback_t callback;
+	void* callback_data;
+	const struct ArchiveEntries* previous;
+	const char* root;
 };
 
 typedef struct ArchiveEntries archive_entries_t;
 
+struct ArchiveMember {
+	char* name;
+	char* data;
+	size_t size;
+};
+
+typedef struct ArchiveMember archive_member_t;
+
+struct ArchiveMembers {
+	size_t size;
+	size_t offset;
+	archive_member_t* items;
+};
+
+typedef struct ArchiveMembers archive_members_t;
+
 typedef size_t (*uncompress_callback_t)(char*, size_t, size_t, void*);
+typedef int (*uncompress_control_callback_t)(const archive_members_t* const, void* const);
+typedef long (*uncompress_read_callback_t)(void* const, const void** const);
+
+void uncompress_set_block_size(const size_t size);
+void uncompress_set_threads(const size_t threads);
+void uncompress_set_umask(const int mask);
 
 int uncompress(
 	const char* const source,
 	const size_t size,
 	uncompress_callback_t callback,
 	void* const callback_data,
+	const char* const directory,
+	archive_entries_t* const entries,
+	extract_stats_t* const stats
+);
+
+int uncompress_deb(
+	const char* const source,
+	const char* const directory,
+	uncompress_control_callback_t callback,
+	void* const callback_data,
+	archive_entries_t* const entries,
+	extract_stats_t* const stats
+);
+
+int uncompress_list(
+	const char* const source,
+	archive_entries_t* const entries
+);
+
+int uncompress_deb_list(
+	const char* const source,
 	archive_entries_t* const entries
 );
 
+int uncompress_deb_stream(
+	uncompress_read_callback_t read,
+	void* const read_data,
+	const char* const directory,
+	uncompress_control_callback_t callback,
+	void* const callback_data,
+	archive_entries_t* const entries,
+	extract_stats_t* const stats
+);
+
+const archive_member_t* archive_members_get(
+	const archive_members_t* const members,
+	const char* const name
+);
+
+int archive_members_copy(
+	archive_members_t* const destination,
+	const archive_members_t* const source
+);
+
 void archive_entries_free(archive_entries_t* const entries);
+void archive_members_free(archive_members_t* const members);
+
+#endif
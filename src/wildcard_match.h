@@ -1 +0,0 @@
-int wildcard_match(const char* const pattern, const char* const string);
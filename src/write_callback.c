@@ -1,11 +1,18 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+
+#include <curl/curl.h>
 
 #include "repository.h"
 #include "logging.h"
 #include "buffer.h"
+#include "biggestint.h"
+#include "errors.h"
 #include "fs/fstream.h"
+#include "fs/mv.h"
+#include "fs/rm.h"
 #include "write_callback.h"
 
 size_t write_string_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
@@ -29,19 +36,723 @@ size_t write_string_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
 	
 }
 
+static const char SIDECAR_FILE_EXT[] = ".meta";
+
+static int file_sink_hash(file_sink_t* const sink, fstream_t* const stream) {
+	/*
+	Feed the contents of the stream into the digest, as if they had just been received.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	char buffer[8192];
+	ssize_t rsize = 0;
+	
+	sink->received = 0;
+	
+	while (1) {
+		rsize = fstream_read(stream, buffer, sizeof(buffer));
+		
+		if (rsize == -1) {
+			return -1;
+		}
+		
+		if (rsize == 0) {
+			break;
+		}
+		
+		if (sink->checksum != NULL) {
+			sha256_update(&sink->sha256, buffer, (size_t) rsize);
+		}
+		
+		sink->received += (biguint_t) rsize;
+	}
+	
+	return 0;
+	
+}
+
+static int file_sink_load(file_sink_t* const sink) {
+	/*
+	Look for data left behind by an earlier, interrupted transfer into the same file.
+	
+	The sidecar file records the validator (an ETag or Last-Modified date) and the total
+	length announced by the server when the transfer started. The data already on disk
+	can only be reused if both are present and the file is still incomplete. The digest
+	is brought up to date by hashing what is already there.
+	
+	Returns (0) if the transfer can be resumed, (-1) otherwise.
+	*/
+	
+	int err = -1;
+	
+	char buffer[8192];
+	
+	char* line = NULL;
+	char* end = NULL;
+	
+	ssize_t rsize = 0;
+	long int size = 0;
+	biguint_t length = 0;
+	
+	fstream_t* stream = NULL;
+	
+	stream = fstream_open(sink->sidecar, FSTREAM_READ);
+	
+	if (stream == NULL) {
+		goto end;
+	}
+	
+	rsize = fstream_read(stream, buffer, sizeof(buffer) - 1);
+	
+	fstream_close(stream);
+	stream = NULL;
+	
+	if (rsize <= 0) {
+		goto end;
+	}
+	
+	buffer[rsize] = '\0';
+	
+	line = buffer;
+	end = strchr(line, '\n');
+	
+	if (end == NULL || end == line || (size_t) (end - line) >= sizeof(sink->validator)) {
+		goto end;
+	}
+	
+	*end = '\0';
+	strcpy(sink->validator, line);
+	
+	for (line = end + 1; *line >= '0' && *line <= '9'; line++) {
+		length = length * 10 + (biguint_t) (*line - '0');
+	}
+	
+	/* The index may now point to a different build of the same package */
+	if (sink->expected != 0 && length != 0 && length != sink->expected) {
+		goto end;
+	}
+	
+	stream = fstream_open(sink->filename, FSTREAM_READ);
+	
+	if (stream == NULL) {
+		goto end;
+	}
+	
+	size = fsream_size(stream);
+	
+	if (size <= 0 || (length != 0 && (biguint_t) size >= length)) {
+		goto end;
+	}
+	
+	if (file_sink_hash(sink, stream) != 0) {
+		goto end;
+	}
+	
+	sink->length = length;
+	sink->offset = sink->received;
+	
+	err = 0;
+	
+	end:;
+	
+	fstream_close(stream);
+	
+	if (err != 0) {
+		sink->validator[0] = '\0';
+		
+		if (sink->checksum != NULL) {
+			sha256_init(&sink->sha256);
+		}
+	}
+	
+	return err;
+	
+}
+
+static int file_sink_save(const file_sink_t* const sink) {
+	/*
+	Record the validator and total length of the current response next to the
+	partial file, so that a later run can pick up where this one left off.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	int status = FSTREAM_SUCCESS;
+	
+	char* length = NULL;
+	fstream_t* stream = NULL;
+	
+	if (sink->validator[0] == '\0') {
+		return remove_file(sink->sidecar);
+	}
+	
+	length = uint_stringify((sink->length == 0) ? sink->expected : sink->length);
+	
+	if (length == NULL) {
+		return -1;
+	}
+	
+	stream = fstream_open(sink->sidecar, FSTREAM_WRITE);
+	
+	if (stream == NULL) {
+		free(length);
+		return -1;
+	}
+	
+	status = fstream_write(stream, sink->validator, strlen(sink->validator));
+	
+	if (status == FSTREAM_SUCCESS) {
+		status = fstream_write(stream, "\n", 1);
+	}
+	
+	if (status == FSTREAM_SUCCESS) {
+		status = fstream_write(stream, length, strlen(length));
+	}
+	
+	if (status == FSTREAM_SUCCESS) {
+		status = fstream_write(stream, "\n", 1);
+	}
+	
+	free(length);
+	
+	if (fstream_close(stream) != FSTREAM_SUCCESS) {
+		status = FSTREAM_ERROR;
+	}
+	
+	return (status == FSTREAM_SUCCESS) ? 0 : -1;
+	
+}
+
+int file_sink_open(
+	file_sink_t* const sink,
+	const char* const filename,
+	const unsigned char* const checksum,
+	const biguint_t expected
+) {
+	/*
+	Prepare the sink for a new transfer into the given file.
+	
+	If a checksum is given, the SHA-256 digest of the data is computed as it
+	arrives and compared against it. If the expected size is known (nonzero),
+	the comparison happens as soon as the last byte is received.
+	
+	If an earlier transfer into the same file was interrupted, the data already
+	on disk is kept and sink->offset tells from where the request should continue.
+	*/
+	
+	int err = APTERR_SUCCESS;
+	int resumable = 0;
+	
+	memset(sink, 0, sizeof(*sink));
+	
+	sink->checksum = checksum;
+	sink->expected = expected;
+	sink->status = FILE_SINK_PENDING;
+	
+	sink->filename = malloc(strlen(filename) + 1);
+	sink->sidecar = malloc(strlen(filename) + strlen(SIDECAR_FILE_EXT) + 1);
+	
+	if (sink->filename == NULL || sink->sidecar == NULL) {
+		err = APTERR_MEM_ALLOC_FAILURE;
+		goto end;
+	}
+	
+	strcpy(sink->filename, filename);
+	
+	strcpy(sink->sidecar, filename);
+	strcat(sink->sidecar, SIDECAR_FILE_EXT);
+	
+	if (checksum != NULL) {
+		sha256_init(&sink->sha256);
+	}
+	
+	resumable = (file_sink_load(sink) == 0);
+	
+	if (!resumable && remove_file(sink->sidecar) != 0) {
+		err = APTERR_FS_RM_FAILURE;
+		goto end;
+	}
+	
+	sink->stream = fstream_open(sink->filename, resumable ? FSTREAM_APPEND : FSTREAM_WRITE);
+	
+	if (sink->stream == NULL) {
+		err = APTERR_FSTREAM_OPEN_FAILURE;
+		goto end;
+	}
+	
+	end:;
+	
+	if (err != APTERR_SUCCESS) {
+		file_sink_close(sink);
+	}
+	
+	return err;
+	
+}
+
+int file_sink_restart(file_sink_t* const sink) {
+	/*
+	Discard whatever was received so far and start over from the first byte.
+	
+	The validator is left untouched, as this may be called while the headers
+	of the response that replaces the old data are still being parsed.
+	*/
+	
+	fstream_close(sink->stream);
+	sink->stream = fstream_open(sink->filename, FSTREAM_WRITE);
+	
+	if (sink->stream == NULL) {
+		return APTERR_FSTREAM_OPEN_FAILURE;
+	}
+	
+	if (remove_file(sink->sidecar) != 0) {
+		return APTERR_FS_RM_FAILURE;
+	}
+	
+	if (sink->checksum != NULL) {
+		sha256_init(&sink->sha256);
+	}
+	
+	sink->received = 0;
+	sink->offset = 0;
+	sink->status = FILE_SINK_PENDING;
+	
+	return APTERR_SUCCESS;
+	
+}
+
+void file_sink_resume(file_sink_t* const sink) {
+	/*
+	Continue an interrupted transfer from the last byte written to disk.
+	*/
+	
+	sink->offset = sink->received;
+	sink->status = FILE_SINK_PENDING;
+	
+}
+
+int file_sink_finish(file_sink_t* const sink) {
+	/*
+	Compare the digest of the received data against the expected checksum.
+	
+	Returns FILE_SINK_VERIFIED if they match or no checksum was given, and
+	FILE_SINK_MISMATCH otherwise.
+	*/
+	
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	
+	if (sink->status != FILE_SINK_PENDING) {
+		return sink->status;
+	}
+	
+	sink->status = FILE_SINK_VERIFIED;
+	
+	if (sink->checksum == NULL) {
+		return sink->status;
+	}
+	
+	sha256_final(&sink->sha256, digest);
+	
+	if (memcmp(digest, sink->checksum, sizeof(digest)) != 0) {
+		sink->status = FILE_SINK_MISMATCH;
+	}
+	
+	return sink->status;
+	
+}
+
+int file_sink_verify(file_sink_t* const sink) {
+	/*
+	Compute the digest of the whole file at once and compare it against the expected
+	checksum. This is used when the parts of the file were not received in order.
+	*/
+	
+	fstream_t* stream = NULL;
+	
+	if (sink->checksum != NULL) {
+		sha256_init(&sink->sha256);
+	}
+	
+	sink->status = FILE_SINK_PENDING;
+	
+	stream = fstream_open(sink->filename, FSTREAM_READ);
+	
+	if (stream == NULL || file_sink_hash(sink, stream) != 0) {
+		sink->status = FILE_SINK_MISMATCH;
+	}
+	
+	fstream_close(stream);
+	
+	if (sink->expected != 0 && sink->received != sink->expected) {
+		sink->status = FILE_SINK_MISMATCH;
+	}
+	
+	return file_sink_finish(sink);
+	
+}
+
+int file_sink_commit(file_sink_t* const sink, const char* const destination) {
+	/*
+	Move the completed file to its final location and forget about the sidecar.
+	*/
+	
+	int status = FSTREAM_SUCCESS;
+	
+	status = fstream_close(sink->stream);
+	sink->stream = NULL;
+	
+	if (status != FSTREAM_SUCCESS) {
+		return APTERR_FSTREAM_WRITE_FAILURE;
+	}
+	
+	if (move_file(sink->filename, destination) != 0) {
+		return APTERR_FS_MOVE_FAILURE;
+	}
+	
+	if (remove_file(sink->sidecar) != 0) {
+		return APTERR_FS_RM_FAILURE;
+	}
+	
+	return APTERR_SUCCESS;
+	
+}
+
+int file_sink_discard(file_sink_t* const sink) {
+	/*
+	Forget about a completed transfer whose data went somewhere other than the file.
+	*/
+	
+	fstream_close(sink->stream);
+	sink->stream = NULL;
+	
+	if (remove_file(sink->filename) != 0 || remove_file(sink->sidecar) != 0) {
+		return APTERR_FS_RM_FAILURE;
+	}
+	
+	return APTERR_SUCCESS;
+	
+}
+
+void file_sink_close(file_sink_t* const sink) {
+	
+	fstream_close(sink->stream);
+	sink->stream = NULL;
+	
+	free(sink->filename);
+	sink->filename = NULL;
+	
+	free(sink->sidecar);
+	sink->sidecar = NULL;
+	
+}
+
 size_t write_file_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
 	
 	int status = FSTREAM_SUCCESS;
+	int written = 0;
 	
-	fstream_t* stream = userdata;
+	file_sink_t* sink = userdata;
 	const size_t chunk_size = size * nmemb;
 	
-	status = fstream_write(stream, ptr, chunk_size);
+	/* The data goes straight to the extractor instead of the file */
+	if (sink->unpack != NULL) {
+		written = stream_unpack_write(sink->unpack, ptr, chunk_size);
+		
+		/* The same bytes are handed to us again once the transfer is resumed */
+		if (written == STREAM_UNPACK_FULL) {
+			return CURL_WRITEFUNC_PAUSE;
+		}
+		
+		status = (written == 0) ? FSTREAM_SUCCESS : FSTREAM_ERROR;
+	} else {
+		status = fstream_write(sink->stream, ptr, chunk_size);
+	}
 	
 	if (status != FSTREAM_SUCCESS) {
 		return 0;
 	}
 	
+	sink->received += chunk_size;
+	
+	if (sink->checksum == NULL) {
+		return chunk_size;
+	}
+	
+	sha256_update(&sink->sha256, ptr, chunk_size);
+	
+	if (sink->expected == 0 || sink->received < sink->expected) {
+		return chunk_size;
+	}
+	
+	/* Abort the transfer right away if the data does not match what we expect */
+	if (sink->received > sink->expected || file_sink_finish(sink) == FILE_SINK_MISMATCH) {
+		sink->status = FILE_SINK_MISMATCH;
+		return 0;
+	}
+	
 	return chunk_size;
 	
-}
\ No newline at end of file
+}
+
+static const char* header_value(
+	const char* const line,
+	const size_t size,
+	const char* const name,
+	size_t* const length
+) {
+	/*
+	Return the value of the header in the given line if its name matches (case-insensitively).
+	*/
+	
+	size_t index = 0;
+	const size_t name_size = strlen(name);
+	
+	if (size <= name_size || line[name_size] != ':') {
+		return NULL;
+	}
+	
+	for (index = 0; index < name_size; index++) {
+		if (tolower((unsigned char) line[index]) != tolower((unsigned char) name[index])) {
+			return NULL;
+		}
+	}
+	
+	for (index = name_size + 1; index < size && (line[index] == ' ' || line[index] == '\t'); index++);
+	
+	*length = size - index;
+	
+	return line + index;
+	
+}
+
+static biguint_t header_number(
+	const char* const value,
+	const size_t size,
+	size_t* const consumed
+) {
+	
+	size_t index = 0;
+	biguint_t number = 0;
+	
+	for (index = 0; index < size && value[index] >= '0' && value[index] <= '9'; index++) {
+		number = number * 10 + (biguint_t) (value[index] - '0');
+	}
+	
+	*consumed = index;
+	
+	return number;
+	
+}
+
+size_t header_file_cb(char* buffer, size_t size, size_t nitems, void* userdata) {
+	/*
+	Keep track of what the server says about the response body.
+	
+	When a transfer is resumed, the server answers with 206 if the range request was
+	honored, or with 200 and the whole body if it was not (e.g. the If-Range validator
+	no longer matches). In the latter case, the data already on disk is discarded.
+	*/
+	
+	file_sink_t* sink = userdata;
+	
+	const size_t chunk_size = size * nitems;
+	size_t length = chunk_size;
+	
+	const char* value = NULL;
+	size_t value_size = 0;
+	size_t consumed = 0;
+	
+	biguint_t start = 0;
+	
+	while (length > 0 && (buffer[length - 1] == '\r' || buffer[length - 1] == '\n')) {
+		length--;
+	}
+	
+	/* A new response begins (there may be more than one due to redirects) */
+	if (length > 5 && memcmp(buffer, "HTTP/", 5) == 0) {
+		value = memchr(buffer, ' ', length);
+		
+		sink->code = 0;
+		sink->length = 0;
+		sink->validator[0] = '\0';
+		
+		if (value != NULL) {
+			value++;
+			sink->code = (long) header_number(value, length - (size_t) (value - buffer), &consumed);
+		}
+		
+		return chunk_size;
+	}
+	
+	if (!(sink->code == 200 || sink->code == 206)) {
+		return chunk_size;
+	}
+	
+	/* End of headers */
+	if (length == 0) {
+		if (sink->code == 200 && sink->offset > 0) {
+			loggln(LOG_VERBOSE, "Server did not honor the range request for '%s'; starting over", sink->filename);
+			
+			if (file_sink_restart(sink) != APTERR_SUCCESS) {
+				return 0;
+			}
+		}
+		
+		if (file_sink_save(sink) != 0) {
+			return 0;
+		}
+		
+		return chunk_size;
+	}
+	
+	value = header_value(buffer, length, "ETag", &value_size);
+	
+	/* Weak entity tags cannot be used with If-Range */
+	if (value != NULL) {
+		if (value_size < sizeof(sink->validator) && !(value_size > 2 && memcmp(value, "W/", 2) == 0)) {
+			memcpy(sink->validator, value, value_size);
+			sink->validator[value_size] = '\0';
+		}
+		
+		return chunk_size;
+	}
+	
+	value = header_value(buffer, length, "Last-Modified", &value_size);
+	
+	if (value != NULL) {
+		if (value_size < sizeof(sink->validator) && sink->validator[0] == '\0') {
+			memcpy(sink->validator, value, value_size);
+			sink->validator[value_size] = '\0';
+		}
+		
+		return chunk_size;
+	}
+	
+	value = header_value(buffer, length, "Content-Length", &value_size);
+	
+	if (value != NULL) {
+		if (sink->code == 200) {
+			sink->length = header_number(value, value_size, &consumed);
+		}
+		
+		return chunk_size;
+	}
+	
+	value = header_value(buffer, length, "Content-Range", &value_size);
+	
+	if (value != NULL && sink->code == 206) {
+		/* bytes <start>-<end>/<length> */
+		if (value_size > 6 && memcmp(value, "bytes ", 6) == 0) {
+			start = header_number(value + 6, value_size - 6, &consumed);
+			value = memchr(value, '/', value_size);
+			
+			if (value != NULL) {
+				value++;
+				sink->length = header_number(value, length - (size_t) (value - buffer), &consumed);
+			}
+		}
+		
+		/* We cannot append a range that does not start where our data ends */
+		if (start != sink->offset) {
+			sink->status = FILE_SINK_STALE;
+			return 0;
+		}
+	}
+	
+	return chunk_size;
+	
+}
+
+size_t write_segment_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
+	
+	int status = FSTREAM_SUCCESS;
+	
+	file_segment_t* segment = userdata;
+	const size_t chunk_size = size * nmemb;
+	
+	/* The server sent more than we asked for */
+	if (segment->received + chunk_size > segment->size) {
+		segment->status = FILE_SINK_STALE;
+		return 0;
+	}
+	
+	status = fstream_pwrite(segment->stream, ptr, chunk_size, segment->start + segment->received);
+	
+	if (status != FSTREAM_SUCCESS) {
+		return 0;
+	}
+	
+	segment->received += chunk_size;
+	
+	return chunk_size;
+	
+}
+
+size_t header_segment_cb(char* buffer, size_t size, size_t nitems, void* userdata) {
+	/*
+	Make sure the server sends exactly the range we asked for.
+	
+	Servers that do not support range requests answer with 200 and the whole
+	file; the segment is then marked as stale so that the caller can fall back
+	to a single transfer.
+	*/
+	
+	file_segment_t* segment = userdata;
+	
+	const size_t chunk_size = size * nitems;
+	size_t length = chunk_size;
+	
+	const char* value = NULL;
+	size_t value_size = 0;
+	size_t consumed = 0;
+	
+	biguint_t start = 0;
+	
+	while (length > 0 && (buffer[length - 1] == '\r' || buffer[length - 1] == '\n')) {
+		length--;
+	}
+	
+	if (length > 5 && memcmp(buffer, "HTTP/", 5) == 0) {
+		value = memchr(buffer, ' ', length);
+		segment->code = 0;
+		
+		if (value != NULL) {
+			value++;
+			segment->code = (long) header_number(value, length - (size_t) (value - buffer), &consumed);
+		}
+		
+		return chunk_size;
+	}
+	
+	if (length == 0) {
+		if (segment->code >= 200 && segment->code < 300 && segment->code != 206) {
+			segment->status = FILE_SINK_STALE;
+			return 0;
+		}
+		
+		return chunk_size;
+	}
+	
+	if (segment->code != 206) {
+		return chunk_size;
+	}
+	
+	value = header_value(buffer, length, "Content-Range", &value_size);
+	
+	if (value == NULL) {
+		return chunk_size;
+	}
+	
+	if (value_size > 6 && memcmp(value, "bytes ", 6) == 0) {
+		start = header_number(value + 6, value_size - 6, &consumed);
+	}
+	
+	if (consumed == 0 || start != segment->start + segment->received) {
+		segment->status = FILE_SINK_STALE;
+		return 0;
+	}
+	
+	return chunk_size;
+	
+}
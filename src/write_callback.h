@@ -1,4 +1,68 @@
+#if !defined(WRITE_CALLBACK_H)
+#define WRITE_CALLBACK_H
+
 #include <stddef.h>
 
+#include "biggestint.h"
+#include "fs/fstream.h"
+#include "sha256.h"
+#include "stream_unpack.h"
+
+#define FILE_SINK_PENDING (0)
+#define FILE_SINK_VERIFIED (1)
+#define FILE_SINK_MISMATCH (2)
+#define FILE_SINK_STALE (3)
+
+#define FILE_SINK_MAX_VALIDATOR (256)
+
+struct FileSink {
+	fstream_t* stream;
+	char* filename;
+	char* sidecar;
+	sha256_t sha256;
+	const unsigned char* checksum;
+	biguint_t expected;
+	biguint_t received;
+	biguint_t offset;
+	biguint_t length;
+	long code;
+	char validator[FILE_SINK_MAX_VALIDATOR];
+	int status;
+	stream_unpack_t* unpack;
+};
+
+typedef struct FileSink file_sink_t;
+
+struct FileSegment {
+	fstream_t* stream;
+	biguint_t start;
+	biguint_t size;
+	biguint_t received;
+	long code;
+	int status;
+};
+
+typedef struct FileSegment file_segment_t;
+
+int file_sink_open(
+	file_sink_t* const sink,
+	const char* const filename,
+	const unsigned char* const checksum,
+	const biguint_t expected
+);
+
+int file_sink_restart(file_sink_t* const sink);
+void file_sink_resume(file_sink_t* const sink);
+int file_sink_finish(file_sink_t* const sink);
+int file_sink_verify(file_sink_t* const sink);
+int file_sink_commit(file_sink_t* const sink, const char* const destination);
+int file_sink_discard(file_sink_t* const sink);
+void file_sink_close(file_sink_t* const sink);
+
 size_t write_string_cb(char* ptr, size_t size, size_t nmemb, void* userdata);
 size_t write_file_cb(char* ptr, size_t size, size_t nmemb, void* userdata);
+size_t header_file_cb(char* buffer, size_t size, size_t nitems, void* userdata);
+size_t write_segment_cb(char* ptr, size_t size, size_t nmemb, void* userdata);
+size_t header_segment_cb(char* buffer, size_t size, size_t nitems, void* userdata);
+
+#endif
@@ -0,0 +1,151 @@
+/*
+Compare how long it takes to decode an archive with libarchive's own
+single-threaded filters and with the threaded decoders from decompress.c.
+
+Usage: decompress_benchmark <archive> [threads] [block size in kilobytes]
+
+The decoded data is only counted, never written anywhere, so the numbers
+reflect decompression (and tar parsing) alone.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "uncompress.h"
+#include "os/clock.h"
+#include "os/cpuinfo.h"
+
+#define BENCHMARK_ROUNDS (3)
+
+static size_t count_callback(char* data, size_t size, size_t nmemb, void* argument) {
+	
+	size_t* const total = argument;
+	
+	(void) data;
+	
+	*total += size * nmemb;
+	
+	return size * nmemb;
+	
+}
+
+static int benchmark(
+	const char* const filename,
+	const size_t threads,
+	size_t* const total,
+	biguint_t* const elapsed
+) {
+	/*
+	Decode the archive a few times with the given number of threads and keep
+	the fastest run.
+	
+	Returns (0) on success, (-1) on error.
+	*/
+	
+	size_t round = 0;
+	
+	biguint_t start = 0;
+	biguint_t time = 0;
+	
+	*elapsed = BIGUINT_MAX;
+	
+	uncompress_set_threads(threads);
+	
+	for (round = 0; round < BENCHMARK_ROUNDS; round++) {
+		*total = 0;
+		
+		start = clock_monotonic();
+		
+		if (uncompress(filename, 0, count_callback, total, NULL, NULL, NULL) != 0) {
+			return -1;
+		}
+		
+		time = clock_monotonic() - start;
+		
+		if (time < *elapsed) {
+			*elapsed = time;
+		}
+	}
+	
+	return 0;
+	
+}
+
+static void report(
+	const char* const name,
+	const size_t total,
+	const biguint_t elapsed
+) {
+	
+	const double seconds = (elapsed == 0) ? 0.001 : (double) elapsed / 1000.0;
+	
+	printf(
+		"%-24s %10llu ms %10.1f MiB/s\n",
+		name,
+		(unsigned long long) elapsed,
+		((double) total / (1024.0 * 1024.0)) / seconds
+	);
+	
+}
+
+int main(int argc, char* argv[]) {
+	
+	const char* filename = NULL;
+	
+	char name[48] = {0};
+	
+	ssize_t nproc = 0;
+	
+	size_t threads = 0;
+	size_t block_size = 0;
+	
+	size_t single_total = 0;
+	size_t threaded_total = 0;
+	
+	biguint_t single_elapsed = 0;
+	biguint_t threaded_elapsed = 0;
+	
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <archive> [threads] [block size in kilobytes]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	
+	filename = argv[1];
+	
+	nproc = get_nproc();
+	threads = (argc > 2) ? (size_t) strtoul(argv[2], NULL, 10) : (size_t) ((nproc < 1) ? 1 : nproc);
+	
+	/* A single thread would take the libarchive path again */
+	if (threads < 2) {
+		threads = 2;
+	}
+	
+	block_size = (argc > 3) ? (size_t) strtoul(argv[3], NULL, 10) * 1024 : UNCOMPRESS_BLOCK_SIZE;
+	
+	uncompress_set_block_size(block_size);
+	
+	if (benchmark(filename, 1, &single_total, &single_elapsed) != 0) {
+		fprintf(stderr, "could not decode '%s' with libarchive\n", filename);
+		return EXIT_FAILURE;
+	}
+	
+	if (benchmark(filename, threads, &threaded_total, &threaded_elapsed) != 0) {
+		fprintf(stderr, "could not decode '%s' with the threaded decoder\n", filename);
+		return EXIT_FAILURE;
+	}
+	
+	if (single_total != threaded_total) {
+		fprintf(stderr, "the decoders disagree on the size of '%s' (%zu != %zu bytes)\n", filename, single_total, threaded_total);
+		return EXIT_FAILURE;
+	}
+	
+	printf("%s: %zu bytes decoded, best of %i rounds, %zu KiB blocks\n", filename, single_total, BENCHMARK_ROUNDS, block_size / 1024);
+	
+	report("libarchive", single_total, single_elapsed);
+	
+	sprintf(name, "threaded (%zu threads)", threads);
+	report(name, threaded_total, threaded_elapsed);
+	
+	return EXIT_SUCCESS;
+	
+}
@@ -40,7 +40,7 @@ parser.add_argument(
 	"--install",
 	metavar = "PACKAGE",
 	required = False,
-	help = "Install one or more packages. Use a semicolon-separated list (e.g. 'pkg1;pkg2')."
+	help = "Install one or more packages. Use a semicolon-separated list (e.g. 'pkg1;pkg2'). Globs (e.g. 'lib*-dev') and anchored regular expressions (e.g. '^python3-.*$') match package names."
 )
 
 parser.add_argument(
@@ -48,7 +48,7 @@ parser.add_argument(
 	"--uninstall",
 	metavar = "PACKAGE",
 	required = False,
-	help = "Uninstall one or more packages. Use a semicolon-separated list (e.g. 'pkg1;pkg2')."
+	help = "Uninstall one or more packages. Use a semicolon-separated list (e.g. 'pkg1;pkg2'). Globs and regular expressions match installed package names."
 )
 
 parser.add_argument(
@@ -56,7 +56,14 @@ parser.add_argument(
 	"--search",
 	metavar = "PACKAGE",
 	required = False,
-	help = "Search available repositories for packages matching the given query."
+	help = "Search available repositories for packages matching the given query. Globs and regular expressions are matched against package names; multi-word queries are matched against package descriptions."
+)
+
+parser.add_argument(
+	"--owns",
+	metavar = "PATH",
+	required = False,
+	help = "Print the installed packages that own the given file or directory."
 )
 
 parser.add_argument(